@@ -0,0 +1,220 @@
+// How fast the readers get through a large trace. Decodes the trace in
+// process, first chunk by chunk in file order and then merged into timestamp
+// order, and runs skeletonkey-analyze over it in each of its modes, reporting
+// MB/s, events/s and each run's peak RSS. Without --trace it generates a
+// synthetic one first, taking the same options as skeletonkey-tracegen.
+//
+//   skeletonkey-analyzer-bench [--trace FILE] [--analyzer PATH] [-j N]
+//                              [--size BYTES] [--threads N] [--locks N]
+//                              [--stacks N] [--contention FRACTION]
+//                              [--compression CODEC[:LEVEL]]
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "synthetic_trace.h"
+#include "trace_decoder.h"
+
+#ifndef SKELETON_KEY_ANALYZER
+#define SKELETON_KEY_ANALYZER "skeletonkey-analyze"
+#endif
+
+extern char** environ;
+
+using namespace skeleton_key;
+
+namespace {
+
+struct Run
+{
+    bool ok = false;
+    double seconds = 0;
+    // Kilobytes, as getrusage() reports them.
+    long max_rss = 0;
+};
+
+// Runs the analyzer with its output thrown away.
+Run
+runAnalyzer(const std::string& analyzer, const std::vector<std::string>& arguments)
+{
+    std::vector<char*> argv;
+    argv.push_back(const_cast<char*>(analyzer.c_str()));
+    for (const std::string& argument : arguments) argv.push_back(const_cast<char*>(argument.c_str()));
+    argv.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    Run run;
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid;
+    int error = posix_spawn(&pid, analyzer.c_str(), &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (error != 0) {
+        fprintf(stderr, "cannot run %s: %s\n", analyzer.c_str(), strerror(error));
+        return run;
+    }
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid) return run;
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    run.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    run.seconds = elapsed.count();
+    run.max_rss = usage.ru_maxrss;
+    return run;
+}
+
+long
+ownMaxRss()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+void
+report(const char* name, double seconds, uint64_t bytes, uint64_t events, long max_rss)
+{
+    printf("  %-22s %8.2f s %9.1f MB/s %9.2f Mevents/s %9.1f MB RSS\n",
+           name,
+           seconds,
+           bytes / 1e6 / seconds,
+           events / 1e6 / seconds,
+           max_rss / 1024.0);
+}
+
+}  // namespace
+
+int
+main(int argc, char** argv)
+{
+    SyntheticTrace::Options options;
+    std::string trace_path;
+    std::string analyzer = SKELETON_KEY_ANALYZER;
+    unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            fprintf(stderr, "%s: %s needs a value\n", argv[0], argv[i]);
+            return 2;
+        }
+        if (strcmp(argv[i], "--trace") == 0) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--analyzer") == 0) {
+            analyzer = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0) {
+            jobs = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        } else if (strcmp(argv[i], "--size") == 0) {
+            options.size = parseByteSize(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            options.threads = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        } else if (strcmp(argv[i], "--locks") == 0) {
+            options.locks = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        } else if (strcmp(argv[i], "--stacks") == 0) {
+            options.stacks = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        } else if (strcmp(argv[i], "--contention") == 0) {
+            options.contention = strtod(argv[++i], nullptr);
+        } else if (strcmp(argv[i], "--compression") == 0) {
+            if (!parseCompression(argv[++i], &options.codec, &options.level)
+                || !codecAvailable(options.codec))
+            {
+                fprintf(stderr, "%s: cannot compress with %s\n", argv[0], argv[i]);
+                return 2;
+            }
+        } else {
+            fprintf(stderr, "%s: unknown option %s\n", argv[0], argv[i]);
+            return 2;
+        }
+    }
+
+    char directory[] = "/tmp/skeletonkey-analyzer-bench.XXXXXX";
+    if (!mkdtemp(directory)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    bool generated = trace_path.empty();
+    if (generated) {
+        trace_path = std::string(directory) + "/trace.bin";
+        SyntheticTrace synthetic(options);
+        printf("generating %.0f MB: %u threads, %u locks, %u stacks, %.0f%% contention, %s\n",
+               options.size / 1e6,
+               options.threads,
+               options.locks,
+               options.stacks,
+               options.contention * 100,
+               codecName(options.codec));
+        if (!synthetic.write(trace_path.c_str())) {
+            perror(trace_path.c_str());
+            return 1;
+        }
+    }
+
+    std::string columns = std::string(directory) + "/trace.cols";
+    std::vector<std::pair<std::string, std::vector<std::string>>> modes = {
+            {"analyze -j 1", {"-j", "1", trace_path}},
+            {"--deadlocks", {"--deadlocks", trace_path}},
+            {"--blocking", {"--blocking", trace_path}},
+            {"--export-columns", {"--export-columns", columns, trace_path}},
+    };
+    if (jobs > 1) {
+        std::string count = std::to_string(jobs);
+        modes.insert(modes.begin() + 1, {"analyze -j " + count, {"-j", count, trace_path}});
+    }
+
+    // Decode up front, so the trace is in the page cache for every run.
+    uint64_t bytes;
+    uint64_t events = 0;
+    {
+        TraceFile trace;
+        if (!trace.open(trace_path.c_str())) {
+            perror(trace_path.c_str());
+            return 1;
+        }
+        bytes = trace.size();
+        printf("%s: %.1f MB\n", trace_path.c_str(), bytes / 1e6);
+
+        auto start = std::chrono::steady_clock::now();
+        StackStore stacks;
+        std::vector<ChunkRef> chunks = indexChunks(trace);
+        DecodedEvent event;
+        for (const ChunkRef& chunk : chunks) {
+            ChunkDecoder decoder(trace, chunk, stacks);
+            while (decoder.next(event)) events++;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        report("decode chunks", elapsed.count(), bytes, events, ownMaxRss());
+
+        start = std::chrono::steady_clock::now();
+        StackStore merged_stacks;
+        uint64_t merged = 0;
+        forEachEvent(trace, merged_stacks, [&](const DecodedEvent&) { merged++; });
+        elapsed = std::chrono::steady_clock::now() - start;
+        report("decode and merge", elapsed.count(), bytes, merged, ownMaxRss());
+    }
+
+    for (const auto& [name, arguments] : modes) {
+        Run run = runAnalyzer(analyzer, arguments);
+        if (!run.ok) {
+            printf("  %-22s failed\n", name.c_str());
+            continue;
+        }
+        report(name.c_str(), run.seconds, bytes, events, run.max_rss);
+        fflush(stdout);
+    }
+
+    unlink(columns.c_str());
+    if (generated) unlink(trace_path.c_str());
+    rmdir(directory);
+    return 0;
+}
@@ -0,0 +1,508 @@
+// What the hooks cost per lock operation. Each workload runs in a child
+// process, once without the tracer and once with libskeleton_key.so
+// preloaded in each tracer mode, at 1, 2, 4, ... threads up to the limit.
+// A row reports the time per operation and thread, total throughput, the
+// slowdown against the untraced run, throughput relative to one thread of
+// the same mode, and for modes that write a trace the events per second
+// and bytes per event it produced.
+//
+//   skeletonkey-bench [--threads N] [--ms MS] [--library PATH]
+//                     [--workloads NAME,...] [--modes NAME,...]
+#include <pthread.h>
+#include <sched.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "trace_decoder.h"
+
+#ifndef SKELETON_KEY_LIBRARY
+#define SKELETON_KEY_LIBRARY "libskeleton_key.so"
+#endif
+
+extern char** environ;
+
+using namespace skeleton_key;
+
+namespace {
+
+// One thread's results, alone on a cache line.
+struct alignas(64) Counter
+{
+    uint64_t ops = 0;
+    // What a reader saw, so that its reads are not optimized away.
+    uint64_t seen = 0;
+};
+
+struct Shared
+{
+    std::atomic<bool> go{false};
+    std::atomic<bool> stop{false};
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+    // Protected by mutex or rwlock; keeps the critical sections from being empty.
+    uint64_t value = 0;
+};
+
+// Two threads handing a turn back and forth through a condition variable.
+struct PingPong
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    int turn = 0;
+};
+
+struct Context
+{
+    Shared shared;
+    std::vector<Counter> counters;
+    std::vector<PingPong> pairs;
+};
+
+using WorkFn = void (*)(Context&, unsigned);
+
+void
+waitForStart(const Shared& shared)
+{
+    while (!shared.go.load(std::memory_order_acquire)) sched_yield();
+}
+
+void
+privateMutex(Context& context, unsigned thread)
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    uint64_t ops = 0;
+    waitForStart(context.shared);
+    while (!context.shared.stop.load(std::memory_order_relaxed)) {
+        pthread_mutex_lock(&mutex);
+        pthread_mutex_unlock(&mutex);
+        ops++;
+    }
+    pthread_mutex_destroy(&mutex);
+    context.counters[thread].ops = ops;
+}
+
+void
+sharedMutex(Context& context, unsigned thread)
+{
+    Shared& shared = context.shared;
+    uint64_t ops = 0;
+    waitForStart(shared);
+    while (!shared.stop.load(std::memory_order_relaxed)) {
+        pthread_mutex_lock(&shared.mutex);
+        shared.value++;
+        pthread_mutex_unlock(&shared.mutex);
+        ops++;
+    }
+    context.counters[thread].ops = ops;
+}
+
+void
+rwlockRead(Context& context, unsigned thread)
+{
+    Shared& shared = context.shared;
+    uint64_t ops = 0;
+    uint64_t seen = 0;
+    waitForStart(shared);
+    while (!shared.stop.load(std::memory_order_relaxed)) {
+        pthread_rwlock_rdlock(&shared.rwlock);
+        seen += shared.value;
+        pthread_rwlock_unlock(&shared.rwlock);
+        ops++;
+    }
+    context.counters[thread].ops = ops;
+    context.counters[thread].seen = seen;
+}
+
+void
+rwlockWrite(Context& context, unsigned thread)
+{
+    Shared& shared = context.shared;
+    uint64_t ops = 0;
+    waitForStart(shared);
+    while (!shared.stop.load(std::memory_order_relaxed)) {
+        pthread_rwlock_wrlock(&shared.rwlock);
+        shared.value++;
+        pthread_rwlock_unlock(&shared.rwlock);
+        ops++;
+    }
+    context.counters[thread].ops = ops;
+}
+
+// Counts completed hand-offs: each is one wait that a signal ended.
+void
+condPingPong(Context& context, unsigned thread)
+{
+    Shared& shared = context.shared;
+    PingPong& pair = context.pairs[thread / 2];
+    int side = thread % 2;
+    uint64_t ops = 0;
+    waitForStart(shared);
+    pthread_mutex_lock(&pair.mutex);
+    while (!shared.stop.load(std::memory_order_relaxed)) {
+        if (pair.turn != side) {
+            pthread_cond_wait(&pair.cond, &pair.mutex);
+            continue;
+        }
+        pair.turn = 1 - side;
+        ops++;
+        pthread_cond_signal(&pair.cond);
+    }
+    pthread_mutex_unlock(&pair.mutex);
+    context.counters[thread].ops = ops;
+}
+
+struct Workload
+{
+    const char* name;
+    const char* description;
+    WorkFn work;
+    // Threads come in pairs.
+    bool paired;
+};
+
+const Workload WORKLOADS[] = {
+        {"mutex", "uncontended mutex, one per thread", privateMutex, false},
+        {"mutex-shared", "contended mutex, one for all threads", sharedMutex, false},
+        {"rwlock-read", "rwlock taken for reading by all threads", rwlockRead, false},
+        {"rwlock-write", "rwlock taken for writing by all threads", rwlockWrite, false},
+        {"cond", "condition variable ping-pong between pairs of threads", condPingPong, true},
+};
+
+struct Mode
+{
+    const char* name;
+    // Tracer settings on top of the defaults.
+    std::vector<const char*> environment;
+    bool preload;
+    bool writes_trace;
+};
+
+const Mode MODES[] = {
+        {"baseline", {}, false, false},
+        {"full", {}, true, true},
+        {"no-stack", {"SKELETON_KEY_UNWINDER=none"}, true, true},
+        {"contended", {"SKELETON_KEY_CAPTURE=contended"}, true, true},
+        {"sampled", {"SKELETON_KEY_SAMPLE=64"}, true, true},
+        {"muted", {"SKELETON_KEY_MUTE_AFTER=1000"}, true, true},
+        {"zstd", {"SKELETON_KEY_COMPRESSION=zstd"}, true, true},
+        {"aggregate", {"SKELETON_KEY_BACKEND=aggregate"}, true, false},
+};
+
+const Workload*
+findWorkload(const char* name)
+{
+    for (const Workload& workload : WORKLOADS) {
+        if (strcmp(workload.name, name) == 0) return &workload;
+    }
+    return nullptr;
+}
+
+// Runs in the child: prints "ops N ns N" for the caller to parse.
+int
+runWorkload(const Workload& workload, unsigned threads, unsigned ms)
+{
+    Context context;
+    context.counters.resize(threads);
+    context.pairs = std::vector<PingPong>((threads + 1) / 2);
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < threads; i++) workers.emplace_back(workload.work, std::ref(context), i);
+
+    auto start = std::chrono::steady_clock::now();
+    context.shared.go.store(true, std::memory_order_release);
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+    context.shared.stop.store(true, std::memory_order_relaxed);
+    for (PingPong& pair : context.pairs) {
+        pthread_mutex_lock(&pair.mutex);
+        pthread_cond_broadcast(&pair.cond);
+        pthread_mutex_unlock(&pair.mutex);
+    }
+    for (std::thread& worker : workers) worker.join();
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start);
+
+    uint64_t ops = 0;
+    for (const Counter& counter : context.counters) ops += counter.ops;
+    printf("ops %" PRIu64 " ns %" PRIu64 "\n", ops, static_cast<uint64_t>(elapsed.count()));
+    return 0;
+}
+
+struct Result
+{
+    bool ok = false;
+    uint64_t ops = 0;
+    uint64_t ns = 0;
+    uint64_t events = 0;
+    uint64_t bytes = 0;
+    uint64_t dropped = 0;
+};
+
+std::vector<std::string>
+splitList(const char* list)
+{
+    std::vector<std::string> names;
+    std::string name;
+    for (const char* c = list;; c++) {
+        if (*c == ',' || *c == '\0') {
+            if (!name.empty()) names.push_back(name);
+            name.clear();
+            if (*c == '\0') break;
+        } else {
+            name += *c;
+        }
+    }
+    return names;
+}
+
+bool
+selected(const std::vector<std::string>& names, const char* name)
+{
+    return names.empty() || std::find(names.begin(), names.end(), name) != names.end();
+}
+
+// Events and bytes of a file-backend trace.
+void
+measureTrace(const std::string& path, Result& result)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return;
+    result.bytes = st.st_size;
+    TraceFile trace;
+    if (!trace.open(path.c_str()) || trace.version() < 2) return;
+    for (const ChunkRef& chunk : indexChunks(trace)) result.events += chunk.event_count;
+}
+
+class Runner
+{
+    std::string self_;
+    std::string library_;
+    std::string directory_;
+    unsigned ms_;
+
+  public:
+    Runner(std::string self, std::string library, std::string directory, unsigned ms)
+        : self_(std::move(self)), library_(std::move(library)), directory_(std::move(directory)), ms_(ms)
+    {
+    }
+
+    Result run(const Workload& workload, const Mode& mode, unsigned threads)
+    {
+        std::string trace = directory_ + "/trace.bin";
+        unlink(trace.c_str());
+
+        // Start from this environment without any tracer settings in it.
+        std::vector<std::string> strings;
+        for (char** variable = environ; *variable; variable++) {
+            if (strncmp(*variable, "LD_PRELOAD=", 11) == 0) continue;
+            if (strncmp(*variable, "SKELETON_KEY", 12) == 0) continue;
+            strings.push_back(*variable);
+        }
+        if (mode.preload) {
+            strings.push_back("LD_PRELOAD=" + library_);
+            strings.push_back("SKELETON_KEYOUTPUT=" + trace);
+            for (const char* variable : mode.environment) strings.push_back(variable);
+        }
+        std::vector<char*> environment;
+        for (std::string& variable : strings) environment.push_back(&variable[0]);
+        environment.push_back(nullptr);
+
+        std::string thread_count = std::to_string(threads);
+        std::string ms = std::to_string(ms_);
+        const char* argv[] = {
+                self_.c_str(), "--run", workload.name, thread_count.c_str(), ms.c_str(), nullptr};
+
+        Result result;
+        int pipe_fds[2];
+        if (pipe(pipe_fds) != 0) return result;
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDERR_FILENO);
+        posix_spawn_file_actions_addclose(&actions, pipe_fds[0]);
+        pid_t pid;
+        int error = posix_spawn(&pid,
+                                self_.c_str(),
+                                &actions,
+                                nullptr,
+                                const_cast<char**>(argv),
+                                environment.data());
+        posix_spawn_file_actions_destroy(&actions);
+        close(pipe_fds[1]);
+        if (error != 0) {
+            close(pipe_fds[0]);
+            fprintf(stderr, "cannot run %s: %s\n", self_.c_str(), strerror(error));
+            return result;
+        }
+
+        // The tracer prints to both streams, so look for our lines among its.
+        std::string output;
+        char buffer[4096];
+        ssize_t n;
+        while ((n = read(pipe_fds[0], buffer, sizeof(buffer))) > 0) output.append(buffer, n);
+        close(pipe_fds[0]);
+        int status;
+        waitpid(pid, &status, 0);
+
+        size_t line = 0;
+        while (line < output.size()) {
+            size_t end = output.find('\n', line);
+            if (end == std::string::npos) end = output.size();
+            std::string text = output.substr(line, end - line);
+            const char* dropped = strstr(text.c_str(), "dropped ");
+            if (sscanf(text.c_str(), "ops %" SCNu64 " ns %" SCNu64, &result.ops, &result.ns) == 2) {
+                result.ok = true;
+            } else if (dropped) {
+                result.dropped = strtoull(dropped + 8, nullptr, 10);
+            }
+            line = end + 1;
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) result.ok = false;
+        if (result.ok && mode.writes_trace) measureTrace(trace, result);
+        unlink(trace.c_str());
+        return result;
+    }
+};
+
+std::string
+formatRate(double rate)
+{
+    char text[32];
+    if (rate >= 1e9) {
+        snprintf(text, sizeof(text), "%.2fG", rate / 1e9);
+    } else if (rate >= 1e6) {
+        snprintf(text, sizeof(text), "%.2fM", rate / 1e6);
+    } else {
+        snprintf(text, sizeof(text), "%.0fk", rate / 1e3);
+    }
+    return text;
+}
+
+int
+usage(const char* program)
+{
+    fprintf(stderr,
+            "usage: %s [--threads N] [--ms MS] [--library PATH]\n"
+            "       [--workloads NAME,...] [--modes NAME,...]\n",
+            program);
+    fprintf(stderr, "workloads:");
+    for (const Workload& workload : WORKLOADS) fprintf(stderr, " %s", workload.name);
+    fprintf(stderr, "\nmodes:");
+    for (const Mode& mode : MODES) fprintf(stderr, " %s", mode.name);
+    fprintf(stderr, "\n");
+    return 2;
+}
+
+}  // namespace
+
+int
+main(int argc, char** argv)
+{
+    if (argc == 5 && strcmp(argv[1], "--run") == 0) {
+        const Workload* workload = findWorkload(argv[2]);
+        unsigned threads = static_cast<unsigned>(strtoul(argv[3], nullptr, 10));
+        if (!workload || threads == 0) return 2;
+        return runWorkload(*workload, threads, static_cast<unsigned>(strtoul(argv[4], nullptr, 10)));
+    }
+
+    unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    unsigned ms = 200;
+    std::string library = SKELETON_KEY_LIBRARY;
+    std::vector<std::string> workloads;
+    std::vector<std::string> modes;
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) return usage(argv[0]);
+        if (strcmp(argv[i], "--threads") == 0) {
+            max_threads = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        } else if (strcmp(argv[i], "--ms") == 0) {
+            ms = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        } else if (strcmp(argv[i], "--library") == 0) {
+            library = argv[++i];
+        } else if (strcmp(argv[i], "--workloads") == 0) {
+            workloads = splitList(argv[++i]);
+        } else if (strcmp(argv[i], "--modes") == 0) {
+            modes = splitList(argv[++i]);
+        } else {
+            return usage(argv[0]);
+        }
+    }
+    for (const std::string& name : workloads) {
+        if (!findWorkload(name.c_str())) return usage(argv[0]);
+    }
+    // The baseline is what the overhead is measured against.
+    if (!modes.empty() && !selected(modes, "baseline")) modes.insert(modes.begin(), "baseline");
+
+    char self[4096];
+    ssize_t length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (length <= 0) return 1;
+    self[length] = '\0';
+    char directory[] = "/tmp/skeletonkey-bench.XXXXXX";
+    if (!mkdtemp(directory)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    Runner runner(self, library, directory, ms);
+    printf("%u ms per run, library %s\n", ms, library.c_str());
+
+    for (const Workload& workload : WORKLOADS) {
+        if (!selected(workloads, workload.name)) continue;
+        // Powers of two and the limit itself, rounded up to pairs if need be.
+        std::vector<unsigned> counts;
+        for (unsigned threads = 1;; threads = std::min(threads * 2, max_threads)) {
+            unsigned count = workload.paired ? threads + threads % 2 : threads;
+            if (counts.empty() || counts.back() != count) counts.push_back(count);
+            if (threads == max_threads) break;
+        }
+
+        printf("\n%s (%s)\n", workload.name, workload.description);
+        printf("  %7s  %-10s %9s %9s %9s %8s %10s %11s\n",
+               "threads", "mode", "ns/op", "Mops/s", "overhead", "scaling", "events/s", "bytes/event");
+        std::vector<double> single(sizeof(MODES) / sizeof(MODES[0]), 0);
+        for (unsigned threads : counts) {
+            double baseline = 0;
+            for (size_t m = 0; m < sizeof(MODES) / sizeof(MODES[0]); m++) {
+                const Mode& mode = MODES[m];
+                if (!selected(modes, mode.name)) continue;
+                Result result = runner.run(workload, mode, threads);
+                if (!result.ok || result.ops == 0) {
+                    printf("  %7u  %-10s failed\n", threads, mode.name);
+                    continue;
+                }
+                double ns_per_op = static_cast<double>(result.ns) * threads / result.ops;
+                double throughput = result.ops * 1e9 / result.ns;
+                if (m == 0) baseline = ns_per_op;
+                if (single[m] == 0) single[m] = throughput;
+                printf("  %7u  %-10s %9.1f %9.2f", threads, mode.name, ns_per_op, throughput / 1e6);
+                if (baseline > 0) {
+                    printf(" %8.2fx", ns_per_op / baseline);
+                } else {
+                    printf(" %9s", "-");
+                }
+                printf(" %7.2fx", throughput / single[m]);
+                if (result.events > 0) {
+                    printf(" %10s %11.1f",
+                           formatRate(result.events * 1e9 / result.ns).c_str(),
+                           static_cast<double>(result.bytes) / result.events);
+                } else {
+                    printf(" %10s %11s", "-", "-");
+                }
+                if (result.dropped) printf("  (dropped %" PRIu64 ")", result.dropped);
+                printf("\n");
+                fflush(stdout);
+            }
+        }
+    }
+    rmdir(directory);
+    return 0;
+}
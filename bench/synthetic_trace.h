@@ -0,0 +1,369 @@
+// Synthetic traces for benchmarking the readers, in the format the file
+// backend writes: a TraceHeader, per-thread Events chunks of the tracer's
+// chunk size, and an Index chunk.
+//
+// The events come from a small simulation rather than from random bytes, so
+// the analyzers see consistent lock states. Each thread repeatedly picks a
+// lock and a call site, takes the lock, holds it and lets it go, with
+// pseudo-random think and hold times. With probability `contention` it picks
+// one of the locks another thread holds right now and queues behind it, so
+// contention is roughly the fraction of acquisitions that wait. Every event
+// carries a stack, as in the default capture mode; `stacks` is the number of
+// distinct call sites, each with its own acquire and release stack. With a
+// codec the chunks are compressed the way the tracer compresses them.
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <queue>
+#include <random>
+#include <vector>
+
+#include "compression.h"
+#include "trace_format.h"
+
+namespace skeleton_key {
+
+// "64M", "10G" and the like; plain numbers are bytes.
+inline uint64_t
+parseByteSize(const char* text)
+{
+    char* end = nullptr;
+    uint64_t size = strtoull(text, &end, 10);
+    switch (*end) {
+        case 'k':
+        case 'K':
+            return size << 10;
+        case 'm':
+        case 'M':
+            return size << 20;
+        case 'g':
+        case 'G':
+            return size << 30;
+        default:
+            return size;
+    }
+}
+
+class SyntheticTrace
+{
+  public:
+    struct Options
+    {
+        uint64_t size = 256ull << 20;
+        uint32_t threads = 8;
+        uint32_t locks = 64;
+        uint32_t stacks = 256;
+        double contention = 0.1;
+        uint64_t seed = 1;
+        Codec codec = Codec::None;
+        int level = 0;
+    };
+
+    struct Stats
+    {
+        uint64_t bytes = 0;
+        // Events chunk payloads before compression.
+        uint64_t raw_bytes = 0;
+        uint64_t events = 0;
+        uint64_t chunks = 0;
+        uint64_t contended = 0;
+        uint64_t acquisitions = 0;
+    };
+
+  private:
+    // The tracer's chunk size and worst case event size with 16 frames.
+    static constexpr size_t CHUNK_CAPACITY = 64 * 1024;
+    static constexpr size_t MAX_EVENT_SIZE = 2 + 10 * (2 + 16 + 6);
+    static constexpr uint64_t NO_THREAD = UINT32_MAX;
+
+    struct Site
+    {
+        std::vector<uint64_t> acquire;
+        std::vector<uint64_t> release;
+    };
+
+    struct Thread
+    {
+        uint32_t tid;
+        uint32_t lock = 0;
+        uint32_t site = 0;
+        uint64_t wait_start = 0;
+        // Chunk being filled, header included.
+        std::vector<uint8_t> chunk;
+        size_t used = 0;
+        uint64_t last_timestamp = 0;
+        LockDictionary dictionary;
+        // Stack ids defined in the current chunk, by generation.
+        std::vector<uint32_t> defined;
+        uint32_t generation = 0;
+    };
+
+    struct Lock
+    {
+        uint64_t owner = NO_THREAD;
+        std::deque<uint32_t> waiters;
+        // Position in held_, while held.
+        size_t held_index = 0;
+    };
+
+    Options options_;
+    std::mt19937_64 rng_;
+    std::vector<Site> sites_;
+    std::vector<Thread> threads_;
+    std::vector<Lock> locks_;
+    std::vector<uint32_t> held_;
+    std::vector<ChunkIndexEntry> index_;
+    Compressor compressor_;
+    FILE* out_ = nullptr;
+    std::vector<char> buffer_;
+    Stats stats_;
+
+    uint64_t random(uint64_t low, uint64_t high)
+    {
+        return low + rng_() % (high - low + 1);
+    }
+
+    static uint64_t lockAddress(uint32_t lock)
+    {
+        return 0x5555'5560'0000ull + lock * 64ull;
+    }
+
+    // Return addresses in the program and in two libraries, the outermost
+    // frames shared by every stack as they would be in real threads.
+    void makeSites()
+    {
+        const uint64_t bases[] = {0x5555'5555'4000ull, 0x7f3a'1c20'0000ull, 0x7f3a'1d80'0000ull};
+        for (uint32_t i = 0; i < options_.stacks; i++) {
+            Site site;
+            size_t depth = random(6, 14);
+            for (size_t frame = 0; frame < depth; frame++) {
+                uint64_t base = bases[random(0, 2)];
+                site.acquire.push_back(base + random(0x100, 0x3f'ffff));
+            }
+            site.acquire.push_back(0x7f3a'1c29'4ac3ull);
+            site.acquire.push_back(0x7f3a'1c32'6850ull);
+            site.release = site.acquire;
+            site.release[0] += random(0x10, 0x80);
+            sites_.push_back(std::move(site));
+        }
+    }
+
+    void startChunk(Thread& thread, uint64_t timestamp)
+    {
+        thread.used = sizeof(ChunkHeader);
+        thread.last_timestamp = timestamp;
+        thread.dictionary.reset();
+        thread.generation++;
+        ChunkHeader header = {};
+        header.magic = ChunkHeader::MAGIC;
+        header.kind = ChunkKind::Events;
+        header.tid = thread.tid;
+        header.base_timestamp = timestamp;
+        memcpy(thread.chunk.data(), &header, sizeof(header));
+    }
+
+    void flushChunk(Thread& thread)
+    {
+        if (thread.used == sizeof(ChunkHeader)) return;
+        ChunkHeader* header = reinterpret_cast<ChunkHeader*>(thread.chunk.data());
+        header->size = static_cast<uint32_t>(thread.used - sizeof(ChunkHeader));
+        stats_.raw_bytes += header->size;
+        const uint8_t* payload = thread.chunk.data() + sizeof(ChunkHeader);
+        if (size_t compressed = compressor_.compress(payload, header->size)) {
+            header->codec = compressor_.codec();
+            header->raw_size = header->size;
+            header->size = static_cast<uint32_t>(compressed);
+            payload = compressor_.data();
+        }
+        ChunkIndexEntry entry = {stats_.bytes, header->base_timestamp, header->size, header->tid, 0, 0};
+        entry.event_count = header->event_count;
+        index_.push_back(entry);
+        fwrite(header, 1, sizeof(ChunkHeader), out_);
+        fwrite(payload, 1, header->size, out_);
+        stats_.bytes += sizeof(ChunkHeader) + header->size;
+        stats_.chunks++;
+    }
+
+    void emit(Thread& thread, EventType type, uint64_t timestamp, uint64_t duration, uint64_t stack_id)
+    {
+        if (thread.used + MAX_EVENT_SIZE > CHUNK_CAPACITY) {
+            flushChunk(thread);
+            startChunk(thread, timestamp);
+        }
+        uint8_t* start = thread.chunk.data() + thread.used;
+        VarIntWriter writer(start);
+        if (thread.defined[stack_id] != thread.generation) {
+            thread.defined[stack_id] = thread.generation;
+            const Site& site = sites_[stack_id / 2];
+            const std::vector<uint64_t>& frames = stack_id % 2 ? site.release : site.acquire;
+            writer.writeByte(RECORD_STACK_DEFINITION);
+            writer.write(stack_id);
+            writer.write(frames.size());
+            for (uint64_t frame : frames) writer.write(frame);
+        }
+        writer.writeByte(static_cast<uint8_t>(type));
+        writer.write(zigzagEncode(static_cast<int64_t>(timestamp - thread.last_timestamp)));
+        writer.write(thread.dictionary.encode(lockAddress(thread.lock)));
+        if (eventHasDuration(type)) writer.write(duration);
+        writer.write(STACK_ID_BASE + stack_id);
+        thread.last_timestamp = timestamp;
+        thread.used = writer.position() - thread.chunk.data();
+
+        ChunkHeader* header = reinterpret_cast<ChunkHeader*>(thread.chunk.data());
+        header->event_count++;
+        stats_.events++;
+    }
+
+    void hold(uint32_t lock, uint32_t thread)
+    {
+        locks_[lock].owner = thread;
+        locks_[lock].held_index = held_.size();
+        held_.push_back(lock);
+    }
+
+    void letGo(uint32_t lock)
+    {
+        size_t index = locks_[lock].held_index;
+        held_[index] = held_.back();
+        locks_[held_[index]].held_index = index;
+        held_.pop_back();
+        locks_[lock].owner = NO_THREAD;
+    }
+
+    uint32_t pickLock(uint32_t thread)
+    {
+        bool contend = std::uniform_real_distribution<double>(0, 1)(rng_) < options_.contention;
+        if (contend && !held_.empty()) {
+            uint32_t lock = held_[random(0, held_.size() - 1)];
+            if (locks_[lock].owner != thread) return lock;
+        }
+        // A free lock, unless they are nearly all taken.
+        for (int attempt = 0; attempt < 8; attempt++) {
+            uint32_t lock = static_cast<uint32_t>(random(0, options_.locks - 1));
+            if (locks_[lock].owner == NO_THREAD) return lock;
+        }
+        return static_cast<uint32_t>(random(0, options_.locks - 1));
+    }
+
+  public:
+    explicit SyntheticTrace(const Options& options)
+    : options_(options)
+    , rng_(options.seed)
+    {
+        options_.threads = std::max(options_.threads, 1u);
+        options_.locks = std::max(options_.locks, 1u);
+        options_.stacks = std::max(options_.stacks, 1u);
+    }
+
+    // Write the trace to `path`; false if it cannot be created.
+    bool write(const char* path)
+    {
+        compressor_.configure(options_.codec, options_.level, CHUNK_CAPACITY - sizeof(ChunkHeader));
+        out_ = fopen(path, "wb");
+        if (!out_) return false;
+        buffer_.resize(4 << 20);
+        setvbuf(out_, buffer_.data(), _IOFBF, buffer_.size());
+
+        const uint64_t base = 1'000'000'000;
+        TraceHeader trace_header = {};
+        memcpy(trace_header.magic, TraceHeader::MAGIC, sizeof(TraceHeader::MAGIC));
+        trace_header.version = TraceHeader::VERSION;
+        trace_header.header_size = sizeof(TraceHeader);
+        trace_header.clock = static_cast<uint32_t>(ClockSource::Steady);
+        trace_header.pid = 1;
+        trace_header.ticks_per_second = 1'000'000'000;
+        trace_header.base_ticks = base;
+        trace_header.base_ns = base;
+        fwrite(&trace_header, 1, sizeof(trace_header), out_);
+        stats_.bytes = sizeof(trace_header);
+
+        makeSites();
+        locks_.resize(options_.locks);
+        // (time of the thread's next step, thread); a thread is either about
+        // to acquire or about to release, and waiting threads are not queued.
+        using Step = std::pair<uint64_t, uint32_t>;
+        std::priority_queue<Step, std::vector<Step>, std::greater<Step>> steps;
+        std::vector<bool> holding(options_.threads, false);
+        for (uint32_t i = 0; i < options_.threads; i++) {
+            Thread thread;
+            thread.tid = 1000 + i;
+            thread.chunk.resize(CHUNK_CAPACITY);
+            thread.defined.assign(2 * options_.stacks, 0);
+            threads_.push_back(std::move(thread));
+            uint64_t start = base + random(0, 10'000);
+            startChunk(threads_.back(), start);
+            steps.emplace(start, i);
+        }
+
+        while (stats_.bytes < options_.size) {
+            auto [now, index] = steps.top();
+            steps.pop();
+            Thread& thread = threads_[index];
+            if (!holding[index]) {
+                thread.lock = pickLock(index);
+                thread.site = static_cast<uint32_t>(random(0, options_.stacks - 1));
+                thread.wait_start = now;
+                stats_.acquisitions++;
+                emit(thread, EventType::MutexLock, now, 0, 2 * thread.site);
+                Lock& lock = locks_[thread.lock];
+                if (lock.owner == NO_THREAD) {
+                    uint64_t done = now + random(20, 120);
+                    emit(thread, EventType::MutexLockDone, done, done - now, 2 * thread.site);
+                    hold(thread.lock, index);
+                    holding[index] = true;
+                    steps.emplace(done + random(50, 5'000), index);
+                } else {
+                    stats_.contended++;
+                    lock.waiters.push_back(index);
+                }
+                continue;
+            }
+
+            emit(thread, EventType::MutexUnlock, now, 0, 2 * thread.site + 1);
+            holding[index] = false;
+            steps.emplace(now + random(100, 20'000), index);
+            Lock& lock = locks_[thread.lock];
+            letGo(thread.lock);
+            if (lock.waiters.empty()) continue;
+            // Hand the lock to the longest waiter.
+            uint32_t next = lock.waiters.front();
+            lock.waiters.pop_front();
+            Thread& waiter = threads_[next];
+            uint64_t done = now + random(500, 3'000);
+            emit(waiter, EventType::MutexLockDone, done, done - waiter.wait_start, 2 * waiter.site);
+            hold(waiter.lock, next);
+            holding[next] = true;
+            steps.emplace(done + random(50, 5'000), next);
+        }
+        for (Thread& thread : threads_) flushChunk(thread);
+
+        ChunkHeader header = {};
+        header.magic = ChunkHeader::MAGIC;
+        header.kind = ChunkKind::Index;
+        size_t entries_size = index_.size() * sizeof(ChunkIndexEntry);
+        header.size = static_cast<uint32_t>(entries_size + sizeof(ChunkIndexTrailer));
+        ChunkIndexTrailer trailer = {};
+        trailer.index_offset = stats_.bytes;
+        trailer.entry_count = static_cast<uint32_t>(index_.size());
+        trailer.magic = ChunkIndexTrailer::MAGIC;
+        fwrite(&header, 1, sizeof(header), out_);
+        fwrite(index_.data(), 1, entries_size, out_);
+        fwrite(&trailer, 1, sizeof(trailer), out_);
+        stats_.bytes += sizeof(header) + entries_size + sizeof(trailer);
+        bool ok = fclose(out_) == 0;
+        out_ = nullptr;
+        return ok;
+    }
+
+    const Stats& stats() const
+    {
+        return stats_;
+    }
+};
+
+}  // namespace skeleton_key
@@ -0,0 +1,77 @@
+// Writes a synthetic trace for benchmarking and testing the readers; see
+// synthetic_trace.h for what it contains.
+//
+//   skeletonkey-tracegen [--size BYTES] [--threads N] [--locks N] [--stacks N]
+//                        [--contention FRACTION] [--seed N]
+//                        [--compression CODEC[:LEVEL]] <output>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "synthetic_trace.h"
+
+using namespace skeleton_key;
+
+int
+main(int argc, char** argv)
+{
+    SyntheticTrace::Options options;
+    const char* output = nullptr;
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--size") == 0 && has_value) {
+            options.size = parseByteSize(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && has_value) {
+            options.threads = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        } else if (strcmp(argv[i], "--locks") == 0 && has_value) {
+            options.locks = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        } else if (strcmp(argv[i], "--stacks") == 0 && has_value) {
+            options.stacks = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        } else if (strcmp(argv[i], "--contention") == 0 && has_value) {
+            options.contention = strtod(argv[++i], nullptr);
+        } else if (strcmp(argv[i], "--seed") == 0 && has_value) {
+            options.seed = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--compression") == 0 && has_value) {
+            if (!parseCompression(argv[++i], &options.codec, &options.level)
+                || !codecAvailable(options.codec))
+            {
+                fprintf(stderr, "%s: cannot compress with %s\n", argv[0], argv[i]);
+                return 2;
+            }
+        } else if (!output && argv[i][0] != '-') {
+            output = argv[i];
+        } else {
+            output = nullptr;
+            break;
+        }
+    }
+    if (!output) {
+        fprintf(stderr,
+                "usage: %s [--size BYTES] [--threads N] [--locks N] [--stacks N]\n"
+                "       [--contention FRACTION] [--seed N] [--compression CODEC[:LEVEL]] <output>\n",
+                argv[0]);
+        return 2;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    SyntheticTrace trace(options);
+    if (!trace.write(output)) {
+        perror(output);
+        return 1;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    const SyntheticTrace::Stats& stats = trace.stats();
+    printf("%s: %.1f MB (%.1f MB raw), %" PRIu64 " events in %" PRIu64 " chunks, %.1f%% of %" PRIu64
+           " acquisitions contended (%.0f MB/s)\n",
+           output,
+           stats.bytes / 1e6,
+           stats.raw_bytes / 1e6,
+           stats.events,
+           stats.chunks,
+           stats.acquisitions ? 100.0 * stats.contended / stats.acquisitions : 0.0,
+           stats.acquisitions,
+           stats.bytes / 1e6 / elapsed.count());
+    return 0;
+}
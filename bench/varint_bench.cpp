@@ -0,0 +1,129 @@
+// Throughput of the varint kernels in varint_decode.h on the two shapes of
+// input the trace decoder feeds them: the handful of small fields of one
+// event, and the long runs of 6-byte addresses that make up a stack.
+//
+//   skeletonkey-varint-bench [megabytes]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "varint_decode.h"
+
+using namespace skeleton_key;
+
+namespace {
+
+struct Workload
+{
+    const char* name;
+    std::vector<uint8_t> bytes;
+    // Values per decode call, in order.
+    std::vector<uint32_t> runs;
+    std::vector<uint64_t> values;
+};
+
+void
+append(Workload& workload, uint64_t value)
+{
+    workload.values.push_back(value);
+    while (value >= 0x80) {
+        workload.bytes.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    workload.bytes.push_back(static_cast<uint8_t>(value));
+}
+
+// Timestamp delta, lock code, optional result and duration, stack reference.
+Workload
+eventFields(size_t size, std::mt19937_64& rng)
+{
+    Workload workload{"event fields", {}, {}, {}};
+    while (workload.bytes.size() < size) {
+        uint32_t run = 3;
+        append(workload, rng() % 4000);
+        append(workload, rng() % 12);
+        if (rng() % 8 == 0) {
+            append(workload, rng() % 4);
+            run++;
+        }
+        if (rng() % 2 == 0) {
+            append(workload, rng() % 200000);
+            run++;
+        }
+        append(workload, 2 + rng() % 300);
+        workload.runs.push_back(run);
+    }
+    return workload;
+}
+
+// Return addresses in a PIE binary and shared libraries.
+Workload
+stackFrames(size_t size, std::mt19937_64& rng)
+{
+    Workload workload{"stack frames", {}, {}, {}};
+    while (workload.bytes.size() < size) {
+        uint32_t depth = 4 + rng() % 13;
+        for (uint32_t i = 0; i < depth; i++) {
+            uint64_t base = rng() % 2 ? 0x5600'0000'0000ull : 0x7f00'0000'0000ull;
+            append(workload, base + rng() % 0xFFFF'FFFFull);
+        }
+        workload.runs.push_back(depth);
+    }
+    return workload;
+}
+
+double
+run(const Workload& workload, DecodeVarIntsFn decode, std::vector<uint64_t>& out, int repeats)
+{
+    const uint8_t* end = workload.bytes.data() + workload.bytes.size();
+    auto start = std::chrono::steady_clock::now();
+    for (int repeat = 0; repeat < repeats; repeat++) {
+        const uint8_t* in = workload.bytes.data();
+        uint64_t* values = out.data();
+        for (uint32_t count : workload.runs) {
+            in = decode(in, end, values, count);
+            values += count;
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return workload.bytes.size() * static_cast<double>(repeats) / elapsed.count();
+}
+
+}  // namespace
+
+int
+main(int argc, char** argv)
+{
+    size_t megabytes = argc > 1 ? strtoul(argv[1], nullptr, 10) : 16;
+    std::mt19937_64 rng(42);
+    Workload workloads[] = {eventFields(megabytes << 20, rng), stackFrames(megabytes << 20, rng)};
+
+    VarIntKernel kernels[MAX_VARINT_KERNELS];
+    size_t kernel_count = availableVarIntKernels(kernels);
+
+    for (const Workload& workload : workloads) {
+        printf("%s (%zu MB, %.2f bytes/value)\n",
+               workload.name,
+               workload.bytes.size() >> 20,
+               static_cast<double>(workload.bytes.size()) / workload.values.size());
+        std::vector<uint64_t> out(workload.values.size());
+        double scalar = 0;
+        for (size_t k = 0; k < kernel_count; k++) {
+            run(workload, kernels[k].decode, out, 1);
+            if (out != workload.values) {
+                fprintf(stderr, "%s: wrong values\n", kernels[k].name);
+                return 1;
+            }
+            double rate = run(workload, kernels[k].decode, out, 5);
+            if (k == 0) scalar = rate;
+            printf("  %-8s %8.1f MB/s  %5.2fx%s\n",
+                   kernels[k].name,
+                   rate / 1e6,
+                   rate / scalar,
+                   kernels[k].decode == varIntKernel() ? "  (selected)" : "");
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,58 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+// A blocking chain over two locks: the holder keeps lock_2 for 100 ms, the
+// middle thread takes lock_1 and then waits for lock_2, and the last thread
+// waits for lock_1. The holder's section of lock_2 is at the root of both
+// waits, while the last thread is only directly blocked by lock_1.
+pthread_mutex_t lock_1 = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t lock_2 = PTHREAD_MUTEX_INITIALIZER;
+
+void*
+holder(void* arg)
+{
+    pthread_mutex_lock(&lock_2);
+    printf("Holder has lock 2\n");
+    usleep(100 * 1000);
+    pthread_mutex_unlock(&lock_2);
+    return NULL;
+}
+
+void*
+middle(void* arg)
+{
+    usleep(20 * 1000);
+    pthread_mutex_lock(&lock_1);
+    printf("Middle has lock 1, waiting for lock 2\n");
+    pthread_mutex_lock(&lock_2);
+    pthread_mutex_unlock(&lock_2);
+    pthread_mutex_unlock(&lock_1);
+    return NULL;
+}
+
+void*
+last(void* arg)
+{
+    usleep(40 * 1000);
+    printf("Last waiting for lock 1\n");
+    pthread_mutex_lock(&lock_1);
+    pthread_mutex_unlock(&lock_1);
+    return NULL;
+}
+
+int
+main()
+{
+    pthread_t threads[3];
+
+    pthread_create(&threads[0], NULL, holder, NULL);
+    pthread_create(&threads[1], NULL, middle, NULL);
+    pthread_create(&threads[2], NULL, last, NULL);
+
+    for (int i = 0; i < 3; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    return 0;
+}
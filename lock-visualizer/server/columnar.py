@@ -0,0 +1,186 @@
+"""Reader for the columnar export written by ``skeletonkey-analyze --export-columns``.
+
+The layout is described in src/columnar.h. Opening a file only reads its
+header, lock index and thread list; the rows of a lock are sliced out of the
+mapped file when they are asked for, so serving one lock costs time in
+proportion to that lock's events rather than to the whole trace. The
+level-of-detail index lets a time window be summarized from a bounded number
+of buckets, however many rows fall inside it.
+"""
+import mmap
+import struct
+import sys
+from array import array
+from bisect import bisect_left
+from dataclasses import dataclass
+from typing import Dict, List, Optional
+
+COLUMNAR_MAGIC = b'SKCOLS1\0'
+COLUMNAR_VERSION = 2
+COLUMNAR_HEADER_FORMAT = '<8sII14Q'
+COLUMNAR_LOCK_FORMAT = '<5QIIQ'
+COLUMNAR_LEVEL_FORMAT = '<3Q'
+COLUMNAR_BUCKET_FORMAT = '<QII4Q'
+# LockRange.kinds
+COLUMNAR_MUTEX = 1
+COLUMNAR_RWLOCK = 2
+COLUMNAR_COND = 4
+COLUMNAR_SPIN = 8
+COLUMNAR_SEM = 16
+COLUMNAR_BARRIER = 32
+# Duration of an interval that had not ended when the trace did.
+OPEN_DURATION = (1 << 64) - 1
+
+
+@dataclass
+class LockRange:
+    address: int
+    first_row: int
+    row_count: int
+    first_timestamp: int
+    last_timestamp: int
+    kinds: int
+    level_count: int
+    first_level: int
+
+
+@dataclass
+class Level:
+    bucket_width: int
+    first_bucket: int
+    bucket_count: int
+
+
+@dataclass
+class Bucket:
+    start: int
+    wait_count: int
+    hold_count: int
+    wait_total: int
+    hold_total: int
+    wait_max: int
+    hold_max: int
+
+
+@dataclass
+class LockRows:
+    timestamp: array
+    duration: array
+    tid: array
+    result: array
+    type: bytes
+
+    def __len__(self):
+        return len(self.timestamp)
+
+
+def is_columnar(filename: str) -> bool:
+    with open(filename, 'rb') as f:
+        return f.read(len(COLUMNAR_MAGIC)) == COLUMNAR_MAGIC
+
+
+class ColumnarTrace:
+    def __init__(self, filename: str):
+        if sys.byteorder != 'little':
+            raise ValueError("columnar traces are little-endian")
+        self._file = open(filename, 'rb')
+        self._map = mmap.mmap(self._file.fileno(), 0, access=mmap.ACCESS_READ)
+
+        header = struct.unpack_from(COLUMNAR_HEADER_FORMAT, self._map, 0)
+        (magic, version, _header_size, lock_count, thread_count, self.row_count,
+         locks_offset, threads_offset, self._timestamp_offset, self._duration_offset,
+         self._tid_offset, self._result_offset, self._type_offset,
+         level_count, _bucket_count, levels_offset, self._buckets_offset) = header
+        if magic != COLUMNAR_MAGIC or version != COLUMNAR_VERSION:
+            raise ValueError(f"{filename} is not a columnar trace")
+
+        lock_size = struct.calcsize(COLUMNAR_LOCK_FORMAT)
+        self.locks: Dict[int, LockRange] = {}
+        for i in range(lock_count):
+            lock = LockRange(*struct.unpack_from(COLUMNAR_LOCK_FORMAT, self._map,
+                                                 locks_offset + i * lock_size))
+            self.locks[lock.address] = lock
+
+        level_size = struct.calcsize(COLUMNAR_LEVEL_FORMAT)
+        self._levels = [Level(*struct.unpack_from(COLUMNAR_LEVEL_FORMAT, self._map,
+                                                  levels_offset + i * level_size))
+                        for i in range(level_count)]
+
+        threads = array('I')
+        threads.frombytes(self._map[threads_offset:threads_offset + 4 * thread_count])
+        self.threads: List[int] = list(threads)
+
+    def _column(self, typecode: str, offset: int, first: int, count: int) -> array:
+        values = array(typecode)
+        start = offset + first * values.itemsize
+        values.frombytes(self._map[start:start + count * values.itemsize])
+        return values
+
+    def rows(self, address: int) -> Optional[LockRows]:
+        """The rows of one lock, in time order, or None for an unknown lock."""
+        lock = self.locks.get(address)
+        if lock is None:
+            return None
+        return self.rows_between(address, 0, lock.row_count)
+
+    def row_range(self, address: int, start: int, end: int) -> range:
+        """The rows of a lock with timestamps in [start, end)."""
+        lock = self.locks.get(address)
+        if lock is None:
+            return range(0)
+        first = self._timestamp_offset + lock.first_row * 8
+        with memoryview(self._map)[first:first + lock.row_count * 8] as raw, \
+                raw.cast('Q') as timestamps:
+            return range(bisect_left(timestamps, start), bisect_left(timestamps, end))
+
+    def rows_between(self, address: int, begin: int, end: int) -> LockRows:
+        """Rows [begin, end) of a lock, as numbered by row_range()."""
+        first = self.locks[address].first_row + begin
+        count = end - begin
+        return LockRows(
+            timestamp=self._column('Q', self._timestamp_offset, first, count),
+            duration=self._column('Q', self._duration_offset, first, count),
+            tid=self._column('I', self._tid_offset, first, count),
+            result=self._column('i', self._result_offset, first, count),
+            type=self._map[self._type_offset + first:self._type_offset + first + count],
+        )
+
+    def levels(self, address: int) -> List[Level]:
+        """The levels of detail of a lock, finest first."""
+        lock = self.locks.get(address)
+        if lock is None:
+            return []
+        return self._levels[lock.first_level:lock.first_level + lock.level_count]
+
+    def _bucket(self, index: int) -> Bucket:
+        size = struct.calcsize(COLUMNAR_BUCKET_FORMAT)
+        return Bucket(*struct.unpack_from(COLUMNAR_BUCKET_FORMAT, self._map,
+                                          self._buckets_offset + index * size))
+
+    def buckets(self, level: Level, start: int, end: int) -> List[Bucket]:
+        """The buckets of a level that overlap [start, end)."""
+        # Binary search for the first bucket ending after start.
+        low, high = level.first_bucket, level.first_bucket + level.bucket_count
+        while low < high:
+            middle = (low + high) // 2
+            if self._bucket(middle).start + level.bucket_width <= start:
+                low = middle + 1
+            else:
+                high = middle
+        buckets = []
+        for index in range(low, level.first_bucket + level.bucket_count):
+            bucket = self._bucket(index)
+            if bucket.start >= end:
+                break
+            buckets.append(bucket)
+        return buckets
+
+    def close(self):
+        self._map.close()
+        self._file.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
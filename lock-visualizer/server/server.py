@@ -1,70 +1,216 @@
 from flask import Flask, jsonify, send_from_directory, request
 import sys
 from collections import defaultdict
-from typing import Dict, List, Set
-from .trace_reader import read_event, EventType
+from typing import Dict, List, Set, Tuple
+from .trace_reader import open_trace, read_events, EventType
+from .columnar import COLUMNAR_MUTEX, ColumnarTrace, OPEN_DURATION, is_columnar
 
 app = Flask(__name__, static_folder='../static', static_url_path='')
 
+WAIT_TYPES = (EventType.MutexLock, EventType.MutexTryLock, EventType.MutexTimedLock)
+DONE_TYPES = (EventType.MutexLockDone, EventType.MutexTryLockDone, EventType.MutexTimedLockDone)
+
+# A window with more rows than this is sent as level-of-detail buckets.
+MAX_WINDOW_EVENTS = 5000
+# Buckets the frontend draws across a window by default.
+DEFAULT_WIDTH = 200
+
+
+def overlaps(event: dict, start: int, end: int) -> bool:
+    # An interval that never ended stays open to the end of the trace.
+    return event['timestamp'] < end and ('duration' not in event
+                                         or event['timestamp'] + event['duration'] > start)
+
+
 class TimelineData:
     def __init__(self):
         self.events_by_lock: Dict[int, List[dict]] = defaultdict(list)
         self.threads: Set[int] = set()
-        
+        # The open wait and held intervals of each (lock, tid), so a Done or
+        # Unlock finds its match without scanning the lock's history.
+        self._open_waits: Dict[Tuple[int, int], dict] = {}
+        self._open_holds: Dict[Tuple[int, int], List[dict]] = defaultdict(list)
+
+    def lock_addresses(self) -> List[int]:
+        return list(self.events_by_lock.keys())
+
+    def thread_ids(self) -> List[int]:
+        return list(self.threads)
+
+    def lock_events(self, lock_addr: int) -> List[dict]:
+        return self.events_by_lock.get(lock_addr, [])
+
+    def window(self, lock_addr: int, start=None, end=None, width=DEFAULT_WIDTH) -> dict:
+        # Without the columnar export there is no index: filter every event.
+        events = self.lock_events(lock_addr)
+        if start is None:
+            start = min((e['timestamp'] for e in events), default=0)
+        if end is None:
+            end = max((e['timestamp'] + e.get('duration', 0) for e in events), default=0) + 1
+        return {'start': start, 'end': end,
+                'events': [e for e in events if overlaps(e, start, end)]}
+
+    def _hold(self, event):
+        held = {
+            'tid': event.tid,
+            'type': 'held',
+            'timestamp': event.timestamp
+        }
+        self.events_by_lock[event.ptr1].append(held)
+        self._open_holds[(event.ptr1, event.tid)].append(held)
+
     def process_event(self, event):
-        print(event)
         self.threads.add(event.tid)
+        key = (event.ptr1, event.tid)
 
-        if event.type in [EventType.MutexLock, EventType.MutexTryLock, EventType.MutexTimedLock]:
-            self.events_by_lock[event.ptr1].append({
+        if event.type in WAIT_TYPES:
+            wait = {
                 'tid': event.tid,
                 'type': 'wait',
                 'timestamp': event.timestamp
-            })
+            }
+            self.events_by_lock[event.ptr1].append(wait)
+            self._open_waits[key] = wait
             
-        elif event.type in [EventType.MutexLockDone, EventType.MutexTryLockDone, EventType.MutexTimedLockDone]:
-            wait_event = next(
-                (e for e in reversed(self.events_by_lock[event.ptr1])
-                 if e['tid'] == event.tid and e['type'] == 'wait' and 'duration' not in e),
-                None
-            )
+        elif event.type in DONE_TYPES:
+            wait_event = self._open_waits.pop(key, None)
             
             if wait_event:
                 # Set wait duration
                 wait_event['duration'] = event.timestamp - wait_event['timestamp']
                 
                 # Start held period
-                self.events_by_lock[event.ptr1].append({
-                    'tid': event.tid,
-                    'type': 'held',
-                    'timestamp': event.timestamp
-                })
+                self._hold(event)
                 
+        elif event.type == EventType.MutexLockFast:
+            self._hold(event)
+
         elif event.type == EventType.MutexUnlock:
             # Find the matching held event
-            held_event = next(
-                (e for e in reversed(self.events_by_lock[event.ptr1])
-                 if e['tid'] == event.tid and e['type'] == 'held' and 'duration' not in e),
-                None
-            )
+            holds = self._open_holds.get(key)
+            held_event = holds.pop() if holds else None
             
             if held_event:
                 # Set held duration from LockDone to Unlock
                 held_event['duration'] = event.timestamp - held_event['timestamp']
 
+class ColumnarTimeline:
+    """Serves the same timelines from a columnar export, one lock at a time.
+
+    The export has already paired waits with acquisitions and acquisitions
+    with unlocks, so a lock's timeline is a single pass over its rows.
+    """
+
+    def __init__(self, filename: str):
+        self.trace = ColumnarTrace(filename)
+
+    def lock_addresses(self) -> List[int]:
+        # The timelines only show mutexes.
+        return [address for address, lock in self.trace.locks.items() if lock.kinds & COLUMNAR_MUTEX]
+
+    def thread_ids(self) -> List[int]:
+        return self.trace.threads
+
+    def lock_events(self, lock_addr: int) -> List[dict]:
+        rows = self.trace.rows(lock_addr)
+        if rows is None:
+            return []
+        return self._events(rows)
+
+    def window(self, lock_addr: int, start=None, end=None, width=DEFAULT_WIDTH) -> dict:
+        """The events of a lock overlapping [start, end), or summaries of them.
+
+        Windows with few enough rows are read out of the columns, along with
+        the intervals that began earlier and reach into the window; denser
+        ones are answered from the level of detail with the finest buckets
+        that still cover the window in at most about `width` of them.
+        """
+        lock = self.trace.locks.get(lock_addr)
+        levels = self.trace.levels(lock_addr)
+        if lock is None or not levels:
+            return {'start': start or 0, 'end': end or 0, 'events': []}
+        if start is None:
+            start = lock.first_timestamp
+        if end is None:
+            end = lock.last_timestamp + 1
+
+        rows = self.trace.row_range(lock_addr, start, end)
+        if len(rows) <= MAX_WINDOW_EVENTS:
+            events = []
+            for earlier in self._reaching(lock_addr, levels, len(levels) - 1, 0, start):
+                earlier_rows = self.trace.rows_between(lock_addr, earlier.start, earlier.stop)
+                events.extend(self._events(earlier_rows))
+            events.extend(self._events(self.trace.rows_between(lock_addr, rows.start, rows.stop)))
+            return {'start': start, 'end': end,
+                    'events': [e for e in events if overlaps(e, start, end)]}
+
+        wanted = (end - start) / max(1, width)
+        level = next((level for level in levels if level.bucket_width >= wanted), levels[-1])
+        return {'start': start, 'end': end, 'events': [],
+                'bucket_width': level.bucket_width,
+                'buckets': [vars(bucket) for bucket in self.trace.buckets(level, start, end)]}
+
+    def _reaching(self, lock_addr: int, levels, depth: int, low: int, start: int) -> List[range]:
+        """Row ranges, before `start`, that may hold intervals lasting past it.
+
+        Each bucket bounds when the intervals starting in it end, so only the
+        buckets that could reach `start` are searched, level by level.
+        """
+        level = levels[depth]
+        found = []
+        for bucket in self.trace.buckets(level, low, start):
+            bucket_end = bucket.start + level.bucket_width
+            if bucket_end + max(bucket.wait_max, bucket.hold_max) <= start:
+                continue
+            if depth == 0:
+                found.append(self.trace.row_range(lock_addr, bucket.start, min(bucket_end, start)))
+            else:
+                found.extend(self._reaching(lock_addr, levels, depth - 1,
+                                            bucket.start, min(bucket_end, start)))
+        return found
+
+    def _events(self, rows) -> List[dict]:
+        # Rows are read a window at a time, so an acquisition starts a held
+        # period on its own; in a whole trace each has its wait before it.
+        events = []
+        for i in range(len(rows)):
+            event_type = rows.type[i]
+            tid = rows.tid[i]
+            if event_type in WAIT_TYPES:
+                kind = 'wait'
+            elif event_type in DONE_TYPES:
+                if rows.result[i] != 0:
+                    continue
+                kind = 'held'
+            elif event_type == EventType.MutexLockFast:
+                kind = 'held'
+            else:
+                continue
+            event = {'tid': tid, 'type': kind, 'timestamp': rows.timestamp[i]}
+            if rows.duration[i] != OPEN_DURATION:
+                event['duration'] = rows.duration[i]
+            events.append(event)
+        return events
+
+
 @app.route('/api/locks')
 def get_locks():
     return jsonify({
-        'locks': list(timeline_data.events_by_lock.keys()),
-        'threads': list(timeline_data.threads)
+        'locks': timeline_data.lock_addresses(),
+        'threads': timeline_data.thread_ids()
     })
 
 @app.route('/api/timeline/<int:lock_addr>')
 def get_timeline(lock_addr):
-    events = timeline_data.events_by_lock.get(lock_addr, [])
+    # Optional ?start=&end= (ns) select a window and ?width= the zoom level:
+    # about how many buckets a summarized window is split into.
+    window = timeline_data.window(lock_addr,
+                                  request.args.get('start', type=int),
+                                  request.args.get('end', type=int),
+                                  request.args.get('width', DEFAULT_WIDTH, type=int))
     return jsonify({
-        'events': events,
-        'threads': list(timeline_data.threads)
+        **window,
+        'threads': timeline_data.thread_ids()
     })
 
 @app.route('/api/multi_timeline', methods=['POST'])
@@ -75,9 +221,14 @@ def get_multi_timeline():
     # Get all events for requested locks
     events = []
     threads = set()
+    summarized = []
     
     for lock_addr in lock_addresses:
-        lock_events = timeline_data.events_by_lock.get(lock_addr, [])
+        window = timeline_data.window(lock_addr, request.json.get('start'), request.json.get('end'))
+        if 'buckets' in window:
+            # Too dense to draw interval by interval.
+            summarized.append(lock_addr)
+        lock_events = window['events']
         # Only include 'held' events for the overlap view
         held_events = [
             {**e, 'lock_addr': lock_addr} 
@@ -89,7 +240,8 @@ def get_multi_timeline():
         
     return jsonify({
         'events': events,
-        'threads': list(threads)
+        'threads': list(threads),
+        'summarized': summarized
     })
 
 @app.route('/')
@@ -99,12 +251,18 @@ def root():
 timeline_data = TimelineData()
 
 def load_trace_file(filename):
-    with open(filename, 'rb') as f:
-        while True:
-            event = read_event(f)
-            if event is None:
-                break
-            timeline_data.process_event(event)
+    global timeline_data
+    if is_columnar(filename):
+        timeline_data = ColumnarTimeline(filename)
+        return
+
+    with open_trace(filename) as f:
+        events = list(read_events(f))
+
+    # Events are buffered per thread; replay them in timestamp order.
+    events.sort(key=lambda e: e.timestamp)
+    for event in events:
+        timeline_data.process_event(event)
 
 def main():
     if len(sys.argv) != 2:
@@ -1,9 +1,10 @@
+import io
 import sys
 import struct
 from collections import defaultdict
 from enum import IntEnum
 from dataclasses import dataclass
-from typing import List, BinaryIO, Optional
+from typing import List, BinaryIO, Iterator, Optional
 from rich.console import Console
 from rich.table import Table
 from rich import box
@@ -46,6 +47,40 @@ class EventType(IntEnum):
     CondWaitDone = 30
     CondTimedWait = 31
     CondTimedWaitDone = 32
+    # Acquisitions that did not wait (SKELETON_KEY_CAPTURE=contended)
+    MutexLockFast = 33
+    RWLockReadFast = 34
+    RWLockWriteFast = 35
+    # Spinlock events; a SpinLockDone's duration is spent spinning on the CPU
+    SpinInit = 36
+    SpinDestroy = 37
+    SpinLock = 38
+    SpinLockDone = 39
+    SpinTryLock = 40
+    SpinTryLockDone = 41
+    SpinUnlock = 42
+    SpinLockFast = 43
+    # Semaphore events; sem_clockwait() is logged as SemTimedWait
+    SemInit = 44
+    SemDestroy = 45
+    SemWait = 46
+    SemWaitDone = 47
+    SemTryWait = 48
+    SemTryWaitDone = 49
+    SemTimedWait = 50
+    SemTimedWaitDone = 51
+    SemPost = 52
+    SemWaitFast = 53
+    # Barrier events
+    BarrierInit = 54
+    BarrierDestroy = 55
+    BarrierWait = 56
+    BarrierWaitDone = 57
+    # Waits against a chosen clock
+    MutexClockLock = 58
+    MutexClockLockDone = 59
+    CondClockWait = 60
+    CondClockWaitDone = 61
 
 @dataclass
 class Event:
@@ -74,6 +109,119 @@ class LockStats:
             return 0
         return self.total_time_ms / self.locked_count
 
+# Files written by the mmap/ring backends: a header page followed by
+# fixed-size slots, each holding one chunk.
+MAPPED_MAGIC = b"SKMMAP1\0"
+MAPPED_HEADER_SIZE = 4096
+MAPPED_SLOT_HEADER_SIZE = 16
+MAPPED_TRACE_HEADER_OFFSET = 32
+
+# Trace format, see src/trace_format.h; keep in sync with the writer.
+TRACE_MAGIC = b"SKEYTRC\0"
+TRACE_HEADER_FORMAT = "<8sIIIIQQQ"
+TRACE_HEADER_SIZE = struct.calcsize(TRACE_HEADER_FORMAT)
+# Sampling fields that newer writers append to the header.
+TRACE_SAMPLING_FORMAT = "<IIII"
+TRACE_SAMPLING_SIZE = struct.calcsize(TRACE_SAMPLING_FORMAT)
+CLOCK_STEADY = 0
+
+CHUNK_MAGIC = 0x4B434B53
+CHUNK_HEADER_FORMAT = "<IB3sIIIIQ"
+CHUNK_HEADER_SIZE = struct.calcsize(CHUNK_HEADER_FORMAT)
+CHUNK_EVENTS = 1
+
+EVENT_HAS_PTR2 = 0x80
+EVENT_HAS_RESULT = 0x40
+EVENT_TYPE_MASK = 0x3F
+DURATION_EVENTS = frozenset(t for t in EventType if t.name.endswith("Done"))
+LOCK_DICTIONARY_SIZE = 8
+RECORD_STACK_DEFINITION = 0x3F
+STACK_NONE = 0
+STACK_INLINE = 1
+STACK_ID_BASE = 2
+
+class TraceClock:
+    """Converts recorded clock values to nanoseconds."""
+
+    def __init__(self, ticks_per_second=1_000_000_000, base_ticks=0, base_ns=0):
+        self.ticks_per_second = ticks_per_second
+        self.base_ticks = base_ticks
+        self.base_ns = base_ns
+
+    def to_ns(self, ticks: int) -> int:
+        return self.base_ns + (ticks - self.base_ticks) * 1_000_000_000 // self.ticks_per_second
+
+    def duration_to_ns(self, ticks: int) -> int:
+        return ticks * 1_000_000_000 // self.ticks_per_second
+
+@dataclass
+class TraceInfo:
+    version: int
+    pid: int
+    clock: TraceClock
+    # Multiply counts and totals by this to estimate the unsampled run.
+    sample_scale: float = 1.0
+
+def _sample_scale(period: int, on_ms: int, off_ms: int) -> float:
+    scale = float(max(period, 1))
+    if on_ms > 0 and off_ms > 0:
+        scale *= (on_ms + off_ms) / on_ms
+    return scale
+
+def read_header(f: BinaryIO) -> TraceInfo:
+    """Consume the trace header if there is one and describe the trace.
+
+    Traces without a header are version 1 with nanosecond timestamps.
+    """
+    start = f.tell()
+    raw = f.read(TRACE_HEADER_SIZE)
+    if len(raw) < TRACE_HEADER_SIZE or not raw.startswith(TRACE_MAGIC):
+        f.seek(start)
+        return TraceInfo(1, 0, TraceClock())
+    (_magic, version, header_size, clock, pid,
+     ticks_per_second, base_ticks, base_ns) = struct.unpack(TRACE_HEADER_FORMAT, raw)
+    sample_scale = 1.0
+    if header_size >= TRACE_HEADER_SIZE + TRACE_SAMPLING_SIZE:
+        period, _flags, on_ms, off_ms = struct.unpack(TRACE_SAMPLING_FORMAT, f.read(TRACE_SAMPLING_SIZE))
+        sample_scale = _sample_scale(period, on_ms, off_ms)
+    f.seek(start + header_size)
+    if clock == CLOCK_STEADY or ticks_per_second == 0:
+        return TraceInfo(version, pid, TraceClock(), sample_scale)
+    return TraceInfo(version, pid, TraceClock(ticks_per_second, base_ticks, base_ns), sample_scale)
+
+def open_trace(filename: str) -> BinaryIO:
+    """Open a trace file, reassembling mapped traces into a record stream."""
+    f = open(filename, "rb")
+    header = f.read(MAPPED_HEADER_SIZE)
+    if not header.startswith(MAPPED_MAGIC):
+        f.seek(0)
+        return f
+
+    slot_size, _ring, slot_count, _next_sequence = struct.unpack_from("<IIQQ", header, 8)
+    f.seek(MAPPED_HEADER_SIZE)
+    slots = []
+    for _ in range(slot_count):
+        slot = f.read(slot_size)
+        if len(slot) < slot_size:
+            break
+        sequence, used = struct.unpack_from("<QI", slot)
+        if sequence:
+            used = min(used, slot_size - MAPPED_SLOT_HEADER_SIZE)
+            data = bytearray(slot[MAPPED_SLOT_HEADER_SIZE:MAPPED_SLOT_HEADER_SIZE + used])
+            # The writer never finishes a slot's chunk header; its size is
+            # whatever the slot says was used.
+            if used >= CHUNK_HEADER_SIZE and struct.unpack_from("<I", data)[0] == CHUNK_MAGIC:
+                struct.pack_into("<I", data, 8, used - CHUNK_HEADER_SIZE)
+            slots.append((sequence, bytes(data)))
+    f.close()
+    slots.sort(key=lambda s: s[0])
+    # The trace header lives inside the mapped header page.
+    trace_header = b""
+    if header.startswith(TRACE_MAGIC, MAPPED_TRACE_HEADER_OFFSET):
+        header_size, = struct.unpack_from("<I", header, MAPPED_TRACE_HEADER_OFFSET + 12)
+        trace_header = header[MAPPED_TRACE_HEADER_OFFSET:MAPPED_TRACE_HEADER_OFFSET + header_size]
+    return io.BytesIO(trace_header + b"".join(data for _, data in slots))
+
 def read_varint(f: BinaryIO) -> int:
     result = 0
     shift = 0
@@ -88,7 +236,7 @@ def read_varint(f: BinaryIO) -> int:
         shift += 7
     return result
 
-def read_event(f: BinaryIO) -> Optional[Event]:
+def read_event(f: BinaryIO, clock: Optional[TraceClock] = None) -> Optional[Event]:
     try:
         # Read event fields using varint encoding
         timestamp = read_varint(f)
@@ -104,6 +252,112 @@ def read_event(f: BinaryIO) -> Optional[Event]:
         for _ in range(stack_depth):
             read_varint(f)  # Skip stack addresses for now
         
+        if clock is not None:
+            timestamp = clock.to_ns(timestamp)
+            duration = clock.duration_to_ns(duration)
         return Event(timestamp, tid, event_type, ptr1, ptr2, result, duration, stack_depth)
     except EOFError:
-        return None
\ No newline at end of file
+        return None
+
+def _varint(data: bytes, pos: int):
+    result = 0
+    shift = 0
+    while True:
+        b = data[pos]
+        pos += 1
+        result |= (b & 0x7F) << shift
+        if not (b & 0x80):
+            return result, pos
+        shift += 7
+
+def _unzigzag(value: int) -> int:
+    return (value >> 1) ^ -(value & 1)
+
+class LockDictionary:
+    """Mirror of the writer's per-chunk dictionary of lock addresses."""
+
+    def __init__(self):
+        self.entries = [0] * LOCK_DICTIONARY_SIZE
+        self.last = 0
+        self.next = 0
+
+    def decode(self, code: int) -> int:
+        if code < LOCK_DICTIONARY_SIZE:
+            return self.entries[code]
+        address = (self.last + _unzigzag(code - LOCK_DICTIONARY_SIZE)) & 0xFFFFFFFFFFFFFFFF
+        self.entries[self.next] = address
+        self.next = (self.next + 1) % LOCK_DICTIONARY_SIZE
+        self.last = address
+        return address
+
+def read_chunk_events(tid: int, timestamp: int, payload: bytes,
+                      clock: TraceClock, stacks: dict) -> Iterator[Event]:
+    """Decode the events of one version 2 Events chunk.
+
+    `stacks` maps stack ids to their depth and is shared by all chunks of the
+    trace; definition records in this chunk are added to it.
+    """
+    locks = LockDictionary()
+    pos = 0
+    while pos < len(payload):
+        type_byte = payload[pos]
+        pos += 1
+        if type_byte == RECORD_STACK_DEFINITION:
+            stack_id, pos = _varint(payload, pos)
+            depth, pos = _varint(payload, pos)
+            for _ in range(depth):
+                _, pos = _varint(payload, pos)
+            stacks[stack_id] = depth
+            continue
+        event_type = EventType(type_byte & EVENT_TYPE_MASK)
+        delta, pos = _varint(payload, pos)
+        timestamp += _unzigzag(delta)
+        code, pos = _varint(payload, pos)
+        ptr1 = locks.decode(code)
+        ptr2 = 0
+        if type_byte & EVENT_HAS_PTR2:
+            code, pos = _varint(payload, pos)
+            ptr2 = locks.decode(code)
+        result = 0
+        if type_byte & EVENT_HAS_RESULT:
+            value, pos = _varint(payload, pos)
+            result = _unzigzag(value)
+        duration = 0
+        if event_type in DURATION_EVENTS:
+            duration, pos = _varint(payload, pos)
+        stack_ref, pos = _varint(payload, pos)
+        stack_depth = 0
+        if stack_ref == STACK_INLINE:
+            stack_depth, pos = _varint(payload, pos)
+            for _ in range(stack_depth):
+                _, pos = _varint(payload, pos)
+        elif stack_ref >= STACK_ID_BASE:
+            stack_depth = stacks.get(stack_ref - STACK_ID_BASE, 0)
+        yield Event(clock.to_ns(timestamp), tid, event_type, ptr1, ptr2, result,
+                    clock.duration_to_ns(duration), stack_depth)
+
+def read_events(f: BinaryIO, info: Optional[TraceInfo] = None) -> Iterator[Event]:
+    """Yield every event in an opened trace, whatever its version.
+
+    Pass the result of read_header() as `info` if the header was already read.
+    """
+    if info is None:
+        info = read_header(f)
+    if info.version < 2:
+        while True:
+            event = read_event(f, info.clock)
+            if event is None:
+                return
+            yield event
+
+    stacks = {}
+    while True:
+        raw = f.read(CHUNK_HEADER_SIZE)
+        if len(raw) < CHUNK_HEADER_SIZE:
+            return
+        magic, kind, _, size, tid, _count, _, base_timestamp = struct.unpack(CHUNK_HEADER_FORMAT, raw)
+        if magic != CHUNK_MAGIC:
+            raise ValueError(f"corrupt chunk at offset {f.tell() - CHUNK_HEADER_SIZE}")
+        payload = f.read(size)
+        if kind == CHUNK_EVENTS:
+            yield from read_chunk_events(tid, base_timestamp, payload, info.clock, stacks)
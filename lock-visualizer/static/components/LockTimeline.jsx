@@ -2,6 +2,8 @@ window.LockTimeline = () => {
     const [locks, setLocks] = React.useState([]);
     const [selectedLock, setSelectedLock] = React.useState(null);
     const [timelineData, setTimelineData] = React.useState(null);
+    // Time window being shown, or null for the whole lifetime of the lock.
+    const [view, setView] = React.useState(null);
     const [mouseY, setMouseY] = React.useState(null);
     
     const timelineRef = React.useRef(null);
@@ -20,26 +22,25 @@ window.LockTimeline = () => {
     
     React.useEffect(() => {
         if (selectedLock) {
-            fetch(`/api/timeline/${selectedLock}`)
+            // Dense windows come back as buckets, about one per 10px.
+            const query = view ? `?start=${view.start}&end=${view.end}&width=200` : '?width=200';
+            fetch(`/api/timeline/${selectedLock}${query}`)
                 .then(res => res.json())
                 .then(data => {
                     console.log('Timeline data:', data);
                     setTimelineData(data);
                 });
         }
-    }, [selectedLock]);
+    }, [selectedLock, view]);
     
     if (!timelineData) return <div>Loading...</div>;
     
-    const rawStart = Math.min(...timelineData.events.map(e => e.timestamp));
-    const rawEnd = Math.max(...timelineData.events.map(e => 
-        e.timestamp + (e.duration || 0)
-    ));
-    const timelineDuration = rawEnd - rawStart;
+    const buckets = timelineData.buckets || null;
+    const timelineDuration = timelineData.end - timelineData.start;
     
     const padding = timelineDuration * 0.02;
-    const timelineStart = rawStart - padding;
-    const timelineEnd = rawEnd + padding;
+    const timelineStart = timelineData.start - padding;
+    const timelineEnd = timelineData.end + padding;
     const paddedDuration = timelineEnd - timelineStart;
     
     const timeToY = time => ((time - timelineStart) / paddedDuration) * 2000;
@@ -61,6 +62,35 @@ window.LockTimeline = () => {
         setMouseY(null);
     };
     
+    const zoomOut = () => {
+        const middle = (timelineData.start + timelineData.end) / 2;
+        setView({
+            start: Math.max(0, Math.floor(middle - timelineDuration)),
+            end: Math.ceil(middle + timelineDuration)
+        });
+    };
+    
+    // Bars scaled by the share of the bucket spent waiting or holding.
+    const renderBucket = (bucket, i) => {
+        const width = timelineData.bucket_width;
+        const top = timeToY(Math.max(bucket.start, timelineStart));
+        const bottom = timeToY(Math.min(bucket.start + width, timelineEnd));
+        const share = total => `${Math.min(100, (100 * total) / width)}%`;
+        return (
+            <div
+                key={i}
+                className="absolute left-0 right-0 flex cursor-zoom-in hover:bg-gray-50"
+                style={{ top: `${top}px`, height: `${Math.max(2, bottom - top)}px` }}
+                title={`${formatNumber(bucket.wait_count)} waits (max ${formatNumber(bucket.wait_max)}), ` +
+                       `${formatNumber(bucket.hold_count)} holds (max ${formatNumber(bucket.hold_max)})`}
+                onClick={() => setView({ start: bucket.start, end: bucket.start + width })}
+            >
+                <div className="bg-yellow-300" style={{ width: share(bucket.wait_total) }} />
+                <div className="bg-green-300" style={{ width: share(bucket.hold_total) }} />
+            </div>
+        );
+    };
+    
     return (
         <div className="min-h-screen bg-gray-50 p-8">
             <div className="max-w-7xl mx-auto">
@@ -72,7 +102,10 @@ window.LockTimeline = () => {
                         <select
                             className="px-4 py-2 border border-gray-300 rounded-md shadow-sm focus:ring-2 focus:ring-blue-500 focus:border-blue-500"
                             value={selectedLock || ''}
-                            onChange={e => setSelectedLock(Number(e.target.value))}
+                            onChange={e => {
+                                setSelectedLock(Number(e.target.value));
+                                setView(null);
+                            }}
                         >
                             {locks.map(lock => (
                                 <option key={lock} value={lock}>
@@ -80,6 +113,25 @@ window.LockTimeline = () => {
                                 </option>
                             ))}
                         </select>
+                        <div className="flex items-center gap-2">
+                            {buckets && (
+                                <span className="text-xs text-gray-500">
+                                    Summarized in {formatNumber(timelineData.bucket_width)} ns buckets, click to zoom in
+                                </span>
+                            )}
+                            <button
+                                className="px-3 py-1 border border-gray-300 rounded-md text-sm"
+                                onClick={zoomOut}
+                            >
+                                Zoom out
+                            </button>
+                            <button
+                                className="px-3 py-1 border border-gray-300 rounded-md text-sm"
+                                onClick={() => setView(null)}
+                            >
+                                Reset
+                            </button>
+                        </div>
                     </div>
                     
                     <div 
@@ -136,8 +188,18 @@ window.LockTimeline = () => {
                             ))}
                         </div>
 
+                        {/* Summaries of a window too dense to draw event by event */}
+                        {buckets && (
+                            <div
+                                className="absolute top-0 bottom-0 left-0 border-l border-gray-200"
+                                style={{ width: `${Math.max(1, timelineData.threads.length) * 120}px` }}
+                            >
+                                {buckets.map(renderBucket)}
+                            </div>
+                        )}
+
                         {/* Events */}
-                        {timelineData.threads.map((thread, threadIndex) => (
+                        {!buckets && timelineData.threads.map((thread, threadIndex) => (
                             <div
                                 key={thread}
                                 className="absolute top-0 bottom-0 border-l border-gray-200"
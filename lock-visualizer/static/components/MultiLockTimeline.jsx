@@ -165,6 +165,14 @@ window.MultiLockTimeline = () => {
                         })}
                     </div>
                     
+                    {timelineData.summarized && timelineData.summarized.length > 0 && (
+                        <div className="text-sm text-gray-500 mb-4">
+                            Too many events to draw for{' '}
+                            {timelineData.summarized.map(lock => `0x${lock.toString(16)}`).join(', ')}
+                            ; open them in the single lock view to zoom in
+                        </div>
+                    )}
+                    
                     <div 
                         ref={timelineRef}
                         className="relative select-none cursor-crosshair" 
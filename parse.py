@@ -1,9 +1,11 @@
+import io
+import math
 import sys
 import struct
 from collections import defaultdict
 from enum import IntEnum
 from dataclasses import dataclass
-from typing import List, BinaryIO, Optional, Dict, Set
+from typing import List, BinaryIO, Iterator, Optional, Dict, Set
 from rich.console import Console
 from rich.table import Table
 from rich import box
@@ -46,6 +48,40 @@ class EventType(IntEnum):
     CondWaitDone = 30
     CondTimedWait = 31
     CondTimedWaitDone = 32
+    # Acquisitions that did not wait (SKELETON_KEY_CAPTURE=contended)
+    MutexLockFast = 33
+    RWLockReadFast = 34
+    RWLockWriteFast = 35
+    # Spinlock events; a SpinLockDone's duration is spent spinning on the CPU
+    SpinInit = 36
+    SpinDestroy = 37
+    SpinLock = 38
+    SpinLockDone = 39
+    SpinTryLock = 40
+    SpinTryLockDone = 41
+    SpinUnlock = 42
+    SpinLockFast = 43
+    # Semaphore events; sem_clockwait() is logged as SemTimedWait
+    SemInit = 44
+    SemDestroy = 45
+    SemWait = 46
+    SemWaitDone = 47
+    SemTryWait = 48
+    SemTryWaitDone = 49
+    SemTimedWait = 50
+    SemTimedWaitDone = 51
+    SemPost = 52
+    SemWaitFast = 53
+    # Barrier events
+    BarrierInit = 54
+    BarrierDestroy = 55
+    BarrierWait = 56
+    BarrierWaitDone = 57
+    # Waits against a chosen clock
+    MutexClockLock = 58
+    MutexClockLockDone = 59
+    CondClockWait = 60
+    CondClockWaitDone = 61
 
 @dataclass
 class Event:
@@ -74,6 +110,122 @@ class LockStats:
             return 0
         return self.total_time_ms / self.locked_count
 
+# Files written by the mmap/ring backends: a header page followed by
+# fixed-size slots, each holding one chunk.
+MAPPED_MAGIC = b"SKMMAP1\0"
+MAPPED_HEADER_SIZE = 4096
+MAPPED_SLOT_HEADER_SIZE = 16
+MAPPED_TRACE_HEADER_OFFSET = 32
+
+# Trace format, see src/trace_format.h; keep in sync with the writer.
+TRACE_MAGIC = b"SKEYTRC\0"
+TRACE_HEADER_FORMAT = "<8sIIIIQQQ"
+TRACE_HEADER_SIZE = struct.calcsize(TRACE_HEADER_FORMAT)
+# Sampling fields that newer writers append to the header.
+TRACE_SAMPLING_FORMAT = "<IIII"
+TRACE_SAMPLING_SIZE = struct.calcsize(TRACE_SAMPLING_FORMAT)
+CLOCK_STEADY = 0
+
+CHUNK_MAGIC = 0x4B434B53
+CHUNK_HEADER_FORMAT = "<IBB2sIIIIQ"
+CHUNK_HEADER_SIZE = struct.calcsize(CHUNK_HEADER_FORMAT)
+CHUNK_EVENTS = 1
+CODEC_NONE = 0
+CODEC_ZSTD = 1
+CODEC_LZ4 = 2
+
+EVENT_HAS_PTR2 = 0x80
+EVENT_HAS_RESULT = 0x40
+EVENT_TYPE_MASK = 0x3F
+DURATION_EVENTS = frozenset(t for t in EventType if t.name.endswith("Done"))
+LOCK_DICTIONARY_SIZE = 8
+RECORD_STACK_DEFINITION = 0x3F
+STACK_NONE = 0
+STACK_INLINE = 1
+STACK_ID_BASE = 2
+
+class TraceClock:
+    """Converts recorded clock values to nanoseconds."""
+
+    def __init__(self, ticks_per_second=1_000_000_000, base_ticks=0, base_ns=0):
+        self.ticks_per_second = ticks_per_second
+        self.base_ticks = base_ticks
+        self.base_ns = base_ns
+
+    def to_ns(self, ticks: int) -> int:
+        return self.base_ns + (ticks - self.base_ticks) * 1_000_000_000 // self.ticks_per_second
+
+    def duration_to_ns(self, ticks: int) -> int:
+        return ticks * 1_000_000_000 // self.ticks_per_second
+
+@dataclass
+class TraceInfo:
+    version: int
+    pid: int
+    clock: TraceClock
+    # Multiply counts and totals by this to estimate the unsampled run.
+    sample_scale: float = 1.0
+
+def _sample_scale(period: int, on_ms: int, off_ms: int) -> float:
+    scale = float(max(period, 1))
+    if on_ms > 0 and off_ms > 0:
+        scale *= (on_ms + off_ms) / on_ms
+    return scale
+
+def read_header(f: BinaryIO) -> TraceInfo:
+    """Consume the trace header if there is one and describe the trace.
+
+    Traces without a header are version 1 with nanosecond timestamps.
+    """
+    start = f.tell()
+    raw = f.read(TRACE_HEADER_SIZE)
+    if len(raw) < TRACE_HEADER_SIZE or not raw.startswith(TRACE_MAGIC):
+        f.seek(start)
+        return TraceInfo(1, 0, TraceClock())
+    (_magic, version, header_size, clock, pid,
+     ticks_per_second, base_ticks, base_ns) = struct.unpack(TRACE_HEADER_FORMAT, raw)
+    sample_scale = 1.0
+    if header_size >= TRACE_HEADER_SIZE + TRACE_SAMPLING_SIZE:
+        period, _flags, on_ms, off_ms = struct.unpack(TRACE_SAMPLING_FORMAT, f.read(TRACE_SAMPLING_SIZE))
+        sample_scale = _sample_scale(period, on_ms, off_ms)
+    f.seek(start + header_size)
+    if clock == CLOCK_STEADY or ticks_per_second == 0:
+        return TraceInfo(version, pid, TraceClock(), sample_scale)
+    return TraceInfo(version, pid, TraceClock(ticks_per_second, base_ticks, base_ns), sample_scale)
+
+def open_trace(filename: str) -> BinaryIO:
+    """Open a trace file, reassembling mapped traces into a record stream."""
+    f = open(filename, "rb")
+    header = f.read(MAPPED_HEADER_SIZE)
+    if not header.startswith(MAPPED_MAGIC):
+        f.seek(0)
+        return f
+
+    slot_size, _ring, slot_count, _next_sequence = struct.unpack_from("<IIQQ", header, 8)
+    f.seek(MAPPED_HEADER_SIZE)
+    slots = []
+    for _ in range(slot_count):
+        slot = f.read(slot_size)
+        if len(slot) < slot_size:
+            break
+        sequence, used = struct.unpack_from("<QI", slot)
+        if sequence:
+            used = min(used, slot_size - MAPPED_SLOT_HEADER_SIZE)
+            data = bytearray(slot[MAPPED_SLOT_HEADER_SIZE:MAPPED_SLOT_HEADER_SIZE + used])
+            # The writer never finishes a slot's chunk header; its size is
+            # whatever the slot says was used.
+            if used >= CHUNK_HEADER_SIZE and struct.unpack_from("<I", data)[0] == CHUNK_MAGIC:
+                struct.pack_into("<I", data, 8, used - CHUNK_HEADER_SIZE)
+            slots.append((sequence, bytes(data)))
+    f.close()
+    slots.sort(key=lambda s: s[0])
+    # The trace header lives inside the mapped header page.
+    trace_header = b""
+    if header.startswith(TRACE_MAGIC, MAPPED_TRACE_HEADER_OFFSET):
+        header_size, = struct.unpack_from("<I", header, MAPPED_TRACE_HEADER_OFFSET + 12)
+        trace_header = header[MAPPED_TRACE_HEADER_OFFSET:MAPPED_TRACE_HEADER_OFFSET + header_size]
+    return io.BytesIO(trace_header + b"".join(data for _, data in slots))
+
 def read_varint(f: BinaryIO) -> int:
     result = 0
     shift = 0
@@ -88,7 +240,7 @@ def read_varint(f: BinaryIO) -> int:
         shift += 7
     return result
 
-def read_event(f: BinaryIO) -> Optional[Event]:
+def read_event(f: BinaryIO, clock: Optional[TraceClock] = None) -> Optional[Event]:
     try:
         # Read event fields using varint encoding
         timestamp = read_varint(f)
@@ -104,12 +256,202 @@ def read_event(f: BinaryIO) -> Optional[Event]:
         for _ in range(stack_depth):
             read_varint(f)  # Skip stack addresses for now
         
+        if clock is not None:
+            timestamp = clock.to_ns(timestamp)
+            duration = clock.duration_to_ns(duration)
         return Event(timestamp, tid, event_type, ptr1, ptr2, result, duration, stack_depth)
     except EOFError:
         return None
 
-class LockStats:
+def _varint(data: bytes, pos: int):
+    result = 0
+    shift = 0
+    while True:
+        b = data[pos]
+        pos += 1
+        result |= (b & 0x7F) << shift
+        if not (b & 0x80):
+            return result, pos
+        shift += 7
+
+def _unzigzag(value: int) -> int:
+    return (value >> 1) ^ -(value & 1)
+
+class LockDictionary:
+    """Mirror of the writer's per-chunk dictionary of lock addresses."""
+
+    def __init__(self):
+        self.entries = [0] * LOCK_DICTIONARY_SIZE
+        self.last = 0
+        self.next = 0
+
+    def decode(self, code: int) -> int:
+        if code < LOCK_DICTIONARY_SIZE:
+            return self.entries[code]
+        address = (self.last + _unzigzag(code - LOCK_DICTIONARY_SIZE)) & 0xFFFFFFFFFFFFFFFF
+        self.entries[self.next] = address
+        self.next = (self.next + 1) % LOCK_DICTIONARY_SIZE
+        self.last = address
+        return address
+
+def decompress_chunk(codec: int, payload: bytes, raw_size: int) -> bytes:
+    """Payload of a compressed Events chunk (SKELETON_KEY_COMPRESSION)."""
+    try:
+        if codec == CODEC_ZSTD:
+            import zstandard
+            return zstandard.ZstdDecompressor().decompress(payload, max_output_size=raw_size)
+        if codec == CODEC_LZ4:
+            import lz4.block
+            return lz4.block.decompress(payload, uncompressed_size=raw_size)
+    except ImportError as error:
+        raise ValueError(f"compressed trace: pip install {'zstandard' if codec == CODEC_ZSTD else 'lz4'}"
+                         ) from error
+    raise ValueError(f"unknown chunk codec {codec}")
+
+
+def read_chunk_events(tid: int, timestamp: int, payload: bytes,
+                      clock: TraceClock, stacks: dict) -> Iterator[Event]:
+    """Decode the events of one version 2 Events chunk.
+
+    `stacks` maps stack ids to their depth and is shared by all chunks of the
+    trace; definition records in this chunk are added to it.
+    """
+    locks = LockDictionary()
+    pos = 0
+    while pos < len(payload):
+        type_byte = payload[pos]
+        pos += 1
+        if type_byte == RECORD_STACK_DEFINITION:
+            stack_id, pos = _varint(payload, pos)
+            depth, pos = _varint(payload, pos)
+            for _ in range(depth):
+                _, pos = _varint(payload, pos)
+            stacks[stack_id] = depth
+            continue
+        event_type = EventType(type_byte & EVENT_TYPE_MASK)
+        delta, pos = _varint(payload, pos)
+        timestamp += _unzigzag(delta)
+        code, pos = _varint(payload, pos)
+        ptr1 = locks.decode(code)
+        ptr2 = 0
+        if type_byte & EVENT_HAS_PTR2:
+            code, pos = _varint(payload, pos)
+            ptr2 = locks.decode(code)
+        result = 0
+        if type_byte & EVENT_HAS_RESULT:
+            value, pos = _varint(payload, pos)
+            result = _unzigzag(value)
+        duration = 0
+        if event_type in DURATION_EVENTS:
+            duration, pos = _varint(payload, pos)
+        stack_ref, pos = _varint(payload, pos)
+        stack_depth = 0
+        if stack_ref == STACK_INLINE:
+            stack_depth, pos = _varint(payload, pos)
+            for _ in range(stack_depth):
+                _, pos = _varint(payload, pos)
+        elif stack_ref >= STACK_ID_BASE:
+            stack_depth = stacks.get(stack_ref - STACK_ID_BASE, 0)
+        yield Event(clock.to_ns(timestamp), tid, event_type, ptr1, ptr2, result,
+                    clock.duration_to_ns(duration), stack_depth)
+
+def read_events(f: BinaryIO, info: Optional[TraceInfo] = None) -> Iterator[Event]:
+    """Yield every event in an opened trace, whatever its version.
+
+    Pass the result of read_header() as `info` if the header was already read.
+    """
+    if info is None:
+        info = read_header(f)
+    if info.version < 2:
+        while True:
+            event = read_event(f, info.clock)
+            if event is None:
+                return
+            yield event
+
+    stacks = {}
+    while True:
+        raw = f.read(CHUNK_HEADER_SIZE)
+        if len(raw) < CHUNK_HEADER_SIZE:
+            return
+        (magic, kind, codec, _, size, tid, _count, raw_size,
+         base_timestamp) = struct.unpack(CHUNK_HEADER_FORMAT, raw)
+        if magic != CHUNK_MAGIC:
+            raise ValueError(f"corrupt chunk at offset {f.tell() - CHUNK_HEADER_SIZE}")
+        payload = f.read(size)
+        if kind == CHUNK_EVENTS:
+            if codec != CODEC_NONE:
+                payload = decompress_chunk(codec, payload, raw_size)
+            yield from read_chunk_events(tid, base_timestamp, payload, info.clock, stacks)
+
+# Same bucket layout as src/histogram.h, so the counts of either merge.
+HISTOGRAM_SUB_BUCKET_BITS = 3
+HISTOGRAM_MAX_EXPONENT = 42
+HISTOGRAM_SUB_BUCKETS = 1 << HISTOGRAM_SUB_BUCKET_BITS
+HISTOGRAM_LINEAR_BUCKETS = 2 * HISTOGRAM_SUB_BUCKETS
+HISTOGRAM_BUCKETS = (HISTOGRAM_LINEAR_BUCKETS
+                     + (HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BUCKET_BITS) * HISTOGRAM_SUB_BUCKETS)
+HISTOGRAM_LARGEST = (2 << HISTOGRAM_MAX_EXPONENT) - 1
+
+
+class LatencyHistogram:
+    """Log-bucketed nanosecond latencies in fixed memory, within 12.5% per value."""
+
     def __init__(self):
+        self.counts = [0] * HISTOGRAM_BUCKETS
+        self.total = 0
+
+    @staticmethod
+    def bucket_of(value: int) -> int:
+        if value < HISTOGRAM_LINEAR_BUCKETS:
+            return max(value, 0)
+        value = min(value, HISTOGRAM_LARGEST)
+        exponent = value.bit_length() - 1
+        sub_bucket = (value >> (exponent - HISTOGRAM_SUB_BUCKET_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1)
+        octave = exponent - HISTOGRAM_SUB_BUCKET_BITS - 1
+        return HISTOGRAM_LINEAR_BUCKETS + octave * HISTOGRAM_SUB_BUCKETS + sub_bucket
+
+    @staticmethod
+    def upper_bound(bucket: int) -> int:
+        if bucket + 1 == HISTOGRAM_BUCKETS:
+            return HISTOGRAM_LARGEST
+        bucket += 1
+        if bucket < HISTOGRAM_LINEAR_BUCKETS:
+            return bucket - 1
+        octave, sub_bucket = divmod(bucket - HISTOGRAM_LINEAR_BUCKETS, HISTOGRAM_SUB_BUCKETS)
+        return ((HISTOGRAM_SUB_BUCKETS | sub_bucket) << (octave + 1)) - 1
+
+    def record(self, value: int, count: int = 1):
+        self.counts[self.bucket_of(value)] += count
+        self.total += count
+
+    def merge(self, other: 'LatencyHistogram'):
+        for bucket, count in enumerate(other.counts):
+            self.counts[bucket] += count
+        self.total += other.total
+
+    def percentile(self, percent: float) -> int:
+        """The largest value of the bucket holding the percentile; 0 when empty."""
+        if self.total == 0:
+            return 0
+        wanted = max(1, math.ceil(percent / 100 * self.total))
+        seen = 0
+        for bucket, count in enumerate(self.counts):
+            seen += count
+            if seen >= wanted:
+                return self.upper_bound(bucket)
+        return HISTOGRAM_LARGEST
+
+
+# In a sampled trace the owner a thread waited behind was most likely not
+# sampled itself, so a lock call this long (the duration of its *Done event)
+# counts as contended on its own (SAMPLED_CONTENTION_NS in src/trace_format.h).
+SAMPLED_CONTENTION_NS = 1000
+
+
+class LockStats:
+    def __init__(self, sampled: bool = False):
+        self.sampled = sampled
         # Existing fields
         self.locked_count = 0
         self.changes = 0
@@ -118,6 +460,10 @@ class LockStats:
         self.total_time_ms = 0
         self.is_mutex = True
         self.last_owner = None
+        # A spinlock is a mutex whose contended waits are spent spinning on
+        # the CPU, so they are summed apart from the time threads blocked.
+        self.is_spin = False
+        self.spin_time_ms = 0
 
         # New fields for enhanced analysis
         self.threads: Set[int] = set()
@@ -131,11 +477,40 @@ class LockStats:
             'contentions': 0,
             'wait_time_ms': 0
         })
-        self.acquisition_times = []
-        self.hold_times = []
+        self.wait_histogram = LatencyHistogram()
+        self.hold_histogram = LatencyHistogram()
         self.current_holds = {}  # (tid, timestamp) pairs
         self.current_owner = None  # Currently holding thread
-        self.pending_locks = {}  # tid -> timestamp of lock attempt
+        self.pending_locks = {}  # tid -> (timestamp, contended, exclusive) of lock attempt
+
+        # Shared holders of an rwlock; readers joining each other neither
+        # contend nor change the owner.
+        self.readers: Dict[int, List[int]] = {}  # tid -> [since, depth]
+        self.read_count = 0
+        # A batch runs from the lock going from free or written to read until
+        # the last reader leaves. Batches of about one reader gain nothing
+        # over a mutex.
+        self.reader_batches = 0
+        self.max_readers = 0
+        # Contended writer waits, and the part of them spent while readers
+        # held the lock (summed over the writers waiting).
+        self.write_wait_ms = 0
+        self.writer_starvation_ms = 0
+        self.waiting_writers = 0
+        self.last_change = 0
+
+    def scale(self, factor: float):
+        """Turn the counts and totals of a sampled trace into estimates."""
+        self.locked_count = round(self.locked_count * factor)
+        self.changes = round(self.changes * factor)
+        self.contentions = round(self.contentions * factor)
+        self.contention_time_ms *= factor
+        self.spin_time_ms *= factor
+        self.total_time_ms *= factor
+        self.read_count = round(self.read_count * factor)
+        self.reader_batches = round(self.reader_batches * factor)
+        self.write_wait_ms *= factor
+        self.writer_starvation_ms *= factor
 
     @property
     def avg_time_ms(self):
@@ -143,60 +518,226 @@ class LockStats:
             return 0
         return self.total_time_ms / self.locked_count
 
-    def record_lock_attempt(self, event: Event):
+    def _read_owned_by_others(self, tid: int) -> bool:
+        return len(self.readers) > (1 if tid in self.readers else 0)
+
+    def _advance(self, timestamp: int):
+        """Charge the time since the last change to writers waiting on readers."""
+        if self.waiting_writers and self.readers and timestamp > self.last_change:
+            self.writer_starvation_ms += (timestamp - self.last_change) * self.waiting_writers / 1_000_000
+        self.last_change = timestamp
+
+    def _end_attempt(self, tid: int):
+        _, _, exclusive = self.pending_locks.pop(tid)
+        if exclusive:
+            self.waiting_writers -= 1
+
+    def record_lock_attempt(self, event: Event, exclusive: bool = True):
         # Record when a thread starts trying to acquire the lock
         # We have contention if someone else owns the lock
-        is_contended = self.current_owner is not None and self.current_owner != event.tid
-        self.pending_locks[event.tid] = (event.timestamp, is_contended)
+        self._advance(event.timestamp)
+        is_contended = ((self.current_owner is not None and self.current_owner != event.tid)
+                        or (exclusive and self._read_owned_by_others(event.tid)))
+        if event.tid in self.pending_locks:
+            self._end_attempt(event.tid)
+        self.pending_locks[event.tid] = (event.timestamp, is_contended, exclusive)
+        if exclusive:
+            self.waiting_writers += 1
 
-    def record_acquisition(self, event: Event):
+    def record_acquisition(self, event: Event, exclusive: bool = True):
+        self._advance(event.timestamp)
         self.locked_count += 1
         self.threads.add(event.tid)
         
         # Check if this was a contended acquisition
         if event.tid in self.pending_locks:
-            start_time, was_contended = self.pending_locks[event.tid]
-            if was_contended:  # Only count if it was actually contended
+            start_time, was_contended, _ = self.pending_locks[event.tid]
+            if was_contended or (self.sampled and event.duration_ns >= SAMPLED_CONTENTION_NS):
                 self.contentions += 1
                 wait_time_ms = (event.timestamp - start_time) / 1_000_000
-                self.contention_time_ms += wait_time_ms
+                if self.is_spin:
+                    self.spin_time_ms += wait_time_ms
+                else:
+                    self.contention_time_ms += wait_time_ms
                 self.max_wait_ms = max(self.max_wait_ms, wait_time_ms)
                 self.busy_threads.add(event.tid)
-                self.acquisition_times.append(wait_time_ms)
+                self.wait_histogram.record(event.timestamp - start_time)
+                if not self.is_mutex and exclusive:
+                    self.write_wait_ms += wait_time_ms
                 
                 # Update thread stats
                 self.thread_stats[event.tid]['contentions'] += 1
                 self.thread_stats[event.tid]['wait_time_ms'] += wait_time_ms
             
-            del self.pending_locks[event.tid]
+            self._end_attempt(event.tid)
         
         # Track ownership changes
-        if self.current_owner is not None and self.current_owner != event.tid:
+        if ((self.current_owner is not None and self.current_owner != event.tid)
+                or (exclusive and self._read_owned_by_others(event.tid))):
             self.changes += 1
-        
-        self.current_owner = event.tid
         self.thread_stats[event.tid]['acquisitions'] += 1
+
+        if not exclusive:
+            self.read_count += 1
+            if not self.readers:
+                self.reader_batches += 1
+            hold = self.readers.setdefault(event.tid, [event.timestamp, 0])
+            hold[1] += 1
+            self.max_readers = max(self.max_readers, len(self.readers))
+            return
+
+        self.current_owner = event.tid
         self.current_holds[event.tid] = event.timestamp
         self.current_owners.add(event.tid)
 
+    def record_failure(self, event: Event):
+        self._advance(event.timestamp)
+        if event.tid in self.pending_locks:
+            self._end_attempt(event.tid)
+
+    def _record_hold(self, since: int, timestamp: int):
+        hold_ns = timestamp - since
+        hold_time = hold_ns / 1_000_000
+        self.total_time_ms += hold_time
+        self.max_hold_ms = max(self.max_hold_ms, hold_time)
+        self.hold_histogram.record(hold_ns)
 
     def record_release(self, event: Event):
+        self._advance(event.timestamp)
+        if event.tid in self.readers and self.current_owner != event.tid:
+            hold = self.readers[event.tid]
+            hold[1] -= 1
+            if hold[1] == 0:
+                self._record_hold(hold[0], event.timestamp)
+                del self.readers[event.tid]
+            return
+
         if event.tid in self.current_holds:
-            hold_time = (event.timestamp - self.current_holds[event.tid]) / 1_000_000
-            self.total_time_ms += hold_time
-            self.max_hold_ms = max(self.max_hold_ms, hold_time)
-            self.hold_times.append(hold_time)
+            self._record_hold(self.current_holds[event.tid], event.timestamp)
             del self.current_holds[event.tid]
             self.current_owners.discard(event.tid)
             
         if self.current_owner == event.tid:
             self.current_owner = None
+
+class SemStats:
+    """Waits on a semaphore, the time spent in them, and its posts. Nobody
+    owns a semaphore, so there are no holds or owner changes."""
+
+    def __init__(self):
+        self.waits = 0
+        # Waits that timed out, were interrupted or found no unit to take.
+        self.failed = 0
+        self.posts = 0
+        self.wait_time_ms = 0
+        self.max_wait_ms = 0
+        self.wait_histogram = LatencyHistogram()
+
+    def record_wait(self, event: Event):
+        if event.result != 0:
+            self.failed += 1
+            return
+        self.waits += 1
+        self.wait_time_ms += event.duration_ns / 1_000_000
+        self.max_wait_ms = max(self.max_wait_ms, event.duration_ns / 1_000_000)
+        self.wait_histogram.record(event.duration_ns)
+
+    def scale(self, factor: float):
+        for name in ('waits', 'failed', 'posts'):
+            setattr(self, name, round(getattr(self, name) * factor))
+        self.wait_time_ms *= factor
+
+PTHREAD_BARRIER_SERIAL_THREAD = -1
+
+class BarrierStats:
+    """How long threads waited at a barrier, and how many rounds completed,
+    one per wait that returned PTHREAD_BARRIER_SERIAL_THREAD."""
+
+    def __init__(self):
+        self.waits = 0
+        self.rounds = 0
+        self.wait_time_ms = 0
+        self.max_wait_ms = 0
+        self.wait_histogram = LatencyHistogram()
+
+    def record_wait(self, event: Event):
+        self.waits += 1
+        if event.result == PTHREAD_BARRIER_SERIAL_THREAD:
+            self.rounds += 1
+        self.wait_time_ms += event.duration_ns / 1_000_000
+        self.max_wait_ms = max(self.max_wait_ms, event.duration_ns / 1_000_000)
+        self.wait_histogram.record(event.duration_ns)
+
+    def scale(self, factor: float):
+        self.waits = round(self.waits * factor)
+        self.rounds = round(self.rounds * factor)
+        self.wait_time_ms *= factor
+
+class CondStats:
+    """Waits and signals of a condition variable, and the wakeup latency from
+    a signal to the return of the wait it woke, which includes taking the
+    mutex back. Waiters are assumed to be woken in the order they started
+    waiting."""
+
+    def __init__(self):
+        self.waits = 0
+        self.signals = 0
+        self.broadcasts = 0
+        # Signals and broadcasts that found no thread waiting.
+        self.empty_signals = 0
+        # Waits ended by a signal, and the rest: timeouts, and spurious or
+        # untraced wakeups.
+        self.woken = 0
+        self.timeouts = 0
+        self.unsignaled = 0
+        self.max_wakeup_ms = 0
+        self.wakeup_histogram = LatencyHistogram()
+        self.waiters: Dict[int, Optional[int]] = {}  # tid -> signal timestamp, longest waiting first
+
+    def record_wait(self, event: Event):
+        self.waits += 1
+        self.waiters.pop(event.tid, None)
+        self.waiters[event.tid] = None
+
+    def record_signal(self, event: Event, broadcast: bool):
+        if broadcast:
+            self.broadcasts += 1
+        else:
+            self.signals += 1
+        woke = False
+        for tid, signaled in self.waiters.items():
+            if signaled is None:
+                self.waiters[tid] = event.timestamp
+                woke = True
+                if not broadcast:
+                    break
+        if not woke:
+            self.empty_signals += 1
+
+    def record_wakeup(self, event: Event):
+        signaled = self.waiters.pop(event.tid, None)
+        if signaled is not None:
+            latency = max(event.timestamp - signaled, 0)
+            self.woken += 1
+            self.max_wakeup_ms = max(self.max_wakeup_ms, latency / 1_000_000)
+            self.wakeup_histogram.record(latency)
+        elif event.result != 0:
+            self.timeouts += 1
+        else:
+            self.unsignaled += 1
+
+    def scale(self, factor: float):
+        for name in ('waits', 'signals', 'broadcasts', 'empty_signals', 'woken', 'timeouts',
+                     'unsignaled'):
+            setattr(self, name, round(getattr(self, name) * factor))
+
 def print_lock_table(locks: Dict[int, LockStats]):
     console = Console()
     table = Table(
         box=box.MINIMAL_HEAVY_HEAD,
         title="Lock Analysis Summary",
-        caption="M = Mutex, W = RWLock"
+        caption="M = Mutex, W = RWLock, S = Spinlock; "
+                "spin.Time = contended waits spent spinning on the CPU"
     )
 
     # Add columns
@@ -205,6 +746,7 @@ def print_lock_table(locks: Dict[int, LockStats]):
     table.add_column("Changed", justify="right")
     table.add_column("Cont.", justify="right")
     table.add_column("cont.Time[ms]", justify="right")
+    table.add_column("spin.Time[ms]", justify="right")
     table.add_column("tot.Time[ms]", justify="right")
     table.add_column("avg.Time[ms]", justify="right")
     table.add_column("Flags", justify="left")
@@ -215,7 +757,7 @@ def print_lock_table(locks: Dict[int, LockStats]):
             continue
 
         flags = (
-            'M' if stats.is_mutex else 'W',
+            'S' if stats.is_spin else 'M' if stats.is_mutex else 'W',
             '-',  # State
             '-',  # Use
             '-',  # Type
@@ -229,13 +771,136 @@ def print_lock_table(locks: Dict[int, LockStats]):
             f"{stats.changes}",
             f"{stats.contentions}",
             f"{stats.contention_time_ms:.3f}",
+            f"{stats.spin_time_ms:.3f}",
             f"{stats.total_time_ms:.3f}",
             f"{stats.avg_time_ms:.3f}",
             ''.join(flags)
         )
 
     console.print(table)
+    blocked = sum(stats.contention_time_ms for stats in locks.values() if stats.locked_count)
+    spinning = sum(stats.spin_time_ms for stats in locks.values() if stats.locked_count)
+    console.print(f"Contended: {blocked:.3f} ms blocked, {spinning:.3f} ms spinning")
     
+def print_rwlock_table(locks: Dict[int, LockStats]):
+    rows = [(i, stats) for i, (addr, stats) in enumerate(sorted(locks.items()))
+            if not stats.is_mutex and stats.locked_count > 0]
+    if not rows:
+        return
+    table = Table(
+        box=box.MINIMAL_HEAVY_HEAD,
+        title="RWLock Readers and Writers",
+        caption="avg.Batch = reads per stretch of shared holding; near 1, a mutex would do\n"
+                "wr.Starved = writer wait time spent while readers held the lock"
+    )
+    table.add_column("Lock #", justify="right", style="cyan")
+    for column in ("Reads", "Writes", "Batches", "avg.Batch", "max.Readers", "wr.Wait[ms]",
+                   "wr.Starved[ms]"):
+        table.add_column(column, justify="right")
+    for i, stats in rows:
+        table.add_row(
+            f"{i}",
+            f"{stats.read_count}",
+            f"{stats.locked_count - stats.read_count}",
+            f"{stats.reader_batches}",
+            f"{stats.read_count / max(stats.reader_batches, 1):.2f}",
+            f"{stats.max_readers}",
+            f"{stats.write_wait_ms:.3f}",
+            f"{stats.writer_starvation_ms:.3f}",
+        )
+    Console().print(table)
+
+def print_cond_table(locks: Dict[int, LockStats], conds: Dict[int, CondStats]):
+    # Numbered like the locks, since every address seen as ptr1 is in both.
+    rows = [(i, conds[addr]) for i, addr in enumerate(sorted(locks)) if addr in conds]
+    if not rows:
+        return
+    table = Table(
+        box=box.MINIMAL_HEAVY_HEAD,
+        title="Condition Variables",
+        caption="Empty = signals that found no waiter; "
+                "wake = from signal until the wait returned with the mutex"
+    )
+    table.add_column("Lock #", justify="right", style="cyan")
+    for column in ("Waits", "Signals", "Bcasts", "Empty", "Timeouts", "Unsignaled",
+                   "wake p50[us]", "p99[us]", "max[us]"):
+        table.add_column(column, justify="right")
+    for i, stats in rows:
+        p50, p99 = (min(stats.wakeup_histogram.percentile(p) / 1000, stats.max_wakeup_ms * 1000)
+                    for p in (50, 99))
+        table.add_row(
+            f"{i}",
+            f"{stats.waits}",
+            f"{stats.signals}",
+            f"{stats.broadcasts}",
+            f"{stats.empty_signals}",
+            f"{stats.timeouts}",
+            f"{stats.unsignaled}",
+            f"{p50:.3f}",
+            f"{p99:.3f}",
+            f"{stats.max_wakeup_ms * 1000:.3f}",
+        )
+    Console().print(table)
+
+def _wait_percentiles(histogram: LatencyHistogram, max_ms: float):
+    return [min(histogram.percentile(p) / 1000, max_ms * 1000) for p in (50, 99)]
+
+def print_sem_table(locks: Dict[int, LockStats], sems: Dict[int, SemStats]):
+    rows = [(i, sems[addr]) for i, addr in enumerate(sorted(locks)) if addr in sems]
+    if not rows:
+        return
+    table = Table(
+        box=box.MINIMAL_HEAVY_HEAD,
+        title="Semaphores",
+        caption="Failed = waits that timed out, were interrupted or found the count at zero"
+    )
+    table.add_column("Lock #", justify="right", style="cyan")
+    for column in ("Waits", "Failed", "Posts", "wait.Time[ms]", "wait p50[us]", "p99[us]", "max[us]"):
+        table.add_column(column, justify="right")
+    for i, stats in rows:
+        p50, p99 = _wait_percentiles(stats.wait_histogram, stats.max_wait_ms)
+        table.add_row(
+            f"{i}",
+            f"{stats.waits}",
+            f"{stats.failed}",
+            f"{stats.posts}",
+            f"{stats.wait_time_ms:.3f}",
+            f"{p50:.3f}",
+            f"{p99:.3f}",
+            f"{stats.max_wait_ms * 1000:.3f}",
+        )
+    Console().print(table)
+
+def print_barrier_table(locks: Dict[int, LockStats], barriers: Dict[int, BarrierStats]):
+    rows = [(i, barriers[addr]) for i, addr in enumerate(sorted(locks)) if addr in barriers]
+    if not rows:
+        return
+    table = Table(
+        box=box.MINIMAL_HEAVY_HEAD,
+        title="Barriers",
+        caption="wait = from arriving at the barrier until the round completed"
+    )
+    table.add_column("Lock #", justify="right", style="cyan")
+    for column in ("Waits", "Rounds", "wait.Time[ms]", "wait p50[us]", "p99[us]", "max[us]"):
+        table.add_column(column, justify="right")
+    for i, stats in rows:
+        p50, p99 = _wait_percentiles(stats.wait_histogram, stats.max_wait_ms)
+        table.add_row(
+            f"{i}",
+            f"{stats.waits}",
+            f"{stats.rounds}",
+            f"{stats.wait_time_ms:.3f}",
+            f"{p50:.3f}",
+            f"{p99:.3f}",
+            f"{stats.max_wait_ms * 1000:.3f}",
+        )
+    Console().print(table)
+
+def print_percentiles(console: Console, histogram: LatencyHistogram, max_ms: float):
+    # A bucket's upper bound can lie past the largest value actually seen.
+    values = [min(histogram.percentile(p) / 1_000_000, max_ms) for p in (50, 99, 99.9)]
+    console.print(f"    p50/p99/p99.9: {values[0]:.3f}ms / {values[1]:.3f}ms / {values[2]:.3f}ms")
+
 def print_detailed_analysis(locks: Dict[int, LockStats]):
     console = Console()
     console.print("\n[bold]Detailed Lock Analysis[/bold]\n")
@@ -245,17 +910,20 @@ def print_detailed_analysis(locks: Dict[int, LockStats]):
             continue
 
         console.print(f"[cyan]Lock #{i} (0x{addr:x}):[/cyan]")
-        console.print(f"  Type: {'Mutex' if stats.is_mutex else 'RWLock'}")
+        kind = 'Spinlock' if stats.is_spin else 'Mutex' if stats.is_mutex else 'RWLock'
+        console.print(f"  Type: {kind}")
         console.print(f"  Total acquisitions: {stats.locked_count}")
         console.print(f"  Unique threads: {len(stats.threads)}")
         
         if stats.contentions > 0:
             contention_pct = (stats.contentions * 100) / stats.locked_count
             console.print(f"  Contentions: {stats.contentions} ({contention_pct:.1f}%)")
-            console.print("  Wait times:")
-            console.print(f"    Total: {stats.contention_time_ms:.3f}ms")
-            console.print(f"    Average: {stats.contention_time_ms/stats.contentions:.3f}ms")
+            wait_ms = stats.spin_time_ms if stats.is_spin else stats.contention_time_ms
+            console.print("  Spin times (on the CPU):" if stats.is_spin else "  Wait times:")
+            console.print(f"    Total: {wait_ms:.3f}ms")
+            console.print(f"    Average: {wait_ms/stats.contentions:.3f}ms")
             console.print(f"    Maximum: {stats.max_wait_ms:.3f}ms")
+            print_percentiles(console, stats.wait_histogram, stats.max_wait_ms)
 
             console.print("\n  Thread contention analysis:")
             for tid, tstats in sorted(stats.thread_stats.items()):
@@ -270,6 +938,7 @@ def print_detailed_analysis(locks: Dict[int, LockStats]):
         console.print(f"    Total: {stats.total_time_ms:.3f}ms")
         console.print(f"    Average: {stats.avg_time_ms:.3f}ms")
         console.print(f"    Maximum: {stats.max_hold_ms:.3f}ms")
+        print_percentiles(console, stats.hold_histogram, stats.max_hold_ms)
         console.print("")
 
 class LockOrderTracker:
@@ -384,23 +1053,87 @@ class StarvationDetector:
         
         return starved
 
-def analyze_locks(events: List[Event]) -> Dict[int, LockStats]:
-    locks = defaultdict(LockStats)
+READ_ATTEMPTS = frozenset({EventType.RWLockRead, EventType.RWLockTimedRead})
+WRITE_ATTEMPTS = frozenset({EventType.RWLockWrite, EventType.RWLockTimedWrite})
+READ_ACQUISITIONS = frozenset({EventType.RWLockReadDone, EventType.RWLockTryReadDone,
+                               EventType.RWLockTimedReadDone, EventType.RWLockReadFast})
+WRITE_ACQUISITIONS = frozenset({EventType.RWLockWriteDone, EventType.RWLockTryWriteDone,
+                                EventType.RWLockTimedWriteDone, EventType.RWLockWriteFast})
+COND_WAITS = frozenset({EventType.CondWait, EventType.CondTimedWait, EventType.CondClockWait})
+COND_WAKEUPS = frozenset({EventType.CondWaitDone, EventType.CondTimedWaitDone,
+                          EventType.CondClockWaitDone})
+# Mutex waits that may time out, and spinlock events, which are otherwise
+# like a mutex's.
+TIMED_ATTEMPTS = frozenset({EventType.MutexTimedLock, EventType.MutexClockLock})
+TIMED_ACQUISITIONS = frozenset({EventType.MutexTryLockDone, EventType.MutexTimedLockDone,
+                                EventType.MutexClockLockDone, EventType.SpinTryLockDone})
+SPIN_EVENTS = frozenset({EventType.SpinLock, EventType.SpinLockDone, EventType.SpinLockFast,
+                         EventType.SpinTryLockDone, EventType.SpinUnlock})
+SEM_WAITS = frozenset({EventType.SemWaitDone, EventType.SemTryWaitDone, EventType.SemTimedWaitDone,
+                       EventType.SemWaitFast})
+
+def analyze_locks(events: List[Event], sampled: bool = False) -> Dict[int, LockStats]:
+    locks = defaultdict(lambda: LockStats(sampled))
+    conds = defaultdict(CondStats)
+    sems = defaultdict(SemStats)
+    barriers = defaultdict(BarrierStats)
     order_tracker = LockOrderTracker()
     convoy_detector = ConvoyDetector()
     starvation_detector = StarvationDetector()
     
     for event in events:
         lock = locks[event.ptr1]
-        
-        if event.type == EventType.MutexLock:
+        if event.type in SPIN_EVENTS:
+            lock.is_spin = True
+
+        # A condition wait gives up its mutex and takes it back on return.
+        if event.type in COND_WAITS:
+            locks[event.ptr2].record_release(event)
+            conds[event.ptr1].record_wait(event)
+        elif event.type in COND_WAKEUPS:
+            locks[event.ptr2].record_acquisition(event)
+            conds[event.ptr1].record_wakeup(event)
+        elif event.type in (EventType.CondSignal, EventType.CondBroadcast):
+            conds[event.ptr1].record_signal(event, event.type == EventType.CondBroadcast)
+
+        elif event.type in SEM_WAITS:
+            sems[event.ptr1].record_wait(event)
+        elif event.type == EventType.SemPost:
+            sems[event.ptr1].posts += 1
+        elif event.type == EventType.BarrierWaitDone:
+            barriers[event.ptr1].record_wait(event)
+
+        elif event.type in READ_ATTEMPTS or event.type in WRITE_ATTEMPTS:
+            lock.is_mutex = False
+            lock.record_lock_attempt(event, event.type in WRITE_ATTEMPTS)
+        elif event.type in READ_ACQUISITIONS or event.type in WRITE_ACQUISITIONS:
+            lock.is_mutex = False
+            if event.result == 0:
+                lock.record_acquisition(event, event.type in WRITE_ACQUISITIONS)
+            else:
+                lock.record_failure(event)
+        elif event.type == EventType.RWLockUnlock:
+            lock.is_mutex = False
+            lock.record_release(event)
+
+        elif event.type in TIMED_ATTEMPTS:
+            lock.record_lock_attempt(event)
+        elif event.type in TIMED_ACQUISITIONS:
+            if event.result == 0:
+                lock.record_acquisition(event)
+                order_tracker.record_acquisition(event.tid, event.ptr1)
+            else:
+                lock.record_failure(event)
+
+        elif event.type in (EventType.MutexLock, EventType.SpinLock):
             # Record the attempt starting time
             lock.record_lock_attempt(event)
             convoy_detector.record_attempt(event.tid, event.ptr1, event.timestamp)
             starvation_detector.record_attempt(event.tid, event.ptr1, event.timestamp)
             
-        elif event.type == EventType.MutexLockDone:
-            assert event.tid in lock.pending_locks
+        elif event.type in (EventType.MutexLockDone, EventType.SpinLockDone):
+            # A ring trace may have lost the matching MutexLock; the
+            # acquisition is still counted, just not its wait.
             lock.record_acquisition(event)
             order_tracker.record_acquisition(event.tid, event.ptr1)
             
@@ -415,11 +1148,15 @@ def analyze_locks(events: List[Event]) -> Dict[int, LockStats]:
                         event.tid, event.ptr1, event.timestamp, wait_time
                     )
             
-        elif event.type == EventType.MutexUnlock:
+        elif event.type in (EventType.MutexLockFast, EventType.SpinLockFast):
+            lock.record_acquisition(event)
+            order_tracker.record_acquisition(event.tid, event.ptr1)
+
+        elif event.type in (EventType.MutexUnlock, EventType.SpinUnlock):
             lock.record_release(event)
             order_tracker.record_release(event.tid, event.ptr1)
 
-    return locks, order_tracker, convoy_detector, starvation_detector
+    return locks, conds, sems, barriers, order_tracker, convoy_detector, starvation_detector
 
 
 def print_risk_analysis(order_tracker: LockOrderTracker, 
@@ -468,16 +1205,29 @@ def main():
         print(f"Usage: {sys.argv[0]} <trace file>", file=sys.stderr)
         sys.exit(1)
 
-    events = []
-    with open(sys.argv[1], "rb") as f:
-        while True:
-            event = read_event(f)
-            if event is None:
-                break
-            events.append(event)
+    with open_trace(sys.argv[1]) as f:
+        info = read_header(f)
+        events = list(read_events(f, info))
+
+    # Events are buffered per thread, so restore the global order. sort() is
+    # stable, which keeps each thread's own events in recorded order.
+    events.sort(key=lambda e: e.timestamp)
 
-    locks, order_tracker, convoy_detector, starvation_detector = analyze_locks(events)
+    (locks, conds, sems, barriers, order_tracker, convoy_detector,
+     starvation_detector) = analyze_locks(events, info.sample_scale != 1)
+    if info.sample_scale != 1:
+        print(f"Sampled trace: counts and totals scaled by {info.sample_scale:g}")
+        for stats in locks.values():
+            stats.scale(info.sample_scale)
+        for stats in conds.values():
+            stats.scale(info.sample_scale)
+        for stats in list(sems.values()) + list(barriers.values()):
+            stats.scale(info.sample_scale)
     print_lock_table(locks)
+    print_rwlock_table(locks)
+    print_cond_table(locks, conds)
+    print_sem_table(locks, sems)
+    print_barrier_table(locks, barriers)
     print_detailed_analysis(locks)
     print_risk_analysis(order_tracker, convoy_detector, starvation_detector)
 
@@ -0,0 +1,287 @@
+// Blocking attribution: which critical sections other threads waited for.
+//
+// A critical section is a lock together with the stack that acquired it.
+// While a thread waits on a lock, its blocked time is charged to the section
+// of the lock's current owner (directly blocking it) and to the section at
+// the root of the blocking chain: if the owner is itself waiting on another
+// lock, the chain continues with that lock's owner, and so on until a thread
+// that is running. Shortening the root sections is what unblocks the most
+// threads, so ranking() orders sections by their root time.
+//
+// Charging is done whenever ownership or waiting changes, for the time since
+// the previous change, so its cost is one chain walk per waiting thread and
+// only while there are waiters. Time a blocked waiter spends after its lock
+// lost its exclusive owner, or while it is held for reading, has no section
+// to charge and is counted as hand-off time instead. Waiting on a spinlock
+// keeps the waiter on the CPU, so that time is charged to sections like any
+// other but summed apart from the time threads were blocked.
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "trace_decoder.h"
+#include "trace_format.h"
+
+namespace skeleton_key {
+
+class BlockingAnalyzer
+{
+  public:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    struct Section
+    {
+        void* lock;
+        uint32_t stack;
+        uint64_t holds = 0;
+        // Waits this section's holds were in the way of, once per hold.
+        uint64_t waits = 0;
+        // Time threads waited with this section holding their lock, and with
+        // it at the root of their chain.
+        uint64_t direct_ns = 0;
+        uint64_t root_ns = 0;
+    };
+
+  private:
+    struct LockState
+    {
+        uint32_t owner = NONE;
+        uint32_t depth = 0;
+        uint32_t section = NONE;
+        // Counts acquisitions, so a waiter can tell holders apart.
+        uint64_t hold = 0;
+    };
+
+    struct ThreadState
+    {
+        uint32_t waiting_for = NONE;
+        uint32_t wait_stack = NO_STACK;
+        // The hold of the lock this wait was last charged to.
+        uint64_t charged_hold = 0;
+        bool contended = false;
+        bool spinning = false;
+    };
+
+    std::unordered_map<void*, uint32_t> ids_;
+    std::vector<LockState> locks_;
+    std::unordered_map<uint64_t, uint32_t> section_ids_;
+    std::vector<Section> sections_;
+    std::unordered_map<uint32_t, ThreadState> threads_;
+    // Threads waiting right now.
+    std::vector<uint32_t> waiting_;
+    uint64_t last_change_ = 0;
+
+    uint64_t contended_waits_ = 0;
+    uint64_t blocked_ns_ = 0;
+    uint64_t spin_ns_ = 0;
+    uint64_t handoff_ns_ = 0;
+
+    uint32_t lockId(void* address)
+    {
+        auto [it, inserted] = ids_.emplace(address, static_cast<uint32_t>(locks_.size()));
+        if (inserted) locks_.emplace_back();
+        return it->second;
+    }
+
+    uint32_t sectionId(void* address, uint32_t lock, uint32_t stack)
+    {
+        uint64_t key = static_cast<uint64_t>(lock) << 32 | stack;
+        auto [it, inserted] = section_ids_.emplace(key, static_cast<uint32_t>(sections_.size()));
+        if (inserted) sections_.push_back({address, stack});
+        return it->second;
+    }
+
+    // Charges the time since the last change to whatever blocks each waiter.
+    void charge(uint64_t now)
+    {
+        uint64_t elapsed = now > last_change_ ? now - last_change_ : 0;
+        last_change_ = now;
+        if (elapsed == 0) return;
+        for (uint32_t tid : waiting_) {
+            ThreadState& thread = threads_[tid];
+            const LockState& lock = locks_[thread.waiting_for];
+            if (lock.owner == NONE || lock.owner == tid) {
+                // Before any owner blocked it, this is just the call itself.
+                if (thread.contended) handoff_ns_ += elapsed;
+                continue;
+            }
+            if (!thread.contended) {
+                thread.contended = true;
+                contended_waits_++;
+            }
+            if (thread.charged_hold != lock.hold) {
+                thread.charged_hold = lock.hold;
+                sections_[lock.section].waits++;
+            }
+            (thread.spinning ? spin_ns_ : blocked_ns_) += elapsed;
+            sections_[lock.section].direct_ns += elapsed;
+
+            // Follow owners that are waiting themselves; a chain of distinct
+            // threads is no longer than the number of waiters.
+            uint32_t root = lock.section;
+            uint32_t owner = lock.owner;
+            for (size_t steps = 0; steps < waiting_.size(); steps++) {
+                const ThreadState& blocker = threads_[owner];
+                if (blocker.waiting_for == NONE) break;
+                const LockState& next = locks_[blocker.waiting_for];
+                if (next.owner == NONE || next.owner == owner) break;
+                root = next.section;
+                owner = next.owner;
+            }
+            sections_[root].root_ns += elapsed;
+        }
+    }
+
+    void startWait(uint32_t tid, uint32_t lock, const DecodedEvent& event)
+    {
+        ThreadState& thread = threads_[tid];
+        if (thread.waiting_for == NONE) waiting_.push_back(tid);
+        thread.waiting_for = lock;
+        thread.wait_stack = event.stack;
+        thread.charged_hold = 0;
+        thread.contended = false;
+        thread.spinning = event.type == EventType::SpinLock;
+    }
+
+    // Returns the stack of the wait that ended, if any.
+    uint32_t endWait(uint32_t tid)
+    {
+        ThreadState& thread = threads_[tid];
+        if (thread.waiting_for == NONE) return NO_STACK;
+        thread.waiting_for = NONE;
+        waiting_.erase(std::find(waiting_.begin(), waiting_.end(), tid));
+        return thread.wait_stack;
+    }
+
+    void acquire(uint32_t tid, void* address, bool exclusive, const DecodedEvent& event)
+    {
+        uint32_t wait_stack = endWait(tid);
+        if (!exclusive) return;
+        uint32_t id = lockId(address);
+        LockState& lock = locks_[id];
+        if (lock.owner == tid) {
+            lock.depth++;
+            return;
+        }
+        // Use the wait's stack when the acquisition carries none.
+        uint32_t stack = event.stack != NO_STACK ? event.stack : wait_stack;
+        lock.owner = tid;
+        lock.depth = 1;
+        lock.hold++;
+        lock.section = sectionId(address, id, stack);
+        sections_[lock.section].holds++;
+    }
+
+    void release(uint32_t tid, void* address)
+    {
+        LockState& lock = locks_[lockId(address)];
+        if (lock.owner != tid) return;
+        if (--lock.depth == 0) lock.owner = NONE;
+    }
+
+  public:
+    // Events must come in timestamp order.
+    void process(const DecodedEvent& event)
+    {
+        switch (event.type) {
+            case EventType::MutexLock:
+            case EventType::MutexTimedLock:
+            case EventType::MutexClockLock:
+            case EventType::SpinLock:
+            case EventType::RWLockRead:
+            case EventType::RWLockTimedRead:
+            case EventType::RWLockWrite:
+            case EventType::RWLockTimedWrite:
+                charge(event.timestamp);
+                startWait(event.tid, lockId(event.ptr1), event);
+                break;
+            case EventType::MutexLockDone:
+            case EventType::MutexTimedLockDone:
+            case EventType::MutexClockLockDone:
+            case EventType::MutexTryLockDone:
+            case EventType::MutexLockFast:
+            case EventType::SpinLockDone:
+            case EventType::SpinTryLockDone:
+            case EventType::SpinLockFast:
+            case EventType::RWLockWriteDone:
+            case EventType::RWLockTimedWriteDone:
+            case EventType::RWLockTryWriteDone:
+            case EventType::RWLockWriteFast:
+            case EventType::RWLockReadDone:
+            case EventType::RWLockTimedReadDone:
+            case EventType::RWLockTryReadDone:
+            case EventType::RWLockReadFast: {
+                charge(event.timestamp);
+                if (event.result != 0) {
+                    endWait(event.tid);
+                    break;
+                }
+                bool exclusive = event.type != EventType::RWLockReadDone
+                                 && event.type != EventType::RWLockTimedReadDone
+                                 && event.type != EventType::RWLockTryReadDone
+                                 && event.type != EventType::RWLockReadFast;
+                acquire(event.tid, event.ptr1, exclusive, event);
+                break;
+            }
+            case EventType::MutexUnlock:
+            case EventType::RWLockUnlock:
+            case EventType::SpinUnlock:
+                charge(event.timestamp);
+                release(event.tid, event.ptr1);
+                break;
+            case EventType::CondWait:
+            case EventType::CondTimedWait:
+            case EventType::CondClockWait:
+                charge(event.timestamp);
+                release(event.tid, event.ptr2);
+                break;
+            case EventType::CondWaitDone:
+            case EventType::CondTimedWaitDone:
+            case EventType::CondClockWaitDone:
+                charge(event.timestamp);
+                acquire(event.tid, event.ptr2, true, event);
+                break;
+            default:
+                break;
+        }
+    }
+
+    // Sections that blocked anyone, most root time first.
+    std::vector<const Section*> ranking() const
+    {
+        std::vector<const Section*> ranked;
+        for (const Section& section : sections_) {
+            if (section.direct_ns || section.root_ns) ranked.push_back(&section);
+        }
+        std::sort(ranked.begin(), ranked.end(), [](const Section* a, const Section* b) {
+            return a->root_ns != b->root_ns ? a->root_ns > b->root_ns : a->direct_ns > b->direct_ns;
+        });
+        return ranked;
+    }
+
+    uint64_t contendedWaits() const
+    {
+        return contended_waits_;
+    }
+
+    uint64_t blockedNs() const
+    {
+        return blocked_ns_;
+    }
+
+    // Contended waits on spinlocks, spent on the CPU.
+    uint64_t spinNs() const
+    {
+        return spin_ns_;
+    }
+
+    uint64_t handoffNs() const
+    {
+        return handoff_ns_;
+    }
+};
+
+}  // namespace skeleton_key
@@ -0,0 +1,438 @@
+// Columnar export of a trace, for tools that want the events of one lock
+// without decoding the whole trace, such as the lock visualizer.
+//
+// Layout (little-endian; offsets count from the start of the file and every
+// section starts 8-byte aligned):
+//
+//   ColumnarHeader
+//   ColumnarLock[lock_count]       sorted by address
+//   uint32_t tids[thread_count]    every thread seen in the trace, sorted
+//   uint64_t timestamp[row_count]  nanoseconds
+//   uint64_t duration[row_count]   nanoseconds, see below
+//   uint32_t tid[row_count]
+//   int32_t  result[row_count]
+//   uint8_t  type[row_count]       EventType
+//   ColumnarLevel[level_count]
+//   ColumnarBucket[bucket_count]
+//
+// Rows are the trace's events keyed by ptr1, sorted by lock and then time,
+// so lock i owns rows [first_row, first_row + row_count) of every column.
+// The duration column pairs events up so intervals need no more matching:
+// on an acquire call (MutexLock, RWLockTryRead, SemWait, BarrierWait, ...)
+// it is the wait until the call returned, on a successful acquisition of a
+// lock (its *Done, or a *Fast event) how long the thread then held it.
+// Semaphore and barrier waits end no hold. An interval that never ended is
+// OPEN_DURATION. Every other row keeps its logged duration.
+//
+// The levels and buckets are a level-of-detail index over those intervals,
+// so a viewer can draw any time window of a lock at any zoom from a bounded
+// number of summaries instead of its rows. Lock i owns levels
+// [first_level, first_level + level_count), finest first. Level l cuts time
+// into buckets of 2^(LOD_BASE_SHIFT + l * LOD_FANOUT_SHIFT) ns and stores,
+// sorted by start, only the buckets some interval of the lock starts in: its
+// counts, total and longest waits and holds. Each level is the previous one
+// merged LOD_FANOUT_SHIFT bits at a time, up to the level with one bucket.
+// Intervals that never ended count as lasting until the end of the trace.
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "trace_decoder.h"
+#include "trace_format.h"
+
+namespace skeleton_key {
+
+#pragma pack(push, 1)
+struct ColumnarHeader
+{
+    static constexpr char MAGIC[8] = {'S', 'K', 'C', 'O', 'L', 'S', '1', '\0'};
+    static constexpr uint32_t VERSION = 2;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t lock_count;
+    uint64_t thread_count;
+    uint64_t row_count;
+    uint64_t locks_offset;
+    uint64_t threads_offset;
+    uint64_t timestamp_offset;
+    uint64_t duration_offset;
+    uint64_t tid_offset;
+    uint64_t result_offset;
+    uint64_t type_offset;
+    uint64_t level_count;
+    uint64_t bucket_count;
+    uint64_t levels_offset;
+    uint64_t buckets_offset;
+};
+
+struct ColumnarLock
+{
+    uint64_t address;
+    uint64_t first_row;
+    uint64_t row_count;
+    // Of the lock's first and last rows.
+    uint64_t first_timestamp;
+    uint64_t last_timestamp;
+    // COLUMNAR_* bits for the kinds of object events at this address were for.
+    uint32_t kinds;
+    uint32_t level_count;
+    uint64_t first_level;
+};
+
+struct ColumnarLevel
+{
+    uint64_t bucket_width;
+    uint64_t first_bucket;
+    uint64_t bucket_count;
+};
+
+struct ColumnarBucket
+{
+    uint64_t start;
+    uint32_t wait_count;
+    uint32_t hold_count;
+    uint64_t wait_total;
+    uint64_t hold_total;
+    uint64_t wait_max;
+    uint64_t hold_max;
+};
+#pragma pack(pop)
+static_assert(sizeof(ColumnarHeader) == 128 && sizeof(ColumnarLock) == 56 && sizeof(ColumnarLevel) == 24
+                      && sizeof(ColumnarBucket) == 48,
+              "fixed columnar layout");
+
+// ColumnarLock::kinds
+static constexpr uint32_t COLUMNAR_MUTEX = 1;
+static constexpr uint32_t COLUMNAR_RWLOCK = 2;
+static constexpr uint32_t COLUMNAR_COND = 4;
+static constexpr uint32_t COLUMNAR_SPIN = 8;
+static constexpr uint32_t COLUMNAR_SEM = 16;
+static constexpr uint32_t COLUMNAR_BARRIER = 32;
+
+static constexpr uint64_t OPEN_DURATION = UINT64_MAX;
+
+// The finest buckets are 4.1us wide and every level is 8 times coarser.
+static constexpr unsigned LOD_BASE_SHIFT = 12;
+static constexpr unsigned LOD_FANOUT_SHIFT = 3;
+
+// Collects a trace's events, fed in timestamp order, into columns.
+class ColumnarBuilder
+{
+    struct LockRows
+    {
+        std::vector<uint64_t> timestamp;
+        std::vector<uint64_t> duration;
+        std::vector<uint32_t> tid;
+        std::vector<int32_t> result;
+        std::vector<uint8_t> type;
+        uint32_t kinds = 0;
+        // Row of each thread's acquire call in progress, and of the
+        // acquisitions it holds (more than one for recursive mutexes).
+        std::unordered_map<uint32_t, size_t> waiting;
+        std::unordered_map<uint32_t, std::vector<size_t>> holding;
+    };
+
+    std::unordered_map<void*, LockRows> locks_;
+    std::unordered_set<uint32_t> threads_;
+    uint64_t row_count_ = 0;
+    uint64_t end_timestamp_ = 0;
+
+    static uint32_t kindOf(EventType type)
+    {
+        if (type >= EventType::MutexInit && type <= EventType::MutexUnlock) return COLUMNAR_MUTEX;
+        if (type >= EventType::RWLockInit && type <= EventType::RWLockUnlock) return COLUMNAR_RWLOCK;
+        if (type >= EventType::CondInit && type <= EventType::CondTimedWaitDone) return COLUMNAR_COND;
+        if (type == EventType::MutexLockFast) return COLUMNAR_MUTEX;
+        if (type == EventType::RWLockReadFast || type == EventType::RWLockWriteFast) {
+            return COLUMNAR_RWLOCK;
+        }
+        if (type >= EventType::SpinInit && type <= EventType::SpinLockFast) return COLUMNAR_SPIN;
+        if (type >= EventType::SemInit && type <= EventType::SemWaitFast) return COLUMNAR_SEM;
+        if (type >= EventType::BarrierInit && type <= EventType::BarrierWaitDone) {
+            return COLUMNAR_BARRIER;
+        }
+        if (type == EventType::MutexClockLock || type == EventType::MutexClockLockDone) {
+            return COLUMNAR_MUTEX;
+        }
+        if (type == EventType::CondClockWait || type == EventType::CondClockWaitDone) {
+            return COLUMNAR_COND;
+        }
+        return 0;
+    }
+
+    static bool isAcquireCall(EventType type)
+    {
+        switch (type) {
+            case EventType::MutexLock:
+            case EventType::MutexTryLock:
+            case EventType::MutexTimedLock:
+            case EventType::RWLockRead:
+            case EventType::RWLockTryRead:
+            case EventType::RWLockTimedRead:
+            case EventType::RWLockWrite:
+            case EventType::RWLockTryWrite:
+            case EventType::RWLockTimedWrite:
+            case EventType::MutexClockLock:
+            case EventType::SpinLock:
+            case EventType::SpinTryLock:
+            case EventType::SemWait:
+            case EventType::SemTryWait:
+            case EventType::SemTimedWait:
+            case EventType::BarrierWait:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    static bool isAcquireDone(EventType type)
+    {
+        switch (type) {
+            case EventType::MutexLockDone:
+            case EventType::MutexTryLockDone:
+            case EventType::MutexTimedLockDone:
+            case EventType::RWLockReadDone:
+            case EventType::RWLockTryReadDone:
+            case EventType::RWLockTimedReadDone:
+            case EventType::RWLockWriteDone:
+            case EventType::RWLockTryWriteDone:
+            case EventType::RWLockTimedWriteDone:
+            case EventType::MutexClockLockDone:
+            case EventType::SpinLockDone:
+            case EventType::SpinTryLockDone:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    static bool isFastAcquire(EventType type)
+    {
+        return type == EventType::MutexLockFast || type == EventType::RWLockReadFast
+               || type == EventType::RWLockWriteFast || type == EventType::SpinLockFast;
+    }
+
+    // The end of a wait that leaves nothing held.
+    static bool isWaitDone(EventType type)
+    {
+        switch (type) {
+            case EventType::SemWaitDone:
+            case EventType::SemTryWaitDone:
+            case EventType::SemTimedWaitDone:
+            case EventType::SemWaitFast:
+            case EventType::BarrierWaitDone:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Appends the levels of one lock's index over its intervals.
+    void buildLevels(const LockRows& rows,
+                     std::vector<ColumnarLevel>& levels,
+                     std::vector<ColumnarBucket>& buckets) const
+    {
+        size_t first = buckets.size();
+        uint64_t width_shift = LOD_BASE_SHIFT;
+        for (size_t row = 0; row < rows.timestamp.size(); row++) {
+            auto type = static_cast<EventType>(rows.type[row]);
+            bool wait = isAcquireCall(type);
+            if (!wait && !((isAcquireDone(type) || isFastAcquire(type)) && rows.result[row] == 0)) {
+                continue;
+            }
+            uint64_t timestamp = rows.timestamp[row];
+            uint64_t duration = rows.duration[row];
+            if (duration == OPEN_DURATION) duration = end_timestamp_ - timestamp;
+            uint64_t start = timestamp >> width_shift << width_shift;
+            if (buckets.size() == first || buckets.back().start != start) {
+                buckets.push_back({start, 0, 0, 0, 0, 0, 0});
+            }
+            ColumnarBucket& bucket = buckets.back();
+            if (wait) {
+                bucket.wait_count++;
+                bucket.wait_total += duration;
+                bucket.wait_max = std::max(bucket.wait_max, duration);
+            } else {
+                bucket.hold_count++;
+                bucket.hold_total += duration;
+                bucket.hold_max = std::max(bucket.hold_max, duration);
+            }
+        }
+        if (buckets.size() == first) return;
+        levels.push_back({uint64_t(1) << width_shift, first, buckets.size() - first});
+
+        while (levels.back().bucket_count > 1 && width_shift + LOD_FANOUT_SHIFT < 64) {
+            width_shift += LOD_FANOUT_SHIFT;
+            const ColumnarLevel finer = levels.back();
+            size_t level_first = buckets.size();
+            for (uint64_t i = finer.first_bucket; i < finer.first_bucket + finer.bucket_count; i++) {
+                // Copied: push_back may move the buckets.
+                ColumnarBucket child = buckets[i];
+                uint64_t start = child.start >> width_shift << width_shift;
+                if (buckets.size() == level_first || buckets.back().start != start) {
+                    child.start = start;
+                    buckets.push_back(child);
+                    continue;
+                }
+                ColumnarBucket& bucket = buckets.back();
+                bucket.wait_count += child.wait_count;
+                bucket.hold_count += child.hold_count;
+                bucket.wait_total += child.wait_total;
+                bucket.hold_total += child.hold_total;
+                bucket.wait_max = std::max(bucket.wait_max, child.wait_max);
+                bucket.hold_max = std::max(bucket.hold_max, child.hold_max);
+            }
+            levels.push_back({uint64_t(1) << width_shift, level_first, buckets.size() - level_first});
+        }
+    }
+
+    template<typename T>
+    static void
+    writeColumn(FILE* out, const std::vector<const LockRows*>& locks, std::vector<T> LockRows::*column)
+    {
+        for (const LockRows* rows : locks) {
+            const std::vector<T>& values = rows->*column;
+            fwrite(values.data(), sizeof(T), values.size(), out);
+        }
+    }
+
+    static uint64_t align(uint64_t offset)
+    {
+        return (offset + 7) & ~uint64_t(7);
+    }
+
+    static void pad(FILE* out, uint64_t from, uint64_t to)
+    {
+        static const uint8_t zeros[8] = {};
+        fwrite(zeros, 1, to - from, out);
+    }
+
+  public:
+    void add(const DecodedEvent& event)
+    {
+        threads_.insert(event.tid);
+        end_timestamp_ = std::max(end_timestamp_, event.timestamp);
+        if (event.type == EventType::ThreadCreate) return;
+
+        LockRows& rows = locks_[event.ptr1];
+        size_t row = rows.timestamp.size();
+        rows.timestamp.push_back(event.timestamp);
+        rows.duration.push_back(event.duration);
+        rows.tid.push_back(event.tid);
+        rows.result.push_back(event.result);
+        rows.type.push_back(static_cast<uint8_t>(event.type));
+        rows.kinds |= kindOf(event.type);
+        row_count_++;
+
+        if (isAcquireCall(event.type)) {
+            rows.duration[row] = OPEN_DURATION;
+            rows.waiting[event.tid] = row;
+        } else if (isAcquireDone(event.type) || isFastAcquire(event.type) || isWaitDone(event.type)) {
+            auto wait = rows.waiting.find(event.tid);
+            if (wait != rows.waiting.end()) {
+                rows.duration[wait->second] = event.timestamp - rows.timestamp[wait->second];
+                rows.waiting.erase(wait);
+            }
+            if (event.result == 0 && !isWaitDone(event.type)) {
+                rows.duration[row] = OPEN_DURATION;
+                rows.holding[event.tid].push_back(row);
+            }
+        } else if (event.type == EventType::MutexUnlock || event.type == EventType::RWLockUnlock
+                   || event.type == EventType::SpinUnlock)
+        {
+            auto held = rows.holding.find(event.tid);
+            if (held != rows.holding.end() && !held->second.empty()) {
+                size_t acquired = held->second.back();
+                held->second.pop_back();
+                rows.duration[acquired] = event.timestamp - rows.timestamp[acquired];
+            }
+        }
+    }
+
+    uint64_t rowCount() const
+    {
+        return row_count_;
+    }
+
+    size_t lockCount() const
+    {
+        return locks_.size();
+    }
+
+    bool write(const char* path) const
+    {
+        std::vector<std::pair<void*, const LockRows*>> sorted;
+        for (const auto& [address, rows] : locks_) sorted.emplace_back(address, &rows);
+        std::sort(sorted.begin(), sorted.end());
+        std::vector<const LockRows*> ordered;
+        std::vector<ColumnarLock> locks;
+        std::vector<ColumnarLevel> levels;
+        std::vector<ColumnarBucket> buckets;
+        uint64_t first_row = 0;
+        for (const auto& [address, rows] : sorted) {
+            uint64_t count = rows->timestamp.size();
+            size_t first_level = levels.size();
+            buildLevels(*rows, levels, buckets);
+            locks.push_back({reinterpret_cast<uint64_t>(address),
+                             first_row,
+                             count,
+                             rows->timestamp.front(),
+                             rows->timestamp.back(),
+                             rows->kinds,
+                             static_cast<uint32_t>(levels.size() - first_level),
+                             first_level});
+            ordered.push_back(rows);
+            first_row += count;
+        }
+        std::vector<uint32_t> threads(threads_.begin(), threads_.end());
+        std::sort(threads.begin(), threads.end());
+
+        ColumnarHeader header = {};
+        memcpy(header.magic, ColumnarHeader::MAGIC, sizeof(header.magic));
+        header.version = ColumnarHeader::VERSION;
+        header.header_size = sizeof(header);
+        header.lock_count = locks.size();
+        header.thread_count = threads.size();
+        header.row_count = row_count_;
+        header.locks_offset = align(sizeof(header));
+        header.threads_offset = align(header.locks_offset + locks.size() * sizeof(ColumnarLock));
+        header.timestamp_offset = align(header.threads_offset + threads.size() * sizeof(uint32_t));
+        header.duration_offset = header.timestamp_offset + row_count_ * sizeof(uint64_t);
+        header.tid_offset = header.duration_offset + row_count_ * sizeof(uint64_t);
+        header.result_offset = header.tid_offset + row_count_ * sizeof(uint32_t);
+        header.type_offset = header.result_offset + row_count_ * sizeof(int32_t);
+        header.level_count = levels.size();
+        header.bucket_count = buckets.size();
+        header.levels_offset = align(header.type_offset + row_count_);
+        header.buckets_offset = header.levels_offset + levels.size() * sizeof(ColumnarLevel);
+
+        FILE* out = fopen(path, "wb");
+        if (!out) return false;
+        fwrite(&header, sizeof(header), 1, out);
+        pad(out, sizeof(header), header.locks_offset);
+        fwrite(locks.data(), sizeof(ColumnarLock), locks.size(), out);
+        pad(out, header.locks_offset + locks.size() * sizeof(ColumnarLock), header.threads_offset);
+        fwrite(threads.data(), sizeof(uint32_t), threads.size(), out);
+        pad(out, header.threads_offset + threads.size() * sizeof(uint32_t), header.timestamp_offset);
+        writeColumn(out, ordered, &LockRows::timestamp);
+        writeColumn(out, ordered, &LockRows::duration);
+        writeColumn(out, ordered, &LockRows::tid);
+        writeColumn(out, ordered, &LockRows::result);
+        writeColumn(out, ordered, &LockRows::type);
+        pad(out, header.type_offset + row_count_, header.levels_offset);
+        fwrite(levels.data(), sizeof(ColumnarLevel), levels.size(), out);
+        fwrite(buckets.data(), sizeof(ColumnarBucket), buckets.size(), out);
+        bool ok = !ferror(out);
+        return fclose(out) == 0 && ok;
+    }
+};
+
+}  // namespace skeleton_key
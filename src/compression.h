@@ -0,0 +1,246 @@
+// Block compression of Events chunks, shared by the tracer and the readers.
+//
+// The tracer's drainer thread compresses each chunk on its own as it writes
+// it out, so the hooks never pay for it and every chunk stays a frame that
+// the index points at and that decompresses without any other; the sharded
+// analyzer decompresses them on all its threads. zstd and LZ4 are used when
+// the build found them (SKELETON_KEY_HAVE_ZSTD, SKELETON_KEY_HAVE_LZ4).
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef SKELETON_KEY_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef SKELETON_KEY_HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+
+#include "trace_format.h"
+
+namespace skeleton_key {
+
+inline const char*
+codecName(Codec codec)
+{
+    switch (codec) {
+        case Codec::None:
+            return "none";
+        case Codec::Zstd:
+            return "zstd";
+        case Codec::Lz4:
+            return "lz4";
+    }
+    return "unknown";
+}
+
+// Whether this build can compress and decompress with `codec`.
+inline bool
+codecAvailable(Codec codec)
+{
+    switch (codec) {
+        case Codec::None:
+            return true;
+        case Codec::Zstd:
+#ifdef SKELETON_KEY_HAVE_ZSTD
+            return true;
+#else
+            return false;
+#endif
+        case Codec::Lz4:
+#ifdef SKELETON_KEY_HAVE_LZ4
+            return true;
+#else
+            return false;
+#endif
+    }
+    return false;
+}
+
+// "CODEC[:LEVEL]" with CODEC one of zstd, lz4 or none. Level 0, the
+// default, is the codec's fastest useful setting: zstd level 1 and plain
+// LZ4. Higher levels trade tracer CPU for disk bandwidth (zstd up to 22,
+// LZ4 from 2 up to 12 with LZ4HC); negative ones are faster still.
+inline bool
+parseCompression(const char* text, Codec* codec, int* level)
+{
+    const char* colon = strchr(text, ':');
+    size_t length = colon ? static_cast<size_t>(colon - text) : strlen(text);
+    if (length == 4 && strncmp(text, "zstd", 4) == 0) {
+        *codec = Codec::Zstd;
+    } else if (length == 3 && strncmp(text, "lz4", 3) == 0) {
+        *codec = Codec::Lz4;
+    } else if (length == 4 && strncmp(text, "none", 4) == 0) {
+        *codec = Codec::None;
+    } else {
+        return false;
+    }
+    *level = 0;
+    if (colon) {
+        char* end = nullptr;
+        *level = static_cast<int>(strtol(colon + 1, &end, 10));
+        if (end == colon + 1 || *end != '\0') return false;
+    }
+    return true;
+}
+
+// Compresses chunks into a buffer of its own, keeping the codec's state
+// from one chunk to the next.
+class Compressor
+{
+    Codec codec_ = Codec::None;
+    int level_ = 0;
+    uint8_t* buffer_ = nullptr;
+    size_t capacity_ = 0;
+#ifdef SKELETON_KEY_HAVE_ZSTD
+    ZSTD_CCtx* zstd_ = nullptr;
+#endif
+
+  public:
+    Compressor() = default;
+    Compressor(const Compressor&) = delete;
+    Compressor& operator=(const Compressor&) = delete;
+
+    ~Compressor()
+    {
+        configure(Codec::None, 0, 0);
+    }
+
+    // Compress inputs of up to `max_input` bytes with `codec` from now on.
+    // False, leaving compression off, if the build does not have the codec.
+    bool configure(Codec codec, int level, [[maybe_unused]] size_t max_input)
+    {
+#ifdef SKELETON_KEY_HAVE_ZSTD
+        if (zstd_) ZSTD_freeCCtx(zstd_);
+        zstd_ = nullptr;
+#endif
+        delete[] buffer_;
+        buffer_ = nullptr;
+        capacity_ = 0;
+        codec_ = Codec::None;
+        level_ = 0;
+        if (codec == Codec::None || !codecAvailable(codec)) return codec == Codec::None;
+
+        switch (codec) {
+#ifdef SKELETON_KEY_HAVE_ZSTD
+            case Codec::Zstd:
+                zstd_ = ZSTD_createCCtx();
+                if (!zstd_) return false;
+                capacity_ = ZSTD_compressBound(max_input);
+                break;
+#endif
+#ifdef SKELETON_KEY_HAVE_LZ4
+            case Codec::Lz4:
+                capacity_ = static_cast<size_t>(LZ4_compressBound(static_cast<int>(max_input)));
+                break;
+#endif
+            default:
+                return false;
+        }
+        buffer_ = new uint8_t[capacity_];
+        codec_ = codec;
+        level_ = level;
+        return true;
+    }
+
+    Codec codec() const
+    {
+        return codec_;
+    }
+
+    int level() const
+    {
+        return level_;
+    }
+
+    // Compress `size` bytes into data(). Returns the compressed size, or 0
+    // when the codec failed or did not make the input any smaller, in which
+    // case it is best stored as it is.
+    size_t compress([[maybe_unused]] const uint8_t* input, size_t size)
+    {
+        size_t compressed = 0;
+        switch (codec_) {
+#ifdef SKELETON_KEY_HAVE_ZSTD
+            case Codec::Zstd: {
+                size_t result = ZSTD_compressCCtx(
+                        zstd_, buffer_, capacity_, input, size, level_ != 0 ? level_ : 1);
+                if (!ZSTD_isError(result)) compressed = result;
+                break;
+            }
+#endif
+#ifdef SKELETON_KEY_HAVE_LZ4
+            case Codec::Lz4: {
+                const char* source = reinterpret_cast<const char*>(input);
+                char* target = reinterpret_cast<char*>(buffer_);
+                int length = static_cast<int>(size);
+                int capacity = static_cast<int>(capacity_);
+                int result;
+                if (level_ > 1) {
+                    result = LZ4_compress_HC(source, target, length, capacity, level_);
+                } else if (level_ < 0) {
+                    result = LZ4_compress_fast(source, target, length, capacity, -level_);
+                } else {
+                    result = LZ4_compress_default(source, target, length, capacity);
+                }
+                if (result > 0) compressed = static_cast<size_t>(result);
+                break;
+            }
+#endif
+            default:
+                break;
+        }
+        return compressed < size ? compressed : 0;
+    }
+
+    const uint8_t* data() const
+    {
+        return buffer_;
+    }
+};
+
+// Decompress a payload of `size` bytes that is `raw_size` bytes raw into
+// `out`. False if the build lacks the codec or the data is corrupt.
+inline bool
+decompress(Codec codec, const uint8_t* input, size_t size, uint8_t* out, size_t raw_size)
+{
+    switch (codec) {
+        case Codec::None:
+            if (size != raw_size) return false;
+            memcpy(out, input, size);
+            return true;
+#ifdef SKELETON_KEY_HAVE_ZSTD
+        case Codec::Zstd: {
+            // One context per thread instead of one per chunk.
+            thread_local struct Context
+            {
+                ZSTD_DCtx* zstd = ZSTD_createDCtx();
+
+                ~Context()
+                {
+                    ZSTD_freeDCtx(zstd);
+                }
+            } context;
+            if (!context.zstd) return false;
+            size_t result = ZSTD_decompressDCtx(context.zstd, out, raw_size, input, size);
+            return !ZSTD_isError(result) && result == raw_size;
+        }
+#endif
+#ifdef SKELETON_KEY_HAVE_LZ4
+        case Codec::Lz4: {
+            int result = LZ4_decompress_safe(reinterpret_cast<const char*>(input),
+                                             reinterpret_cast<char*>(out),
+                                             static_cast<int>(size),
+                                             static_cast<int>(raw_size));
+            return result >= 0 && static_cast<size_t>(result) == raw_size;
+        }
+#endif
+        default:
+            return false;
+    }
+}
+
+}  // namespace skeleton_key
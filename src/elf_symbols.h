@@ -0,0 +1,182 @@
+// Function (and optionally data object) symbols read from an ELF file, for
+// the analyzer's symbolizer and for the tracer's call-site and lock filters.
+#pragma once
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cxxabi.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace skeleton_key {
+
+// The function symbols of one ELF file (64-bit, native byte order), and
+// with `objects` also its data objects.
+class ElfSymbols
+{
+    struct Symbol
+    {
+        uint64_t address;
+        uint64_t size;
+        std::string name;
+    };
+    std::vector<Symbol> symbols_;
+
+    static std::string demangle(const char* name)
+    {
+        int status = 0;
+        char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+        if (status != 0 || demangled == nullptr) return name;
+        std::string result(demangled);
+        free(demangled);
+        return result;
+    }
+
+    static std::string noteBuildId(const uint8_t* data, size_t size, const Elf64_Ehdr& ehdr)
+    {
+        static constexpr char HEX[] = "0123456789abcdef";
+        for (unsigned i = 0; i < ehdr.e_phnum; i++) {
+            Elf64_Phdr phdr;
+            size_t at = ehdr.e_phoff + i * sizeof(phdr);
+            if (at + sizeof(phdr) > size) break;
+            memcpy(&phdr, data + at, sizeof(phdr));
+            if (phdr.p_type != PT_NOTE || phdr.p_offset + phdr.p_filesz > size) continue;
+            size_t align = phdr.p_align == 8 ? 8 : 4;
+            auto round = [&](size_t n) { return (n + align - 1) & ~(align - 1); };
+            size_t note = phdr.p_offset;
+            size_t end = phdr.p_offset + phdr.p_filesz;
+            while (note + sizeof(Elf64_Nhdr) <= end) {
+                Elf64_Nhdr header;
+                memcpy(&header, data + note, sizeof(header));
+                size_t name = note + sizeof(header);
+                size_t desc = name + round(header.n_namesz);
+                if (desc + header.n_descsz > end) break;
+                if (header.n_type == NT_GNU_BUILD_ID && header.n_namesz == 4
+                    && memcmp(data + name, "GNU", 4) == 0)
+                {
+                    std::string id;
+                    for (size_t b = 0; b < header.n_descsz; b++) {
+                        id += HEX[data[desc + b] >> 4];
+                        id += HEX[data[desc + b] & 15];
+                    }
+                    return id;
+                }
+                note = desc + round(header.n_descsz);
+            }
+        }
+        return {};
+    }
+
+    void readSymbols(const uint8_t* data, size_t size, const Elf64_Ehdr& ehdr, bool objects)
+    {
+        if (ehdr.e_shoff == 0 || ehdr.e_shoff + ehdr.e_shnum * sizeof(Elf64_Shdr) > size) return;
+        std::vector<Elf64_Shdr> sections(ehdr.e_shnum);
+        memcpy(sections.data(), data + ehdr.e_shoff, ehdr.e_shnum * sizeof(Elf64_Shdr));
+        // The full symbol table if the file was not stripped, else the
+        // dynamic one.
+        const Elf64_Shdr* table = nullptr;
+        for (const Elf64_Shdr& section : sections) {
+            if (section.sh_type == SHT_SYMTAB) table = &section;
+        }
+        for (const Elf64_Shdr& section : sections) {
+            if (table == nullptr && section.sh_type == SHT_DYNSYM) table = &section;
+        }
+        if (table == nullptr || table->sh_link >= sections.size()) return;
+        const Elf64_Shdr& strings = sections[table->sh_link];
+        if (table->sh_offset + table->sh_size > size) return;
+        if (strings.sh_offset + strings.sh_size > size) return;
+
+        size_t count = table->sh_size / sizeof(Elf64_Sym);
+        for (size_t i = 0; i < count; i++) {
+            Elf64_Sym symbol;
+            memcpy(&symbol, data + table->sh_offset + i * sizeof(symbol), sizeof(symbol));
+            unsigned type = ELF64_ST_TYPE(symbol.st_info);
+            bool wanted = type == STT_FUNC || type == STT_GNU_IFUNC || (objects && type == STT_OBJECT);
+            if (!wanted || symbol.st_value == 0) continue;
+            if (symbol.st_shndx == SHN_UNDEF || symbol.st_name >= strings.sh_size) continue;
+            const char* name = reinterpret_cast<const char*>(data + strings.sh_offset + symbol.st_name);
+            // Demangled when looked up; most symbols never are.
+            symbols_.push_back({symbol.st_value, symbol.st_size, name});
+        }
+        std::sort(symbols_.begin(), symbols_.end(), [](const Symbol& a, const Symbol& b) {
+            return a.address < b.address;
+        });
+    }
+
+  public:
+    // False when the file cannot be read, is no 64-bit ELF file, or has a
+    // build-id other than `build_id` (if that is not empty).
+    bool load(const std::string& path, const std::string& build_id, bool objects = false)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        struct stat st;
+        void* mapping = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(Elf64_Ehdr)) {
+            mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        ::close(fd);
+        if (mapping == MAP_FAILED) return false;
+
+        const auto* data = static_cast<const uint8_t*>(mapping);
+        size_t size = st.st_size;
+        Elf64_Ehdr ehdr;
+        memcpy(&ehdr, data, sizeof(ehdr));
+        bool usable = memcmp(ehdr.e_ident, ELFMAG, SELFMAG) == 0 && ehdr.e_ident[EI_CLASS] == ELFCLASS64
+                      && (build_id.empty() || noteBuildId(data, size, ehdr) == build_id);
+        if (usable) readSymbols(data, size, ehdr, objects);
+        munmap(mapping, size);
+        return usable;
+    }
+
+    // "function+0xoffset" for a return address given as ELF virtual
+    // address, or empty if no function covers it. A return address points
+    // past its call, which may have been the last instruction of the
+    // function, so the function that covers the byte before it is taken.
+    std::string lookup(uint64_t address) const
+    {
+        uint64_t call = address - 1;
+        auto it = std::upper_bound(
+                symbols_.begin(), symbols_.end(), call, [](uint64_t value, const Symbol& symbol) {
+                    return value < symbol.address;
+                });
+        if (it == symbols_.begin()) return {};
+        --it;
+        if (it->size != 0 && call >= it->address + it->size) return {};
+        char offset[32];
+        snprintf(offset, sizeof(offset), "+0x%" PRIx64, address - it->address);
+        return demangle(it->name.c_str()) + offset;
+    }
+
+    // Calls `found(i, address, size)` with the ELF virtual address of every
+    // symbol called `names[i]`, as spelled in the file or demangled, with or
+    // without its parameter list (so "Cache::get" covers all overloads).
+    template<typename Found>
+    void find(const std::vector<std::string>& names, Found found) const
+    {
+        for (const Symbol& symbol : symbols_) {
+            std::string demangled;
+            for (size_t i = 0; i < names.size(); i++) {
+                const std::string& name = names[i];
+                bool match = symbol.name == name;
+                if (!match && symbol.name.compare(0, 2, "_Z") == 0) {
+                    if (demangled.empty()) demangled = demangle(symbol.name.c_str());
+                    match = demangled.compare(0, name.size(), name) == 0
+                            && (demangled.size() == name.size() || demangled[name.size()] == '(');
+                }
+                if (match) found(i, symbol.address, symbol.size);
+            }
+        }
+    }
+};
+
+}  // namespace skeleton_key
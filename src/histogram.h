@@ -0,0 +1,137 @@
+// Log-bucketed latency histograms in the style of HdrHistogram.
+//
+// Values below 16 get a bucket each; above that every power of two is split
+// into 8 equal buckets, so a bucket is never wider than 1/8 of its values
+// and a percentile read from it is within 12.5% of the exact one. Values up
+// to 2^43 (about two hours in nanoseconds) fit in 328 fixed buckets; larger
+// ones land in the last. The layout is the same everywhere, so histograms
+// from different threads, processes or runs merge by adding their counts
+// bucket by bucket.
+//
+// BasicLatencyHistogram<uint64_t> is the plain version the analyzer uses;
+// with std::atomic<uint64_t> counts any number of threads can record into
+// one histogram with relaxed increments, as the aggregate backend does.
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace skeleton_key {
+
+static constexpr unsigned HISTOGRAM_SUB_BUCKET_BITS = 3;
+static constexpr unsigned HISTOGRAM_MAX_EXPONENT = 42;
+static constexpr size_t HISTOGRAM_SUB_BUCKETS = size_t(1) << HISTOGRAM_SUB_BUCKET_BITS;
+static constexpr size_t HISTOGRAM_LINEAR_BUCKETS = 2 * HISTOGRAM_SUB_BUCKETS;
+static constexpr size_t HISTOGRAM_OCTAVES = HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BUCKET_BITS;
+static constexpr size_t HISTOGRAM_BUCKETS =
+        HISTOGRAM_LINEAR_BUCKETS + HISTOGRAM_OCTAVES * HISTOGRAM_SUB_BUCKETS;
+
+template<typename Count>
+class BasicLatencyHistogram
+{
+    static constexpr bool ATOMIC = !std::is_integral_v<Count>;
+
+    Count counts_[HISTOGRAM_BUCKETS] = {};
+
+  public:
+    static size_t bucketOf(uint64_t value)
+    {
+        if (value < HISTOGRAM_LINEAR_BUCKETS) return static_cast<size_t>(value);
+        constexpr uint64_t largest = (uint64_t(2) << HISTOGRAM_MAX_EXPONENT) - 1;
+        if (value > largest) value = largest;
+        unsigned exponent = 63 - __builtin_clzll(value);
+        unsigned shift = exponent - HISTOGRAM_SUB_BUCKET_BITS;
+        size_t sub_bucket = (value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1);
+        size_t octave = exponent - HISTOGRAM_SUB_BUCKET_BITS - 1;
+        return HISTOGRAM_LINEAR_BUCKETS + octave * HISTOGRAM_SUB_BUCKETS + sub_bucket;
+    }
+
+    // Smallest and largest value that fall into `bucket`.
+    static uint64_t lowerBound(size_t bucket)
+    {
+        if (bucket < HISTOGRAM_LINEAR_BUCKETS) return bucket;
+        size_t index = bucket - HISTOGRAM_LINEAR_BUCKETS;
+        size_t octave = index / HISTOGRAM_SUB_BUCKETS;
+        uint64_t sub_bucket = index % HISTOGRAM_SUB_BUCKETS;
+        // The octave's first bucket starts at 2^(octave + SUB_BUCKET_BITS + 1).
+        return (HISTOGRAM_SUB_BUCKETS | sub_bucket) << (octave + 1);
+    }
+
+    static uint64_t upperBound(size_t bucket)
+    {
+        if (bucket + 1 == HISTOGRAM_BUCKETS) return (uint64_t(2) << HISTOGRAM_MAX_EXPONENT) - 1;
+        return lowerBound(bucket + 1) - 1;
+    }
+
+    void record(uint64_t value, uint64_t count = 1)
+    {
+        if constexpr (ATOMIC) {
+            counts_[bucketOf(value)].fetch_add(count, std::memory_order_relaxed);
+        } else {
+            counts_[bucketOf(value)] += count;
+        }
+    }
+
+    uint64_t count(size_t bucket) const
+    {
+        if constexpr (ATOMIC) {
+            return counts_[bucket].load(std::memory_order_relaxed);
+        } else {
+            return counts_[bucket];
+        }
+    }
+
+    uint64_t total() const
+    {
+        uint64_t total = 0;
+        for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) total += count(bucket);
+        return total;
+    }
+
+    template<typename Other>
+    void merge(const BasicLatencyHistogram<Other>& other)
+    {
+        for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+            if (uint64_t n = other.count(bucket)) record(lowerBound(bucket), n);
+        }
+    }
+
+    // Merges a histogram of values in other units, each multiplied by
+    // numerator / denominator: clock ticks into nanoseconds, say. Values are
+    // taken at the middle of their bucket.
+    template<typename Other>
+    void mergeScaled(const BasicLatencyHistogram<Other>& other, uint64_t numerator, uint64_t denominator)
+    {
+        if (numerator == denominator) return merge(other);
+        for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+            uint64_t n = other.count(bucket);
+            if (n == 0) continue;
+            unsigned __int128 middle = (lowerBound(bucket) + upperBound(bucket)) / 2;
+            record(static_cast<uint64_t>(middle * numerator / denominator), n);
+        }
+    }
+
+    // The value below which `percent` of the recorded values lie, as the
+    // largest value of its bucket; 0 when empty.
+    uint64_t percentile(double percent) const
+    {
+        uint64_t total = this->total();
+        if (total == 0) return 0;
+        auto wanted = static_cast<uint64_t>(std::ceil(percent / 100 * static_cast<double>(total)));
+        if (wanted == 0) wanted = 1;
+        uint64_t seen = 0;
+        for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+            seen += count(bucket);
+            if (seen >= wanted) return upperBound(bucket);
+        }
+        return upperBound(HISTOGRAM_BUCKETS - 1);
+    }
+};
+
+using LatencyHistogram = BasicLatencyHistogram<uint64_t>;
+using AtomicLatencyHistogram = BasicLatencyHistogram<std::atomic<uint64_t>>;
+
+}  // namespace skeleton_key
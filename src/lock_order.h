@@ -0,0 +1,402 @@
+// Deadlock analysis over a trace, in the spirit of the kernel's lockdep.
+//
+// Lock order: whenever a thread acquires a lock while holding others, each
+// held lock gains an edge to the new one, remembering the first thread and
+// stacks that took them in that order. A cycle in this graph is a potential
+// deadlock, whether or not the threads involved ever met. Cycles are found
+// as edges are added, with the incremental topological order of Pearce and
+// Kelly: most new edges agree with the current order and cost one compare,
+// the others only search the part of the graph between their two ends. The
+// edge closing a cycle is reported and kept out of the graph, so the order
+// stays acyclic and every cycle is reported once, by its closing edge.
+//
+// Wait-for: when a thread starts waiting on a lock, the chain of owners it
+// waits for, and whatever they wait for in turn, is followed; reaching the
+// waiting thread again is an actual deadlock at that moment. Only exclusive
+// owners (mutexes, spinlocks and write locks) are known, so waits on
+// read-held locks never close such a chain, and semaphores and barriers,
+// which have no owner, take no part.
+//
+// Successful try-locks are held like other locks but add no edges, since
+// they cannot block. pthread_cond_wait releases its mutex for the wait and
+// reacquires it afterwards.
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "trace_decoder.h"
+#include "trace_format.h"
+
+namespace skeleton_key {
+
+// A directed graph kept in a topological order as edges are added.
+class LockOrderGraph
+{
+    std::vector<std::vector<uint32_t>> out_;
+    std::vector<std::vector<uint32_t>> in_;
+    // Position of each node in the order, and the node at each position.
+    std::vector<uint32_t> order_;
+    std::vector<uint32_t> node_at_;
+    // Search state, valid for nodes whose mark is the current epoch.
+    std::vector<uint32_t> mark_;
+    std::vector<uint32_t> parent_;
+    uint32_t epoch_ = 0;
+    std::vector<uint32_t> forward_;
+    std::vector<uint32_t> backward_;
+    std::vector<uint32_t> stack_;
+
+    // Nodes reachable from `start` ordered no later than `bound` into
+    // forward_; false if that reaches `target`.
+    bool searchForward(uint32_t start, uint32_t target, uint32_t bound)
+    {
+        forward_.clear();
+        stack_.assign(1, start);
+        mark_[start] = epoch_;
+        while (!stack_.empty()) {
+            uint32_t node = stack_.back();
+            stack_.pop_back();
+            forward_.push_back(node);
+            for (uint32_t next : out_[node]) {
+                if (next == target) {
+                    parent_[target] = node;
+                    return false;
+                }
+                if (mark_[next] != epoch_ && order_[next] < bound) {
+                    mark_[next] = epoch_;
+                    parent_[next] = node;
+                    stack_.push_back(next);
+                }
+            }
+        }
+        return true;
+    }
+
+    // Nodes reaching `start` ordered no earlier than `bound` into backward_.
+    void searchBackward(uint32_t start, uint32_t bound)
+    {
+        backward_.clear();
+        stack_.assign(1, start);
+        mark_[start] = epoch_;
+        while (!stack_.empty()) {
+            uint32_t node = stack_.back();
+            stack_.pop_back();
+            backward_.push_back(node);
+            for (uint32_t previous : in_[node]) {
+                if (mark_[previous] != epoch_ && order_[previous] > bound) {
+                    mark_[previous] = epoch_;
+                    stack_.push_back(previous);
+                }
+            }
+        }
+    }
+
+    // Give the nodes of both searches their positions back, backward ones
+    // first, each group keeping its relative order.
+    void reorder()
+    {
+        auto by_order = [&](uint32_t a, uint32_t b) { return order_[a] < order_[b]; };
+        std::sort(backward_.begin(), backward_.end(), by_order);
+        std::sort(forward_.begin(), forward_.end(), by_order);
+        std::vector<uint32_t> positions;
+        positions.reserve(backward_.size() + forward_.size());
+        for (uint32_t node : backward_) positions.push_back(order_[node]);
+        for (uint32_t node : forward_) positions.push_back(order_[node]);
+        std::sort(positions.begin(), positions.end());
+        size_t i = 0;
+        for (const std::vector<uint32_t>* group : {&backward_, &forward_}) {
+            for (uint32_t node : *group) {
+                order_[node] = positions[i++];
+                node_at_[order_[node]] = node;
+            }
+        }
+    }
+
+  public:
+    uint32_t addNode()
+    {
+        uint32_t node = static_cast<uint32_t>(out_.size());
+        out_.emplace_back();
+        in_.emplace_back();
+        order_.push_back(node);
+        node_at_.push_back(node);
+        mark_.push_back(0);
+        parent_.push_back(0);
+        return node;
+    }
+
+    size_t nodeCount() const
+    {
+        return out_.size();
+    }
+
+    // Adds from -> to, which must be new, unless it would close a cycle. In
+    // that case returns false with the path to ... from already in the graph
+    // in `cycle`.
+    bool addEdge(uint32_t from, uint32_t to, std::vector<uint32_t>& cycle)
+    {
+        uint32_t lower = order_[to];
+        uint32_t upper = order_[from];
+        if (lower < upper) {
+            epoch_++;
+            if (!searchForward(to, from, upper)) {
+                cycle.clear();
+                for (uint32_t node = from; node != to; node = parent_[node]) cycle.push_back(node);
+                cycle.push_back(to);
+                std::reverse(cycle.begin(), cycle.end());
+                return false;
+            }
+            searchBackward(from, lower);
+            reorder();
+        }
+        out_[from].push_back(to);
+        in_[to].push_back(from);
+        return true;
+    }
+};
+
+class LockOrderAnalyzer
+{
+  public:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    // The first time a thread acquired `to` while holding `from`.
+    struct Edge
+    {
+        uint32_t from;
+        uint32_t to;
+        uint32_t tid;
+        uint64_t timestamp;
+        uint32_t held_stack;
+        uint32_t acquire_stack;
+    };
+
+    // Locks taken in an order that loops: edges[i].to == edges[i + 1].from,
+    // the last edge closing the cycle.
+    struct PotentialDeadlock
+    {
+        std::vector<Edge> edges;
+    };
+
+    // Threads each waiting for a lock owned by the next, the last waiting
+    // for one owned by the first.
+    struct Deadlock
+    {
+        uint64_t timestamp;
+        struct Wait
+        {
+            uint32_t tid;
+            uint32_t lock;
+            uint32_t stack;
+        };
+        std::vector<Wait> waits;
+    };
+
+  private:
+    struct Held
+    {
+        uint32_t lock;
+        uint32_t stack;
+    };
+
+    struct ThreadState
+    {
+        std::vector<Held> held;
+        uint32_t waiting_for = NONE;
+        uint32_t wait_stack = NO_STACK;
+    };
+
+    LockOrderGraph graph_;
+    std::unordered_map<void*, uint32_t> ids_;
+    std::vector<void*> addresses_;
+    // Exclusive owner of each lock.
+    std::vector<uint32_t> owners_;
+    // Every edge seen, including those that closed a cycle, by from << 32 | to.
+    std::unordered_map<uint64_t, uint32_t> edge_ids_;
+    std::vector<Edge> edges_;
+    std::unordered_map<uint32_t, ThreadState> threads_;
+    std::vector<PotentialDeadlock> potential_;
+    std::vector<Deadlock> deadlocks_;
+    std::vector<uint32_t> cycle_;
+
+    uint32_t lockId(void* address)
+    {
+        auto [it, inserted] = ids_.emplace(address, static_cast<uint32_t>(addresses_.size()));
+        if (inserted) {
+            graph_.addNode();
+            addresses_.push_back(address);
+            owners_.push_back(NONE);
+        }
+        return it->second;
+    }
+
+    const Edge& edge(uint32_t from, uint32_t to) const
+    {
+        return edges_[edge_ids_.at(static_cast<uint64_t>(from) << 32 | to)];
+    }
+
+    void addOrder(const Held& held, uint32_t lock, const DecodedEvent& event)
+    {
+        uint64_t key = static_cast<uint64_t>(held.lock) << 32 | lock;
+        auto [it, inserted] = edge_ids_.emplace(key, static_cast<uint32_t>(edges_.size()));
+        if (!inserted) return;
+        edges_.push_back({held.lock, lock, event.tid, event.timestamp, held.stack, event.stack});
+        if (graph_.addEdge(held.lock, lock, cycle_)) return;
+
+        PotentialDeadlock found;
+        for (size_t i = 0; i + 1 < cycle_.size(); i++) {
+            found.edges.push_back(edge(cycle_[i], cycle_[i + 1]));
+        }
+        found.edges.push_back(edges_.back());
+        potential_.push_back(std::move(found));
+    }
+
+    void wait(ThreadState& thread, uint32_t lock, const DecodedEvent& event)
+    {
+        thread.waiting_for = lock;
+        thread.wait_stack = event.stack;
+
+        // Follow owners and what they wait for; a chain of distinct threads
+        // is never longer than the number of threads.
+        Deadlock found{event.timestamp, {{event.tid, lock, event.stack}}};
+        for (size_t steps = 0; steps <= threads_.size(); steps++) {
+            uint32_t owner = owners_[found.waits.back().lock];
+            if (owner == NONE) return;
+            if (owner == event.tid) {
+                // Waiting on a lock the thread owns itself is taken for a
+                // recursive mutex.
+                if (found.waits.size() > 1) deadlocks_.push_back(std::move(found));
+                return;
+            }
+            auto it = threads_.find(owner);
+            if (it == threads_.end() || it->second.waiting_for == NONE) return;
+            found.waits.push_back({owner, it->second.waiting_for, it->second.wait_stack});
+        }
+    }
+
+    void
+    acquire(ThreadState& thread, uint32_t lock, bool exclusive, bool ordered, const DecodedEvent& event)
+    {
+        thread.waiting_for = NONE;
+        if (ordered) {
+            for (const Held& held : thread.held) {
+                if (held.lock != lock) addOrder(held, lock, event);
+            }
+        }
+        thread.held.push_back({lock, event.stack});
+        if (exclusive) owners_[lock] = event.tid;
+    }
+
+    void release(ThreadState& thread, uint32_t lock, uint32_t tid)
+    {
+        auto held = std::find_if(thread.held.rbegin(), thread.held.rend(), [&](const Held& entry) {
+            return entry.lock == lock;
+        });
+        if (held == thread.held.rend()) return;
+        thread.held.erase(std::next(held).base());
+        bool still_held = std::any_of(thread.held.begin(), thread.held.end(), [&](const Held& entry) {
+            return entry.lock == lock;
+        });
+        if (!still_held && owners_[lock] == tid) owners_[lock] = NONE;
+    }
+
+  public:
+    // Events must come in timestamp order.
+    void process(const DecodedEvent& event)
+    {
+        switch (event.type) {
+            case EventType::MutexLock:
+            case EventType::MutexTimedLock:
+            case EventType::MutexClockLock:
+            case EventType::SpinLock:
+            case EventType::RWLockRead:
+            case EventType::RWLockTimedRead:
+            case EventType::RWLockWrite:
+            case EventType::RWLockTimedWrite:
+                wait(threads_[event.tid], lockId(event.ptr1), event);
+                break;
+            case EventType::MutexLockDone:
+            case EventType::MutexTimedLockDone:
+            case EventType::MutexClockLockDone:
+            case EventType::MutexLockFast:
+            case EventType::SpinLockDone:
+            case EventType::SpinLockFast:
+            case EventType::RWLockWriteDone:
+            case EventType::RWLockTimedWriteDone:
+            case EventType::RWLockWriteFast:
+            case EventType::RWLockReadDone:
+            case EventType::RWLockTimedReadDone:
+            case EventType::RWLockReadFast: {
+                ThreadState& thread = threads_[event.tid];
+                if (event.result != 0) {
+                    thread.waiting_for = NONE;
+                    break;
+                }
+                bool exclusive = event.type != EventType::RWLockReadDone
+                                 && event.type != EventType::RWLockTimedReadDone
+                                 && event.type != EventType::RWLockReadFast;
+                acquire(thread, lockId(event.ptr1), exclusive, true, event);
+                break;
+            }
+            case EventType::MutexTryLockDone:
+            case EventType::SpinTryLockDone:
+            case EventType::RWLockTryWriteDone:
+            case EventType::RWLockTryReadDone:
+                if (event.result == 0) {
+                    acquire(threads_[event.tid],
+                            lockId(event.ptr1),
+                            event.type != EventType::RWLockTryReadDone,
+                            false,
+                            event);
+                }
+                break;
+            case EventType::MutexUnlock:
+            case EventType::RWLockUnlock:
+            case EventType::SpinUnlock:
+                release(threads_[event.tid], lockId(event.ptr1), event.tid);
+                break;
+            case EventType::CondWait:
+            case EventType::CondTimedWait:
+            case EventType::CondClockWait:
+                release(threads_[event.tid], lockId(event.ptr2), event.tid);
+                break;
+            case EventType::CondWaitDone:
+            case EventType::CondTimedWaitDone:
+            case EventType::CondClockWaitDone:
+                // The mutex is reacquired even when the wait timed out.
+                acquire(threads_[event.tid], lockId(event.ptr2), true, true, event);
+                break;
+            default:
+                break;
+        }
+    }
+
+    void* address(uint32_t lock) const
+    {
+        return addresses_[lock];
+    }
+
+    size_t lockCount() const
+    {
+        return addresses_.size();
+    }
+
+    size_t edgeCount() const
+    {
+        return edges_.size();
+    }
+
+    const std::vector<PotentialDeadlock>& potentialDeadlocks() const
+    {
+        return potential_;
+    }
+
+    const std::vector<Deadlock>& deadlocks() const
+    {
+        return deadlocks_;
+    }
+};
+
+}  // namespace skeleton_key
@@ -1,113 +1,51 @@
+// Analyzer for skeleton key traces. Prints the same per-lock summary as
+// parse.py, with --events every event and its stack, with --deadlocks lock
+// order cycles and deadlocks (lock_order.h), or with --blocking the critical
+// sections other threads waited for most (blocking.h). With --listen or
+// --follow it reads a live trace instead and reprints the summary as the
+// events come in; --export-columns converts the trace for the visualizer.
+// --control sends a command to a traced process's control socket. Given
+// several traces, e.g. of a process and its children, it analyzes them as one.
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
+#include <cinttypes>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
-#include <execinfo.h>
-#include <fstream>
 #include <iomanip>
+#include <fcntl.h>
 #include <iostream>
 #include <memory>
+#include <poll.h>
+#include <pthread.h>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
 #include <unordered_map>
 #include <vector>
 
-// Keep enum in sync with writer
-enum class EventType : uint8_t {
-    // Thread events
-    ThreadCreate,
-
-    // Mutex events
-    MutexInit,
-    MutexDestroy,
-    MutexLock,
-    MutexLockDone,
-    MutexTryLock,
-    MutexTryLockDone,
-    MutexTimedLock,
-    MutexTimedLockDone,
-    MutexUnlock,
-
-    // RWLock events
-    RWLockInit,
-    RWLockDestroy,
-    RWLockRead,
-    RWLockReadDone,
-    RWLockTryRead,
-    RWLockTryReadDone,
-    RWLockTimedRead,
-    RWLockTimedReadDone,
-    RWLockWrite,
-    RWLockWriteDone,
-    RWLockTryWrite,
-    RWLockTryWriteDone,
-    RWLockTimedWrite,
-    RWLockTimedWriteDone,
-    RWLockUnlock,
-
-    // Condition variable events
-    CondInit,
-    CondDestroy,
-    CondSignal,
-    CondBroadcast,
-    CondWait,
-    CondWaitDone,
-    CondTimedWait,
-    CondTimedWaitDone
-};
-
-class VarIntReader
-{
-    std::vector<uint8_t> buffer_;
-    size_t pos_ = 0;
-
-  public:
-    explicit VarIntReader(std::vector<uint8_t>&& buffer)
-    : buffer_(std::move(buffer))
-    {
-    }
-
-    uint64_t readVarInt()
-    {
-        uint64_t result = 0;
-        int shift = 0;
-
-        while (pos_ < buffer_.size()) {
-            uint8_t byte = buffer_[pos_++];
-            result |= static_cast<uint64_t>(byte & 0x7F) << shift;
-            if ((byte & 0x80) == 0) break;
-            shift += 7;
-        }
-
-        return result;
-    }
+#include "blocking.h"
+#include "columnar.h"
+#include "histogram.h"
+#include "lock_order.h"
+#include "symbolizer.h"
+#include "trace_decoder.h"
 
-    EventType readEventType()
-    {
-        return static_cast<EventType>(buffer_[pos_++]);
-    }
+using skeleton_key::BlockingAnalyzer;
+using skeleton_key::ChunkRef;
+using skeleton_key::DecodedEvent;
+using skeleton_key::EventType;
+using skeleton_key::LockOrderAnalyzer;
+using skeleton_key::StackStore;
+using skeleton_key::Symbolizer;
+using skeleton_key::TraceFile;
 
-    void* readPtr()
-    {
-        return reinterpret_cast<void*>(readVarInt());
-    }
-
-    std::vector<void*> readStack()
-    {
-        uint32_t depth = readVarInt();
-        std::vector<void*> stack;
-        stack.reserve(depth);
-
-        for (uint32_t i = 0; i < depth; i++) {
-            stack.push_back(readPtr());
-        }
-
-        return stack;
-    }
-
-    bool eof() const
-    {
-        return pos_ >= buffer_.size();
-    }
-};
-
-std::string
+static std::string
 eventTypeToString(EventType type)
 {
     switch (type) {
@@ -177,71 +115,1247 @@ eventTypeToString(EventType type)
             return "CondTimedWait";
         case EventType::CondTimedWaitDone:
             return "CondTimedWaitDone";
+        case EventType::MutexLockFast:
+            return "MutexLockFast";
+        case EventType::RWLockReadFast:
+            return "RWLockReadFast";
+        case EventType::RWLockWriteFast:
+            return "RWLockWriteFast";
+        case EventType::SpinInit:
+            return "SpinInit";
+        case EventType::SpinDestroy:
+            return "SpinDestroy";
+        case EventType::SpinLock:
+            return "SpinLock";
+        case EventType::SpinLockDone:
+            return "SpinLockDone";
+        case EventType::SpinTryLock:
+            return "SpinTryLock";
+        case EventType::SpinTryLockDone:
+            return "SpinTryLockDone";
+        case EventType::SpinUnlock:
+            return "SpinUnlock";
+        case EventType::SpinLockFast:
+            return "SpinLockFast";
+        case EventType::SemInit:
+            return "SemInit";
+        case EventType::SemDestroy:
+            return "SemDestroy";
+        case EventType::SemWait:
+            return "SemWait";
+        case EventType::SemWaitDone:
+            return "SemWaitDone";
+        case EventType::SemTryWait:
+            return "SemTryWait";
+        case EventType::SemTryWaitDone:
+            return "SemTryWaitDone";
+        case EventType::SemTimedWait:
+            return "SemTimedWait";
+        case EventType::SemTimedWaitDone:
+            return "SemTimedWaitDone";
+        case EventType::SemPost:
+            return "SemPost";
+        case EventType::SemWaitFast:
+            return "SemWaitFast";
+        case EventType::BarrierInit:
+            return "BarrierInit";
+        case EventType::BarrierDestroy:
+            return "BarrierDestroy";
+        case EventType::BarrierWait:
+            return "BarrierWait";
+        case EventType::BarrierWaitDone:
+            return "BarrierWaitDone";
+        case EventType::MutexClockLock:
+            return "MutexClockLock";
+        case EventType::MutexClockLockDone:
+            return "MutexClockLockDone";
+        case EventType::CondClockWait:
+            return "CondClockWait";
+        case EventType::CondClockWaitDone:
+            return "CondClockWaitDone";
         default:
             return "Unknown";
     }
 }
 
-int
-main(int argc, char** argv)
+// Per-lock counters, following LockStats in parse.py: a wait counts as
+// contention when another thread owned the lock as it began, or in a sampled
+// trace when the lock call took SAMPLED_CONTENTION_NS, and the hold
+// time runs from a thread's acquisition to its next unlock. An rwlock has
+// one exclusive owner or any number of shared holders; readers joining each
+// other neither contend nor change the owner. A spinlock is a mutex whose
+// contended waits are spent spinning on the CPU, so they are summed apart
+// from the time threads were blocked.
+struct LockStats
 {
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <trace file>\n";
-        return 1;
+    uint64_t locked_count = 0;
+    uint64_t changes = 0;
+    uint64_t contentions = 0;
+    uint64_t contention_time_ns = 0;
+    uint64_t spin_time_ns = 0;
+    uint64_t max_wait_ns = 0;
+    uint64_t total_time_ns = 0;
+    uint64_t max_hold_ns = 0;
+    bool is_mutex = true;
+    bool is_spin = false;
+    // Of the contended waits and of all holds.
+    skeleton_key::LatencyHistogram wait_histogram;
+    skeleton_key::LatencyHistogram hold_histogram;
+
+    // Shared acquisitions, and how they bunch up: a batch runs from the
+    // time the lock goes from free or written to read until the last reader
+    // leaves. Batches of about one reader gain nothing over a mutex.
+    uint64_t read_count = 0;
+    uint64_t reader_batches = 0;
+    uint64_t max_readers = 0;
+    // Contended waits of writers, and the part of them spent while the lock
+    // was held for reading (summed over the writers waiting).
+    uint64_t write_wait_ns = 0;
+    uint64_t writer_starvation_ns = 0;
+
+    static constexpr uint32_t NO_OWNER = UINT32_MAX;
+    uint32_t current_owner = NO_OWNER;
+    struct Attempt
+    {
+        uint64_t start;
+        bool contended;
+        bool exclusive;
+    };
+    struct SharedHold
+    {
+        uint64_t since;
+        uint32_t depth;
+    };
+    // Waits under way and holds in progress, by thread.
+    std::unordered_map<uint32_t, Attempt> pending;
+    std::unordered_map<uint32_t, uint64_t> holds;
+    std::unordered_map<uint32_t, SharedHold> readers;
+    uint32_t waiting_writers = 0;
+    uint64_t last_change = 0;
+
+    // Whether threads other than `tid` hold the lock for reading.
+    bool readOwnedByOthers(uint32_t tid) const
+    {
+        return readers.size() > readers.count(tid);
     }
 
-    std::ifstream input(argv[1], std::ios::binary);
-    if (!input) {
-        std::cerr << "Failed to open " << argv[1] << "\n";
-        return 1;
+    // Charges the time since the last change to the writers waiting on readers.
+    void advance(uint64_t now)
+    {
+        if (waiting_writers != 0 && !readers.empty() && now > last_change) {
+            writer_starvation_ns += (now - last_change) * waiting_writers;
+        }
+        last_change = now;
+    }
+
+    void endAttempt(std::unordered_map<uint32_t, Attempt>::iterator it)
+    {
+        if (it->second.exclusive) waiting_writers--;
+        pending.erase(it);
+    }
+
+    void attempt(const DecodedEvent& event, bool exclusive)
+    {
+        advance(event.timestamp);
+        bool contended = (current_owner != NO_OWNER && current_owner != event.tid)
+                         || (exclusive && readOwnedByOthers(event.tid));
+        auto it = pending.find(event.tid);
+        if (it != pending.end()) endAttempt(it);
+        pending[event.tid] = {event.timestamp, contended, exclusive};
+        if (exclusive) waiting_writers++;
+    }
+
+    void acquired(const DecodedEvent& event, bool exclusive, bool sampled)
+    {
+        advance(event.timestamp);
+        locked_count++;
+        // A ring trace may have lost the matching attempt; the acquisition
+        // still counts, just not its wait.
+        auto it = pending.find(event.tid);
+        if (it != pending.end()) {
+            bool slow = sampled && event.duration >= skeleton_key::SAMPLED_CONTENTION_NS;
+            if (it->second.contended || slow) {
+                uint64_t wait = event.timestamp - it->second.start;
+                contentions++;
+                (is_spin ? spin_time_ns : contention_time_ns) += wait;
+                max_wait_ns = std::max(max_wait_ns, wait);
+                wait_histogram.record(wait);
+                if (!is_mutex && exclusive) write_wait_ns += wait;
+            }
+            endAttempt(it);
+        }
+        if ((current_owner != NO_OWNER && current_owner != event.tid)
+            || (exclusive && readOwnedByOthers(event.tid))) {
+            changes++;
+        }
+        if (exclusive) {
+            current_owner = event.tid;
+            holds[event.tid] = event.timestamp;
+            return;
+        }
+        read_count++;
+        if (readers.empty()) reader_batches++;
+        SharedHold& hold = readers[event.tid];
+        if (hold.depth++ == 0) hold.since = event.timestamp;
+        max_readers = std::max<uint64_t>(max_readers, readers.size());
+    }
+
+    void failed(const DecodedEvent& event)
+    {
+        advance(event.timestamp);
+        auto it = pending.find(event.tid);
+        if (it != pending.end()) endAttempt(it);
+    }
+
+    void recordHold(uint64_t hold)
+    {
+        total_time_ns += hold;
+        max_hold_ns = std::max(max_hold_ns, hold);
+        hold_histogram.record(hold);
+    }
+
+    void released(const DecodedEvent& event)
+    {
+        advance(event.timestamp);
+        auto reader = readers.find(event.tid);
+        if (reader != readers.end() && current_owner != event.tid) {
+            if (--reader->second.depth == 0) {
+                recordHold(event.timestamp - reader->second.since);
+                readers.erase(reader);
+            }
+            return;
+        }
+        auto it = holds.find(event.tid);
+        if (it != holds.end()) {
+            recordHold(event.timestamp - it->second);
+            holds.erase(it);
+        }
+        if (current_owner == event.tid) current_owner = NO_OWNER;
+    }
+};
+
+// Per condition variable: how often it is waited on and signaled, and the
+// wakeup latency from a signal to the return of the wait it woke, which
+// includes taking the mutex back. Waiters are assumed to be woken in the
+// order they started waiting.
+struct CondStats
+{
+    uint64_t waits = 0;
+    uint64_t signals = 0;
+    uint64_t broadcasts = 0;
+    // Signals and broadcasts that found no thread waiting.
+    uint64_t empty_signals = 0;
+    // Waits ended by a signal, and the rest: timeouts, and spurious or
+    // untraced wakeups.
+    uint64_t woken = 0;
+    uint64_t timeouts = 0;
+    uint64_t unsignaled = 0;
+    uint64_t wakeup_ns = 0;
+    uint64_t max_wakeup_ns = 0;
+    skeleton_key::LatencyHistogram wakeup_histogram;
+
+    struct Waiter
+    {
+        uint32_t tid;
+        bool signaled;
+        uint64_t signal_time;
+    };
+    // Longest waiting first.
+    std::vector<Waiter> waiters;
+
+    void wait(const DecodedEvent& event)
+    {
+        waits++;
+        waiters.erase(std::remove_if(waiters.begin(),
+                                     waiters.end(),
+                                     [&](const Waiter& waiter) { return waiter.tid == event.tid; }),
+                      waiters.end());
+        waiters.push_back({event.tid, false, 0});
+    }
+
+    void signal(const DecodedEvent& event, bool broadcast)
+    {
+        (broadcast ? broadcasts : signals)++;
+        bool any = false;
+        for (Waiter& waiter : waiters) {
+            if (waiter.signaled) continue;
+            waiter.signaled = true;
+            waiter.signal_time = event.timestamp;
+            any = true;
+            if (!broadcast) break;
+        }
+        if (!any) empty_signals++;
+    }
+
+    void woke(const DecodedEvent& event)
+    {
+        auto it = std::find_if(waiters.begin(), waiters.end(), [&](const Waiter& waiter) {
+            return waiter.tid == event.tid;
+        });
+        if (it != waiters.end() && it->signaled) {
+            uint64_t latency = event.timestamp - std::min(event.timestamp, it->signal_time);
+            woken++;
+            wakeup_ns += latency;
+            max_wakeup_ns = std::max(max_wakeup_ns, latency);
+            wakeup_histogram.record(latency);
+        } else if (event.result != 0) {
+            timeouts++;
+        } else {
+            unsignaled++;
+        }
+        if (it != waiters.end()) waiters.erase(it);
+    }
+};
+
+// Per semaphore: its waits, the time spent in them, and its posts. Nobody
+// owns a semaphore, so there are no holds or owner changes.
+struct SemStats
+{
+    uint64_t waits = 0;
+    // Waits that timed out, were interrupted or found no unit to take.
+    uint64_t failed = 0;
+    uint64_t posts = 0;
+    uint64_t wait_ns = 0;
+    uint64_t max_wait_ns = 0;
+    skeleton_key::LatencyHistogram wait_histogram;
+
+    void waited(const DecodedEvent& event)
+    {
+        if (event.result != 0) {
+            failed++;
+            return;
+        }
+        waits++;
+        wait_ns += event.duration;
+        max_wait_ns = std::max(max_wait_ns, event.duration);
+        wait_histogram.record(event.duration);
+    }
+};
+
+// Per barrier: how long threads waited at it, and how many rounds
+// completed, one per wait that returned PTHREAD_BARRIER_SERIAL_THREAD.
+struct BarrierStats
+{
+    uint64_t waits = 0;
+    uint64_t rounds = 0;
+    uint64_t wait_ns = 0;
+    uint64_t max_wait_ns = 0;
+    skeleton_key::LatencyHistogram wait_histogram;
+
+    void waited(const DecodedEvent& event)
+    {
+        waits++;
+        if (event.result == PTHREAD_BARRIER_SERIAL_THREAD) rounds++;
+        wait_ns += event.duration;
+        max_wait_ns = std::max(max_wait_ns, event.duration);
+        wait_histogram.record(event.duration);
+    }
+};
+
+static bool
+isCondWait(EventType type)
+{
+    return type == EventType::CondWait || type == EventType::CondTimedWait
+           || type == EventType::CondClockWait || type == EventType::CondWaitDone
+           || type == EventType::CondTimedWaitDone || type == EventType::CondClockWaitDone;
+}
+
+class LockAnalyzer
+{
+    // Every address seen as ptr1, so lock numbers match parse.py's.
+    std::unordered_map<void*, LockStats> locks_;
+    std::unordered_map<void*, CondStats> conds_;
+    std::unordered_map<void*, SemStats> sems_;
+    std::unordered_map<void*, BarrierStats> barriers_;
+    unsigned shard_;
+    unsigned shards_;
+    bool sampled_ = false;
+
+    bool owns(const void* lock) const
+    {
+        return shards_ == 1 || shardOf(lock, shards_) == shard_;
+    }
+
+  public:
+    // Analyzer `shard` of `shards` only keeps the locks shardOf() gives it.
+    explicit LockAnalyzer(unsigned shard = 0, unsigned shards = 1) : shard_(shard), shards_(shards)
+    {
+    }
+
+    // Which of `shards` analyzers sees the events of `lock`. A lock's state
+    // only depends on its own events, so analyzers for disjoint sets of
+    // locks can run in parallel and be merged afterwards.
+    static unsigned shardOf(const void* lock, unsigned shards)
+    {
+        uint64_t hash = (reinterpret_cast<uintptr_t>(lock) >> 3) * 0x9E37'79B9'7F4A'7C15ull;
+        return static_cast<unsigned>((hash >> 32) % shards);
+    }
+
+    // The analyzers an event concerns: that of its lock, and for condition
+    // waits also that of the mutex they release and take back.
+    static std::pair<unsigned, unsigned> shardsOf(const DecodedEvent& event, unsigned shards)
+    {
+        unsigned first = shardOf(event.ptr1, shards);
+        return {first, isCondWait(event.type) ? shardOf(event.ptr2, shards) : first};
+    }
+
+    // Whether the trace was sampled, which changes what counts as contended.
+    void setSampled(bool sampled)
+    {
+        sampled_ = sampled;
+    }
+
+    void merge(LockAnalyzer&& other)
+    {
+        locks_.merge(other.locks_);
+        conds_.merge(other.conds_);
+        sems_.merge(other.sems_);
+        barriers_.merge(other.barriers_);
+    }
+
+    void process(const DecodedEvent& event)
+    {
+        // A condition wait gives up its mutex and takes it back on return.
+        if (isCondWait(event.type) && owns(event.ptr2)) {
+            LockStats& mutex = locks_[event.ptr2];
+            if (event.type == EventType::CondWait || event.type == EventType::CondTimedWait
+                || event.type == EventType::CondClockWait)
+            {
+                mutex.released(event);
+            } else {
+                mutex.acquired(event, true, sampled_);
+            }
+        }
+        if (!owns(event.ptr1)) return;
+
+        LockStats& lock = locks_[event.ptr1];
+        switch (event.type) {
+            case EventType::SpinLock:
+                lock.is_spin = true;
+                [[fallthrough]];
+            case EventType::MutexLock:
+            case EventType::MutexTimedLock:
+            case EventType::MutexClockLock:
+                lock.attempt(event, true);
+                break;
+            case EventType::SpinLockDone:
+            case EventType::SpinLockFast:
+                lock.is_spin = true;
+                [[fallthrough]];
+            case EventType::MutexLockDone:
+            case EventType::MutexLockFast:
+                lock.acquired(event, true, sampled_);
+                break;
+            case EventType::SpinTryLockDone:
+                lock.is_spin = true;
+                [[fallthrough]];
+            case EventType::MutexTryLockDone:
+            case EventType::MutexTimedLockDone:
+            case EventType::MutexClockLockDone:
+                if (event.result == 0) {
+                    lock.acquired(event, true, sampled_);
+                } else {
+                    lock.failed(event);
+                }
+                break;
+            case EventType::SpinUnlock:
+                lock.is_spin = true;
+                [[fallthrough]];
+            case EventType::MutexUnlock:
+                lock.released(event);
+                break;
+            case EventType::RWLockRead:
+            case EventType::RWLockTimedRead:
+            case EventType::RWLockWrite:
+            case EventType::RWLockTimedWrite:
+                lock.is_mutex = false;
+                lock.attempt(event, event.type == EventType::RWLockWrite
+                                            || event.type == EventType::RWLockTimedWrite);
+                break;
+            case EventType::RWLockReadDone:
+            case EventType::RWLockTryReadDone:
+            case EventType::RWLockTimedReadDone:
+            case EventType::RWLockReadFast:
+            case EventType::RWLockWriteDone:
+            case EventType::RWLockTryWriteDone:
+            case EventType::RWLockTimedWriteDone:
+            case EventType::RWLockWriteFast:
+                lock.is_mutex = false;
+                if (event.result == 0) {
+                    bool exclusive = event.type == EventType::RWLockWriteDone
+                                     || event.type == EventType::RWLockTryWriteDone
+                                     || event.type == EventType::RWLockTimedWriteDone
+                                     || event.type == EventType::RWLockWriteFast;
+                    lock.acquired(event, exclusive, sampled_);
+                } else {
+                    lock.failed(event);
+                }
+                break;
+            case EventType::RWLockUnlock:
+                lock.is_mutex = false;
+                lock.released(event);
+                break;
+            case EventType::CondWait:
+            case EventType::CondTimedWait:
+            case EventType::CondClockWait:
+                conds_[event.ptr1].wait(event);
+                break;
+            case EventType::CondWaitDone:
+            case EventType::CondTimedWaitDone:
+            case EventType::CondClockWaitDone:
+                conds_[event.ptr1].woke(event);
+                break;
+            case EventType::CondSignal:
+            case EventType::CondBroadcast:
+                conds_[event.ptr1].signal(event, event.type == EventType::CondBroadcast);
+                break;
+            case EventType::SemWaitDone:
+            case EventType::SemTryWaitDone:
+            case EventType::SemTimedWaitDone:
+            case EventType::SemWaitFast:
+                sems_[event.ptr1].waited(event);
+                break;
+            case EventType::SemPost:
+                sems_[event.ptr1].posts++;
+                break;
+            case EventType::BarrierWaitDone:
+                barriers_[event.ptr1].waited(event);
+                break;
+            default:
+                break;
+        }
     }
 
-    // Read entire file
-    input.seekg(0, std::ios::end);
-    size_t size = input.tellg();
-    input.seekg(0);
+    void print(double sample_scale) const
+    {
+        std::vector<std::pair<void*, const LockStats*>> sorted;
+        sorted.reserve(locks_.size());
+        for (const auto& [address, stats] : locks_) sorted.emplace_back(address, &stats);
+        std::sort(sorted.begin(), sorted.end());
+
+        auto count = [&](uint64_t value) {
+            return std::to_string(static_cast<uint64_t>(value * sample_scale + 0.5));
+        };
+        auto millis = [](double ns) {
+            char text[32];
+            snprintf(text, sizeof(text), "%.3f", ns / 1e6);
+            return std::string(text);
+        };
 
-    std::vector<uint8_t> buffer(size);
-    input.read(reinterpret_cast<char*>(buffer.data()), size);
+        std::vector<std::vector<std::string>> rows = {
+                {"Lock #",
+                 "Locked",
+                 "Changed",
+                 "Cont.",
+                 "cont.Time[ms]",
+                 "spin.Time[ms]",
+                 "tot.Time[ms]",
+                 "avg.Time[ms]",
+                 "Flags"}};
+        uint64_t blocked_ns = 0;
+        uint64_t spin_ns = 0;
+        for (size_t i = 0; i < sorted.size(); i++) {
+            const LockStats& stats = *sorted[i].second;
+            if (stats.locked_count == 0) continue;
+            blocked_ns += stats.contention_time_ns;
+            spin_ns += stats.spin_time_ns;
+            rows.push_back({
+                    std::to_string(i),
+                    count(stats.locked_count),
+                    count(stats.changes),
+                    count(stats.contentions),
+                    millis(stats.contention_time_ns * sample_scale),
+                    millis(stats.spin_time_ns * sample_scale),
+                    millis(stats.total_time_ns * sample_scale),
+                    millis(static_cast<double>(stats.total_time_ns) / stats.locked_count),
+                    std::string(stats.is_spin ? "S" : stats.is_mutex ? "M" : "W") + "----.",
+            });
+        }
+
+        std::cout << "Lock Analysis Summary\n";
+        printTable(rows, true);
+        std::cout << "M = Mutex, W = RWLock, S = Spinlock; spin.Time = contended waits spent spinning "
+                     "on the CPU\n"
+                  << "Contended: " << millis(blocked_ns * sample_scale) << " ms blocked, "
+                  << millis(spin_ns * sample_scale) << " ms spinning\n";
 
-    VarIntReader reader(std::move(buffer));
-    uint64_t first_timestamp = 0;
+        // Percentiles are of the trace's own samples, so need no scaling.
+        auto micros = [](const skeleton_key::LatencyHistogram& histogram, double percent, uint64_t max) {
+            char text[32];
+            snprintf(text, sizeof(text), "%.3f", std::min(histogram.percentile(percent), max) / 1e3);
+            return std::string(text);
+        };
+        rows = {{"Lock #",
+                 "wait p50[us]",
+                 "p99[us]",
+                 "p99.9[us]",
+                 "hold p50[us]",
+                 "p99[us]",
+                 "p99.9[us]"}};
+        for (size_t i = 0; i < sorted.size(); i++) {
+            const LockStats& stats = *sorted[i].second;
+            if (stats.locked_count == 0) continue;
+            rows.push_back({
+                    std::to_string(i),
+                    micros(stats.wait_histogram, 50, stats.max_wait_ns),
+                    micros(stats.wait_histogram, 99, stats.max_wait_ns),
+                    micros(stats.wait_histogram, 99.9, stats.max_wait_ns),
+                    micros(stats.hold_histogram, 50, stats.max_hold_ns),
+                    micros(stats.hold_histogram, 99, stats.max_hold_ns),
+                    micros(stats.hold_histogram, 99.9, stats.max_hold_ns),
+            });
+        }
+        std::cout << "\nLatency Percentiles (contended waits, all holds)\n";
+        printTable(rows, false);
 
-    // Process events
-    while (!reader.eof()) {
-        uint64_t timestamp = reader.readVarInt();
-        if (first_timestamp == 0) first_timestamp = timestamp;
-        uint32_t tid = reader.readVarInt();
-        EventType type = reader.readEventType();
-        void* ptr1 = reader.readPtr();
-        void* ptr2 = reader.readPtr();
-        int32_t result = reader.readVarInt();
-        uint64_t duration = reader.readVarInt();
-        auto stack = reader.readStack();
+        rows = {{"Lock #",
+                 "Reads",
+                 "Writes",
+                 "Batches",
+                 "avg.Batch",
+                 "max.Readers",
+                 "wr.Wait[ms]",
+                 "wr.Starved[ms]"}};
+        for (size_t i = 0; i < sorted.size(); i++) {
+            const LockStats& stats = *sorted[i].second;
+            if (stats.is_mutex || stats.locked_count == 0) continue;
+            char batch[32];
+            double reads = static_cast<double>(stats.read_count);
+            snprintf(batch, sizeof(batch), "%.2f", reads / std::max<uint64_t>(stats.reader_batches, 1));
+            rows.push_back({
+                    std::to_string(i),
+                    count(stats.read_count),
+                    count(stats.locked_count - stats.read_count),
+                    count(stats.reader_batches),
+                    batch,
+                    std::to_string(stats.max_readers),
+                    millis(stats.write_wait_ns * sample_scale),
+                    millis(stats.writer_starvation_ns * sample_scale),
+            });
+        }
+        if (rows.size() > 1) {
+            std::cout << "\nRWLock Readers and Writers\n";
+            printTable(rows, false);
+            std::cout << "avg.Batch = reads per stretch of shared holding; near 1, a mutex would do\n"
+                         "wr.Starved = writer wait time spent while readers held the lock\n";
+        }
 
-        // Print event details
-        std::cout << std::fixed << std::setprecision(6) << (timestamp - first_timestamp) / 1e9 << " "
-                  << "tid=" << tid << " " << std::setw(20) << std::left << eventTypeToString(type) << " "
-                  << "ptr=" << ptr1;
+        rows = {{"Lock #",
+                 "Waits",
+                 "Signals",
+                 "Bcasts",
+                 "Empty",
+                 "Timeouts",
+                 "Unsignaled",
+                 "wake p50[us]",
+                 "p99[us]",
+                 "max[us]"}};
+        for (size_t i = 0; i < sorted.size(); i++) {
+            auto it = conds_.find(sorted[i].first);
+            if (it == conds_.end()) continue;
+            const CondStats& stats = it->second;
+            rows.push_back({
+                    std::to_string(i),
+                    count(stats.waits),
+                    count(stats.signals),
+                    count(stats.broadcasts),
+                    count(stats.empty_signals),
+                    count(stats.timeouts),
+                    count(stats.unsignaled),
+                    micros(stats.wakeup_histogram, 50, stats.max_wakeup_ns),
+                    micros(stats.wakeup_histogram, 99, stats.max_wakeup_ns),
+                    micros(stats.wakeup_histogram, 100, stats.max_wakeup_ns),
+            });
+        }
+        if (rows.size() > 1) {
+            std::cout << "\nCondition Variables\n";
+            printTable(rows, false);
+            std::cout << "Empty = signals that found no waiter; wake = from signal until the wait "
+                         "returned with the mutex\n";
+        }
 
-        if (ptr2) {
-            std::cout << " aux_ptr=" << ptr2;
+        rows = {{"Lock #",
+                 "Waits",
+                 "Failed",
+                 "Posts",
+                 "wait.Time[ms]",
+                 "wait p50[us]",
+                 "p99[us]",
+                 "max[us]"}};
+        for (size_t i = 0; i < sorted.size(); i++) {
+            auto it = sems_.find(sorted[i].first);
+            if (it == sems_.end()) continue;
+            const SemStats& stats = it->second;
+            rows.push_back({
+                    std::to_string(i),
+                    count(stats.waits),
+                    count(stats.failed),
+                    count(stats.posts),
+                    millis(stats.wait_ns * sample_scale),
+                    micros(stats.wait_histogram, 50, stats.max_wait_ns),
+                    micros(stats.wait_histogram, 99, stats.max_wait_ns),
+                    micros(stats.wait_histogram, 100, stats.max_wait_ns),
+            });
+        }
+        if (rows.size() > 1) {
+            std::cout << "\nSemaphores\n";
+            printTable(rows, false);
+            std::cout << "Failed = waits that timed out, were interrupted or found the count at zero\n";
         }
 
-        if (duration > 0) {
-            std::cout << " duration=" << duration / 1e9 << "s";
+        rows = {{"Lock #", "Waits", "Rounds", "wait.Time[ms]", "wait p50[us]", "p99[us]", "max[us]"}};
+        for (size_t i = 0; i < sorted.size(); i++) {
+            auto it = barriers_.find(sorted[i].first);
+            if (it == barriers_.end()) continue;
+            const BarrierStats& stats = it->second;
+            rows.push_back({
+                    std::to_string(i),
+                    count(stats.waits),
+                    count(stats.rounds),
+                    millis(stats.wait_ns * sample_scale),
+                    micros(stats.wait_histogram, 50, stats.max_wait_ns),
+                    micros(stats.wait_histogram, 99, stats.max_wait_ns),
+                    micros(stats.wait_histogram, 100, stats.max_wait_ns),
+            });
         }
+        if (rows.size() > 1) {
+            std::cout << "\nBarriers\n";
+            printTable(rows, false);
+            std::cout << "wait = from arriving at the barrier until the round completed\n";
+        }
+    }
 
-        if (result != 0) {
-            std::cout << " result=" << result;
+  private:
+    // Prints rows[0] as the header of an aligned table. `flags_last` left
+    // aligns the last column; the rest are right aligned.
+    static void printTable(const std::vector<std::vector<std::string>>& rows, bool flags_last)
+    {
+        std::vector<size_t> widths(rows[0].size());
+        for (const auto& row : rows) {
+            for (size_t column = 0; column < row.size(); column++) {
+                widths[column] = std::max(widths[column], row[column].size());
+            }
         }
 
-        std::cout << "\nStack trace:\n";
-        for (void* addr : stack) {
-            std::cout << "  " << (void*)addr << "\n";
+        for (size_t r = 0; r < rows.size(); r++) {
+            for (size_t column = 0; column < rows[r].size(); column++) {
+                if (flags_last && column + 1 == rows[r].size()) {
+                    std::cout << " " << rows[r][column];
+                } else {
+                    std::cout << (column ? " " : "") << std::right << std::setw(widths[column])
+                              << rows[r][column];
+                }
+            }
+            std::cout << "\n";
+            if (r == 0) {
+                size_t total = widths.size() - 1;
+                for (size_t width : widths) total += width;
+                std::cout << std::string(total, '-') << "\n";
+            }
         }
+    }
+};
+
+// The process of each trace when several are analyzed together, by trace
+// position; empty for a single trace.
+static std::vector<std::string> processes;
+
+// A lock address as its process had it, followed by that process when the
+// traces of several are merged.
+static std::string
+formatAddress(const void* address)
+{
+    std::ostringstream text;
+    text << skeleton_key::untagged(address);
+    if (address && !processes.empty()) {
+        text << " (" << processes[skeleton_key::traceIndex(address)] << ")";
+    }
+    return text.str();
+}
+
+// One frame of a stack: the raw address, then its symbol when the trace
+// lists the module it belongs to.
+static void
+printFrame(const char* indent, void* address, Symbolizer& symbolizer)
+{
+    std::cout << indent << skeleton_key::untagged(address);
+    const std::string& symbol = symbolizer.symbolize(address);
+    if (!symbol.empty()) std::cout << " " << symbol;
+    std::cout << "\n";
+}
+
+static void
+printEvent(const DecodedEvent& event,
+           uint64_t first_timestamp,
+           const StackStore& stacks,
+           Symbolizer& symbolizer)
+{
+    std::cout << std::fixed << std::setprecision(6) << (event.timestamp - first_timestamp) / 1e9
+              << " "
+              << "tid=" << event.tid << " " << std::setw(20) << std::left
+              << eventTypeToString(event.type) << " "
+              << "ptr=" << formatAddress(event.ptr1);
+
+    if (event.ptr2) {
+        std::cout << " aux_ptr=" << formatAddress(event.ptr2);
+    }
+
+    if (event.duration > 0) {
+        std::cout << " duration=" << event.duration / 1e9 << "s";
+    }
+
+    if (event.result != 0) {
+        std::cout << " result=" << event.result;
+    }
+
+    std::cout << "\nStack trace:\n";
+    for (void* addr : stacks.frames(event.stack)) printFrame("  ", addr, symbolizer);
+    std::cout << "\n";
+}
+
+static void
+printStack(const char* title, uint32_t stack, const StackStore& stacks, Symbolizer& symbolizer)
+{
+    std::cout << "    " << title << ":\n";
+    const std::vector<void*>& frames = stacks.frames(stack);
+    if (frames.empty()) std::cout << "      (no stack)\n";
+    for (void* addr : frames) printFrame("      ", addr, symbolizer);
+}
+
+// Reports at most this many cycles and deadlocks of each kind.
+static constexpr size_t MAX_DEADLOCK_REPORTS = 20;
+
+static void
+printDeadlocks(const LockOrderAnalyzer& analyzer,
+               uint64_t first_timestamp,
+               const StackStore& stacks,
+               Symbolizer& symbolizer)
+{
+    auto seconds = [&](uint64_t timestamp) {
+        char text[32];
+        snprintf(text, sizeof(text), "%.6fs", (timestamp - first_timestamp) / 1e9);
+        return std::string(text);
+    };
+
+    const auto& potential = analyzer.potentialDeadlocks();
+    const auto& deadlocks = analyzer.deadlocks();
+    std::cout << "Lock order: " << analyzer.lockCount() << " locks, " << analyzer.edgeCount()
+              << " orderings, " << potential.size() << " potential deadlocks, " << deadlocks.size()
+              << " deadlocks\n";
+
+    for (size_t i = 0; i < std::min(potential.size(), MAX_DEADLOCK_REPORTS); i++) {
+        const auto& cycle = potential[i];
+        std::cout << "\nPotential deadlock #" << i + 1 << ":";
+        for (const auto& edge : cycle.edges) {
+            std::cout << " " << formatAddress(analyzer.address(edge.from)) << " ->";
+        }
+        std::cout << " " << formatAddress(analyzer.address(cycle.edges.front().from)) << "\n";
+        for (const auto& edge : cycle.edges) {
+            std::cout << "  tid=" << edge.tid << " took " << formatAddress(analyzer.address(edge.to))
+                      << " holding " << formatAddress(analyzer.address(edge.from)) << " at "
+                      << seconds(edge.timestamp) << "\n";
+            printStack("held since", edge.held_stack, stacks, symbolizer);
+            printStack("acquired at", edge.acquire_stack, stacks, symbolizer);
+        }
+    }
+
+    for (size_t i = 0; i < std::min(deadlocks.size(), MAX_DEADLOCK_REPORTS); i++) {
+        const auto& deadlock = deadlocks[i];
+        std::cout << "\nDeadlock #" << i + 1 << " at " << seconds(deadlock.timestamp) << ":\n";
+        for (size_t w = 0; w < deadlock.waits.size(); w++) {
+            const auto& wait = deadlock.waits[w];
+            uint32_t owner = deadlock.waits[(w + 1) % deadlock.waits.size()].tid;
+            std::cout << "  tid=" << wait.tid << " waits for "
+                      << formatAddress(analyzer.address(wait.lock)) << " held by tid=" << owner << "\n";
+            printStack("waiting at", wait.stack, stacks, symbolizer);
+        }
+    }
+
+    size_t omitted = potential.size() + deadlocks.size()
+                     - std::min(potential.size(), MAX_DEADLOCK_REPORTS)
+                     - std::min(deadlocks.size(), MAX_DEADLOCK_REPORTS);
+    if (omitted) std::cout << "\n(" << omitted << " more not shown)\n";
+}
+
+// Critical sections shown by --blocking.
+static constexpr size_t MAX_BLOCKING_REPORTS = 10;
+
+static void
+printBlocking(const BlockingAnalyzer& analyzer,
+              double sample_scale,
+              const StackStore& stacks,
+              Symbolizer& symbolizer)
+{
+    auto millis = [&](uint64_t ns) {
+        char text[32];
+        snprintf(text, sizeof(text), "%.3f", ns * sample_scale / 1e6);
+        return std::string(text);
+    };
+
+    std::cout << "Blocking: " << analyzer.contendedWaits() << " contended waits, "
+              << millis(analyzer.blockedNs()) << " ms blocked behind a holder, "
+              << millis(analyzer.spinNs()) << " ms spinning behind one, " << millis(analyzer.handoffNs())
+              << " ms in hand-off\n";
+    std::vector<const BlockingAnalyzer::Section*> ranked = analyzer.ranking();
+    for (size_t i = 0; i < std::min(ranked.size(), MAX_BLOCKING_REPORTS); i++) {
+        const BlockingAnalyzer::Section& section = *ranked[i];
+        std::cout << "\n#" << i + 1 << " lock " << formatAddress(section.lock) << ": blocked others "
+                  << millis(section.root_ns) << " ms at the root of their chain, "
+                  << millis(section.direct_ns) << " ms directly, " << section.waits << " waits over "
+                  << section.holds << " holds\n";
+        printStack("acquired at", section.stack, stacks, symbolizer);
+    }
+    if (ranked.size() > MAX_BLOCKING_REPORTS) {
+        std::cout << "\n(" << ranked.size() - MAX_BLOCKING_REPORTS << " more sections not shown)\n";
+    }
+}
+
+// How far a live stream's events may arrive out of order before they are
+// counted late. Chunks reach the stream at most about 100 ms after their
+// first event, plus the drainer's own flush interval.
+static constexpr uint64_t REORDER_WINDOW_NS = 1000 * 1000 * 1000;
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void
+onInterrupt(int)
+{
+    interrupted = 1;
+}
+
+// Accept one tracer connection on a Unix socket at `path`.
+static int
+acceptStream(const char* path)
+{
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path too long: " << path << "\n";
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(path);
+    auto* generic = reinterpret_cast<struct sockaddr*>(&address);
+    if (listener < 0 || bind(listener, generic, sizeof(address)) != 0 || listen(listener, 1) != 0) {
+        std::cerr << "Cannot listen on " << path << ": " << strerror(errno) << "\n";
+        if (listener >= 0) close(listener);
+        return -1;
+    }
+    std::cerr << "Waiting for a tracer on " << path << "\n";
+    int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0 && errno != EINTR) std::cerr << "accept: " << strerror(errno) << "\n";
+    close(listener);
+    unlink(path);
+    return fd;
+}
+
+// Send one command to the control socket of a traced process and print
+// its reply.
+static int
+sendControl(const char* path, const std::string& command)
+{
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path too long: " << path << "\n";
+        return 1;
+    }
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0) {
+        std::cerr << "Cannot connect to " << path << ": " << strerror(errno) << "\n";
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    std::string line = command + "\n";
+    if (send(fd, line.data(), line.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(line.size())) {
+        std::cerr << "Cannot send to " << path << ": " << strerror(errno) << "\n";
+        close(fd);
+        return 1;
+    }
+    std::string reply;
+    char buffer[4096];
+    ssize_t received;
+    while ((received = recv(fd, buffer, sizeof(buffer), 0)) > 0) reply.append(buffer, received);
+    close(fd);
+    std::cout << reply;
+    return reply.compare(0, 2, "ok") == 0 ? 0 : 1;
+}
+
+// Analyze a trace as it is produced: from a socket until the tracer
+// disconnects, or from a file until interrupted. Memory stays bounded by
+// the reorder window plus one chunk; the lock table is reprinted every
+// `interval_ms`.
+static int
+analyzeLive(int fd, bool follow, unsigned interval_ms)
+{
+    using Clock = std::chrono::steady_clock;
+
+    skeleton_key::TraceStream stream;
+    skeleton_key::ReorderBuffer reorder(REORDER_WINDOW_NS);
+    StackStore scratch;
+    LockAnalyzer analyzer;
+    uint64_t event_count = 0;
+    auto process = [&](const DecodedEvent& event) {
+        analyzer.setSampled(stream.hasHeader() && stream.header().sampleScale() != 1);
+        analyzer.process(event);
+        event_count++;
+    };
+    auto report = [&](const char* when) {
+        double scale = stream.hasHeader() ? stream.header().sampleScale() : 1;
+        std::cout << "\n[" << when << "] " << event_count << " events";
+        if (reorder.late()) std::cout << ", " << reorder.late() << " arrived late";
+        if (scale != 1) std::cout << ", counts and totals scaled by " << scale;
         std::cout << "\n";
+        analyzer.print(scale);
+        std::cout << std::flush;
+    };
+
+    std::vector<uint8_t> buffer(1 << 16);
+    auto next_report = Clock::now() + std::chrono::milliseconds(interval_ms);
+    bool ok = true;
+    while (!interrupted) {
+        auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(next_report - Clock::now());
+        struct pollfd readable = {fd, POLLIN, 0};
+        int ready = poll(&readable, 1, std::max<int>(timeout.count(), 0));
+        if (ready > 0) {
+            ssize_t size = read(fd, buffer.data(), buffer.size());
+            if (size < 0 && errno != EINTR) {
+                std::cerr << "read: " << strerror(errno) << "\n";
+                break;
+            }
+            if (size == 0) {
+                if (!follow) break;
+                // The end of a file that is still being written.
+                usleep(50 * 1000);
+            }
+            if (size > 0) {
+                auto decode = [&](const ChunkRef& chunk, const uint8_t* payload) {
+                    skeleton_key::ChunkDecoder decoder(payload, chunk, stream.clock(), scratch);
+                    DecodedEvent event;
+                    while (decoder.next(event)) reorder.push(event, process);
+                    scratch.clear();
+                };
+                ok = stream.feed(buffer.data(), size, decode);
+                if (!ok) {
+                    std::cerr << "Not a version 2 trace stream, or corrupt\n";
+                    break;
+                }
+            }
+        }
+        if (Clock::now() >= next_report) {
+            report("live");
+            next_report += std::chrono::milliseconds(interval_ms);
+        }
+    }
+    reorder.flush(process);
+    report("final");
+    close(fd);
+    return ok ? 0 : 1;
+}
+
+int
+main(int argc, char** argv)
+{
+    bool events = false;
+    bool deadlocks = false;
+    bool blocking = false;
+    bool follow = false;
+    const char* socket_path = nullptr;
+    const char* columns_path = nullptr;
+    const char* control_path = nullptr;
+    std::string command;
+    unsigned interval_ms = 1000;
+    unsigned jobs = std::max(std::thread::hardware_concurrency(), 1u);
+    std::vector<const char*> filenames;
+    bool bad_option = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--events") == 0) {
+            events = true;
+        } else if (strcmp(argv[i], "--deadlocks") == 0) {
+            deadlocks = true;
+        } else if (strcmp(argv[i], "--blocking") == 0) {
+            blocking = true;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            jobs = std::max(atoi(argv[++i]), 1);
+        } else if (strcmp(argv[i], "--follow") == 0) {
+            follow = true;
+        } else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--export-columns") == 0 && i + 1 < argc) {
+            columns_path = argv[++i];
+        } else if (strcmp(argv[i], "--control") == 0 && i + 2 < argc) {
+            // Everything after the socket is the command.
+            control_path = argv[++i];
+            while (++i < argc) command += std::string(command.empty() ? "" : " ") + argv[i];
+        } else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+            interval_ms = std::max(atoi(argv[++i]), 1);
+        } else if (argv[i][0] != '-') {
+            filenames.push_back(argv[i]);
+        } else {
+            bad_option = true;
+            break;
+        }
+    }
+    if (control_path) return sendControl(control_path, command);
+    bool live = socket_path || follow;
+    bool valid = !bad_option && !filenames.empty();
+    // A live trace is read as it grows, one at a time.
+    if (follow) valid = valid && filenames.size() == 1;
+    if (socket_path) valid = !bad_option && filenames.empty() && !follow;
+    if (events + deadlocks + blocking + (columns_path != nullptr) + live > 1) valid = false;
+    if (!valid) {
+        std::cerr << "Usage: " << argv[0] << " [-j THREADS] <trace file>...\n"
+                  << "       " << argv[0] << " --events | --deadlocks | --blocking <trace file>...\n"
+                  << "       " << argv[0] << " --export-columns OUTPUT <trace file>...\n"
+                  << "       " << argv[0] << " --listen SOCKET [--interval MS]\n"
+                  << "       " << argv[0] << " --follow <trace file> [--interval MS]\n"
+                  << "       " << argv[0] << " --control SOCKET COMMAND...\n";
+        return 1;
+    }
+
+    if (live) {
+        struct sigaction action = {};
+        action.sa_handler = onInterrupt;
+        sigaction(SIGINT, &action, nullptr);
+        sigaction(SIGTERM, &action, nullptr);
+        int fd = socket_path ? acceptStream(socket_path) : open(filenames[0], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            if (!socket_path) std::cerr << "Failed to open " << filenames[0] << "\n";
+            return 1;
+        }
+        return analyzeLive(fd, follow, interval_ms);
+    }
+
+    // Several traces, e.g. a process's and its children's, are analyzed as
+    // one, with the addresses of all but the first tagged by traceTag().
+    // Headerless files are left out of the merge: version 1 traces can only
+    // be analyzed alone, and an empty one has nothing to add.
+    std::vector<std::unique_ptr<TraceFile>> files;
+    std::vector<const TraceFile*> trace;
+    std::vector<const char*> merged;
+    for (const char* filename : filenames) {
+        auto file = std::make_unique<TraceFile>();
+        if (!file->open(filename)) {
+            std::cerr << "Failed to open " << filename << "\n";
+            return 1;
+        }
+        if (filenames.size() > 1 && file->version() < 2) {
+            const char* reason =
+                    file->size() == 0 ? "empty trace" : "version 1 traces can only be analyzed alone";
+            std::cerr << filename << ": " << reason << ", skipped\n";
+            continue;
+        }
+        trace.push_back(file.get());
+        files.push_back(std::move(file));
+        merged.push_back(filename);
+    }
+    if (trace.empty()) {
+        std::cerr << "No trace to analyze\n";
+        return 1;
+    }
+    filenames = merged;
+    if (trace.size() > 1) {
+        for (size_t i = 0; i < trace.size(); i++) {
+            processes.push_back(trace[i]->hasHeader()
+                                        ? "pid " + std::to_string(trace[i]->header().pid)
+                                        : std::string(filenames[i]));
+        }
+    }
+
+    auto scaleOf = [](const TraceFile* file) {
+        return file->hasHeader() ? file->header().sampleScale() : 1;
+    };
+    double sample_scale = scaleOf(trace[0]);
+    for (size_t i = 1; i < trace.size(); i++) {
+        if (scaleOf(trace[i]) != sample_scale) {
+            std::cerr << filenames[i] << " was sampled differently from " << filenames[0]
+                      << "; scaling by " << filenames[0] << "'s rate\n";
+        }
+    }
+    StackStore stacks;
+
+    if (columns_path) {
+        skeleton_key::ColumnarBuilder columns;
+        skeleton_key::forEachEvent(
+                trace, stacks, [&](const DecodedEvent& event) { columns.add(event); });
+        if (!columns.write(columns_path)) {
+            std::cerr << "Failed to write " << columns_path << ": " << strerror(errno) << "\n";
+            return 1;
+        }
+        std::cerr << "Wrote " << columns.rowCount() << " rows for " << columns.lockCount()
+                  << " locks to " << columns_path << "\n";
+        return 0;
     }
 
+    if (deadlocks) {
+        if (sample_scale != 1) {
+            std::cerr << "Sampled trace: the lock order only covers the sampled operations\n";
+        }
+        LockOrderAnalyzer analyzer;
+        bool first = true;
+        uint64_t first_timestamp = 0;
+        skeleton_key::forEachEvent(trace, stacks, [&](const DecodedEvent& event) {
+            if (first) {
+                first_timestamp = event.timestamp;
+                first = false;
+            }
+            analyzer.process(event);
+        });
+        Symbolizer symbolizer(skeleton_key::readModules(trace));
+        printDeadlocks(analyzer, first_timestamp, stacks, symbolizer);
+        return 0;
+    }
+
+    if (blocking) {
+        if (sample_scale != 1) {
+            std::cerr << "Sampled trace: unsampled holders are missing, times are scaled by "
+                      << sample_scale << "\n";
+        }
+        BlockingAnalyzer analyzer;
+        skeleton_key::forEachEvent(
+                trace, stacks, [&](const DecodedEvent& event) { analyzer.process(event); });
+        Symbolizer symbolizer(skeleton_key::readModules(trace));
+        printBlocking(analyzer, sample_scale, stacks, symbolizer);
+        return 0;
+    }
+
+    if (events) {
+        if (sample_scale != 1) {
+            std::cerr << "Sampled trace: multiply counts and totals by " << sample_scale << "\n";
+        }
+        Symbolizer symbolizer(skeleton_key::readModules(trace));
+        bool first = true;
+        uint64_t first_timestamp = 0;
+        skeleton_key::forEachEvent(trace, stacks, [&](const DecodedEvent& event) {
+            if (first) {
+                first_timestamp = event.timestamp;
+                first = false;
+            }
+            printEvent(event, first_timestamp, stacks, symbolizer);
+        });
+        return 0;
+    }
+
+    // One analyzer per thread, each owning a share of the locks.
+    std::vector<LockAnalyzer> analyzers;
+    analyzers.reserve(jobs);
+    for (unsigned i = 0; i < jobs; i++) {
+        analyzers.emplace_back(i, jobs);
+        analyzers.back().setSampled(sample_scale != 1);
+    }
+    skeleton_key::forEachEventSharded(
+            trace,
+            jobs,
+            [&](const DecodedEvent& event) { return LockAnalyzer::shardsOf(event, jobs); },
+            [&](unsigned shard, const DecodedEvent& event) { analyzers[shard].process(event); });
+    LockAnalyzer& analyzer = analyzers[0];
+    for (unsigned i = 1; i < jobs; i++) analyzer.merge(std::move(analyzers[i]));
+    if (sample_scale != 1) {
+        std::cout << "Sampled trace: counts and totals are scaled by " << sample_scale << "\n";
+    }
+    analyzer.print(sample_scale);
     return 0;
 }
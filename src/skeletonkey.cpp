@@ -1,139 +1,3793 @@
+#include <algorithm>
+#include <arpa/inet.h>
 #include <array>
 #include <atomic>
 #include <chrono>
+#include <cerrno>
+#include <cctype>
+#include <cinttypes>
+#include <climits>
+#include <cmath>
+#include <csignal>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <dlfcn.h>
 #include <execinfo.h>
-#include <fstream>
-#include <mutex>
+#include <fcntl.h>
+#include <link.h>
+#include <linux/futex.h>
+#include <netinet/in.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
+#include <sys/un.h>
+#include <tuple>
 #include <unistd.h>
 #include <vector>
 
+#if defined(__x86_64__) || defined(__i386__)
+#    include <cpuid.h>
+#    include <x86intrin.h>
+#endif
+
+#ifdef SKELETON_KEY_HAVE_LIBUNWIND
+#    define UNW_LOCAL_ONLY
+#    include <libunwind.h>
+#endif
+
+#include "compression.h"
+#include "elf_symbols.h"
+#include "histogram.h"
+#include "trace_format.h"
+
+namespace skeleton_key {
+
+// A pthread function the hooks forward to. It is looked up on first use
+// rather than in the library constructor, so that a lock taken before the
+// constructor runs, by another library's constructor say, still reaches it.
+// Threads racing to look it up find the same address, so publishing it with
+// a relaxed store is enough. The constructor is constexpr, so the pointer is
+// null from the moment the library is mapped.
+template<typename Signature>
+class RealFunction;
+
+template<typename Result, typename... Args>
+class RealFunction<Result(Args...)>
+{
+    using Function = Result (*)(Args...);
+
+    const char* name_;
+    // Symbol version to look for first, for symbols glibc keeps old
+    // versions of around.
+    const char* version_;
+    std::atomic<Function> function_{nullptr};
+
+    __attribute__((noinline)) Function resolve()
+    {
+        void* symbol = version_ ? dlvsym(RTLD_NEXT, name_, version_) : nullptr;
+        if (symbol == nullptr) symbol = dlsym(RTLD_NEXT, name_);
+        if (symbol == nullptr) {
+            fprintf(stderr, "skeleton_key: cannot find %s\n", name_);
+            abort();
+        }
+        Function function = reinterpret_cast<Function>(symbol);
+        function_.store(function, std::memory_order_relaxed);
+        return function;
+    }
+
+  public:
+    constexpr explicit RealFunction(const char* name, const char* version = nullptr)
+    : name_(name)
+    , version_(version)
+    {
+    }
+
+    Result operator()(Args... args)
+    {
+        Function function = function_.load(std::memory_order_relaxed);
+        if (__builtin_expect(function == nullptr, 0)) function = resolve();
+        return function(args...);
+    }
+};
+
+}  // namespace skeleton_key
+
+using skeleton_key::RealFunction;
+
+static RealFunction<int(pthread_mutex_t*, const pthread_mutexattr_t*)> real_pthread_mutex_init{
+        "pthread_mutex_init"};
+static RealFunction<int(pthread_mutex_t*)> real_pthread_mutex_destroy{"pthread_mutex_destroy"};
+static RealFunction<int(pthread_mutex_t*)> real_pthread_mutex_lock{"pthread_mutex_lock"};
+static RealFunction<int(pthread_mutex_t*)> real_pthread_mutex_trylock{"pthread_mutex_trylock"};
+static RealFunction<int(pthread_mutex_t*, const struct timespec*)> real_pthread_mutex_timedlock{
+        "pthread_mutex_timedlock"};
+static RealFunction<int(pthread_mutex_t*)> real_pthread_mutex_unlock{"pthread_mutex_unlock"};
+// Ask for the current condition variable ABI rather than the compatibility
+// versions glibc also exports.
+static RealFunction<int(pthread_cond_t*, const pthread_condattr_t*)> real_pthread_cond_init{
+        "pthread_cond_init", "GLIBC_2.3.2"};
+static RealFunction<int(pthread_cond_t*)> real_pthread_cond_destroy{
+        "pthread_cond_destroy", "GLIBC_2.3.2"};
+static RealFunction<int(pthread_cond_t*)> real_pthread_cond_signal{"pthread_cond_signal", "GLIBC_2.3.2"};
+static RealFunction<int(pthread_cond_t*)> real_pthread_cond_broadcast{
+        "pthread_cond_broadcast", "GLIBC_2.3.2"};
+static RealFunction<int(pthread_cond_t*, pthread_mutex_t*)> real_pthread_cond_wait{
+        "pthread_cond_wait", "GLIBC_2.3.2"};
+static RealFunction<int(pthread_cond_t*, pthread_mutex_t*, const struct timespec*)>
+        real_pthread_cond_timedwait{"pthread_cond_timedwait", "GLIBC_2.3.2"};
+static RealFunction<int(pthread_t*, const pthread_attr_t*, void* (*)(void*), void*)> real_pthread_create{
+        "pthread_create"};
+static RealFunction<int(pthread_rwlock_t*, const pthread_rwlockattr_t*)> real_pthread_rwlock_init{
+        "pthread_rwlock_init"};
+static RealFunction<int(pthread_rwlock_t*)> real_pthread_rwlock_destroy{"pthread_rwlock_destroy"};
+static RealFunction<int(pthread_rwlock_t*)> real_pthread_rwlock_rdlock{"pthread_rwlock_rdlock"};
+static RealFunction<int(pthread_rwlock_t*)> real_pthread_rwlock_tryrdlock{"pthread_rwlock_tryrdlock"};
+static RealFunction<int(pthread_rwlock_t*, const struct timespec*)> real_pthread_rwlock_timedrdlock{
+        "pthread_rwlock_timedrdlock"};
+static RealFunction<int(pthread_rwlock_t*)> real_pthread_rwlock_wrlock{"pthread_rwlock_wrlock"};
+static RealFunction<int(pthread_rwlock_t*)> real_pthread_rwlock_trywrlock{"pthread_rwlock_trywrlock"};
+static RealFunction<int(pthread_rwlock_t*, const struct timespec*)> real_pthread_rwlock_timedwrlock{
+        "pthread_rwlock_timedwrlock"};
+static RealFunction<int(pthread_rwlock_t*)> real_pthread_rwlock_unlock{"pthread_rwlock_unlock"};
+static RealFunction<int(pthread_mutex_t*, clockid_t, const struct timespec*)>
+        real_pthread_mutex_clocklock{"pthread_mutex_clocklock"};
+static RealFunction<int(pthread_cond_t*, pthread_mutex_t*, clockid_t, const struct timespec*)>
+        real_pthread_cond_clockwait{"pthread_cond_clockwait"};
+static RealFunction<int(pthread_spinlock_t*, int)> real_pthread_spin_init{"pthread_spin_init"};
+static RealFunction<int(pthread_spinlock_t*)> real_pthread_spin_destroy{"pthread_spin_destroy"};
+static RealFunction<int(pthread_spinlock_t*)> real_pthread_spin_lock{"pthread_spin_lock"};
+static RealFunction<int(pthread_spinlock_t*)> real_pthread_spin_trylock{"pthread_spin_trylock"};
+static RealFunction<int(pthread_spinlock_t*)> real_pthread_spin_unlock{"pthread_spin_unlock"};
+static RealFunction<int(sem_t*, int, unsigned)> real_sem_init{"sem_init"};
+static RealFunction<int(sem_t*)> real_sem_destroy{"sem_destroy"};
+static RealFunction<int(sem_t*)> real_sem_wait{"sem_wait"};
+static RealFunction<int(sem_t*)> real_sem_trywait{"sem_trywait"};
+static RealFunction<int(sem_t*, const struct timespec*)> real_sem_timedwait{"sem_timedwait"};
+static RealFunction<int(sem_t*, clockid_t, const struct timespec*)> real_sem_clockwait{"sem_clockwait"};
+static RealFunction<int(sem_t*)> real_sem_post{"sem_post"};
+static RealFunction<int(pthread_barrier_t*, const pthread_barrierattr_t*, unsigned)>
+        real_pthread_barrier_init{"pthread_barrier_init"};
+static RealFunction<int(pthread_barrier_t*)> real_pthread_barrier_destroy{"pthread_barrier_destroy"};
+static RealFunction<int(pthread_barrier_t*)> real_pthread_barrier_wait{"pthread_barrier_wait"};
+
+// Thread-local to prevent recursion
+static thread_local bool in_hook = false;
+
 namespace skeleton_key {
 
-enum class EventType : uint8_t {
-    // Thread events
-    ThreadCreate,
-
-    // Mutex events
-    MutexInit,
-    MutexDestroy,
-    MutexLock,
-    MutexLockDone,
-    MutexTryLock,
-    MutexTryLockDone,
-    MutexTimedLock,
-    MutexTimedLockDone,
-    MutexUnlock,
-
-    // RWLock events
-    RWLockInit,
-    RWLockDestroy,
-    RWLockRead,
-    RWLockReadDone,
-    RWLockTryRead,
-    RWLockTryReadDone,
-    RWLockTimedRead,
-    RWLockTimedReadDone,
-    RWLockWrite,
-    RWLockWriteDone,
-    RWLockTryWrite,
-    RWLockTryWriteDone,
-    RWLockTimedWrite,
-    RWLockTimedWriteDone,
-    RWLockUnlock,
-
-    // Condition variable events
-    CondInit,
-    CondDestroy,
-    CondSignal,
-    CondBroadcast,
-    CondWait,
-    CondWaitDone,
-    CondTimedWait,
-    CondTimedWaitDone
+class Clock
+{
+  private:
+    static inline ClockSource source_ = ClockSource::Steady;
+
+    static uint64_t steadyNanos()
+    {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                             std::chrono::steady_clock::now().time_since_epoch())
+                                             .count());
+    }
+
+    static uint64_t readCounter()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        unsigned int aux;
+        return __rdtscp(&aux);
+#elif defined(__aarch64__)
+        uint64_t value;
+        asm volatile("isb; mrs %0, cntvct_el0" : "=r"(value));
+        return value;
+#else
+        return steadyNanos();
+#endif
+    }
+
+  public:
+    // Whether the counter ticks at a constant rate across cores and power
+    // states, which is what makes it usable as a clock.
+    static bool counterIsUsable()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        unsigned int eax, ebx, ecx, edx;
+        if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) return false;
+        return edx & (1u << 8);
+#elif defined(__aarch64__)
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    static void setSource(ClockSource source)
+    {
+        source_ = source;
+    }
+
+    static ClockSource source()
+    {
+        return source_;
+    }
+
+    static uint64_t now()
+    {
+        return source_ == ClockSource::Tsc ? readCounter() : steadyNanos();
+    }
+
+    static uint64_t nanos()
+    {
+        return steadyNanos();
+    }
+};
+
+static TraceHeader
+createTraceHeader(ClockSource clock)
+{
+    TraceHeader header = {};
+    memcpy(header.magic, TraceHeader::MAGIC, sizeof(TraceHeader::MAGIC));
+    header.version = TraceHeader::VERSION;
+    header.header_size = sizeof(TraceHeader);
+    header.clock = static_cast<uint32_t>(clock);
+    header.pid = static_cast<uint32_t>(getpid());
+    header.base_ns = Clock::nanos();
+    header.base_ticks = Clock::now();
+    header.ticks_per_second = 1000000000;
+    return header;
+}
+
+// Measure the counter rate over everything since the header was created.
+// Only uses async-signal-safe calls.
+static void
+recalibrate(TraceHeader& header)
+{
+    if (header.clock != static_cast<uint32_t>(ClockSource::Tsc)) return;
+    uint64_t elapsed_ns = Clock::nanos() - header.base_ns;
+    uint64_t elapsed_ticks = Clock::now() - header.base_ticks;
+    if (elapsed_ns == 0) return;
+    header.ticks_per_second = static_cast<uint64_t>(
+            static_cast<unsigned __int128>(elapsed_ticks) * 1000000000 / elapsed_ns);
+}
+
+enum class UnwinderKind {
+    // glibc backtrace(), which goes through the libgcc unwinder.
+    Backtrace,
+    // Follows the saved frame pointer chain. Only complete for code built
+    // with -fno-omit-frame-pointer, but never takes a lock.
+    FramePointer,
+    // unw_backtrace() with per-thread caching of the unwind info.
+    LibUnwind,
+    None,
+};
+
+static constexpr size_t MAX_STACK_DEPTH = 64;
+
+// Lowest and highest address of the current thread's stack, looked up the
+// first time the frame pointer walker runs on it.
+static thread_local uintptr_t stack_low = 0;
+static thread_local uintptr_t stack_high = 0;
+
+class Unwinder
+{
+  private:
+    // Frames of the tracer itself that may sit on top of the captured stack.
+    static constexpr size_t MAX_OWN_FRAMES = 8;
+
+    static inline UnwinderKind kind_ = UnwinderKind::Backtrace;
+    static inline size_t depth_ = 16;
+    // Executable segment of this library, so that its frames can be left out.
+    static inline uintptr_t own_begin_ = 0;
+    static inline uintptr_t own_end_ = 0;
+
+    static int findOwnSegment(struct dl_phdr_info* info, size_t, void* data)
+    {
+        uintptr_t address = reinterpret_cast<uintptr_t>(data);
+        for (int i = 0; i < info->dlpi_phnum; i++) {
+            const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+            if (phdr.p_type != PT_LOAD || !(phdr.p_flags & PF_X)) continue;
+            uintptr_t begin = info->dlpi_addr + phdr.p_vaddr;
+            if (address >= begin && address < begin + phdr.p_memsz) {
+                own_begin_ = begin;
+                own_end_ = begin + phdr.p_memsz;
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    static bool threadStackBounds()
+    {
+        if (stack_high != 0) return true;
+        pthread_attr_t attr;
+        if (pthread_getattr_np(pthread_self(), &attr) != 0) return false;
+        void* base;
+        size_t size;
+        int result = pthread_attr_getstack(&attr, &base, &size);
+        pthread_attr_destroy(&attr);
+        if (result != 0) return false;
+        stack_low = reinterpret_cast<uintptr_t>(base);
+        stack_high = stack_low + size;
+        return true;
+    }
+
+    // Each frame record holds the caller's frame pointer followed by the
+    // return address, on both x86-64 and arm64. The walk stops at the first
+    // record that is not further up this thread's stack, so a binary without
+    // frame pointers yields a short stack rather than a bad read.
+    __attribute__((noinline)) static int walkFramePointers(void** frames, int max_depth)
+    {
+        if (!threadStackBounds()) return 0;
+        auto* frame = static_cast<uintptr_t*>(__builtin_frame_address(0));
+        int depth = 0;
+        while (depth < max_depth) {
+            uintptr_t address = reinterpret_cast<uintptr_t>(frame);
+            if (address < stack_low || address + 2 * sizeof(uintptr_t) > stack_high) break;
+            if (address % sizeof(uintptr_t) != 0) break;
+            uintptr_t return_address = frame[1];
+            if (return_address == 0) break;
+            frames[depth++] = reinterpret_cast<void*>(return_address);
+            auto* caller = reinterpret_cast<uintptr_t*>(frame[0]);
+            if (caller <= frame) break;
+            frame = caller;
+        }
+        return depth;
+    }
+
+    static int unwind(void** frames, int max_depth)
+    {
+        switch (kind_) {
+            case UnwinderKind::FramePointer:
+                return walkFramePointers(frames, max_depth);
+            case UnwinderKind::LibUnwind:
+#ifdef SKELETON_KEY_HAVE_LIBUNWIND
+                return unw_backtrace(frames, max_depth);
+#else
+                return 0;
+#endif
+            case UnwinderKind::Backtrace:
+                return backtrace(frames, max_depth);
+            case UnwinderKind::None:
+                break;
+        }
+        return 0;
+    }
+
+  public:
+    static bool available(UnwinderKind kind)
+    {
+#ifdef SKELETON_KEY_HAVE_LIBUNWIND
+        (void)kind;
+        return true;
+#else
+        return kind != UnwinderKind::LibUnwind;
+#endif
+    }
+
+    static void configure(UnwinderKind kind, size_t depth)
+    {
+        kind_ = kind;
+        depth_ = std::min(depth, MAX_STACK_DEPTH);
+        dl_iterate_phdr(findOwnSegment, reinterpret_cast<void*>(&Unwinder::configure));
+#ifdef SKELETON_KEY_HAVE_LIBUNWIND
+        if (kind == UnwinderKind::LibUnwind) {
+            unw_set_caching_policy(unw_local_addr_space, UNW_CACHE_PER_THREAD);
+        }
+#endif
+        // backtrace() loads libgcc_s on first use, which takes the loader
+        // lock and allocates; get that out of the way before any hook runs.
+        void* frames[MAX_OWN_FRAMES];
+        if (depth_ > 0) unwind(frames, MAX_OWN_FRAMES);
+    }
+
+    // Capture up to the configured depth of the caller's stack into
+    // `frames`, which needs MAX_STACK_DEPTH entries, leaving out the
+    // tracer's own frames.
+    static int capture(void** frames)
+    {
+        if (depth_ == 0) return 0;
+        void* raw[MAX_STACK_DEPTH + MAX_OWN_FRAMES];
+        int depth = unwind(raw, static_cast<int>(depth_ + MAX_OWN_FRAMES));
+        int skip = 0;
+        while (skip < depth) {
+            uintptr_t address = reinterpret_cast<uintptr_t>(raw[skip]);
+            if (address < own_begin_ || address >= own_end_) break;
+            skip++;
+        }
+        depth = std::min(depth - skip, static_cast<int>(depth_));
+        memcpy(frames, raw + skip, depth * sizeof(void*));
+        return depth;
+    }
+};
+
+enum class SampleMode {
+    // Exactly every Nth operation of a thread.
+    Every,
+    // Each operation with probability 1/N, independently.
+    Random,
+};
+
+static thread_local int64_t sample_countdown = 0;
+static thread_local uint64_t sample_random_state = 0;
+// Locks this thread holds whose acquisition was traced. While sampling only
+// their release is traced, so that every traced acquisition has its unlock.
+// They are kept even when everything is traced, so that switching sampling
+// on or off at runtime loses no unlocks and leaves no stale entries.
+static constexpr size_t MAX_SAMPLED_LOCKS = 64;
+static thread_local std::array<void*, MAX_SAMPLED_LOCKS> sampled_locks;
+static thread_local size_t sampled_lock_count = 0;
+
+// Picks the operations that get traced. The decision is a thread-local
+// countdown, so a skipped operation costs a decrement and a branch on top of
+// the real call; the on/off window is a flag that the drainer flips. The
+// settings are atomics because the control socket can change them while
+// hooks are running. The held-lock list is also what keeps the unlocks of
+// acquisitions a LockFilter left out from being traced.
+class Sampler
+{
+  private:
+    static inline std::atomic<bool> active_{false};
+    static inline std::atomic<bool> filtered_{false};
+    static inline std::atomic<int64_t> period_{1};
+    static inline std::atomic<SampleMode> mode_{SampleMode::Every};
+    static inline std::atomic<uint64_t> on_ns_{0};
+    static inline std::atomic<uint64_t> off_ns_{0};
+    static inline std::atomic<uint64_t> window_start_ns_{0};
+    static inline std::atomic<bool> window_open_{true};
+
+    static int64_t nextGap()
+    {
+        int64_t period = period_.load(std::memory_order_relaxed);
+        if (mode_.load(std::memory_order_relaxed) == SampleMode::Every || period == 1) return period;
+        // Geometrically distributed gaps give every operation the same 1/N
+        // chance, so periodic behaviour in the program cannot alias with them.
+        uint64_t& x = sample_random_state;
+        if (x == 0) x = (reinterpret_cast<uintptr_t>(&sample_countdown) ^ Clock::nanos()) | 1;
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        double uniform = static_cast<double>(((x * 0x2545f4914f6cdd1dull) >> 11) + 1) * 0x1.0p-53;
+        return 1 + static_cast<int64_t>(std::log(uniform) / std::log1p(-1.0 / period));
+    }
+
+  public:
+    // Without both on_ms and off_ms there is no window. Threads pick up a
+    // new period after the gap they are counting down.
+    static void
+    configure(uint32_t period, SampleMode mode, uint32_t on_ms, uint32_t off_ms, uint64_t now_ns)
+    {
+        period_.store(period > 1 ? period : 1, std::memory_order_relaxed);
+        mode_.store(mode, std::memory_order_relaxed);
+        bool window = on_ms > 0 && off_ms > 0;
+        // on_ns_ goes last in and first out, so updateWindow() never sees
+        // it set without the rest.
+        on_ns_.store(0, std::memory_order_relaxed);
+        if (window) {
+            off_ns_.store(off_ms * 1000000ull, std::memory_order_relaxed);
+            window_start_ns_.store(now_ns, std::memory_order_relaxed);
+            on_ns_.store(on_ms * 1000000ull, std::memory_order_release);
+        } else {
+            window_open_.store(true, std::memory_order_relaxed);
+        }
+        active_.store(period > 1 || window || filtered_, std::memory_order_relaxed);
+    }
+
+    // Track held locks even without sampling, because not every
+    // acquisition is traced.
+    static void setFiltered(bool filtered)
+    {
+        filtered_.store(filtered, std::memory_order_relaxed);
+        if (filtered) active_.store(true, std::memory_order_relaxed);
+    }
+
+    // Whether to trace the operation about to start.
+    static bool sample()
+    {
+        if (!active_.load(std::memory_order_relaxed)) return true;
+        if (--sample_countdown > 0) return false;
+        sample_countdown = nextGap();
+        return window_open_.load(std::memory_order_relaxed);
+    }
+
+    // Whether an acquisition about to start may be traced. While sampling
+    // its unlock is only traced if the list has room to remember it.
+    static bool canAcquire()
+    {
+        return !active_.load(std::memory_order_relaxed) || sampled_lock_count < MAX_SAMPLED_LOCKS;
+    }
+
+    // Note a traced acquisition of `lock`.
+    static void acquired(void* lock)
+    {
+        if (sampled_lock_count < MAX_SAMPLED_LOCKS) sampled_locks[sampled_lock_count++] = lock;
+    }
+
+    // Whether to trace the release of `lock`.
+    static bool released(void* lock)
+    {
+        for (size_t i = sampled_lock_count; i-- > 0;) {
+            if (sampled_locks[i] != lock) continue;
+            sampled_locks[i] = sampled_locks[--sampled_lock_count];
+            return true;
+        }
+        return !active_.load(std::memory_order_relaxed);
+    }
+
+    // Open or close the window for `now_ns` and return how long until it
+    // next changes.
+    static uint64_t updateWindow(uint64_t now_ns)
+    {
+        uint64_t on_ns = on_ns_.load(std::memory_order_acquire);
+        if (on_ns == 0) return UINT64_MAX;
+        uint64_t off_ns = off_ns_.load(std::memory_order_relaxed);
+        uint64_t phase = (now_ns - window_start_ns_.load(std::memory_order_relaxed)) % (on_ns + off_ns);
+        bool open = phase < on_ns;
+        window_open_.store(open, std::memory_order_relaxed);
+        return open ? on_ns - phase : on_ns + off_ns - phase;
+    }
+};
+
+static constexpr size_t MAX_VARINT_SIZE = 10;
+// A stack definition record (type byte, id, depth and frames) followed by
+// the event itself (type byte and six varint fields).
+static constexpr size_t MAX_EVENT_SIZE = 2 + MAX_VARINT_SIZE * (2 + MAX_STACK_DEPTH + 6);
+
+// Process-wide set of stack hashes. A stack's id is the slot its hash landed
+// in, so every thread agrees on it without taking a lock. The frames are not
+// kept here: a thread that needs to define a stack in its chunk does so from
+// the frames it has just captured.
+class StackTable
+{
+  public:
+    static constexpr size_t CAPACITY = 1 << 16;
+    static constexpr size_t MAX_PROBES = 32;
+    static constexpr uint32_t NO_ID = UINT32_MAX;
+
+  private:
+    std::array<std::atomic<uint64_t>, CAPACITY> slots_{};
+
+  public:
+    static uint64_t hash(void* const* frames, int depth)
+    {
+        uint64_t hash = 0x9e3779b97f4a7c15ull ^ static_cast<uint64_t>(depth);
+        for (int i = 0; i < depth; i++) {
+            hash ^= reinterpret_cast<uint64_t>(frames[i]);
+            hash *= 0xff51afd7ed558ccdull;
+            hash ^= hash >> 32;
+        }
+        return hash ? hash : 1;
+    }
+
+    // Returns the id of the stack with this hash, or NO_ID once the table
+    // is too crowded around it.
+    uint32_t intern(uint64_t hash)
+    {
+        size_t index = hash & (CAPACITY - 1);
+        for (size_t probe = 0; probe < MAX_PROBES; probe++) {
+            std::atomic<uint64_t>& slot = slots_[index];
+            uint64_t current = slot.load(std::memory_order_relaxed);
+            if (current == 0 && slot.compare_exchange_strong(current, hash, std::memory_order_relaxed)) {
+                return static_cast<uint32_t>(index);
+            }
+            if (current == hash) return static_cast<uint32_t>(index);
+            index = (index + 1) & (CAPACITY - 1);
+        }
+        return NO_ID;
+    }
+};
+
+// Delta state of the chunk the current thread is appending to. It starts
+// over with every chunk so that chunks decode independently.
+struct StreamState
+{
+    static constexpr size_t DEFINED_CACHE_SIZE = 256;
+
+    ChunkHeader* chunk = nullptr;
+    uint64_t last_timestamp = 0;
+    LockDictionary locks;
+    // Stack ids already defined in this chunk, tagged with the chunk's
+    // generation so that starting a chunk does not have to clear them. A
+    // collision only costs a repeated definition.
+    uint32_t generation = 0;
+    std::array<uint64_t, DEFINED_CACHE_SIZE> defined{};
+
+    bool markDefined(uint32_t id)
+    {
+        uint64_t tag = (static_cast<uint64_t>(generation) << 32) | id;
+        uint64_t& entry = defined[id % DEFINED_CACHE_SIZE];
+        if (entry == tag) return false;
+        entry = tag;
+        return true;
+    }
+};
+
+static thread_local StreamState stream_state;
+
+// A block of encoded events. While Free it belongs to the thread that owns the
+// enclosing ThreadBuffer, which marks it Filling while it appends an event;
+// once Pending it belongs to the drainer until the drainer has written it out
+// and marks it Free again. The drainer only takes a Free chunk from a thread
+// when it rotates the output.
+struct Chunk
+{
+    enum State : uint8_t { Free, Filling, Pending };
+    static constexpr size_t CAPACITY = 64 * 1024;
+
+    std::atomic<uint8_t> state{Free};
+    std::atomic<size_t> used{0};
+    Chunk* next_pending = nullptr;
+    uint8_t data[CAPACITY];
+};
+
+// Per-thread ring of chunks. Buffers are never freed: when a thread exits its
+// buffer is released and picked up by the next thread that starts logging, so
+// the drainer can never see memory disappear under it.
+struct ThreadBuffer
+{
+    static constexpr size_t NUM_CHUNKS = 4;
+
+    std::atomic<bool> in_use{true};
+    std::atomic<uint64_t> dropped{0};
+    ThreadBuffer* next = nullptr;
+    size_t current = 0;
+    std::array<Chunk, NUM_CHUNKS> chunks;
+};
+
+static thread_local ThreadBuffer* thread_buffer = nullptr;
+// gettid() is a real syscall, so look it up once per thread.
+static thread_local uint32_t thread_id = 0;
+
+static uint32_t
+currentThreadId()
+{
+    if (thread_id == 0) thread_id = static_cast<uint32_t>(syscall(SYS_gettid));
+    return thread_id;
+}
+
+// Output backend that encodes events straight into a shared file mapping.
+// The file is a page-sized Header followed by fixed-size slots. A thread
+// claims a whole slot and appends to it with no syscall and no copy; the
+// slot's `used` counter is the only thing published per event. Readers take
+// the slots with a non-zero sequence, order them by sequence and concatenate
+// their payloads, which yields the same record stream the file backend
+// writes.
+//
+// In ring mode the file has a fixed number of slots and claims wrap around,
+// overwriting the oldest data, so the file always holds the most recent
+// events ("flight recorder"). Otherwise the file grows by SEGMENT_SIZE at a
+// time; the drainer thread maps new segments ahead of the writers.
+//
+// Since the mapping is MAP_SHARED the data lives in the page cache as soon as
+// it is encoded, so the file survives even a SIGKILL of the traced process.
+class MappedTrace
+{
+  public:
+    static constexpr char MAGIC[8] = {'S', 'K', 'M', 'M', 'A', 'P', '1', '\0'};
+    static constexpr size_t HEADER_SIZE = 4096;
+    static constexpr size_t SLOT_SIZE = 64 * 1024;
+    static constexpr size_t SEGMENT_SIZE = 16 * 1024 * 1024;
+    static constexpr size_t SLOTS_PER_SEGMENT = SEGMENT_SIZE / SLOT_SIZE;
+    static constexpr size_t MAX_MAPPED_SIZE = size_t(256) << 30;
+    static constexpr size_t MIN_RING_SLOTS = 16;
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t slot_size;
+        uint32_t ring;
+        std::atomic<uint64_t> slot_count;
+        std::atomic<uint64_t> next_sequence;
+        TraceHeader trace;
+    };
+    static_assert(offsetof(Header, trace) == 32, "readers expect the trace header at offset 32");
+
+    struct Slot
+    {
+        static constexpr size_t CAPACITY = SLOT_SIZE - 16;
+
+        // Claim number plus one; zero means the slot was never written.
+        std::atomic<uint64_t> sequence;
+        std::atomic<uint32_t> used;
+        std::atomic<uint32_t> owned;
+        uint8_t data[CAPACITY];
+    };
+    static_assert(sizeof(Slot) == SLOT_SIZE, "slot header must be 16 bytes");
+
+  private:
+    int fd_ = -1;
+    uint8_t* base_ = nullptr;
+    Header* header_ = nullptr;
+    bool ring_ = false;
+    uint64_t ring_slots_ = 0;
+
+    Slot* slotAt(uint64_t index) const
+    {
+        return reinterpret_cast<Slot*>(base_ + HEADER_SIZE + index * SLOT_SIZE);
+    }
+
+  public:
+    bool open(const char* filename, bool ring, size_t ring_size)
+    {
+        fd_ = ::open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd_ < 0) return false;
+
+        ring_ = ring;
+        size_t initial_size;
+        if (ring_) {
+            ring_slots_ = std::max(ring_size / SLOT_SIZE, MIN_RING_SLOTS);
+            initial_size = HEADER_SIZE + ring_slots_ * SLOT_SIZE;
+            base_ = static_cast<uint8_t*>(
+                    mmap(nullptr, initial_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0));
+        } else {
+            // Reserve address space for the largest trace up front so the
+            // slots stay contiguous as segments are mapped in behind it.
+            initial_size = HEADER_SIZE + SEGMENT_SIZE;
+            void* reserved = mmap(
+                    nullptr,
+                    MAX_MAPPED_SIZE,
+                    PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                    -1,
+                    0);
+            if (reserved != MAP_FAILED) {
+                base_ = static_cast<uint8_t*>(mmap(
+                        reserved,
+                        initial_size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_FIXED,
+                        fd_,
+                        0));
+            }
+        }
+        if (base_ == MAP_FAILED || base_ == nullptr || ftruncate(fd_, initial_size) != 0) {
+            ::close(fd_);
+            fd_ = -1;
+            return false;
+        }
+
+        header_ = reinterpret_cast<Header*>(base_);
+        memcpy(header_->magic, MAGIC, sizeof(MAGIC));
+        header_->slot_size = SLOT_SIZE;
+        header_->ring = ring_;
+        header_->next_sequence.store(0, std::memory_order_relaxed);
+        header_->slot_count.store(ring_ ? ring_slots_ : SLOTS_PER_SEGMENT, std::memory_order_release);
+        return true;
+    }
+
+    // Start over in a new file in a forked child. The inherited mapping is
+    // dropped without trimming, since the parent is still writing to it.
+    bool reopen(const char* filename)
+    {
+        if (fd_ < 0) return false;
+        munmap(base_, ring_ ? HEADER_SIZE + ring_slots_ * SLOT_SIZE : MAX_MAPPED_SIZE);
+        ::close(fd_);
+        fd_ = -1;
+        base_ = nullptr;
+        header_ = nullptr;
+        return open(filename, ring_, ring_slots_ * SLOT_SIZE);
+    }
+
+    // Hand the calling thread a fresh slot, or nullptr if none is available
+    // right now (the next segment is not mapped yet, or every slot we looked
+    // at is still owned by a thread that is lapping the ring slowly).
+    Slot* claim()
+    {
+        for (int attempt = 0; attempt < 8; attempt++) {
+            uint64_t sequence = header_->next_sequence.fetch_add(1, std::memory_order_relaxed);
+            uint64_t index = sequence;
+            if (ring_) {
+                index = sequence % ring_slots_;
+            } else if (sequence >= header_->slot_count.load(std::memory_order_acquire)) {
+                return nullptr;
+            }
+
+            Slot* slot = slotAt(index);
+            uint32_t expected = 0;
+            if (!slot->owned.compare_exchange_strong(expected, 1, std::memory_order_acquire)) {
+                continue;
+            }
+            slot->used.store(0, std::memory_order_relaxed);
+            slot->sequence.store(sequence + 1, std::memory_order_release);
+            return slot;
+        }
+        return nullptr;
+    }
+
+    TraceHeader* traceHeader() const
+    {
+        return &header_->trace;
+    }
+
+    void release(Slot* slot)
+    {
+        slot->owned.store(0, std::memory_order_release);
+    }
+
+    bool needsGrowth() const
+    {
+        return !ring_
+               && header_->next_sequence.load(std::memory_order_relaxed) + SLOTS_PER_SEGMENT / 2
+                          >= header_->slot_count.load(std::memory_order_relaxed);
+    }
+
+    // Map one more segment if writers are getting close to the end. Only
+    // called from the drainer thread.
+    bool grow()
+    {
+        if (!needsGrowth()) return false;
+
+        uint64_t slots = header_->slot_count.load(std::memory_order_relaxed);
+        size_t offset = HEADER_SIZE + slots * SLOT_SIZE;
+        if (offset + SEGMENT_SIZE > MAX_MAPPED_SIZE || ftruncate(fd_, offset + SEGMENT_SIZE) != 0) {
+            return false;
+        }
+        void* segment = mmap(
+                base_ + offset,
+                SEGMENT_SIZE,
+                PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED,
+                fd_,
+                offset);
+        if (segment == MAP_FAILED) return false;
+        header_->slot_count.store(slots + SLOTS_PER_SEGMENT, std::memory_order_release);
+        return true;
+    }
+
+    // Trim unclaimed slots off a growing file and unmap it. Only uses
+    // async-signal-safe calls.
+    void close()
+    {
+        if (fd_ < 0) return;
+        if (!ring_) {
+            uint64_t slots = std::min(
+                    header_->next_sequence.load(std::memory_order_relaxed),
+                    header_->slot_count.load(std::memory_order_relaxed));
+            header_->slot_count.store(slots, std::memory_order_relaxed);
+            ftruncate(fd_, HEADER_SIZE + slots * SLOT_SIZE);
+        }
+        ::close(fd_);
+        fd_ = -1;
+    }
+};
+
+static thread_local MappedTrace::Slot* thread_slot = nullptr;
+
+// Parse a byte count with an optional K/M/G suffix ("512K", "4M").
+static size_t
+parseSize(const char* value, size_t fallback)
+{
+    if (value == nullptr || *value == '\0') return fallback;
+    char* end = nullptr;
+    unsigned long long size = strtoull(value, &end, 10);
+    switch (*end) {
+        case 'k':
+        case 'K':
+            size <<= 10;
+            break;
+        case 'm':
+        case 'M':
+            size <<= 20;
+            break;
+        case 'g':
+        case 'G':
+            size <<= 30;
+            break;
+        default:
+            break;
+    }
+    return size ? static_cast<size_t>(size) : fallback;
+}
+
+// Parse a decimal count that fits in 32 bits at the start of `text`,
+// leaving *end after it. Unlike strtoul() alone, signs, blanks and overflow
+// are errors.
+static bool
+parseCount(const char* text, const char** end, uint32_t* count)
+{
+    if (!isdigit(static_cast<unsigned char>(*text))) return false;
+    errno = 0;
+    char* stop = nullptr;
+    unsigned long value = strtoul(text, &stop, 10);
+    if (errno == ERANGE || value > UINT32_MAX) return false;
+    *end = stop;
+    *count = static_cast<uint32_t>(value);
+    return true;
+}
+
+// Parse a sampling period: a whole number of 1 or more.
+static bool
+parseSamplePeriod(const char* text, uint32_t* period)
+{
+    const char* end = nullptr;
+    return parseCount(text, &end, period) && *end == '\0' && *period > 0;
+}
+
+// Parse a sampling window, "ON_MS:OFF_MS", or "0" for none.
+static bool
+parseSampleWindow(const char* text, uint32_t* on_ms, uint32_t* off_ms)
+{
+    const char* end = nullptr;
+    if (!parseCount(text, &end, on_ms)) return false;
+    if (*end == '\0') {
+        *off_ms = 0;
+        return *on_ms == 0;
+    }
+    return *end == ':' && parseCount(end + 1, &end, off_ms) && *end == '\0';
+}
+
+struct LockCounters
+{
+    // Spinlock waits are spent on the CPU; semaphores are waited on but not
+    // held.
+    enum Kind : uint32_t {
+        Mutex,
+        RWLock,
+        Spin,
+        Sem,
+    };
+
+    // Written once by the thread that claims the entry, before `ready`.
+    void* lock;
+    uint32_t stack_id;
+    Kind kind;
+    uint32_t depth;
+    void* frames[MAX_STACK_DEPTH];
+    std::atomic<bool> ready;
+
+    // The rest is only updated with relaxed atomics.
+    std::atomic<uint32_t> owner;
+    std::atomic<uint64_t> acquisitions;
+    std::atomic<uint64_t> owner_changes;
+    std::atomic<uint64_t> contentions;
+    std::atomic<uint64_t> wait_ticks;
+    std::atomic<uint64_t> max_wait_ticks;
+    std::atomic<uint64_t> hold_ticks;
+    std::atomic<uint64_t> max_hold_ticks;
+    // In ticks, of the contended waits and of all holds.
+    AtomicLatencyHistogram wait_histogram;
+    AtomicLatencyHistogram hold_histogram;
 };
 
-#pragma pack(push, 1)
-struct Event
-{
-    uint64_t timestamp;  // Nanoseconds since epoch
-    uint32_t tid;  // Thread ID from gettid()
-    EventType type;  // Event type
-    void* ptr1;  // Primary pointer (mutex/rwlock/cond)
-    void* ptr2;  // Secondary pointer (e.g. mutex for cond_wait)
-    int32_t result;  // Return value
-    uint64_t duration_ns;  // Duration for timed operations
-    uint32_t stack_depth;  // Number of stack frames
-};
-#pragma pack(pop)
+// Locks the current thread holds, so that an unlock can be charged to the
+// acquisition it ends. Deeper nesting than this goes unmeasured.
+struct HeldLock
+{
+    void* lock;
+    uint64_t since;
+    LockCounters* counters;
+    // The acquiring call site's entry, if it has one.
+    LockCounters* site;
+    // The tables' epoch at the acquisition; see Aggregator::reopen().
+    uint32_t epoch;
+};
+static constexpr size_t MAX_HELD_LOCKS = 16;
+static thread_local std::array<HeldLock, MAX_HELD_LOCKS> held_locks;
+static thread_local size_t held_lock_count = 0;
+
+// Contended waits of one thread, over all the locks it waited for.
+struct ThreadCounters
+{
+    // 0 while the entry is free. Claimed once and never given back, so a
+    // reused tid adds to the entry of the thread that had it before.
+    std::atomic<uint32_t> tid;
+    std::atomic<uint64_t> contentions;
+    std::atomic<uint64_t> blocked_ticks;
+    std::atomic<uint64_t> spin_ticks;
+    // Only read and written by the metrics thread, which fills it in from
+    // /proc the first time it sees the thread.
+    char name[16];
+};
+static thread_local ThreadCounters* thread_counters = nullptr;
+
+
+// Lock statistics kept inside the process instead of an event stream (the
+// aggregate backend). Each lock gets an entry with the numbers parse.py's
+// LockStats reports, and each (lock, stack id) pair an entry that breaks
+// acquisitions and waits down by call site. Entries are claimed lock-free in
+// an open-addressing table and never removed; `write()` turns them into a
+// text summary.
+class LockAggregator
+{
+  private:
+    static constexpr size_t CAPACITY = 1 << 14;
+    static constexpr size_t MAX_PROBES = 64;
+    static constexpr size_t MAX_THREADS = 1 << 12;
+
+    // Formats the summary into a small buffer and writes it out in pieces.
+    class Printer
+    {
+      private:
+        int fd_;
+        uint64_t ticks_per_second_;
+        // Sockets are sent to without SIGPIPE, since a scraper may hang up.
+        bool socket_;
+        char buffer_[4096];
+        size_t size_ = 0;
+
+      public:
+        Printer(int fd, uint64_t ticks_per_second, bool socket = false)
+        : fd_(fd)
+        , ticks_per_second_(ticks_per_second ? ticks_per_second : 1)
+        , socket_(socket)
+        {
+        }
+
+        uint64_t nanos(uint64_t ticks) const
+        {
+            return static_cast<uint64_t>(static_cast<unsigned __int128>(ticks) * 1000000000
+                                         / ticks_per_second_);
+        }
+
+        uint64_t nanos(const std::atomic<uint64_t>& ticks) const
+        {
+            return nanos(ticks.load(std::memory_order_relaxed));
+        }
+
+        __attribute__((format(printf, 2, 3))) void print(const char* format, ...)
+        {
+            char line[512];
+            va_list args;
+            va_start(args, format);
+            int length = vsnprintf(line, sizeof(line), format, args);
+            va_end(args);
+            if (length <= 0) return;
+            size_t size = std::min(static_cast<size_t>(length), sizeof(line) - 1);
+            if (size_ + size > sizeof(buffer_)) flush();
+            memcpy(buffer_ + size_, line, size);
+            size_ += size;
+        }
+
+        // p50, p99 and p99.9 of a histogram of ticks, as NAME_pXX_ns fields.
+        void printPercentiles(const char* name, const AtomicLatencyHistogram& ticks, uint64_t max_ns)
+        {
+            LatencyHistogram histogram;
+            histogram.mergeScaled(ticks, 1000000000, ticks_per_second_);
+            print(" %s_p50_ns=%" PRIu64 " %s_p99_ns=%" PRIu64 " %s_p999_ns=%" PRIu64,
+                  name,
+                  std::min(histogram.percentile(50), max_ns),
+                  name,
+                  std::min(histogram.percentile(99), max_ns),
+                  name,
+                  std::min(histogram.percentile(99.9), max_ns));
+        }
+
+        // The non-empty buckets of a histogram of ticks, as LOWER_NS:COUNT
+        // pairs; summaries of several processes add up bucket by bucket.
+        void printBuckets(const char* name, const AtomicLatencyHistogram& ticks)
+        {
+            LatencyHistogram histogram;
+            histogram.mergeScaled(ticks, 1000000000, ticks_per_second_);
+            if (histogram.total() == 0) return;
+            print("  %s_histogram", name);
+            for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+                if (uint64_t count = histogram.count(bucket)) {
+                    print(" %" PRIu64 ":%" PRIu64, LatencyHistogram::lowerBound(bucket), count);
+                }
+            }
+            print("\n");
+        }
+
+        // A histogram of ticks as a Prometheus histogram in seconds, with
+        // cumulative buckets at 1, 2.5 and 5 times each power of ten from a
+        // microsecond to ten seconds. A bucket of ours only counts below a
+        // bound it lies below entirely, so the counts are within the
+        // histogram's 12.5% of exact.
+        void printMetricHistogram(
+                const char* name,
+                const char* labels,
+                const AtomicLatencyHistogram& ticks,
+                const std::atomic<uint64_t>& sum_ticks)
+        {
+            static constexpr uint64_t BOUNDS_NS[] = {
+                    1000,       2500,       5000,       10000,      25000,      50000,
+                    100000,     250000,     500000,     1000000,    2500000,    5000000,
+                    10000000,   25000000,   50000000,   100000000,  250000000,  500000000,
+                    1000000000, 2500000000, 5000000000, 10000000000,
+            };
+            LatencyHistogram histogram;
+            histogram.mergeScaled(ticks, 1000000000, ticks_per_second_);
+            size_t bucket = 0;
+            uint64_t below = 0;
+            for (uint64_t bound : BOUNDS_NS) {
+                while (bucket < HISTOGRAM_BUCKETS && LatencyHistogram::upperBound(bucket) < bound) {
+                    below += histogram.count(bucket++);
+                }
+                print("%s_bucket{%s,le=\"%g\"} %" PRIu64 "\n", name, labels, bound / 1e9, below);
+            }
+            print("%s_bucket{%s,le=\"+Inf\"} %" PRIu64 "\n", name, labels, histogram.total());
+            print("%s_sum{%s} %.9f\n", name, labels, nanos(sum_ticks) / 1e9);
+            print("%s_count{%s} %" PRIu64 "\n", name, labels, histogram.total());
+        }
+
+        static const char* kindName(LockCounters::Kind kind)
+        {
+            switch (kind) {
+                case LockCounters::Mutex:
+                    return "mutex";
+                case LockCounters::RWLock:
+                    return "rwlock";
+                case LockCounters::Spin:
+                    return "spin";
+                case LockCounters::Sem:
+                    return "sem";
+            }
+            return "unknown";
+        }
+
+        void printLock(const LockCounters& counters, bool buckets)
+        {
+            print("lock %p %s acquisitions=%" PRIu64 " owner_changes=%" PRIu64 " contentions=%" PRIu64
+                  " wait_ns=%" PRIu64 " max_wait_ns=%" PRIu64 " hold_ns=%" PRIu64
+                  " max_hold_ns=%" PRIu64,
+                  counters.lock,
+                  kindName(counters.kind),
+                  counters.acquisitions.load(std::memory_order_relaxed),
+                  counters.owner_changes.load(std::memory_order_relaxed),
+                  counters.contentions.load(std::memory_order_relaxed),
+                  nanos(counters.wait_ticks),
+                  nanos(counters.max_wait_ticks),
+                  nanos(counters.hold_ticks),
+                  nanos(counters.max_hold_ticks));
+            printPercentiles("wait", counters.wait_histogram, nanos(counters.max_wait_ticks));
+            printPercentiles("hold", counters.hold_histogram, nanos(counters.max_hold_ticks));
+            print("\n");
+            if (buckets) {
+                printBuckets("wait", counters.wait_histogram);
+                printBuckets("hold", counters.hold_histogram);
+            }
+        }
+
+        void printSite(const LockCounters& site)
+        {
+            print("  site %" PRIu32 " acquisitions=%" PRIu64 " contentions=%" PRIu64 " wait_ns=%" PRIu64
+                  " max_wait_ns=%" PRIu64 " hold_ns=%" PRIu64 " max_hold_ns=%" PRIu64,
+                  site.stack_id,
+                  site.acquisitions.load(std::memory_order_relaxed),
+                  site.contentions.load(std::memory_order_relaxed),
+                  nanos(site.wait_ticks),
+                  nanos(site.max_wait_ticks),
+                  nanos(site.hold_ticks),
+                  nanos(site.max_hold_ticks));
+            printPercentiles("wait", site.wait_histogram, nanos(site.max_wait_ticks));
+            printPercentiles("hold", site.hold_histogram, nanos(site.max_hold_ticks));
+            print("\n");
+            printBuckets("wait", site.wait_histogram);
+            printBuckets("hold", site.hold_histogram);
+            for (uint32_t i = 0; i < site.depth; i++) {
+                Dl_info info;
+                if (dladdr(site.frames[i], &info) == 0 || info.dli_fname == nullptr) {
+                    print("    %p\n", site.frames[i]);
+                } else if (info.dli_sname == nullptr) {
+                    print("    %p (%s)\n", site.frames[i], info.dli_fname);
+                } else {
+                    print("    %p %s+0x%tx (%s)\n",
+                          site.frames[i],
+                          info.dli_sname,
+                          static_cast<char*>(site.frames[i]) - static_cast<char*>(info.dli_saddr),
+                          info.dli_fname);
+                }
+            }
+        }
+
+        void printThread(const ThreadCounters& thread)
+        {
+            print("thread %" PRIu32 " contentions=%" PRIu64 " blocked_ns=%" PRIu64 " spin_ns=%" PRIu64
+                  "\n",
+                  thread.tid.load(std::memory_order_relaxed),
+                  thread.contentions.load(std::memory_order_relaxed),
+                  nanos(thread.blocked_ticks),
+                  nanos(thread.spin_ticks));
+        }
+
+        void flush()
+        {
+            const char* data = buffer_;
+            while (size_ > 0) {
+                ssize_t written =
+                        socket_ ? send(fd_, data, size_, MSG_NOSIGNAL) : ::write(fd_, data, size_);
+                if (written < 0) {
+                    if (errno == EINTR) continue;
+                    break;
+                }
+                data += written;
+                size_ -= written;
+            }
+            size_ = 0;
+        }
+    };
+
+    int fd_ = -1;
+    // All three arrays live in one anonymous mapping, so untouched entries
+    // cost no memory.
+    std::atomic<uint64_t>* keys_ = nullptr;
+    LockCounters* entries_ = nullptr;
+    ThreadCounters* threads_ = nullptr;
+    size_t mapping_size_ = 0;
+    std::atomic<uint64_t> overflow_{0};
+    // Bumped whenever the tables start over.
+    std::atomic<uint32_t> epoch_{0};
+
+    static uint64_t key(void* lock, uint32_t stack_id)
+    {
+        uint64_t key = reinterpret_cast<uint64_t>(lock) * 0x9e3779b97f4a7c15ull;
+        key ^= (static_cast<uint64_t>(stack_id) + 1) * 0xff51afd7ed558ccdull;
+        key ^= key >> 29;
+        return key ? key : 1;
+    }
+
+    static void raiseTo(std::atomic<uint64_t>& maximum, uint64_t value)
+    {
+        uint64_t current = maximum.load(std::memory_order_relaxed);
+        while (value > current
+               && !maximum.compare_exchange_weak(current, value, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    LockCounters*
+    find(void* lock, uint32_t stack_id, LockCounters::Kind kind, void* const* frames, int depth)
+    {
+        uint64_t wanted = key(lock, stack_id);
+        size_t index = wanted & (CAPACITY - 1);
+        for (size_t probe = 0; probe < MAX_PROBES; probe++) {
+            uint64_t current = keys_[index].load(std::memory_order_acquire);
+            if (current == 0
+                && keys_[index].compare_exchange_strong(current, wanted, std::memory_order_acq_rel))
+            {
+                LockCounters& counters = entries_[index];
+                counters.lock = lock;
+                counters.stack_id = stack_id;
+                counters.kind = kind;
+                counters.depth = static_cast<uint32_t>(depth);
+                memcpy(counters.frames, frames, depth * sizeof(void*));
+                counters.ready.store(true, std::memory_order_release);
+                return &counters;
+            }
+            if (current == wanted) return &entries_[index];
+            index = (index + 1) & (CAPACITY - 1);
+        }
+        overflow_.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    // The calling thread's entry, claimed on its first contended wait.
+    ThreadCounters* threadCounters(uint32_t tid)
+    {
+        // A forked child's tables start empty, and its thread a new tid.
+        if (thread_counters && thread_counters->tid.load(std::memory_order_relaxed) == tid) {
+            return thread_counters;
+        }
+        size_t index = (tid * 0x9e3779b9u) & (MAX_THREADS - 1);
+        for (size_t probe = 0; probe < MAX_PROBES; probe++) {
+            uint32_t current = threads_[index].tid.load(std::memory_order_relaxed);
+            if (current == tid
+                || (current == 0
+                    && threads_[index].tid.compare_exchange_strong(
+                            current, tid, std::memory_order_relaxed)))
+            {
+                thread_counters = &threads_[index];
+                return thread_counters;
+            }
+            index = (index + 1) & (MAX_THREADS - 1);
+        }
+        return nullptr;
+    }
+
+    // Locks that were waited for longest first, then the busiest.
+    static bool waitedLonger(const LockCounters* a, const LockCounters* b)
+    {
+        uint64_t a_wait = a->wait_ticks.load(std::memory_order_relaxed);
+        uint64_t b_wait = b->wait_ticks.load(std::memory_order_relaxed);
+        if (a_wait != b_wait) return a_wait > b_wait;
+        return a->acquisitions.load(std::memory_order_relaxed)
+               > b->acquisitions.load(std::memory_order_relaxed);
+    }
+
+    static uint64_t threadWait(const ThreadCounters* thread)
+    {
+        return thread->blocked_ticks.load(std::memory_order_relaxed)
+               + thread->spin_ticks.load(std::memory_order_relaxed);
+    }
+
+    bool isLock(size_t i) const
+    {
+        return keys_[i].load(std::memory_order_acquire) != 0
+               && entries_[i].ready.load(std::memory_order_acquire)
+               && entries_[i].stack_id == StackTable::NO_ID;
+    }
+
+    void acquired(
+            void* lock,
+            LockCounters::Kind kind,
+            uint32_t tid,
+            uint64_t timestamp,
+            uint64_t wait,
+            bool contended,
+            void* const* frames,
+            int depth,
+            uint32_t stack_id)
+    {
+        LockCounters* counters = find(lock, StackTable::NO_ID, kind, nullptr, 0);
+        if (counters == nullptr) return;
+        counters->acquisitions.fetch_add(1, std::memory_order_relaxed);
+        // A semaphore wait takes a unit nobody owns.
+        bool held = kind != LockCounters::Sem;
+        uint32_t previous = held ? counters->owner.exchange(tid, std::memory_order_relaxed) : 0;
+        if (previous != 0 && previous != tid) {
+            counters->owner_changes.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (contended) {
+            counters->contentions.fetch_add(1, std::memory_order_relaxed);
+            counters->wait_ticks.fetch_add(wait, std::memory_order_relaxed);
+            raiseTo(counters->max_wait_ticks, wait);
+            counters->wait_histogram.record(wait);
+            if (ThreadCounters* thread = threadCounters(tid)) {
+                thread->contentions.fetch_add(1, std::memory_order_relaxed);
+                auto& ticks = kind == LockCounters::Spin ? thread->spin_ticks : thread->blocked_ticks;
+                ticks.fetch_add(wait, std::memory_order_relaxed);
+            }
+        }
+
+        LockCounters* site = nullptr;
+        if (stack_id != StackTable::NO_ID) site = find(lock, stack_id, kind, frames, depth);
+        if (held) hold(lock, timestamp, counters, site);
+        if (site == nullptr) return;
+        site->acquisitions.fetch_add(1, std::memory_order_relaxed);
+        if (contended) {
+            site->contentions.fetch_add(1, std::memory_order_relaxed);
+            site->wait_ticks.fetch_add(wait, std::memory_order_relaxed);
+            raiseTo(site->max_wait_ticks, wait);
+            site->wait_histogram.record(wait);
+        }
+    }
+
+    void hold(void* lock, uint64_t timestamp, LockCounters* counters, LockCounters* site)
+    {
+        if (held_lock_count == MAX_HELD_LOCKS) return;
+        uint32_t epoch = epoch_.load(std::memory_order_relaxed);
+        held_locks[held_lock_count++] = {lock, timestamp, counters, site, epoch};
+    }
+
+    void released(void* lock, uint64_t timestamp)
+    {
+        // Locks are usually released in reverse order, so search from the top.
+        for (size_t i = held_lock_count; i-- > 0;) {
+            if (held_locks[i].lock != lock) continue;
+            uint64_t held = timestamp - held_locks[i].since;
+            // The entries of a hold that began before the tables started
+            // over are gone.
+            bool current = held_locks[i].epoch == epoch_.load(std::memory_order_relaxed);
+            for (LockCounters* counters : {held_locks[i].counters, held_locks[i].site}) {
+                if (counters == nullptr || !current) continue;
+                counters->hold_ticks.fetch_add(held, std::memory_order_relaxed);
+                raiseTo(counters->max_hold_ticks, held);
+                counters->hold_histogram.record(held);
+            }
+            held_locks[i] = held_locks[--held_lock_count];
+            return;
+        }
+    }
+
+  public:
+    // Acquisitions are the only events whose stacks are kept.
+    static bool usesStack(EventType type)
+    {
+        switch (type) {
+            case EventType::MutexLockDone:
+            case EventType::MutexTryLockDone:
+            case EventType::MutexTimedLockDone:
+            case EventType::MutexLockFast:
+            case EventType::RWLockReadDone:
+            case EventType::RWLockTryReadDone:
+            case EventType::RWLockTimedReadDone:
+            case EventType::RWLockReadFast:
+            case EventType::RWLockWriteDone:
+            case EventType::RWLockTryWriteDone:
+            case EventType::RWLockTimedWriteDone:
+            case EventType::RWLockWriteFast:
+            case EventType::SpinLockDone:
+            case EventType::SpinTryLockDone:
+            case EventType::SpinLockFast:
+            case EventType::SemWaitDone:
+            case EventType::SemTryWaitDone:
+            case EventType::SemTimedWaitDone:
+            case EventType::SemWaitFast:
+            case EventType::MutexClockLockDone:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    bool open(const char* filename)
+    {
+        fd_ = ::open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd_ < 0) return false;
+        mapping_size_ = CAPACITY * (sizeof(std::atomic<uint64_t>) + sizeof(LockCounters))
+                        + MAX_THREADS * sizeof(ThreadCounters);
+        void* mapping = mmap(
+                nullptr,
+                mapping_size_,
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                -1,
+                0);
+        if (mapping == MAP_FAILED) {
+            ::close(fd_);
+            fd_ = -1;
+            return false;
+        }
+        keys_ = static_cast<std::atomic<uint64_t>*>(mapping);
+        entries_ = reinterpret_cast<LockCounters*>(keys_ + CAPACITY);
+        threads_ = reinterpret_cast<ThreadCounters*>(entries_ + CAPACITY);
+        return true;
+    }
+
+    // Start over with empty tables in a new file: in a forked child, or for a
+    // new sampling epoch. Dropping the pages zeroes them without touching
+    // them; a thread recording at that moment may lose its event.
+    bool reopen(const char* filename)
+    {
+        close();
+        if (keys_) madvise(keys_, mapping_size_, MADV_DONTNEED);
+        overflow_.store(0, std::memory_order_relaxed);
+        epoch_.fetch_add(1, std::memory_order_relaxed);
+        fd_ = ::open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        held_lock_count = 0;
+        return fd_ >= 0;
+    }
+
+    // `timestamp` and `duration` are in Clock::now() units; `frames` is the
+    // acquiring stack when there is one.
+    void record(
+            EventType type,
+            void* ptr1,
+            void* ptr2,
+            int32_t result,
+            uint64_t timestamp,
+            uint64_t duration,
+            void* const* frames,
+            int depth,
+            uint32_t stack_id)
+    {
+        LockCounters::Kind kind = LockCounters::RWLock;
+        bool contended = true;
+        switch (type) {
+            case EventType::MutexTryLockDone:
+                contended = false;
+                [[fallthrough]];
+            case EventType::MutexLockDone:
+            case EventType::MutexTimedLockDone:
+            case EventType::MutexClockLockDone:
+                kind = LockCounters::Mutex;
+                break;
+            case EventType::MutexLockFast:
+                kind = LockCounters::Mutex;
+                contended = false;
+                break;
+            case EventType::SpinTryLockDone:
+            case EventType::SpinLockFast:
+                contended = false;
+                [[fallthrough]];
+            case EventType::SpinLockDone:
+                kind = LockCounters::Spin;
+                break;
+            case EventType::SemTryWaitDone:
+            case EventType::SemWaitFast:
+                contended = false;
+                [[fallthrough]];
+            case EventType::SemWaitDone:
+            case EventType::SemTimedWaitDone:
+                kind = LockCounters::Sem;
+                break;
+            case EventType::RWLockTryReadDone:
+            case EventType::RWLockTryWriteDone:
+            case EventType::RWLockReadFast:
+            case EventType::RWLockWriteFast:
+                contended = false;
+                break;
+            case EventType::RWLockReadDone:
+            case EventType::RWLockTimedReadDone:
+            case EventType::RWLockWriteDone:
+            case EventType::RWLockTimedWriteDone:
+                break;
+            case EventType::MutexUnlock:
+            case EventType::RWLockUnlock:
+            case EventType::SpinUnlock:
+                released(ptr1, timestamp);
+                return;
+            // A condition wait gives up the mutex and takes it back.
+            case EventType::CondWait:
+            case EventType::CondTimedWait:
+            case EventType::CondClockWait:
+                released(ptr2, timestamp);
+                return;
+            case EventType::CondWaitDone:
+            case EventType::CondTimedWaitDone:
+            case EventType::CondClockWaitDone: {
+                LockCounters* counters = find(ptr2, StackTable::NO_ID, LockCounters::Mutex, nullptr, 0);
+                if (counters != nullptr) hold(ptr2, timestamp, counters, nullptr);
+                return;
+            }
+            default:
+                return;
+        }
+        if (result != 0) return;
+        uint64_t wait = contended ? duration : 0;
+        acquired(ptr1, kind, currentThreadId(), timestamp, wait, contended, frames, depth, stack_id);
+    }
+
+    // Contended wait over all locks. Spinning burns CPU where blocking does
+    // not, so the two are summed apart.
+    void totals(uint64_t* blocked_ticks, uint64_t* spin_ticks) const
+    {
+        *blocked_ticks = 0;
+        *spin_ticks = 0;
+        for (size_t i = 0; i < CAPACITY; i++) {
+            if (!isLock(i)) continue;
+            uint64_t wait = entries_[i].wait_ticks.load(std::memory_order_relaxed);
+            *(entries_[i].kind == LockCounters::Spin ? spin_ticks : blocked_ticks) += wait;
+        }
+    }
+
+    // Replace the output file with a summary of everything recorded so far.
+    // With `detailed` unset only the per-lock lines are written, in table
+    // order and without allocating or symbolizing, for the signal path.
+    void write(uint64_t ticks_per_second, double sample_scale, bool detailed)
+    {
+        if (fd_ < 0) return;
+        ftruncate(fd_, 0);
+        lseek(fd_, 0, SEEK_SET);
+        Printer out(fd_, ticks_per_second);
+        out.print("# skeleton_key lock summary, pid %d, times in nanoseconds\n", getpid());
+        if (sample_scale != 1) {
+            out.print("# sampled: multiply counts and totals by %.3f for estimates\n", sample_scale);
+        }
+
+        if (!detailed) {
+            for (size_t i = 0; i < CAPACITY; i++) {
+                const LockCounters& counters = entries_[i];
+                if (keys_[i].load(std::memory_order_acquire) == 0) continue;
+                if (!counters.ready.load(std::memory_order_acquire)) continue;
+                if (counters.stack_id == StackTable::NO_ID) out.printLock(counters, false);
+            }
+        } else {
+            std::vector<const LockCounters*> locks;
+            std::vector<const LockCounters*> sites;
+            for (size_t i = 0; i < CAPACITY; i++) {
+                const LockCounters& counters = entries_[i];
+                if (keys_[i].load(std::memory_order_acquire) == 0) continue;
+                if (!counters.ready.load(std::memory_order_acquire)) continue;
+                (counters.stack_id == StackTable::NO_ID ? locks : sites).push_back(&counters);
+            }
+            std::sort(locks.begin(), locks.end(), waitedLonger);
+            std::sort(sites.begin(), sites.end(), [](const LockCounters* a, const LockCounters* b) {
+                if (a->lock != b->lock) return a->lock < b->lock;
+                return waitedLonger(a, b);
+            });
+            for (const LockCounters* counters : locks) {
+                out.printLock(*counters, true);
+                auto first = std::lower_bound(
+                        sites.begin(),
+                        sites.end(),
+                        counters->lock,
+                        [](const LockCounters* site, void* lock) { return site->lock < lock; });
+                for (auto it = first; it != sites.end() && (*it)->lock == counters->lock; ++it) {
+                    out.printSite(**it);
+                }
+            }
+        }
+
+        // Who waited, in table order on the signal path.
+        std::vector<const ThreadCounters*> threads;
+        for (size_t i = 0; i < MAX_THREADS; i++) {
+            if (threads_[i].tid.load(std::memory_order_relaxed) == 0) continue;
+            if (detailed) {
+                threads.push_back(&threads_[i]);
+            } else {
+                out.printThread(threads_[i]);
+            }
+        }
+        std::sort(threads.begin(), threads.end(), [](const ThreadCounters* a, const ThreadCounters* b) {
+            return threadWait(a) > threadWait(b);
+        });
+        for (const ThreadCounters* thread : threads) out.printThread(*thread);
+
+        uint64_t blocked_ticks;
+        uint64_t spin_ticks;
+        totals(&blocked_ticks, &spin_ticks);
+        out.print("# total blocked_ns=%" PRIu64 " spin_ns=%" PRIu64 "\n",
+                  out.nanos(blocked_ticks),
+                  out.nanos(spin_ticks));
+
+        uint64_t overflow = overflow_.load(std::memory_order_relaxed);
+        if (overflow) out.print("# %" PRIu64 " acquisitions not recorded: table full\n", overflow);
+        out.flush();
+    }
+
+    // The Prometheus text exposition of the `top` locks waited for longest
+    // and the `top` threads that waited longest, with totals over all of
+    // them, for a scraper's socket. It only loads the counters, so a scrape
+    // never holds up a hooked thread, at the price of one lock's numbers
+    // being a few operations apart. Counts are as sampled.
+    void writeMetrics(int fd, uint64_t ticks_per_second, double sample_scale, size_t top)
+    {
+        Printer out(fd, ticks_per_second, true);
+        std::vector<const LockCounters*> locks;
+        for (size_t i = 0; i < CAPACITY; i++) {
+            if (isLock(i)) locks.push_back(&entries_[i]);
+        }
+        size_t tracked = locks.size();
+        size_t shown = std::min(top, tracked);
+        std::partial_sort(locks.begin(), locks.begin() + shown, locks.end(), waitedLonger);
+        locks.resize(shown);
+
+        std::vector<std::array<char, 192>> lock_labels(shown);
+        for (size_t i = 0; i < shown; i++) {
+            char* labels = lock_labels[i].data();
+            int length = snprintf(labels,
+                                  lock_labels[i].size(),
+                                  "lock=\"%p\",kind=\"%s\"",
+                                  locks[i]->lock,
+                                  Printer::kindName(locks[i]->kind));
+            // Global locks get their symbol name.
+            Dl_info info;
+            if (dladdr(locks[i]->lock, &info) != 0 && info.dli_sname != nullptr
+                && info.dli_saddr == locks[i]->lock)
+            {
+                snprintf(labels + length,
+                         lock_labels[i].size() - length,
+                         ",symbol=\"%.128s\"",
+                         info.dli_sname);
+            }
+        }
+
+        auto family = [&](const char* name, const char* type, const char* help) {
+            out.print("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+        };
+        auto counts = [&](const char* name, const char* help, auto value) {
+            family(name, "counter", help);
+            for (size_t i = 0; i < shown; i++) {
+                out.print("%s{%s} %" PRIu64 "\n", name, lock_labels[i].data(), value(*locks[i]));
+            }
+        };
+        counts("skeleton_key_lock_acquisitions_total", "Successful acquisitions.", [](auto& lock) {
+            return lock.acquisitions.load(std::memory_order_relaxed);
+        });
+        counts("skeleton_key_lock_contentions_total", "Acquisitions that had to wait.", [](auto& lock) {
+            return lock.contentions.load(std::memory_order_relaxed);
+        });
+        counts("skeleton_key_lock_owner_changes_total",
+               "Acquisitions by another thread than the previous one.",
+               [](auto& lock) { return lock.owner_changes.load(std::memory_order_relaxed); });
+
+        family("skeleton_key_lock_wait_seconds", "histogram", "Contended waits for the lock.");
+        for (size_t i = 0; i < shown; i++) {
+            out.printMetricHistogram("skeleton_key_lock_wait_seconds",
+                                     lock_labels[i].data(),
+                                     locks[i]->wait_histogram,
+                                     locks[i]->wait_ticks);
+        }
+        family("skeleton_key_lock_hold_seconds", "histogram", "Times the lock was held.");
+        for (size_t i = 0; i < shown; i++) {
+            out.printMetricHistogram("skeleton_key_lock_hold_seconds",
+                                     lock_labels[i].data(),
+                                     locks[i]->hold_histogram,
+                                     locks[i]->hold_ticks);
+        }
+        family("skeleton_key_lock_max_wait_seconds", "gauge", "Longest contended wait.");
+        for (size_t i = 0; i < shown; i++) {
+            out.print("skeleton_key_lock_max_wait_seconds{%s} %.9f\n",
+                      lock_labels[i].data(),
+                      out.nanos(locks[i]->max_wait_ticks) / 1e9);
+        }
+
+        std::vector<ThreadCounters*> threads;
+        for (size_t i = 0; i < MAX_THREADS; i++) {
+            if (threads_[i].tid.load(std::memory_order_relaxed) != 0) threads.push_back(&threads_[i]);
+        }
+        size_t shown_threads = std::min(top, threads.size());
+        std::partial_sort(threads.begin(),
+                          threads.begin() + shown_threads,
+                          threads.end(),
+                          [](const ThreadCounters* a, const ThreadCounters* b) {
+                              return threadWait(a) > threadWait(b);
+                          });
+        threads.resize(shown_threads);
+        for (ThreadCounters* thread : threads) {
+            if (thread->name[0] == '\0') readThreadName(thread);
+        }
+        auto thread_family = [&](const char* name, const char* help, auto value) {
+            family(name, "counter", help);
+            for (const ThreadCounters* thread : threads) {
+                out.print("%s{tid=\"%" PRIu32 "\",name=\"%s\"} ",
+                          name,
+                          thread->tid.load(std::memory_order_relaxed),
+                          thread->name);
+                value(*thread);
+            }
+        };
+        thread_family("skeleton_key_thread_contentions_total",
+                      "Acquisitions the thread had to wait for.",
+                      [&](const ThreadCounters& thread) {
+                          out.print("%" PRIu64 "\n", thread.contentions.load(std::memory_order_relaxed));
+                      });
+        thread_family("skeleton_key_thread_blocked_seconds_total",
+                      "Time the thread spent blocked in contended waits.",
+                      [&](const ThreadCounters& thread) {
+                          out.print("%.9f\n", out.nanos(thread.blocked_ticks) / 1e9);
+                      });
+        thread_family("skeleton_key_thread_spin_seconds_total",
+                      "Time the thread spent spinning in contended spinlock waits.",
+                      [&](const ThreadCounters& thread) {
+                          out.print("%.9f\n", out.nanos(thread.spin_ticks) / 1e9);
+                      });
+
+        uint64_t blocked_ticks;
+        uint64_t spin_ticks;
+        totals(&blocked_ticks, &spin_ticks);
+        family("skeleton_key_blocked_seconds_total",
+               "counter",
+               "Contended waits that blocked, over all locks.");
+        out.print("skeleton_key_blocked_seconds_total %.9f\n", out.nanos(blocked_ticks) / 1e9);
+        family("skeleton_key_spin_seconds_total",
+               "counter",
+               "Contended waits that spun, over all locks.");
+        out.print("skeleton_key_spin_seconds_total %.9f\n", out.nanos(spin_ticks) / 1e9);
+        family("skeleton_key_locks", "gauge", "Locks being tracked.");
+        out.print("skeleton_key_locks %zu\n", tracked);
+        family("skeleton_key_unrecorded_acquisitions_total",
+               "counter",
+               "Acquisitions lost to a full table.");
+        out.print("skeleton_key_unrecorded_acquisitions_total %" PRIu64 "\n",
+                  overflow_.load(std::memory_order_relaxed));
+        family("skeleton_key_sample_scale",
+               "gauge",
+               "What to multiply counts and times by for estimates.");
+        out.print("skeleton_key_sample_scale %g\n", sample_scale);
+        out.flush();
+    }
+
+    // The thread's name from /proc, while it still exists, with anything
+    // that would need escaping in a label replaced.
+    static void readThreadName(ThreadCounters* thread)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/task/%" PRIu32 "/comm", thread->tid.load());
+        int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return;
+        ssize_t length = read(fd, thread->name, sizeof(thread->name) - 1);
+        ::close(fd);
+        if (length <= 0) return;
+        thread->name[length] = '\0';
+        for (char* c = thread->name; *c; c++) {
+            if (*c == '\n') *c = '\0';
+            if (*c == '"' || *c == '\\') *c = '_';
+        }
+    }
+
+    void close()
+    {
+        if (fd_ < 0) return;
+        ::close(fd_);
+        fd_ = -1;
+    }
+};
+
+enum class CaptureMode {
+    // Every call is logged, with a stack.
+    All,
+    // Acquisitions that get the lock without waiting are logged as a single
+    // *Fast event without a stack; only the ones that wait get the full
+    // pair of events and stacks. Other events are logged without stacks.
+    Contended,
+};
+
+enum class Backend {
+    // Per-thread chunks, batched by the drainer into write(2) calls.
+    File,
+    // Events encoded directly into a growing shared mapping of the file.
+    Mapped,
+    // Fixed-size mapped ring that keeps only the most recent events.
+    Ring,
+    // No events at all: per-lock counters, written out as a text summary.
+    Aggregate,
+    // The file backend's stream, sent live to an analyzer over a Unix socket.
+    Socket,
+};
+
+// What the hooks do. Every hook is compiled once per tracing policy, so the
+// capture mode and backend checks inside it are made at compile time and a
+// call only branches on which policy is active. The policy is set when the
+// tracer starts and changed later only by the control socket.
+enum class HookPolicy : uint8_t {
+    // The tracer has not started; the first hook to run starts it.
+    Unstarted,
+    // Nothing is traced, e.g. the output could not be opened or tracing has
+    // been disabled. Hooks call straight through.
+    Off,
+    // CaptureMode::All into a trace.
+    All,
+    // CaptureMode::Contended into a trace.
+    Contended,
+    // The aggregate backend, with either capture mode.
+    Aggregate,
+};
+
+static std::atomic<HookPolicy> hook_policy{HookPolicy::Unstarted};
+
+struct Config
+{
+    static constexpr size_t MIN_BATCH_SIZE = Chunk::CAPACITY;
+    static constexpr size_t MAX_BATCH_SIZE = 64 * 1024 * 1024;
+
+    const char* output = "/tmp/skeleton_key.bin";
+    Backend backend = Backend::File;
+    ClockSource clock = ClockSource::Steady;
+    // Bytes the writer thread accumulates before issuing a write(2).
+    size_t batch_size = 4 * 1024 * 1024;
+    // How the writer thread compresses Events chunks (compression.h).
+    Codec compression = Codec::None;
+    int compression_level = 0;
+    // Total size of the flight recorder file in ring mode.
+    size_t ring_size = 64 * 1024 * 1024;
+    UnwinderKind unwinder = UnwinderKind::Backtrace;
+    size_t stack_depth = 16;
+    CaptureMode capture = CaptureMode::All;
+    // With CaptureMode::Contended, waits shorter than this many nanoseconds
+    // also count as fast. 0 means any wait at all is worth a full record.
+    uint64_t slow_ns = 0;
+    // Trace one in sample_period operations, optionally only during the
+    // first sample_on_ms of every sample_on_ms + sample_off_ms.
+    uint32_t sample_period = 1;
+    SampleMode sample_mode = SampleMode::Every;
+    uint32_t sample_on_ms = 0;
+    uint32_t sample_off_ms = 0;
+    // Unix socket to take commands on (see EventLogger::control()), with "%p"
+    // replaced by the pid. nullptr means no socket.
+    const char* control = nullptr;
+    // Where the aggregate backend serves Prometheus metrics over HTTP (see
+    // EventLogger::startMetrics()), and how many locks and threads it lists.
+    const char* metrics = nullptr;
+    size_t metrics_top = 10;
+    // Whether to trace from the start, or wait for an "enable" command.
+    bool enabled = true;
+    // LockFilter lists, comma-separated; nullptr means no filter.
+    const char* locks = nullptr;
+    const char* lock_types = nullptr;
+    const char* callers = nullptr;
+    const char* ignore_callers = nullptr;
+    // Mute a lock after this many acquisitions in a row that did not wait.
+    uint32_t mute_after = 0;
+
+    static Config fromEnvironment()
+    {
+        Config config;
+        if (const char* output = getenv("SKELETON_KEYOUTPUT")) {
+            config.output = output;
+        }
+        config.batch_size = parseSize(getenv("SKELETON_KEY_BATCH_SIZE"), config.batch_size);
+        config.batch_size = std::min(std::max(config.batch_size, MIN_BATCH_SIZE), MAX_BATCH_SIZE);
+        config.ring_size = parseSize(getenv("SKELETON_KEY_RING_SIZE"), config.ring_size);
+        if (const char* compression = getenv("SKELETON_KEY_COMPRESSION")) {
+            if (!parseCompression(compression, &config.compression, &config.compression_level)) {
+                fprintf(stderr, "skeleton_key: unknown compression %s, not compressing\n", compression);
+                config.compression = Codec::None;
+            }
+        }
+        if (const char* clock = getenv("SKELETON_KEY_CLOCK")) {
+            if (strcmp(clock, "tsc") == 0) {
+                config.clock = ClockSource::Tsc;
+            }
+        }
+        if (const char* unwinder = getenv("SKELETON_KEY_UNWINDER")) {
+            if (strcmp(unwinder, "fp") == 0) {
+                config.unwinder = UnwinderKind::FramePointer;
+            } else if (strcmp(unwinder, "libunwind") == 0) {
+                config.unwinder = UnwinderKind::LibUnwind;
+            } else if (strcmp(unwinder, "none") == 0) {
+                config.unwinder = UnwinderKind::None;
+            }
+        }
+        if (const char* depth = getenv("SKELETON_KEY_STACK_DEPTH")) {
+            config.stack_depth = std::min(strtoul(depth, nullptr, 10), MAX_STACK_DEPTH);
+        }
+        if (const char* capture = getenv("SKELETON_KEY_CAPTURE")) {
+            if (strcmp(capture, "contended") == 0) {
+                config.capture = CaptureMode::Contended;
+            }
+        }
+        if (const char* slow_ns = getenv("SKELETON_KEY_SLOW_NS")) {
+            config.slow_ns = strtoull(slow_ns, nullptr, 10);
+        }
+        if (const char* period = getenv("SKELETON_KEY_SAMPLE")) {
+            if (!parseSamplePeriod(period, &config.sample_period)) {
+                fprintf(stderr,
+                        "skeleton_key: invalid SKELETON_KEY_SAMPLE %s, tracing every operation\n",
+                        period);
+                config.sample_period = 1;
+            }
+        }
+        if (const char* mode = getenv("SKELETON_KEY_SAMPLE_MODE")) {
+            if (strcmp(mode, "random") == 0) config.sample_mode = SampleMode::Random;
+        }
+        if (const char* window = getenv("SKELETON_KEY_SAMPLE_WINDOW")) {
+            if (!parseSampleWindow(window, &config.sample_on_ms, &config.sample_off_ms)) {
+                fprintf(stderr, "skeleton_key: invalid SKELETON_KEY_SAMPLE_WINDOW %s, not windowing\n",
+                        window);
+                config.sample_on_ms = 0;
+                config.sample_off_ms = 0;
+            }
+        }
+        if (const char* backend = getenv("SKELETON_KEY_BACKEND")) {
+            if (strcmp(backend, "mmap") == 0) {
+                config.backend = Backend::Mapped;
+            } else if (strcmp(backend, "ring") == 0) {
+                config.backend = Backend::Ring;
+            } else if (strcmp(backend, "aggregate") == 0) {
+                config.backend = Backend::Aggregate;
+            } else if (strcmp(backend, "socket") == 0) {
+                config.backend = Backend::Socket;
+            }
+        }
+        if (const char* control = getenv("SKELETON_KEY_CONTROL")) {
+            if (*control) config.control = control;
+        }
+        if (const char* metrics = getenv("SKELETON_KEY_METRICS")) {
+            if (*metrics) config.metrics = metrics;
+        }
+        if (const char* top = getenv("SKELETON_KEY_METRICS_TOP")) {
+            config.metrics_top = strtoul(top, nullptr, 10);
+        }
+        if (const char* enabled = getenv("SKELETON_KEY_ENABLED")) {
+            config.enabled = strcmp(enabled, "0") != 0;
+        }
+        config.locks = getenv("SKELETON_KEY_LOCKS");
+        config.lock_types = getenv("SKELETON_KEY_LOCK_TYPES");
+        config.callers = getenv("SKELETON_KEY_CALLERS");
+        config.ignore_callers = getenv("SKELETON_KEY_IGNORE_CALLERS");
+        if (const char* mute_after = getenv("SKELETON_KEY_MUTE_AFTER")) {
+            config.mute_after = static_cast<uint32_t>(strtoul(mute_after, nullptr, 10));
+        }
+        return config;
+    }
+};
+
+// What kind of object an event is about, for SKELETON_KEY_LOCK_TYPES.
+enum class LockClass : uint8_t {
+    Thread,
+    Mutex,
+    RWLock,
+    Cond,
+    Spin,
+    Sem,
+    Barrier,
+};
+
+static constexpr LockClass
+lockClass(EventType type)
+{
+    if (type == EventType::ThreadCreate) return LockClass::Thread;
+    if (type >= EventType::MutexClockLock) {
+        return type <= EventType::MutexClockLockDone ? LockClass::Mutex : LockClass::Cond;
+    }
+    if (type >= EventType::BarrierInit) return LockClass::Barrier;
+    if (type >= EventType::SemInit) return LockClass::Sem;
+    if (type >= EventType::SpinInit) return LockClass::Spin;
+    if (type <= EventType::MutexUnlock || type == EventType::MutexLockFast) return LockClass::Mutex;
+    if (type <= EventType::RWLockUnlock || type > EventType::CondTimedWaitDone) return LockClass::RWLock;
+    return LockClass::Cond;
+}
+
+// Decides which locks and call sites are traced at all. Address ranges,
+// lock types and the caller allow and deny lists are resolved once when the
+// tracer starts; callers are the return addresses of the hooked calls,
+// matched against whole modules or the functions of their symbol tables.
+// Locks can also be muted once they have been taken `mute_after` times in a
+// row without waiting. A filtered call costs a few compares and the real
+// call; its unlock is skipped through the Sampler's held-lock list. Only
+// trivially constructed members, since a hook can start the tracer before
+// static initializers have run.
+class LockFilter
+{
+  public:
+    struct Range
+    {
+        uintptr_t start;
+        uintptr_t end;
+    };
+
+  private:
+    static constexpr size_t MAX_RANGES = 1024;
+    static constexpr int MUTE_BITS = 16;
+    static constexpr size_t MUTE_CAPACITY = size_t(1) << MUTE_BITS;
+    static constexpr size_t MUTE_PROBES = 16;
+    static constexpr uint32_t MUTED = 1u << 31;
+
+    struct RangeSet
+    {
+        Range ranges[MAX_RANGES];
+        size_t count;
+        // Whether the list was given at all; an empty allow list matches
+        // nothing.
+        bool used;
+
+        void add(uintptr_t start, uintptr_t end)
+        {
+            if (count == MAX_RANGES) {
+                fprintf(stderr, "skeleton_key: over %zu filter ranges, ignoring the rest\n", MAX_RANGES);
+                return;
+            }
+            if (start < end) ranges[count++] = {start, end};
+        }
+
+        void finish()
+        {
+            std::sort(ranges, ranges + count, [](const Range& a, const Range& b) {
+                return a.start < b.start;
+            });
+            size_t merged = 0;
+            for (size_t i = 0; i < count; i++) {
+                if (merged > 0 && ranges[i].start <= ranges[merged - 1].end) {
+                    ranges[merged - 1].end = std::max(ranges[merged - 1].end, ranges[i].end);
+                } else {
+                    ranges[merged++] = ranges[i];
+                }
+            }
+            count = merged;
+        }
+
+        bool covers(uintptr_t address) const
+        {
+            size_t low = 0;
+            size_t high = count;
+            while (low < high) {
+                size_t middle = (low + high) / 2;
+                if (ranges[middle].end <= address) {
+                    low = middle + 1;
+                } else {
+                    high = middle;
+                }
+            }
+            return low < count && ranges[low].start <= address;
+        }
+    };
+
+    static inline std::atomic<bool> active_{false};
+    static inline uint8_t classes_ = 0xff;
+    static inline RangeSet locks_{};
+    static inline RangeSet callers_{};
+    static inline RangeSet ignored_{};
+    static inline uint32_t mute_after_ = 0;
+    static inline std::array<std::atomic<uintptr_t>, MUTE_CAPACITY> mute_keys_{};
+    // Acquisitions in a row that did not wait, or MUTED.
+    static inline std::array<std::atomic<uint32_t>, MUTE_CAPACITY> mute_counts_{};
+
+    static size_t muteSlot(const void* lock)
+    {
+        uint64_t hash = (reinterpret_cast<uintptr_t>(lock) >> 3) * 0x9e3779b97f4a7c15ull;
+        return hash >> (64 - MUTE_BITS);
+    }
+
+    // The slot of `lock` in the mute table, optionally claiming one, or
+    // MUTE_CAPACITY.
+    static size_t findMuteSlot(const void* lock, bool insert)
+    {
+        auto key = reinterpret_cast<uintptr_t>(lock);
+        size_t slot = muteSlot(lock);
+        for (size_t probe = 0; probe < MUTE_PROBES; probe++, slot = (slot + 1) % MUTE_CAPACITY) {
+            uintptr_t found = mute_keys_[slot].load(std::memory_order_relaxed);
+            if (found == key) return slot;
+            if (found != 0) continue;
+            if (!insert) return MUTE_CAPACITY;
+            if (mute_keys_[slot].compare_exchange_strong(found, key, std::memory_order_relaxed)
+                || found == key)
+            {
+                return slot;
+            }
+        }
+        return MUTE_CAPACITY;
+    }
+
+    static void splitList(const char* list, std::vector<std::string>& entries)
+    {
+        if (list == nullptr) return;
+        const char* start = list;
+        for (const char* end = list;; end++) {
+            if (*end != ',' && *end != '\0') continue;
+            if (end > start) entries.emplace_back(start, end - start);
+            if (*end == '\0') break;
+            start = end + 1;
+        }
+    }
+
+    // "ADDRESS", "START-END" or "START+SIZE", in hex with 0x or decimal.
+    static bool parseRange(const std::string& entry, RangeSet& set)
+    {
+        if (entry.empty() || !isdigit(static_cast<unsigned char>(entry[0]))) return false;
+        char* end = nullptr;
+        uintptr_t start = strtoull(entry.c_str(), &end, 0);
+        uintptr_t stop = start + 1;
+        if (*end == '-') {
+            stop = strtoull(end + 1, &end, 0);
+        } else if (*end == '+') {
+            stop = start + strtoull(end + 1, &end, 0);
+        }
+        set.add(start, stop);
+        return true;
+    }
+
+    struct LoadedModule
+    {
+        std::string path;
+        uintptr_t base;
+        std::vector<Range> code;
+    };
+
+    static std::vector<LoadedModule> loadedModules()
+    {
+        std::vector<LoadedModule> modules;
+        dl_iterate_phdr(
+                [](struct dl_phdr_info* info, size_t, void* data) {
+                    auto* modules = static_cast<std::vector<LoadedModule>*>(data);
+                    LoadedModule module;
+                    module.path = info->dlpi_name ? info->dlpi_name : "";
+                    if (module.path.empty() && modules->empty()) {
+                        char executable[PATH_MAX];
+                        ssize_t length = readlink("/proc/self/exe", executable, sizeof(executable) - 1);
+                        if (length > 0) module.path.assign(executable, length);
+                    }
+                    module.base = info->dlpi_addr;
+                    for (int i = 0; i < info->dlpi_phnum; i++) {
+                        const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+                        if (phdr.p_type != PT_LOAD || !(phdr.p_flags & PF_X)) continue;
+                        uintptr_t start = info->dlpi_addr + phdr.p_vaddr;
+                        module.code.push_back({start, start + phdr.p_memsz});
+                    }
+                    modules->push_back(std::move(module));
+                    return 0;
+                },
+                &modules);
+        return modules;
+    }
+
+    // Whether `entry` names the module at `path`: its file name, or that
+    // without the version suffix ("libfoo" or "libfoo.so" for
+    // "libfoo.so.1").
+    static bool namesModule(const std::string& entry, const std::string& path)
+    {
+        size_t slash = path.rfind('/');
+        std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+        if (name.empty() || name.compare(0, entry.size(), entry) != 0) return false;
+        return name.size() == entry.size() || name[entry.size()] == '.';
+    }
+
+  public:
+    static void
+    configure(const char* locks,
+              const char* types,
+              const char* callers,
+              const char* ignored,
+              uint32_t mute_after)
+    {
+        if (types) {
+            std::vector<std::string> names;
+            splitList(types, names);
+            classes_ = 1 << static_cast<int>(LockClass::Thread);
+            for (const std::string& name : names) {
+                if (name == "mutex") {
+                    classes_ |= 1 << static_cast<int>(LockClass::Mutex);
+                } else if (name == "rwlock") {
+                    classes_ |= 1 << static_cast<int>(LockClass::RWLock);
+                } else if (name == "cond") {
+                    classes_ |= 1 << static_cast<int>(LockClass::Cond);
+                } else if (name == "spin") {
+                    classes_ |= 1 << static_cast<int>(LockClass::Spin);
+                } else if (name == "sem") {
+                    classes_ |= 1 << static_cast<int>(LockClass::Sem);
+                } else if (name == "barrier") {
+                    classes_ |= 1 << static_cast<int>(LockClass::Barrier);
+                } else {
+                    fprintf(stderr, "skeleton_key: unknown lock type %s\n", name.c_str());
+                }
+            }
+        }
+        mute_after_ = std::min(mute_after, MUTED - 1);
+
+        // Symbols are looked up in every module, lock names among data
+        // objects and caller names among functions.
+        std::vector<std::string> lock_names;
+        std::vector<std::string> caller_names;
+        std::vector<RangeSet*> caller_sets;
+        std::vector<std::string> entries;
+        splitList(locks, entries);
+        locks_.used = locks != nullptr;
+        for (const std::string& entry : entries) {
+            if (!parseRange(entry, locks_)) lock_names.push_back(entry);
+        }
+
+        std::vector<LoadedModule> modules;
+        if (callers || ignored || !lock_names.empty()) modules = loadedModules();
+        callers_.used = callers != nullptr;
+        std::pair<const char*, RangeSet*> lists[] = {{callers, &callers_}, {ignored, &ignored_}};
+        for (auto [list, set] : lists) {
+            entries.clear();
+            splitList(list, entries);
+            for (const std::string& entry : entries) {
+                bool module_found = false;
+                for (const LoadedModule& module : modules) {
+                    if (!namesModule(entry, module.path)) continue;
+                    for (const Range& range : module.code) set->add(range.start, range.end);
+                    module_found = true;
+                }
+                if (!module_found && !parseRange(entry, *set)) {
+                    caller_names.push_back(entry);
+                    caller_sets.push_back(set);
+                }
+            }
+        }
+
+        std::vector<bool> lock_found(lock_names.size());
+        std::vector<bool> caller_found(caller_names.size());
+        if (!lock_names.empty() || !caller_names.empty()) {
+            for (const LoadedModule& module : modules) {
+                ElfSymbols symbols;
+                if (module.path.empty() || !symbols.load(module.path, "", !lock_names.empty())) continue;
+                symbols.find(lock_names, [&](size_t i, uint64_t address, uint64_t size) {
+                    uintptr_t start = module.base + address;
+                    locks_.add(start, start + std::max<uint64_t>(size, 1));
+                    lock_found[i] = true;
+                });
+                symbols.find(caller_names, [&](size_t i, uint64_t address, uint64_t size) {
+                    caller_sets[i]->add(module.base + address, module.base + address + size);
+                    caller_found[i] = true;
+                });
+            }
+        }
+        for (size_t i = 0; i < lock_names.size(); i++) {
+            if (!lock_found[i]) {
+                fprintf(stderr, "skeleton_key: no lock named %s\n", lock_names[i].c_str());
+            }
+        }
+        for (size_t i = 0; i < caller_names.size(); i++) {
+            if (!caller_found[i]) {
+                fprintf(stderr,
+                        "skeleton_key: no module or function named %s\n",
+                        caller_names[i].c_str());
+            }
+        }
+        locks_.finish();
+        callers_.finish();
+        ignored_.finish();
+
+        bool active = locks_.used || callers_.used || ignored_.count > 0 || classes_ != 0xff
+                      || mute_after_ > 0;
+        active_.store(active, std::memory_order_relaxed);
+    }
+
+    static bool active()
+    {
+        return active_.load(std::memory_order_relaxed);
+    }
+
+    // Whether to trace a call on `lock` (or on `other`, the mutex of a
+    // condition wait) made from `caller`.
+    static bool traces(LockClass type, const void* lock, const void* other, const void* caller)
+    {
+        if (!(classes_ & (1 << static_cast<int>(type)))) return false;
+        if (locks_.used && !locks_.covers(reinterpret_cast<uintptr_t>(lock))
+            && !(other && locks_.covers(reinterpret_cast<uintptr_t>(other))))
+        {
+            return false;
+        }
+        // The byte before the return address is still part of the call.
+        auto call = reinterpret_cast<uintptr_t>(caller) - 1;
+        if (callers_.used && !callers_.covers(call)) return false;
+        if (ignored_.count > 0 && ignored_.covers(call)) return false;
+        if (mute_after_ > 0) {
+            size_t slot = findMuteSlot(lock, false);
+            if (slot != MUTE_CAPACITY && mute_counts_[slot].load(std::memory_order_relaxed) & MUTED) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Count a traced acquisition towards muting `lock`. Racing threads may
+    // lose a count, which only delays the muting.
+    static void acquired(const void* lock, bool waited)
+    {
+        if (mute_after_ == 0) return;
+        size_t slot = findMuteSlot(lock, true);
+        if (slot == MUTE_CAPACITY) return;
+        std::atomic<uint32_t>& count = mute_counts_[slot];
+        if (waited) {
+            count.store(0, std::memory_order_relaxed);
+            return;
+        }
+        uint32_t seen = count.load(std::memory_order_relaxed) + 1;
+        count.store(seen >= mute_after_ ? MUTED : seen, std::memory_order_relaxed);
+    }
+
+    static bool muting()
+    {
+        return mute_after_ > 0;
+    }
+
+    // A lock initialized or destroyed at this address starts over.
+    static void forget(const void* lock)
+    {
+        if (mute_after_ == 0) return;
+        size_t slot = findMuteSlot(lock, false);
+        if (slot != MUTE_CAPACITY) mute_counts_[slot].store(0, std::memory_order_relaxed);
+    }
+};
+
+// Accumulates chunks in one large buffer so that the file sees a single
+// write(2) per batch instead of one per chunk.
+class BatchWriter
+{
+  private:
+    int fd_ = -1;
+    uint8_t* buffer_ = nullptr;
+    size_t capacity_ = 0;
+    size_t size_ = 0;
+    // Bytes appended so far, i.e. the file offset of the next append.
+    uint64_t offset_ = 0;
+    bool socket_ = false;
+
+    void writeAll(const uint8_t* data, size_t size)
+    {
+        while (size > 0 && fd_ >= 0) {
+            // A socket whose reader went away must not raise SIGPIPE.
+            ssize_t written = socket_ ? send(fd_, data, size, MSG_NOSIGNAL) : ::write(fd_, data, size);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                if (socket_) {
+                    // Nobody is listening any more; drop the rest.
+                    ::close(fd_);
+                    fd_ = -1;
+                }
+                return;
+            }
+            data += written;
+            size -= written;
+        }
+    }
+
+  public:
+    bool open(const char* filename, size_t capacity)
+    {
+        int fd = ::open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) return false;
+        reopen(fd, capacity);
+        return true;
+    }
+
+    // Continue in the already open file `fd`, from its start. The batch
+    // must have been flushed and the old file closed.
+    void reopen(int fd, size_t capacity)
+    {
+        fd_ = fd;
+        offset_ = 0;
+        if (capacity_ < capacity) {
+            delete[] buffer_;
+            buffer_ = new uint8_t[capacity];
+            capacity_ = capacity;
+        }
+    }
+
+    // Stream to the analyzer listening on the Unix socket at `path` instead
+    // of writing a file.
+    bool connect(const char* path, size_t capacity)
+    {
+        struct sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(address.sun_path)) {
+            errno = ENAMETOOLONG;
+            return false;
+        }
+        strcpy(address.sun_path, path);
+        fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd_ < 0) return false;
+        if (::connect(fd_, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0) {
+            int error = errno;
+            ::close(fd_);
+            fd_ = -1;
+            errno = error;
+            return false;
+        }
+        socket_ = true;
+        buffer_ = new uint8_t[capacity];
+        capacity_ = capacity;
+        return true;
+    }
+
+    void append(const void* bytes, size_t size)
+    {
+        auto* data = static_cast<const uint8_t*>(bytes);
+        offset_ += size;
+        // Nothing to write to, e.g. once a stream's reader has gone.
+        if (fd_ < 0) return;
+        if (size_ + size > capacity_) flush();
+        if (size > capacity_) {
+            writeAll(data, size);
+            return;
+        }
+        memcpy(buffer_ + size_, data, size);
+        size_ += size;
+    }
+
+    bool empty() const
+    {
+        return size_ == 0;
+    }
+
+    uint64_t offset() const
+    {
+        return offset_;
+    }
+
+    // Overwrite bytes that are already on disk (used for the trace header).
+    // A stream cannot be rewritten; its reader keeps the initial header.
+    void patch(const void* data, size_t size, off_t offset)
+    {
+        if (fd_ >= 0 && !socket_) pwrite(fd_, data, size, offset);
+    }
+
+    // Only uses write(2), so it is safe to call from a signal handler.
+    void flush()
+    {
+        if (size_ == 0) return;
+        writeAll(buffer_, size_);
+        size_ = 0;
+    }
+
+    void close()
+    {
+        flush();
+        if (fd_ >= 0) ::close(fd_);
+        fd_ = -1;
+    }
+
+    // Close without writing what is buffered, which in a forked child
+    // belongs to the parent.
+    void abandon()
+    {
+        size_ = 0;
+        close();
+    }
+};
+
+// Where the file backend put each chunk, written out as the trace's Index
+// chunk when it closes. The entries live in an anonymous mapping grown with
+// mremap, so the final drain can add to it from a signal handler. If it
+// cannot grow, no index is written and readers walk the chunks instead.
+class ChunkIndex
+{
+    ChunkIndexEntry* entries_ = nullptr;
+    size_t capacity_ = 0;
+    size_t count_ = 0;
+    bool complete_ = true;
+
+    bool grow()
+    {
+        size_t capacity = capacity_ ? capacity_ * 2 : 4096;
+        size_t old_bytes = capacity_ * sizeof(ChunkIndexEntry);
+        size_t bytes = capacity * sizeof(ChunkIndexEntry);
+        void* grown;
+        if (entries_) {
+            grown = mremap(entries_, old_bytes, bytes, MREMAP_MAYMOVE);
+        } else {
+            grown = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        }
+        if (grown == MAP_FAILED) return false;
+        entries_ = static_cast<ChunkIndexEntry*>(grown);
+        capacity_ = capacity;
+        return true;
+    }
+
+  public:
+    void add(const ChunkHeader& chunk, uint64_t offset)
+    {
+        if (!complete_) return;
+        if (count_ == capacity_ && !grow()) {
+            complete_ = false;
+            return;
+        }
+        entries_[count_++] = {offset, chunk.base_timestamp, chunk.size, chunk.tid, chunk.event_count, 0};
+    }
+
+    void write(BatchWriter& writer)
+    {
+        if (!complete_ || count_ == 0) return;
+        ChunkHeader header = {};
+        header.magic = ChunkHeader::MAGIC;
+        header.kind = ChunkKind::Index;
+        size_t entries_size = count_ * sizeof(ChunkIndexEntry);
+        header.size = static_cast<uint32_t>(entries_size + sizeof(ChunkIndexTrailer));
+        ChunkIndexTrailer trailer = {};
+        trailer.index_offset = writer.offset();
+        trailer.entry_count = static_cast<uint32_t>(count_);
+        trailer.magic = ChunkIndexTrailer::MAGIC;
+
+        writer.append(&header, sizeof(header));
+        writer.append(entries_, entries_size);
+        writer.append(&trailer, sizeof(trailer));
+    }
+
+    void close()
+    {
+        if (entries_) munmap(entries_, capacity_ * sizeof(ChunkIndexEntry));
+        entries_ = nullptr;
+        capacity_ = count_ = 0;
+        complete_ = true;
+    }
+};
+
+// The objects loaded into the process, encoded as a ready-made Modules
+// chunk so that it can be written out from a signal handler. refresh() only
+// walks the modules again when something was loaded or unloaded since the
+// last time; the chunk is built in the spare buffer and then published, so a
+// final drain on another thread always finds a whole one.
+class ModuleMap
+{
+  public:
+    // A Modules chunk has to fit into one slot of a mapped trace.
+    static constexpr size_t CAPACITY = MappedTrace::Slot::CAPACITY;
+
+  private:
+    struct Buffer
+    {
+        uint8_t data[CAPACITY];
+        size_t size = 0;
+    };
+    Buffer buffers_[2];
+    std::atomic<int> published_{-1};
+    unsigned long long adds_ = 0;
+    unsigned long long subs_ = 0;
+    char executable_[PATH_MAX] = {};
+
+    struct Walk
+    {
+        ModuleMap* map;
+        Buffer* buffer;
+        uint8_t* out;
+        uint32_t count;
+        bool unchanged;
+    };
+
+    // The GNU build-id note of a loaded module, if it has one.
+    static bool buildId(const struct dl_phdr_info* info, const uint8_t** id, size_t* size)
+    {
+        for (int i = 0; i < info->dlpi_phnum; i++) {
+            const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+            if (phdr.p_type != PT_NOTE) continue;
+            size_t align = phdr.p_align == 8 ? 8 : 4;
+            auto round = [&](size_t n) { return (n + align - 1) & ~(align - 1); };
+            const auto* note = reinterpret_cast<const uint8_t*>(info->dlpi_addr + phdr.p_vaddr);
+            const uint8_t* end = note + phdr.p_memsz;
+            while (note + sizeof(ElfW(Nhdr)) <= end) {
+                const auto* header = reinterpret_cast<const ElfW(Nhdr)*>(note);
+                const uint8_t* name = note + sizeof(ElfW(Nhdr));
+                const uint8_t* desc = name + round(header->n_namesz);
+                if (desc + header->n_descsz > end) break;
+                if (header->n_type == NT_GNU_BUILD_ID && header->n_namesz == 4
+                    && memcmp(name, "GNU", 4) == 0)
+                {
+                    *id = desc;
+                    *size = header->n_descsz;
+                    return true;
+                }
+                note = desc + round(header->n_descsz);
+            }
+        }
+        return false;
+    }
+
+    static int addModule(struct dl_phdr_info* info, size_t size, void* data)
+    {
+        auto* walk = static_cast<Walk*>(data);
+        bool has_counters = size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs);
+        if (walk->count == 0 && has_counters) {
+            if (info->dlpi_adds == walk->map->adds_ && info->dlpi_subs == walk->map->subs_
+                && walk->map->published_.load(std::memory_order_relaxed) >= 0)
+            {
+                walk->unchanged = true;
+                return 1;
+            }
+            walk->map->adds_ = info->dlpi_adds;
+            walk->map->subs_ = info->dlpi_subs;
+        }
+
+        uintptr_t start = UINTPTR_MAX;
+        uintptr_t end = 0;
+        for (int i = 0; i < info->dlpi_phnum; i++) {
+            const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+            if (phdr.p_type != PT_LOAD) continue;
+            start = std::min<uintptr_t>(start, info->dlpi_addr + phdr.p_vaddr);
+            end = std::max<uintptr_t>(end, info->dlpi_addr + phdr.p_vaddr + phdr.p_memsz);
+        }
+        if (start >= end) return 0;
+        const uint8_t* id = nullptr;
+        size_t id_size = 0;
+        buildId(info, &id, &id_size);
+        // The main program comes first, without a name.
+        const char* path = info->dlpi_name;
+        if ((path == nullptr || *path == '\0') && walk->count == 0) path = walk->map->executable_;
+        // A relative LD_PRELOAD path means nothing to a later analysis.
+        char absolute[PATH_MAX];
+        if (path && path[0] != '/' && realpath(path, absolute)) path = absolute;
+        size_t path_size = path ? strlen(path) : 0;
+
+        // Leave out what does not fit rather than overrun the slot.
+        size_t room = walk->buffer->data + CAPACITY - walk->out;
+        if (5 * MAX_VARINT_SIZE + id_size + path_size > room) return 1;
+        VarIntWriter writer(walk->out);
+        writer.write(info->dlpi_addr);
+        writer.write(start);
+        writer.write(end);
+        writer.write(id_size);
+        uint8_t* out = writer.position();
+        if (id_size) memcpy(out, id, id_size);
+        out += id_size;
+        VarIntWriter path_writer(out);
+        path_writer.write(path_size);
+        out = path_writer.position();
+        if (path_size) memcpy(out, path, path_size);
+        walk->out = out + path_size;
+        walk->count++;
+        return 0;
+    }
+
+  public:
+    // Walk the loaded modules again if they changed. Not async-signal-safe;
+    // callers must not race each other.
+    void refresh()
+    {
+        if (executable_[0] == '\0') {
+            ssize_t length = readlink("/proc/self/exe", executable_, sizeof(executable_) - 1);
+            if (length > 0) executable_[length] = '\0';
+        }
+        int published = published_.load(std::memory_order_acquire);
+        Buffer* buffer = &buffers_[published == 0 ? 1 : 0];
+        // Room for the header and the largest module count.
+        uint8_t* modules = buffer->data + sizeof(ChunkHeader) + MAX_VARINT_SIZE;
+        Walk walk = {this, buffer, modules, 0, false};
+        dl_iterate_phdr(addModule, &walk);
+        if (walk.unchanged) return;
+
+        // Now that the count is known, move the modules up behind it.
+        uint8_t* payload = buffer->data + sizeof(ChunkHeader);
+        VarIntWriter writer(payload);
+        writer.write(walk.count);
+        size_t modules_size = walk.out - modules;
+        memmove(writer.position(), modules, modules_size);
+
+        ChunkHeader header = {};
+        header.magic = ChunkHeader::MAGIC;
+        header.kind = ChunkKind::Modules;
+        header.size = static_cast<uint32_t>(writer.position() - payload + modules_size);
+        header.event_count = walk.count;
+        memcpy(buffer->data, &header, sizeof(header));
+        buffer->size = sizeof(header) + header.size;
+        published_.store(buffer == &buffers_[0] ? 0 : 1, std::memory_order_release);
+    }
+
+    // The latest Modules chunk, header included; empty before refresh().
+    const uint8_t* chunk(size_t* size) const
+    {
+        int published = published_.load(std::memory_order_acquire);
+        if (published < 0) {
+            *size = 0;
+            return nullptr;
+        }
+        *size = buffers_[published].size;
+        return buffers_[published].data;
+    }
+};
+
+class EventLogger
+{
+  private:
+    TraceHeader header_;
+    StackTable stacks_;
+    BatchWriter writer_;
+    ChunkIndex index_;
+    Compressor compressor_;
+    // Events chunk payload bytes before and after compression.
+    uint64_t raw_bytes_ = 0;
+    uint64_t stored_bytes_ = 0;
+    MappedTrace mapped_;
+    ModuleMap modules_;
+    bool use_mapped_ = false;
+    // Live stream: chunks are handed to the drainer once they are
+    // stream_ticks_ old instead of only when full, so a quiet thread does
+    // not hold its events back.
+    bool streaming_ = false;
+    uint64_t stream_ticks_ = 0;
+    LockAggregator aggregator_;
+    bool aggregating_ = false;
+    // Set from SIGUSR2 in aggregate mode; the drainer writes the summary.
+    std::atomic<bool> summary_requested_{false};
+    CaptureMode capture_ = CaptureMode::All;
+    Backend backend_ = Backend::File;
+    // What "enable" restores hook_policy to.
+    HookPolicy active_policy_ = HookPolicy::Off;
+    // The file being written and how many times it has been rotated.
+    char output_[PATH_MAX] = {};
+    // Holds an flock() on the configured output path; see claimOutput().
+    int output_lock_fd_ = -1;
+    unsigned rotations_ = 0;
+    size_t batch_size_ = 0;
+    // What to trace: one in `period` operations, optionally only within an
+    // on/off window.
+    struct Sampling
+    {
+        uint32_t period;
+        SampleMode mode;
+        uint32_t on_ms;
+        uint32_t off_ms;
+    };
+    // A rotation the control thread has handed to the drainer, and the
+    // futex it waits on until the drainer has carried it out.
+    enum RotationState : uint32_t {
+        RotationIdle,
+        RotationRequested,
+        // Claimed by the drainer.
+        RotationRunning,
+        RotationDone,
+    };
+    std::atomic<uint32_t> rotation_{RotationIdle};
+    const char* rotation_path_ = nullptr;
+    const Sampling* rotation_sampling_ = nullptr;
+    char* rotation_reply_ = nullptr;
+    size_t rotation_reply_size_ = 0;
+    // Listening control socket, served by its own thread. Only the process
+    // that created it removes it.
+    int control_fd_ = -1;
+    pid_t control_pid_ = 0;
+    const char* control_pattern_ = nullptr;
+    // Whether prepareFork() got the io lock.
+    bool fork_locked_ = false;
+    char control_path_[sizeof(sockaddr_un::sun_path)] = {};
+    // Listening metrics socket, served by its own thread like the control
+    // socket. metrics_path_ is empty for a TCP one.
+    int metrics_fd_ = -1;
+    pid_t metrics_pid_ = 0;
+    const char* metrics_pattern_ = nullptr;
+    size_t metrics_top_ = 0;
+    char metrics_path_[sizeof(sockaddr_un::sun_path)] = {};
+    // Config::slow_ns in Clock::now() units.
+    uint64_t slow_ticks_ = 0;
+    std::atomic<uint64_t> mapped_dropped_{0};
+    std::atomic<bool> initialized_{false};
+    std::atomic<bool> enabled_{false};
+    std::atomic<bool> finalized_{false};
+    // Serialises the drainer against a final drain started from another
+    // thread (exit or a fatal signal). Hooked threads never touch it.
+    std::atomic_flag io_busy_ = ATOMIC_FLAG_INIT;
+
+    // Lock-free registry of every buffer ever created (push only).
+    std::atomic<ThreadBuffer*> buffers_{nullptr};
+    // Lock-free stack of chunks waiting to be written (multi-producer,
+    // single consumer: only the drainer takes them off).
+    std::atomic<Chunk*> pending_{nullptr};
+
+    pthread_key_t buffer_key_;
+    pthread_key_t slot_key_;
+    pthread_t drainer_{};
+    std::atomic<bool> drainer_running_{false};
+    // 1 while the drainer is (about to be) parked on the futex.
+    std::atomic<uint32_t> drainer_sleeping_{0};
+
+    static constexpr long FLUSH_INTERVAL_NS = 100 * 1000 * 1000;
+    // How often the drainer checks for modules loaded or unloaded, so that
+    // the list is current even when the process dies of a signal.
+    static constexpr uint64_t MODULES_INTERVAL_NS = 1000 * 1000 * 1000;
+
+    EventLogger() = default;
+
+    static void releaseThreadBuffer(void* arg)
+    {
+        auto* buffer = static_cast<ThreadBuffer*>(arg);
+        Chunk* chunk = &buffer->chunks[buffer->current];
+        if (claimChunk(chunk)) {
+            instance().submit(chunk);
+            buffer->current = (buffer->current + 1) % ThreadBuffer::NUM_CHUNKS;
+        }
+        thread_buffer = nullptr;
+        buffer->in_use.store(false, std::memory_order_release);
+    }
+
+    static void releaseThreadSlot(void* arg)
+    {
+        instance().mapped_.release(static_cast<MappedTrace::Slot*>(arg));
+        thread_slot = nullptr;
+    }
+
+    ThreadBuffer* acquireThreadBuffer()
+    {
+        ThreadBuffer* buffer = buffers_.load(std::memory_order_acquire);
+        for (; buffer != nullptr; buffer = buffer->next) {
+            bool expected = false;
+            if (!buffer->in_use.load(std::memory_order_relaxed)
+                && buffer->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire))
+            {
+                break;
+            }
+        }
+
+        if (buffer == nullptr) {
+            buffer = new ThreadBuffer();
+            buffer->next = buffers_.load(std::memory_order_relaxed);
+            while (!buffers_.compare_exchange_weak(
+                    buffer->next,
+                    buffer,
+                    std::memory_order_release,
+                    std::memory_order_relaxed))
+            {
+            }
+        }
+
+        pthread_setspecific(buffer_key_, buffer);
+        thread_buffer = buffer;
+        return buffer;
+    }
+
+    // Take the thread's own chunk to append to, unless the drainer has it.
+    static bool claimChunk(Chunk* chunk)
+    {
+        uint8_t expected = Chunk::Free;
+        return chunk->state.compare_exchange_strong(expected, Chunk::Filling, std::memory_order_acquire);
+    }
+
+    // Hand a chunk the thread has claimed to the drainer.
+    void submit(Chunk* chunk)
+    {
+        if (chunk->used.load(std::memory_order_relaxed) == 0) {
+            chunk->state.store(Chunk::Free, std::memory_order_release);
+            return;
+        }
+
+        chunk->state.store(Chunk::Pending, std::memory_order_relaxed);
+        chunk->next_pending = pending_.load(std::memory_order_relaxed);
+        while (!pending_.compare_exchange_weak(chunk->next_pending, chunk, std::memory_order_seq_cst)) {
+        }
+        wakeDrainer();
+    }
+
+    void wakeDrainer()
+    {
+        uint32_t sleeping = 1;
+        if (drainer_sleeping_.load(std::memory_order_seq_cst) == 1
+            && drainer_sleeping_.compare_exchange_strong(sleeping, 0))
+        {
+            syscall(SYS_futex, &drainer_sleeping_, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+        }
+    }
+
+    void writeChunk(Chunk* chunk)
+    {
+        size_t used = chunk->used.load(std::memory_order_acquire);
+        if (used <= sizeof(ChunkHeader)) return;
+
+        // The payload size is only known now; patch a copy so a chunk that
+        // is still being appended to at exit is left alone.
+        ChunkHeader header;
+        memcpy(&header, chunk->data, sizeof(header));
+        header.size = static_cast<uint32_t>(used - sizeof(header));
+        const uint8_t* payload = chunk->data + sizeof(header);
+        raw_bytes_ += header.size;
+        if (compressor_.codec() != Codec::None) {
+            if (size_t compressed = compressor_.compress(payload, header.size)) {
+                header.codec = compressor_.codec();
+                header.raw_size = header.size;
+                header.size = static_cast<uint32_t>(compressed);
+                payload = compressor_.data();
+            }
+        }
+        stored_bytes_ += header.size;
+        if (!streaming_) index_.add(header, writer_.offset());
+        writer_.append(&header, sizeof(header));
+        writer_.append(payload, header.size);
+    }
+
+    bool lockIo(bool bounded)
+    {
+        for (int attempt = 0; io_busy_.test_and_set(std::memory_order_acquire); attempt++) {
+            if (bounded && attempt == 200) return false;
+            struct timespec pause = {0, 1000 * 1000};
+            nanosleep(&pause, nullptr);
+        }
+        return true;
+    }
+
+    void unlockIo()
+    {
+        io_busy_.clear(std::memory_order_release);
+    }
+
+    // Move everything that is pending into the batch, oldest first, and hand
+    // the chunks back to their threads. Callers must hold the io lock.
+    bool drainPending()
+    {
+        Chunk* list = pending_.exchange(nullptr, std::memory_order_acquire);
+        if (list == nullptr) return false;
+
+        Chunk* ordered = nullptr;
+        while (list != nullptr) {
+            Chunk* next = list->next_pending;
+            list->next_pending = ordered;
+            ordered = list;
+            list = next;
+        }
+
+        while (ordered != nullptr) {
+            Chunk* next = ordered->next_pending;
+            writeChunk(ordered);
+            ordered->used.store(0, std::memory_order_relaxed);
+            ordered->state.store(Chunk::Free, std::memory_order_release);
+            ordered = next;
+        }
+        return true;
+    }
+
+    // Write out the events threads have logged but not handed in yet, so
+    // that every thread's events up to now end up in the batch. A thread in
+    // the middle of an event is waited for; one that logs meanwhile drops
+    // its event. Callers must hold the io lock.
+    void sealChunks()
+    {
+        for (ThreadBuffer* buffer = buffers_.load(std::memory_order_acquire); buffer != nullptr;
+             buffer = buffer->next)
+        {
+            for (Chunk& chunk : buffer->chunks) {
+                uint8_t state = Chunk::Free;
+                while (!chunk.state.compare_exchange_weak(state, Chunk::Pending,
+                                                          std::memory_order_acquire)
+                       && state != Chunk::Pending)
+                {
+                    if (state == Chunk::Filling) sched_yield();
+                    state = Chunk::Free;
+                }
+                // Pending chunks are written by drainPending().
+                if (state == Chunk::Pending) continue;
+                if (chunk.used.load(std::memory_order_relaxed) > 0) {
+                    // Keep the thread's chunks in order: the ones it handed
+                    // in before this one go first.
+                    drainPending();
+                    writeChunk(&chunk);
+                    chunk.used.store(0, std::memory_order_relaxed);
+                }
+                chunk.state.store(Chunk::Free, std::memory_order_release);
+            }
+        }
+        drainPending();
+    }
+
+    static void* drainerMain(void*)
+    {
+        in_hook = true;
+        EventLogger& logger = instance();
+        uint64_t last_flush = monotonicNanos();
+        uint64_t last_modules = last_flush;
+        while (logger.drainer_running_.load(std::memory_order_relaxed)) {
+            logger.lockIo(false);
+            if (!logger.aggregating_ && monotonicNanos() - last_modules >= MODULES_INTERVAL_NS) {
+                logger.modules_.refresh();
+                last_modules = monotonicNanos();
+            }
+            bool drained = logger.use_mapped_ ? logger.mapped_.grow() : logger.drainPending();
+            uint32_t requested = RotationRequested;
+            if (logger.rotation_.compare_exchange_strong(
+                        requested, RotationRunning, std::memory_order_acquire))
+            {
+                logger.rotate(
+                        logger.rotation_path_,
+                        logger.rotation_sampling_,
+                        logger.rotation_reply_,
+                        logger.rotation_reply_size_);
+                logger.rotation_.store(RotationDone, std::memory_order_release);
+                syscall(SYS_futex, &logger.rotation_, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+            }
+            if (logger.summary_requested_.exchange(false)) {
+                logger.aggregator_.write(
+                        logger.currentTicksPerSecond(),
+                        logger.header_.sampleScale(),
+                        true);
+            }
+            // Push out a partial batch once it has been sitting around for a
+            // while, so a quiet process still makes progress on disk.
+            uint64_t now = monotonicNanos();
+            if (!logger.writer_.empty() && now - last_flush >= uint64_t(FLUSH_INTERVAL_NS)) {
+                logger.writer_.flush();
+                last_flush = now;
+            } else if (logger.writer_.empty()) {
+                last_flush = now;
+            }
+            logger.unlockIo();
+            if (drained) continue;
+
+            logger.drainer_sleeping_.store(1, std::memory_order_seq_cst);
+            if (logger.pending_.load(std::memory_order_seq_cst) == nullptr
+                && logger.rotation_.load(std::memory_order_seq_cst) != RotationRequested
+                && !(logger.use_mapped_ && logger.mapped_.needsGrowth()))
+            {
+                long interval = static_cast<long>(std::min<uint64_t>(
+                        Sampler::updateWindow(monotonicNanos()),
+                        FLUSH_INTERVAL_NS));
+                struct timespec timeout = {0, interval};
+                syscall(SYS_futex,
+                        &logger.drainer_sleeping_,
+                        FUTEX_WAIT_PRIVATE,
+                        1,
+                        &timeout,
+                        nullptr,
+                        0);
+            }
+            logger.drainer_sleeping_.store(0, std::memory_order_relaxed);
+        }
+        return nullptr;
+    }
+
+    static uint64_t monotonicNanos()
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return uint64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+    }
+
+    // Rate of Clock::now() measured up to this moment.
+    uint64_t currentTicksPerSecond() const
+    {
+        TraceHeader header = header_;
+        recalibrate(header);
+        return header.ticks_per_second;
+    }
+
+    static void onSummarySignal(int)
+    {
+        int saved_errno = errno;
+        instance().summary_requested_.store(true);
+        instance().wakeDrainer();
+        errno = saved_errno;
+    }
+
+    static void onFatalSignal(int signo)
+    {
+        // SA_RESETHAND has already restored the default action, so
+        // re-raising after the drain terminates the process as it would
+        // have without us.
+        instance().finalize(true);
+        raise(signo);
+    }
+
+    void installSignalHandlers()
+    {
+        static constexpr int FATAL_SIGNALS[] =
+                {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT, SIGTERM, SIGINT, SIGQUIT};
+        for (int signo : FATAL_SIGNALS) {
+            struct sigaction previous;
+            if (sigaction(signo, nullptr, &previous) != 0 || previous.sa_handler != SIG_DFL) {
+                // Leave handlers the application installed alone.
+                continue;
+            }
+            struct sigaction action = {};
+            action.sa_handler = onFatalSignal;
+            action.sa_flags = SA_RESETHAND;
+            sigemptyset(&action.sa_mask);
+            sigaction(signo, &action, nullptr);
+        }
+
+        // SIGUSR2 would otherwise kill the process, so taking it over for
+        // on-demand summaries cannot break anything.
+        struct sigaction previous;
+        if (aggregating_ && sigaction(SIGUSR2, nullptr, &previous) == 0
+            && previous.sa_handler == SIG_DFL)
+        {
+            struct sigaction action = {};
+            action.sa_handler = onSummarySignal;
+            action.sa_flags = SA_RESTART;
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGUSR2, &action, nullptr);
+        }
+    }
+
+    // Switch the hooks to `sampling` and record it in the header. The header
+    // is written out when the trace is closed or rotated, so a change that
+    // scales counts differently has to start a new file; see
+    // changeSampling().
+    void setSampling(const Sampling& sampling)
+    {
+        configureSampler(sampling);
+        recordSampling(header_, sampling);
+    }
+
+    static void configureSampler(const Sampling& sampling)
+    {
+        uint64_t now = monotonicNanos();
+        Sampler::configure(sampling.period, sampling.mode, sampling.on_ms, sampling.off_ms, now);
+        Sampler::updateWindow(now);
+    }
+
+    static void recordSampling(TraceHeader& header, const Sampling& sampling)
+    {
+        bool window = sampling.on_ms > 0 && sampling.off_ms > 0;
+        header.sample_period = std::max<uint32_t>(sampling.period, 1);
+        header.sample_flags = sampling.mode == SampleMode::Random ? SAMPLE_RANDOM : 0;
+        header.sample_on_ms = window ? sampling.on_ms : 0;
+        header.sample_off_ms = window ? sampling.off_ms : 0;
+    }
+
+    Sampling currentSampling() const
+    {
+        SampleMode mode = header_.sample_flags & SAMPLE_RANDOM ? SampleMode::Random : SampleMode::Every;
+        return {header_.sample_period, mode, header_.sample_on_ms, header_.sample_off_ms};
+    }
+
+    // Apply sampling changed by a control command. Events must be scaled by
+    // the rate they were sampled at, so a change of rate starts a new epoch:
+    // the file backend rotates, switching at the cut, and the aggregate
+    // backend moves its summary so far to OUTPUT.N and starts over. The
+    // other backends write one header for the whole run and refuse it.
+    // Callers must hold the io lock.
+    void changeSampling(const Sampling& sampling, char* reply, size_t size)
+    {
+        TraceHeader changed = header_;
+        recordSampling(changed, sampling);
+        if (changed.sampleScale() == header_.sampleScale()) {
+            setSampling(sampling);
+        } else if (backend_ == Backend::File) {
+            requestRotation(nullptr, &sampling, reply, size);
+        } else if (backend_ == Backend::Aggregate) {
+            restartAggregate(sampling, reply, size);
+        } else {
+            snprintf(reply, size, "error: only the file and aggregate backends can change the rate");
+        }
+    }
+
+    // Write the aggregate summary so far, scaled by the sampling it was
+    // taken with, to OUTPUT.N and carry on with empty tables and `sampling`.
+    bool restartAggregate(const Sampling& sampling, char* reply, size_t size)
+    {
+        char finished[PATH_MAX];
+        int length = snprintf(finished, sizeof(finished), "%s.%u", output_, rotations_ + 1);
+        if (length < 0 || size_t(length) >= sizeof(finished) || rename(output_, finished) != 0) {
+            snprintf(reply, size, "error: cannot rename %s: %s", output_, strerror(errno));
+            return false;
+        }
+        aggregator_.write(currentTicksPerSecond(), header_.sampleScale(), true);
+        setSampling(sampling);
+        if (!aggregator_.reopen(output_)) {
+            snprintf(reply, size, "error: cannot open %s: %s", output_, strerror(errno));
+            return false;
+        }
+        rotations_++;
+        snprintf(reply, size, "ok %s", finished);
+        return true;
+    }
+
+    // Finish the file backend's trace as finalize() does and carry on in a
+    // new file: `path`, or without one the same output path after the
+    // finished file has been renamed to OUTPUT.N. The chunks threads are
+    // still filling are sealed into the finished file, so it has every event
+    // logged before the rotation; every chunk stands on its own, so neither
+    // file loses a stack definition. With `sampling` the new file is traced
+    // with it. Callers must hold the io lock.
+    bool rotate(const char* path, const Sampling* sampling, char* reply, size_t size)
+    {
+        if (finalized_) {
+            snprintf(reply, size, "error: the tracer has shut down");
+            return false;
+        }
+
+        char finished[PATH_MAX];
+        const char* next = path ? path : output_;
+        if (path && strlen(path) >= sizeof(output_)) {
+            snprintf(reply, size, "error: path too long");
+            return false;
+        }
+        if (!path) {
+            int length = snprintf(finished, sizeof(finished), "%s.%u", output_, rotations_ + 1);
+            if (length < 0 || size_t(length) >= sizeof(finished) || rename(output_, finished) != 0) {
+                snprintf(reply, size, "error: cannot rename %s: %s", output_, strerror(errno));
+                return false;
+            }
+        } else {
+            strcpy(finished, output_);
+        }
+        int fd = ::open(next, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            int error = errno;
+            if (!path) rename(finished, output_);
+            snprintf(reply, size, "error: cannot open %s: %s", next, strerror(error));
+            return false;
+        }
+
+        if (sampling) configureSampler(*sampling);
+        sealChunks();
+        recalibrate(header_);
+        writer_.flush();
+        writer_.patch(&header_, sizeof(header_), 0);
+        writeModules(false);
+        index_.write(writer_);
+        writer_.close();
+        index_.close();
+
+        if (sampling) recordSampling(header_, *sampling);
+        writer_.reopen(fd, batch_size_);
+        beginTrace();
+        if (path) strcpy(output_, path);
+        rotations_++;
+        snprintf(reply, size, "ok %s", finished);
+        return true;
+    }
+
+    // Have the drainer rotate the output between two of its drains, and
+    // wait until it has. Without a drainer, e.g. one that is shutting down,
+    // rotate here. Called and returns with the io lock held, letting go of
+    // it meanwhile.
+    void requestRotation(const char* path, const Sampling* sampling, char* reply, size_t size)
+    {
+        if (!drainer_running_.load(std::memory_order_relaxed)) {
+            rotate(path, sampling, reply, size);
+            return;
+        }
+        rotation_path_ = path;
+        rotation_sampling_ = sampling;
+        rotation_reply_ = reply;
+        rotation_reply_size_ = size;
+        rotation_.store(RotationRequested, std::memory_order_seq_cst);
+        unlockIo();
+        wakeDrainer();
+        for (;;) {
+            uint32_t state = rotation_.load(std::memory_order_acquire);
+            if (state == RotationDone) break;
+            // The drainer stopped before it got to the request.
+            if (state == RotationRequested && !drainer_running_.load(std::memory_order_relaxed)
+                && rotation_.compare_exchange_strong(state, RotationIdle, std::memory_order_acquire))
+            {
+                lockIo(false);
+                rotate(path, sampling, reply, size);
+                return;
+            }
+            struct timespec timeout = {0, FLUSH_INTERVAL_NS};
+            syscall(SYS_futex, &rotation_, FUTEX_WAIT_PRIVATE, state, &timeout, nullptr, 0);
+        }
+        rotation_.store(RotationIdle, std::memory_order_relaxed);
+        lockIo(false);
+    }
+
+    // Carry out one line from the control socket and describe the outcome
+    // in `reply`, which starts with "ok" or "error:".
+    void control(char* line, char* reply, size_t size)
+    {
+        char* rest = nullptr;
+        const char* command = strtok_r(line, " \t\r\n", &rest);
+        const char* argument = strtok_r(nullptr, " \t\r\n", &rest);
+        if (command == nullptr) {
+            snprintf(reply, size, "error: empty command");
+            return;
+        }
+        lockIo(false);
+        Sampling sampling = currentSampling();
+        snprintf(reply, size, "ok");
+        if (finalized_) {
+            snprintf(reply, size, "error: the tracer has shut down");
+        } else if (strcmp(command, "status") == 0) {
+            static constexpr const char* BACKENDS[] = {"file", "mmap", "ring", "aggregate", "socket"};
+            bool enabled = hook_policy.load(std::memory_order_relaxed) != HookPolicy::Off;
+            snprintf(reply,
+                     size,
+                     "ok %s backend=%s output=%s sample=%u mode=%s window=%u:%u capture=%s",
+                     enabled ? "enabled" : "disabled",
+                     BACKENDS[static_cast<int>(backend_)],
+                     output_,
+                     sampling.period,
+                     sampling.mode == SampleMode::Random ? "random" : "every",
+                     sampling.on_ms,
+                     sampling.off_ms,
+                     capture_ == CaptureMode::All ? "all" : "contended");
+            if (compressor_.codec() != Codec::None) {
+                size_t length = strlen(reply);
+                snprintf(reply + length,
+                         size - length,
+                         " compression=%s:%d ratio=%.2f",
+                         codecName(compressor_.codec()),
+                         compressor_.level(),
+                         stored_bytes_ ? static_cast<double>(raw_bytes_) / stored_bytes_ : 1.0);
+            }
+        } else if (strcmp(command, "enable") == 0) {
+            hook_policy.store(active_policy_, std::memory_order_relaxed);
+        } else if (strcmp(command, "disable") == 0) {
+            hook_policy.store(HookPolicy::Off, std::memory_order_relaxed);
+        } else if (strcmp(command, "sample") == 0 && argument) {
+            if (parseSamplePeriod(argument, &sampling.period)) {
+                changeSampling(sampling, reply, size);
+            } else {
+                snprintf(reply, size, "error: sample is a period of 1 or more");
+            }
+        } else if (strcmp(command, "sample-mode") == 0 && argument) {
+            if (strcmp(argument, "every") == 0 || strcmp(argument, "random") == 0) {
+                sampling.mode = strcmp(argument, "random") == 0 ? SampleMode::Random : SampleMode::Every;
+                changeSampling(sampling, reply, size);
+            } else {
+                snprintf(reply, size, "error: sample-mode is every or random");
+            }
+        } else if (strcmp(command, "sample-window") == 0 && argument) {
+            if (parseSampleWindow(argument, &sampling.on_ms, &sampling.off_ms)) {
+                changeSampling(sampling, reply, size);
+            } else {
+                snprintf(reply, size, "error: sample-window is ON_MS:OFF_MS or 0");
+            }
+        } else if (strcmp(command, "capture") == 0 && argument) {
+            if (aggregating_) {
+                snprintf(reply, size, "error: the aggregate backend keeps its capture mode");
+            } else if (strcmp(argument, "all") == 0 || strcmp(argument, "contended") == 0) {
+                capture_ = strcmp(argument, "all") == 0 ? CaptureMode::All : CaptureMode::Contended;
+                active_policy_ = capture_ == CaptureMode::All ? HookPolicy::All : HookPolicy::Contended;
+                if (hook_policy.load(std::memory_order_relaxed) != HookPolicy::Off) {
+                    hook_policy.store(active_policy_, std::memory_order_relaxed);
+                }
+            } else {
+                snprintf(reply, size, "error: capture is all or contended");
+            }
+        } else if (strcmp(command, "rotate") == 0) {
+            if (backend_ == Backend::File) {
+                requestRotation(argument, nullptr, reply, size);
+            } else {
+                snprintf(reply, size, "error: only the file backend can rotate its output");
+            }
+        } else {
+            snprintf(reply, size, "error: unknown command %s", command);
+        }
+        unlockIo();
+    }
+
+    // Serves the control socket: one command per connection, answered with
+    // one line.
+    static void* controlMain(void*)
+    {
+        in_hook = true;
+        EventLogger& logger = instance();
+        for (;;) {
+            int fd = accept4(logger.control_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                // finalize() shut the socket down.
+                return nullptr;
+            }
+            // A client that never finishes its line must not wedge the socket.
+            struct timeval timeout = {1, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            char line[PATH_MAX + 64];
+            size_t size = 0;
+            while (size < sizeof(line) - 1 && !memchr(line, '\n', size)) {
+                ssize_t received = recv(fd, line + size, sizeof(line) - 1 - size, 0);
+                if (received < 0 && errno == EINTR) continue;
+                if (received <= 0) break;
+                size += received;
+            }
+            line[size] = '\0';
+            char reply[PATH_MAX + 256];
+            logger.control(line, reply, sizeof(reply));
+            size_t length = strlen(reply);
+            reply[length++] = '\n';
+            send(fd, reply, length, MSG_NOSIGNAL);
+            ::close(fd);
+        }
+    }
+
+    // Copy `pattern` to a socket path with "%p" replaced by the pid. False
+    // if it does not fit.
+    static bool expandSocketPath(const char* pattern, char (&path)[sizeof(sockaddr_un::sun_path)])
+    {
+        size_t length = 0;
+        const char* in = pattern;
+        for (; *in && length < sizeof(path) - 1; in++) {
+            if (in[0] == '%' && in[1] == 'p') {
+                int written = snprintf(
+                        path + length, sizeof(path) - length, "%d", static_cast<int>(getpid()));
+                length = std::min(length + written, sizeof(path) - 1);
+                in++;
+            } else {
+                path[length++] = *in;
+            }
+        }
+        path[length] = '\0';
+        return *in == '\0';
+    }
+
+    // Listen on `pattern` with "%p" replaced by the pid. Only the owner may
+    // connect, since whoever can can turn tracing on.
+    void startControl(const char* pattern)
+    {
+        if (!expandSocketPath(pattern, control_path_)) {
+            fprintf(stderr, "skeleton_key: control socket path too long: %s\n", pattern);
+            return;
+        }
+
+        struct sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        strcpy(address.sun_path, control_path_);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        unlink(control_path_);
+        auto* generic = reinterpret_cast<struct sockaddr*>(&address);
+        if (fd < 0 || bind(fd, generic, sizeof(address)) != 0 || chmod(control_path_, 0600) != 0
+            || listen(fd, 4) != 0)
+        {
+            fprintf(stderr, "skeleton_key: cannot listen on %s: %s\n", control_path_, strerror(errno));
+            if (fd >= 0) ::close(fd);
+            return;
+        }
+        control_fd_ = fd;
+        control_pid_ = getpid();
+        pthread_t controller;
+        if (real_pthread_create(&controller, nullptr, controlMain, nullptr) != 0) {
+            stopControl();
+            return;
+        }
+        pthread_detach(controller);
+    }
+
+    // Wakes the control thread out of accept() for good. Only uses
+    // async-signal-safe calls.
+    void stopControl()
+    {
+        if (control_fd_ < 0 || control_pid_ != getpid()) return;
+        shutdown(control_fd_, SHUT_RDWR);
+        unlink(control_path_);
+    }
+
+    // Serve metrics over HTTP at `address`: "[HOST]:PORT" for TCP, on
+    // 127.0.0.1 unless HOST says otherwise, or the path of a Unix socket
+    // (anything with a '/'), where "%p" is replaced by the pid.
+    void startMetrics(const char* address)
+    {
+        int fd = -1;
+        if (strchr(address, '/')) {
+            if (!expandSocketPath(address, metrics_path_)) {
+                fprintf(stderr, "skeleton_key: metrics socket path too long: %s\n", address);
+                return;
+            }
+            struct sockaddr_un local = {};
+            local.sun_family = AF_UNIX;
+            strcpy(local.sun_path, metrics_path_);
+            fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            unlink(metrics_path_);
+            if (fd >= 0 && bind(fd, reinterpret_cast<struct sockaddr*>(&local), sizeof(local)) != 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        } else {
+            const char* colon = strrchr(address, ':');
+            char host[64] = "127.0.0.1";
+            if (colon && colon != address) {
+                snprintf(host, sizeof(host), "%.*s", static_cast<int>(colon - address), address);
+            }
+            struct sockaddr_in inet = {};
+            inet.sin_family = AF_INET;
+            unsigned long port = strtoul(colon ? colon + 1 : address, nullptr, 10);
+            inet.sin_port = htons(static_cast<uint16_t>(port));
+            if (inet_pton(AF_INET, host, &inet.sin_addr) != 1) {
+                fprintf(stderr, "skeleton_key: cannot serve metrics on %s: not IPv4\n", address);
+                return;
+            }
+            fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            int reuse = 1;
+            if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+            if (fd >= 0 && bind(fd, reinterpret_cast<struct sockaddr*>(&inet), sizeof(inet)) != 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+        if (fd < 0 || listen(fd, 16) != 0) {
+            fprintf(stderr, "skeleton_key: cannot serve metrics on %s: %s\n", address, strerror(errno));
+            if (fd >= 0) ::close(fd);
+            return;
+        }
+        metrics_fd_ = fd;
+        metrics_pid_ = getpid();
+        pthread_t server;
+        if (real_pthread_create(&server, nullptr, metricsMain, nullptr) != 0) {
+            stopMetrics();
+            return;
+        }
+        pthread_detach(server);
+    }
+
+    void stopMetrics()
+    {
+        if (metrics_fd_ < 0 || metrics_pid_ != getpid()) return;
+        shutdown(metrics_fd_, SHUT_RDWR);
+        if (metrics_path_[0]) unlink(metrics_path_);
+    }
+
+    // Answers every request for /metrics with a snapshot of the aggregate
+    // counters, one request per connection. It never takes the io lock, so
+    // a slow scraper only ever holds up this thread.
+    static void* metricsMain(void*)
+    {
+        in_hook = true;
+        EventLogger& logger = instance();
+        for (;;) {
+            int fd = accept4(logger.metrics_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                // finalize() shut the socket down.
+                return nullptr;
+            }
+            struct timeval timeout = {1, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            // Only the request line matters; the headers are left unread.
+            char request[1024];
+            size_t size = 0;
+            while (size < sizeof(request) - 1 && !memchr(request, '\n', size)) {
+                ssize_t received = recv(fd, request + size, sizeof(request) - 1 - size, 0);
+                if (received < 0 && errno == EINTR) continue;
+                if (received <= 0) break;
+                size += received;
+            }
+            request[size] = '\0';
+            bool found = strncmp(request, "GET /metrics ", 13) == 0
+                         || strncmp(request, "GET / ", 6) == 0;
+            const char* header = found ? "HTTP/1.0 200 OK\r\n"
+                                         "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                                         "Connection: close\r\n\r\n"
+                                       : "HTTP/1.0 404 Not Found\r\n"
+                                         "Content-Type: text/plain\r\n"
+                                         "Connection: close\r\n\r\n"
+                                         "try /metrics\n";
+            if (send(fd, header, strlen(header), MSG_NOSIGNAL) > 0 && found) {
+                logger.aggregator_.writeMetrics(fd,
+                                                logger.currentTicksPerSecond(),
+                                                logger.header_.sampleScale(),
+                                                logger.metrics_top_);
+            }
+            // Drain what is left of the request, so closing does not reset
+            // the connection under the response.
+            shutdown(fd, SHUT_WR);
+            while (recv(fd, request, sizeof(request), 0) > 0) {
+            }
+            ::close(fd);
+        }
+    }
+
+    // Start the writer's trace with the header, on disk at once, so that a
+    // process that leaves through _exit() still leaves a trace with one, if
+    // no events.
+    void beginTrace()
+    {
+        writer_.append(&header_, sizeof(header_));
+        writer_.flush();
+    }
 
-class VarIntWriter
-{
-  private:
-    std::vector<uint8_t> buffer;
+    // Take `path` for this process's trace, or `path.PID` when another live
+    // process is writing it, e.g. the parent of an exec'ed child that kept
+    // LD_PRELOAD. The claim is an flock() held on the file until exit.
+    void claimOutput(const char* path)
+    {
+        snprintf(output_, sizeof(output_), "%s", path);
+        int fd = ::open(path, O_RDONLY | O_CREAT | O_CLOEXEC, 0644);
+        // Opening it for real reports the error.
+        if (fd < 0) return;
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+            output_lock_fd_ = fd;
+            return;
+        }
+        bool taken = errno == EWOULDBLOCK;
+        ::close(fd);
+        if (taken) snprintf(output_, sizeof(output_), "%s.%d", path, static_cast<int>(getpid()));
+    }
 
-    void encodeVarInt(uint64_t value)
+    // pthread_atfork() handlers. The io lock is held across fork(), so the
+    // child does not inherit a batch, index or pending list in mid-update.
+    static void prepareFork()
     {
-        do {
-            uint8_t byte = value & 0x7F;
-            value >>= 7;
-            if (value) byte |= 0x80;
-            buffer.push_back(byte);
-        } while (value);
+        EventLogger& logger = instance();
+        logger.fork_locked_ = logger.enabled_ && !logger.finalized_ && logger.lockIo(true);
     }
 
-  public:
-    void clear()
+    static void parentAfterFork()
     {
-        buffer.clear();
+        EventLogger& logger = instance();
+        if (logger.fork_locked_) logger.unlockIo();
     }
 
-    void write(uint64_t value)
+    static void childAfterFork()
     {
-        encodeVarInt(value);
+        // The forking thread keeps its thread_local in the child, but not
+        // its tid.
+        thread_id = 0;
+        EventLogger& logger = instance();
+        if (!logger.enabled_ || logger.finalized_) return;
+        bool was_in_hook = in_hook;
+        in_hook = true;
+        logger.restartInChild();
+        in_hook = was_in_hook;
     }
 
-    void write(EventType type)
+    // The child has only the forking thread and none of the tracer's. Drop
+    // everything the parent had buffered and start the child's own trace in
+    // OUTPUT.PID, with the parent's time base so that the two line up, and
+    // its own drainer (and control socket, if its path has a "%p").
+    void restartInChild()
     {
-        buffer.push_back(static_cast<uint8_t>(type));
+        io_busy_.clear(std::memory_order_relaxed);
+        pending_.store(nullptr, std::memory_order_relaxed);
+        for (ThreadBuffer* buffer = buffers_.load(); buffer != nullptr; buffer = buffer->next) {
+            for (Chunk& chunk : buffer->chunks) {
+                chunk.used.store(0, std::memory_order_relaxed);
+                chunk.state.store(Chunk::Free, std::memory_order_relaxed);
+            }
+            buffer->current = 0;
+            buffer->dropped.store(0, std::memory_order_relaxed);
+            // Buffers of threads that did not come along are free to reuse.
+            if (buffer != thread_buffer) buffer->in_use.store(false, std::memory_order_relaxed);
+        }
+        thread_slot = nullptr;
+        pthread_setspecific(slot_key_, nullptr);
+        mapped_dropped_.store(0, std::memory_order_relaxed);
+        summary_requested_.store(false, std::memory_order_relaxed);
+        rotations_ = 0;
+        header_.pid = static_cast<uint32_t>(getpid());
+        if (output_lock_fd_ >= 0) ::close(output_lock_fd_);
+        output_lock_fd_ = -1;
+        if (control_fd_ >= 0) ::close(control_fd_);
+        control_fd_ = -1;
+        if (metrics_fd_ >= 0) ::close(metrics_fd_);
+        metrics_fd_ = -1;
+
+        char parent_output[PATH_MAX];
+        memcpy(parent_output, output_, sizeof(parent_output));
+        snprintf(output_, sizeof(output_), "%s.%d", parent_output, static_cast<int>(getpid()));
+        bool opened;
+        if (aggregating_) {
+            opened = aggregator_.reopen(output_);
+        } else if (use_mapped_) {
+            opened = mapped_.reopen(output_);
+            if (opened) *mapped_.traceHeader() = header_;
+        } else {
+            writer_.abandon();
+            index_.close();
+            // The listener took the parent's connection; a stream has no
+            // room for a second process.
+            opened = !streaming_ && writer_.open(output_, batch_size_);
+            if (opened) beginTrace();
+        }
+        if (!opened) {
+            if (!streaming_) {
+                fprintf(stderr, "skeleton_key: cannot open %s: %s\n", output_, strerror(errno));
+            }
+            enabled_ = false;
+            hook_policy.store(HookPolicy::Off, std::memory_order_relaxed);
+            drainer_running_ = false;
+            return;
+        }
+
+        if (control_pattern_ && strstr(control_pattern_, "%p")) startControl(control_pattern_);
+        // A TCP port stays the parent's.
+        if (metrics_pattern_ && strstr(metrics_pattern_, "%p")) startMetrics(metrics_pattern_);
+        drainer_sleeping_.store(0, std::memory_order_relaxed);
+        drainer_running_ = real_pthread_create(&drainer_, nullptr, drainerMain, nullptr) == 0;
     }
 
-    void writePtr(const void* ptr)
+    // Start a new chunk at `out` and return the position just past its
+    // header. Events encoded afterwards are relative to it.
+    static uint8_t* beginChunk(uint8_t* out, uint64_t timestamp)
     {
-        encodeVarInt(reinterpret_cast<uint64_t>(ptr));
+        auto* header = reinterpret_cast<ChunkHeader*>(out);
+        *header = {};
+        header->magic = ChunkHeader::MAGIC;
+        header->kind = ChunkKind::Events;
+        header->tid = currentThreadId();
+        header->base_timestamp = timestamp;
+
+        stream_state.chunk = header;
+        stream_state.last_timestamp = timestamp;
+        stream_state.locks.reset();
+        stream_state.generation++;
+        return out + sizeof(ChunkHeader);
     }
 
-    void writeStack(void* const* stack, uint32_t depth)
+    // Encode one event at `out`, which must have MAX_EVENT_SIZE bytes of
+    // room, and return the position just past it.
+    uint8_t* encode(
+            uint8_t* out,
+            EventType type,
+            void* ptr1,
+            void* ptr2,
+            int32_t result,
+            uint64_t timestamp,
+            uint64_t duration,
+            bool with_stack)
     {
-        encodeVarInt(depth);
-        for (uint32_t i = 0; i < depth; i++) {
-            encodeVarInt(reinterpret_cast<uint64_t>(stack[i]));
+        std::array<void*, MAX_STACK_DEPTH> stack;
+        int depth = with_stack ? Unwinder::capture(stack.data()) : 0;
+
+        StreamState& state = stream_state;
+        uint8_t type_byte = static_cast<uint8_t>(type);
+        if (ptr2 != nullptr) type_byte |= EVENT_HAS_PTR2;
+        if (result != 0) type_byte |= EVENT_HAS_RESULT;
+
+        VarIntWriter writer(out);
+        uint64_t stack_ref = STACK_NONE;
+        uint32_t stack_id = StackTable::NO_ID;
+        if (depth > 0) {
+            stack_id = stacks_.intern(StackTable::hash(stack.data(), depth));
+            stack_ref = stack_id == StackTable::NO_ID ? STACK_INLINE : STACK_ID_BASE + stack_id;
+        }
+        if (stack_id != StackTable::NO_ID && state.markDefined(stack_id)) {
+            writer.writeByte(RECORD_STACK_DEFINITION);
+            writer.write(stack_id);
+            writer.writeStack(stack.data(), depth);
         }
+
+        writer.writeByte(type_byte);
+        writer.write(zigzagEncode(static_cast<int64_t>(timestamp - state.last_timestamp)));
+        writer.write(state.locks.encode(reinterpret_cast<uint64_t>(ptr1)));
+        if (ptr2 != nullptr) writer.write(state.locks.encode(reinterpret_cast<uint64_t>(ptr2)));
+        if (result != 0) writer.write(zigzagEncode(result));
+        if (eventHasDuration(type)) writer.write(duration);
+        writer.write(stack_ref);
+        if (stack_ref == STACK_INLINE) writer.writeStack(stack.data(), depth);
+
+        state.last_timestamp = timestamp;
+        state.chunk->event_count++;
+        return writer.position();
     }
 
-    const uint8_t* data() const
+    void aggregate(
+            EventType type,
+            void* ptr1,
+            void* ptr2,
+            int32_t result,
+            uint64_t timestamp,
+            uint64_t duration,
+            bool with_stack)
     {
-        return buffer.data();
+        std::array<void*, MAX_STACK_DEPTH> stack;
+        int depth = 0;
+        uint32_t stack_id = StackTable::NO_ID;
+        if (with_stack && LockAggregator::usesStack(type)) {
+            depth = Unwinder::capture(stack.data());
+            if (depth > 0) stack_id = stacks_.intern(StackTable::hash(stack.data(), depth));
+        }
+        aggregator_.record(type, ptr1, ptr2, result, timestamp, duration, stack.data(), depth, stack_id);
     }
-    size_t size() const
+
+    void writeModules(bool from_signal)
     {
-        return buffer.size();
+        if (!from_signal) modules_.refresh();
+        size_t size;
+        const uint8_t* chunk = modules_.chunk(&size);
+        if (chunk == nullptr) return;
+        if (!use_mapped_) {
+            writer_.append(chunk, size);
+            return;
+        }
+        // The newest slot, so a ring keeps it.
+        MappedTrace::Slot* slot = mapped_.claim();
+        if (slot == nullptr) return;
+        memcpy(slot->data, chunk, size);
+        slot->used.store(static_cast<uint32_t>(size), std::memory_order_release);
+        mapped_.release(slot);
     }
-};
-
-class EventLogger
-{
-  private:
-    std::ofstream log_;
-    std::atomic<bool> initialized_{false};
-    static constexpr size_t MAX_STACK_DEPTH = 16;
-    std::mutex write_mutex_;
-    VarIntWriter writer_;
 
-    EventLogger() = default;
+    void stopDrainer()
+    {
+        if (!drainer_running_.exchange(false)) return;
+        drainer_sleeping_.store(0);
+        syscall(SYS_futex, &drainer_sleeping_, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+        pthread_join(drainer_, nullptr);
+    }
 
   public:
     static EventLogger& instance()
@@ -142,145 +3796,616 @@ class EventLogger
         return logger;
     }
 
-    void init(const char* filename = "/tmp/skeleton_key.bin")
+    void init(const Config& config)
     {
         if (!initialized_.exchange(true)) {
-            log_.open(filename, std::ios::binary | std::ios::out | std::ios::trunc);
+            use_mapped_ = config.backend == Backend::Mapped || config.backend == Backend::Ring;
+            aggregating_ = config.backend == Backend::Aggregate;
+            streaming_ = config.backend == Backend::Socket;
+            bool opened;
+            if (streaming_) {
+                snprintf(output_, sizeof(output_), "%s", config.output);
+            } else {
+                claimOutput(config.output);
+            }
+            if (aggregating_) {
+                opened = aggregator_.open(output_);
+            } else if (use_mapped_) {
+                opened = mapped_.open(output_, config.backend == Backend::Ring, config.ring_size);
+            } else if (streaming_) {
+                opened = writer_.connect(output_, config.batch_size);
+            } else {
+                opened = writer_.open(output_, config.batch_size);
+            }
+            if (!opened) {
+                fprintf(stderr, "skeleton_key: cannot open %s: %s\n", output_, strerror(errno));
+                hook_policy.store(HookPolicy::Off, std::memory_order_relaxed);
+                return;
+            }
+
+            ClockSource clock = config.clock;
+            if (clock == ClockSource::Tsc && !Clock::counterIsUsable()) {
+                fprintf(stderr, "skeleton_key: no invariant TSC, using the steady clock\n");
+                clock = ClockSource::Steady;
+            }
+            Clock::setSource(clock);
+            header_ = createTraceHeader(clock);
+
+            UnwinderKind unwinder = config.unwinder;
+            if (!Unwinder::available(unwinder)) {
+                fprintf(stderr, "skeleton_key: built without libunwind, using backtrace()\n");
+                unwinder = UnwinderKind::Backtrace;
+            }
+            Unwinder::configure(unwinder, config.stack_depth);
+            if (clock == ClockSource::Tsc) {
+                // Rough rate for traces that never get closed properly;
+                // finalize() replaces it with one measured over the whole run.
+                struct timespec pause = {0, 5 * 1000 * 1000};
+                nanosleep(&pause, nullptr);
+                recalibrate(header_);
+            }
+            LockFilter::configure(
+                    config.locks,
+                    config.lock_types,
+                    config.callers,
+                    config.ignore_callers,
+                    config.mute_after);
+            Sampler::setFiltered(LockFilter::active());
+            setSampling({config.sample_period,
+                         config.sample_mode,
+                         config.sample_on_ms,
+                         config.sample_off_ms});
+            capture_ = config.capture;
+            backend_ = config.backend;
+            batch_size_ = config.batch_size;
+            if (config.compression != Codec::None) {
+                // Mapped slots are encoded in place by the hooks, with no
+                // writer thread to compress them.
+                if (use_mapped_ || aggregating_) {
+                    fprintf(stderr, "skeleton_key: only the file and socket backends compress\n");
+                } else if (!compressor_.configure(
+                                   config.compression, config.compression_level, Chunk::CAPACITY))
+                {
+                    fprintf(stderr,
+                            "skeleton_key: built without %s, writing uncompressed\n",
+                            codecName(config.compression));
+                }
+            }
+            slow_ticks_ = static_cast<uint64_t>(
+                    static_cast<unsigned __int128>(config.slow_ns) * header_.ticks_per_second
+                    / 1000000000);
+            stream_ticks_ = static_cast<uint64_t>(
+                    static_cast<unsigned __int128>(FLUSH_INTERVAL_NS) * header_.ticks_per_second
+                    / 1000000000);
+            if (use_mapped_) {
+                *mapped_.traceHeader() = header_;
+            } else if (!aggregating_) {
+                beginTrace();
+            }
+            pthread_atfork(prepareFork, parentAfterFork, childAfterFork);
+            pthread_key_create(&buffer_key_, releaseThreadBuffer);
+            pthread_key_create(&slot_key_, releaseThreadSlot);
+            if (!aggregating_) {
+                bool was_in_hook = in_hook;
+                in_hook = true;
+                modules_.refresh();
+                in_hook = was_in_hook;
+            }
+            drainer_running_ = true;
+            if (real_pthread_create(&drainer_, nullptr, drainerMain, nullptr) != 0) {
+                drainer_running_ = false;
+            }
+            enabled_ = true;
+            active_policy_ = capture_ == CaptureMode::All ? HookPolicy::All : HookPolicy::Contended;
+            if (aggregating_) active_policy_ = HookPolicy::Aggregate;
+            HookPolicy policy = config.enabled ? active_policy_ : HookPolicy::Off;
+            hook_policy.store(policy, std::memory_order_relaxed);
+
+            atexit([] { instance().finalize(false); });
+            installSignalHandlers();
+            control_pattern_ = config.control;
+            if (config.control) startControl(config.control);
+            if (config.metrics && !aggregating_) {
+                fprintf(stderr, "skeleton_key: metrics need the aggregate backend\n");
+            } else if (config.metrics) {
+                metrics_pattern_ = config.metrics;
+                metrics_top_ = config.metrics_top;
+                startMetrics(config.metrics);
+            }
         }
     }
 
-    void log(EventType type, void* ptr1, void* ptr2, int32_t result, uint64_t duration_ns = 0)
+    template<HookPolicy Policy>
+    void log(EventType type, void* ptr1, void* ptr2, int32_t result)
     {
-        if (!initialized_) return;
+        if (!enabled_.load(std::memory_order_relaxed)) return;
+        log<Policy>(type, ptr1, ptr2, result, Clock::now());
+    }
 
-        std::lock_guard<std::mutex> lock(write_mutex_);
-        // Capture stack trace
-        std::array<void*, MAX_STACK_DEPTH> stack;
-        int depth = backtrace(stack.data(), MAX_STACK_DEPTH);
+    uint64_t slowThreshold() const
+    {
+        return slow_ticks_;
+    }
 
-        // Get current time
-        uint64_t timestamp =
-                static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
-                                              std::chrono::steady_clock::now().time_since_epoch())
-                                              .count());
+    // `timestamp` and `duration` are in Clock::now() units. `contended`
+    // marks the events of an acquisition that had to wait, which keep their
+    // stack whatever the capture mode. `Policy` is the active hook_policy.
+    template<HookPolicy Policy>
+    void
+    log(EventType type,
+        void* ptr1,
+        void* ptr2,
+        int32_t result,
+        uint64_t timestamp,
+        uint64_t duration = 0,
+        bool contended = false)
+    {
+        if (!enabled_.load(std::memory_order_relaxed)) return;
+        if constexpr (Policy == HookPolicy::Aggregate) {
+            bool with_stack = contended || capture_ == CaptureMode::All;
+            aggregate(type, ptr1, ptr2, result, timestamp, duration, with_stack);
+            return;
+        }
+        bool with_stack = contended || Policy == HookPolicy::All;
 
-        // Get thread ID
-        uint32_t tid = static_cast<uint32_t>(syscall(SYS_gettid));
+        if (use_mapped_) {
+            MappedTrace::Slot* slot = thread_slot;
+            if (slot == nullptr
+                || MappedTrace::Slot::CAPACITY - slot->used.load(std::memory_order_relaxed)
+                           < MAX_EVENT_SIZE)
+            {
+                if (slot != nullptr) mapped_.release(slot);
+                slot = thread_slot = mapped_.claim();
+                pthread_setspecific(slot_key_, slot);
+                if (mapped_.needsGrowth()) wakeDrainer();
+                if (slot == nullptr) {
+                    mapped_dropped_.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                uint8_t* start = beginChunk(slot->data, timestamp);
+                slot->used.store(start - slot->data, std::memory_order_relaxed);
+            }
+            uint32_t used = slot->used.load(std::memory_order_relaxed);
+            uint8_t* end = encode(
+                    slot->data + used,
+                    type,
+                    ptr1,
+                    ptr2,
+                    result,
+                    timestamp,
+                    duration,
+                    with_stack);
+            slot->used.store(end - slot->data, std::memory_order_release);
+            return;
+        }
 
-        // Write event in varint format
-        writer_.clear();
-        writer_.write(timestamp);
-        writer_.write(tid);
-        writer_.write(type);
-        writer_.writePtr(ptr1);
-        writer_.writePtr(ptr2);
-        writer_.write(static_cast<uint64_t>(result));
-        writer_.write(duration_ns);
-        writer_.writeStack(stack.data(), depth);
+        ThreadBuffer* buffer = thread_buffer ? thread_buffer : acquireThreadBuffer();
+        Chunk* chunk = &buffer->chunks[buffer->current];
+        bool claimed = claimChunk(chunk);
+        if (claimed
+            && (Chunk::CAPACITY - chunk->used.load(std::memory_order_relaxed) < MAX_EVENT_SIZE
+                || (streaming_ && chunkIsStale(chunk, timestamp))))
+        {
+            submit(chunk);
+            buffer->current = (buffer->current + 1) % ThreadBuffer::NUM_CHUNKS;
+            chunk = &buffer->chunks[buffer->current];
+            claimed = claimChunk(chunk);
+        }
+        if (!claimed) {
+            // The drainer has not caught up with this thread; drop the event
+            // rather than wait for it.
+            buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
 
-        log_.write(reinterpret_cast<const char*>(writer_.data()), writer_.size());
-        log_.flush();
+        size_t used = chunk->used.load(std::memory_order_relaxed);
+        if (used == 0) used = beginChunk(chunk->data, timestamp) - chunk->data;
+        uint8_t* end = encode(
+                chunk->data + used,
+                type,
+                ptr1,
+                ptr2,
+                result,
+                timestamp,
+                duration,
+                with_stack);
+        chunk->used.store(end - chunk->data, std::memory_order_release);
+        chunk->state.store(Chunk::Free, std::memory_order_release);
     }
 
-    ~EventLogger()
+    bool chunkIsStale(const Chunk* chunk, uint64_t now) const
     {
-        if (initialized_) {
-            log_.close();
+        if (chunk->used.load(std::memory_order_relaxed) == 0) return false;
+        const auto* header = reinterpret_cast<const ChunkHeader*>(chunk->data);
+        return now - header->base_timestamp >= stream_ticks_;
+    }
+
+    // Write out every buffered event and close the file. Runs at most once:
+    // from atexit(), the destructor, or a fatal signal handler. On the signal
+    // path only async-signal-safe calls are made.
+    void finalize(bool from_signal)
+    {
+        if (!initialized_ || finalized_.exchange(true)) return;
+        enabled_ = false;
+        stopControl();
+        stopMetrics();
+
+        if (from_signal) {
+            drainer_running_ = false;
+            // The drainer may be mid-write; give it a moment unless the
+            // signal landed on the drainer itself.
+            if (!pthread_equal(pthread_self(), drainer_)) lockIo(true);
+        } else {
+            stopDrainer();
+            lockIo(false);
+        }
+        drainPending();
+
+        recalibrate(header_);
+        if (aggregating_) {
+            aggregator_.write(header_.ticks_per_second, header_.sampleScale(), !from_signal);
+            aggregator_.close();
+        } else if (use_mapped_) {
+            *mapped_.traceHeader() = header_;
+        } else {
+            writer_.flush();
+            writer_.patch(&header_, sizeof(header_), 0);
+        }
+
+        uint64_t dropped = mapped_dropped_.load(std::memory_order_relaxed);
+        for (ThreadBuffer* buffer = buffers_.load(); buffer != nullptr; buffer = buffer->next) {
+            Chunk* chunk = &buffer->chunks[buffer->current];
+            if (chunk->state.load(std::memory_order_acquire) != Chunk::Pending) {
+                writeChunk(chunk);
+            }
+            dropped += buffer->dropped.load(std::memory_order_relaxed);
         }
+        if (!aggregating_) writeModules(from_signal);
+        if (!aggregating_ && !use_mapped_ && !streaming_) index_.write(writer_);
+        writer_.close();
+        index_.close();
+        mapped_.close();
+
+        if (dropped && !from_signal) {
+            fprintf(stderr,
+                    "skeleton_key: dropped %" PRIu64 " events (output fell behind)\n",
+                    dropped);
+        }
+    }
+
+    ~EventLogger()
+    {
+        finalize(false);
     }
 };
 
-}  // namespace skeleton_key
+// Whether a successful call of this type leaves its lock held until an
+// unlock. Semaphore units are not given back by their taker in particular.
+static constexpr bool
+holdsLock(EventType type)
+{
+    return lockClass(type) != LockClass::Sem;
+}
 
-// Function pointer declarations
-extern "C" {
-static int (*real_pthread_mutex_init)(pthread_mutex_t*, const pthread_mutexattr_t*) = nullptr;
-static int (*real_pthread_mutex_destroy)(pthread_mutex_t*) = nullptr;
-static int (*real_pthread_mutex_lock)(pthread_mutex_t*) = nullptr;
-static int (*real_pthread_mutex_trylock)(pthread_mutex_t*) = nullptr;
-static int (*real_pthread_mutex_timedlock)(pthread_mutex_t*, const struct timespec*) = nullptr;
-static int (*real_pthread_mutex_unlock)(pthread_mutex_t*) = nullptr;
-static int (*real_pthread_cond_init)(pthread_cond_t*, const pthread_condattr_t*) = nullptr;
-static int (*real_pthread_cond_destroy)(pthread_cond_t*) = nullptr;
-static int (*real_pthread_cond_signal)(pthread_cond_t*) = nullptr;
-static int (*real_pthread_cond_broadcast)(pthread_cond_t*) = nullptr;
-static int (*real_pthread_cond_wait)(pthread_cond_t*, pthread_mutex_t*) = nullptr;
-static int (*real_pthread_cond_timedwait)(pthread_cond_t*, pthread_mutex_t*, const struct timespec*) =
-        nullptr;
-static int (*real_pthread_create)(pthread_t*, const pthread_attr_t*, void* (*)(void*), void*) = nullptr;
-static int (*real_pthread_rwlock_init)(pthread_rwlock_t*, const pthread_rwlockattr_t*) = nullptr;
-static int (*real_pthread_rwlock_destroy)(pthread_rwlock_t*) = nullptr;
-static int (*real_pthread_rwlock_rdlock)(pthread_rwlock_t*) = nullptr;
-static int (*real_pthread_rwlock_tryrdlock)(pthread_rwlock_t*) = nullptr;
-static int (*real_pthread_rwlock_timedrdlock)(pthread_rwlock_t*, const struct timespec*) = nullptr;
-static int (*real_pthread_rwlock_wrlock)(pthread_rwlock_t*) = nullptr;
-static int (*real_pthread_rwlock_trywrlock)(pthread_rwlock_t*) = nullptr;
-static int (*real_pthread_rwlock_timedwrlock)(pthread_rwlock_t*, const struct timespec*) = nullptr;
-static int (*real_pthread_rwlock_unlock)(pthread_rwlock_t*) = nullptr;
+// Log one blocking acquisition. `acquire` takes the lock; `try_acquire`
+// attempts it without blocking and is only used when acquisitions that do
+// not wait are logged as one compact event.
+template<HookPolicy Policy, typename TryAcquire, typename Acquire>
+static int
+traceAcquire(
+        EventType wait_type,
+        EventType done_type,
+        EventType fast_type,
+        void* lock,
+        TryAcquire try_acquire,
+        Acquire acquire)
+{
+    EventLogger& logger = EventLogger::instance();
+    bool holds = holdsLock(wait_type);
+    uint64_t start = Clock::now();
+    // The aggregate backend needs to know whether the lock was contended,
+    // so it always tries first.
+    if constexpr (Policy == HookPolicy::All) {
+        logger.log<Policy>(wait_type, lock, nullptr, 0, start);
+        // The duration is the call's own, without logging the wait and its
+        // stack, so that readers can tell a wait from a free lock by it.
+        uint64_t called = Clock::now();
+        // Muting needs to know whether the lock was free.
+        bool waited = !LockFilter::muting() || try_acquire() != 0;
+        int result = waited ? acquire() : 0;
+        uint64_t end = Clock::now();
+        logger.log<Policy>(done_type, lock, nullptr, result, end, end - called);
+        if (result == 0) {
+            if (holds) Sampler::acquired(lock);
+            LockFilter::acquired(lock, waited);
+        }
+        return result;
+    }
+
+    if (try_acquire() == 0) {
+        logger.log<Policy>(fast_type, lock, nullptr, 0, start);
+        if (holds) Sampler::acquired(lock);
+        LockFilter::acquired(lock, false);
+        return 0;
+    }
+    // Without a threshold the wait is logged before blocking, so a thread
+    // that never gets the lock still shows up. With one, whether the wait
+    // was slow is only known afterwards.
+    uint64_t threshold = logger.slowThreshold();
+    if (threshold == 0) logger.log<Policy>(wait_type, lock, nullptr, 0, start, 0, true);
+    int result = acquire();
+    uint64_t end = Clock::now();
+    if (result == 0 && holds) Sampler::acquired(lock);
+    bool slow = threshold == 0 || end - start >= threshold;
+    if (result == 0) LockFilter::acquired(lock, slow);
+    if (threshold != 0) {
+        if (!slow) {
+            logger.log<Policy>(fast_type, lock, nullptr, result, start);
+            return result;
+        }
+        logger.log<Policy>(wait_type, lock, nullptr, 0, start, 0, true);
+    }
+    logger.log<Policy>(done_type, lock, nullptr, result, end, end - start, true);
+    return result;
 }
 
-// Thread-local to prevent recursion
-static thread_local bool in_hook = false;
+// Start the tracer from whichever runs first: the library constructor, or a
+// hook called before it. Another thread that gets here while the tracer is
+// still starting returns at once, and its hook calls straight through.
+static void
+startTracer()
+{
+    bool was_in_hook = in_hook;
+    in_hook = true;
+    EventLogger::instance().init(Config::fromEnvironment());
+    in_hook = was_in_hook;
+}
+
+// How an interposer wraps its real function.
+enum class HookKind {
+    // Init, destroy and thread creation: an event after the call, also for
+    // operations the sampler skips.
+    Lifecycle,
+    // Signal and broadcast: an event after the call.
+    Notify,
+    // Blocking acquisitions, through traceAcquire() with the matching trylock.
+    Acquire,
+    // Trylocks: an event before the call and one with its duration after.
+    TryAcquire,
+    // Condition and barrier waits: like TryAcquire, with the mutex, if there
+    // is one, as the second pointer.
+    Wait,
+    // Unlocks: an event after the call, if the acquisition was traced.
+    Release,
+};
+
+// One interposer: its real function, the event it logs, and for the kinds
+// that log twice the event with the call's duration that follows. Blocking
+// acquisitions also name the event of one that did not wait and the trylock
+// that finds out. The object or thread the call is about is always its first
+// argument. call() is inlined into the interposer, so that its return
+// address is the application's call site.
+template<HookKind Kind,
+         auto& Real,
+         EventType Event,
+         EventType Done = Event,
+         EventType Fast = Event,
+         auto& TryReal = Real>
+struct Hook
+{
+    template<HookPolicy Policy, typename Object, typename... Rest>
+    static int trace(void* caller, Object* object, Rest... rest)
+    {
+        if (in_hook) return Real(object, rest...);
+        void* second = nullptr;
+        if constexpr (Kind == HookKind::Wait && sizeof...(Rest) > 0) {
+            second = std::get<0>(std::tie(rest...));
+        }
+        if constexpr (Kind == HookKind::Release) {
+            if (!Sampler::released(object)) return Real(object, rest...);
+        } else if constexpr (lockClass(Event) != LockClass::Thread) {
+            if (LockFilter::active()) {
+                if (Kind == HookKind::Lifecycle) LockFilter::forget(object);
+                if (!LockFilter::traces(lockClass(Event), object, second, caller)) {
+                    return Real(object, rest...);
+                }
+            }
+        }
+        if constexpr ((Kind == HookKind::Acquire || Kind == HookKind::TryAcquire) && holdsLock(Event)) {
+            if (!Sampler::canAcquire()) return Real(object, rest...);
+        }
+        if constexpr (Kind != HookKind::Release && Kind != HookKind::Lifecycle) {
+            if (!Sampler::sample()) return Real(object, rest...);
+        }
+        in_hook = true;
+
+        EventLogger& logger = EventLogger::instance();
+        int result;
+        if constexpr (Kind == HookKind::Acquire) {
+            result = traceAcquire<Policy>(
+                    Event,
+                    Done,
+                    Fast,
+                    object,
+                    [&] { return TryReal(object); },
+                    [&] { return Real(object, rest...); });
+        } else if constexpr (Kind == HookKind::TryAcquire || Kind == HookKind::Wait) {
+            uint64_t start = Clock::now();
+            logger.log<Policy>(Event, object, second, 0, start);
+            result = Real(object, rest...);
+            uint64_t end = Clock::now();
+            logger.log<Policy>(Done, object, second, result, end, end - start);
+            if (Kind == HookKind::TryAcquire && holdsLock(Event) && result == 0) {
+                Sampler::acquired(object);
+            }
+        } else {
+            result = Real(object, rest...);
+            logger.log<Policy>(Event, object, nullptr, result);
+        }
+
+        in_hook = false;
+        return result;
+    }
+
+    template<typename... Args>
+    __attribute__((always_inline)) static inline int call(Args... args)
+    {
+        HookPolicy policy = hook_policy.load(std::memory_order_relaxed);
+        if (policy == HookPolicy::Unstarted && !in_hook) {
+            startTracer();
+            policy = hook_policy.load(std::memory_order_relaxed);
+        }
+        void* caller = __builtin_return_address(0);
+        switch (policy) {
+            case HookPolicy::All:
+                return trace<HookPolicy::All>(caller, args...);
+            case HookPolicy::Contended:
+                return trace<HookPolicy::Contended>(caller, args...);
+            case HookPolicy::Aggregate:
+                return trace<HookPolicy::Aggregate>(caller, args...);
+            case HookPolicy::Unstarted:
+            case HookPolicy::Off:
+                break;
+        }
+        return Real(args...);
+    }
+};
+
+using MutexInitHook = Hook<HookKind::Lifecycle, real_pthread_mutex_init, EventType::MutexInit>;
+using MutexDestroyHook = Hook<HookKind::Lifecycle, real_pthread_mutex_destroy, EventType::MutexDestroy>;
+using MutexLockHook = Hook<HookKind::Acquire,
+                           real_pthread_mutex_lock,
+                           EventType::MutexLock,
+                           EventType::MutexLockDone,
+                           EventType::MutexLockFast,
+                           real_pthread_mutex_trylock>;
+using MutexTryLockHook = Hook<HookKind::TryAcquire,
+                              real_pthread_mutex_trylock,
+                              EventType::MutexTryLock,
+                              EventType::MutexTryLockDone>;
+using MutexTimedLockHook = Hook<HookKind::Acquire,
+                                real_pthread_mutex_timedlock,
+                                EventType::MutexTimedLock,
+                                EventType::MutexTimedLockDone,
+                                EventType::MutexLockFast,
+                                real_pthread_mutex_trylock>;
+using MutexClockLockHook = Hook<HookKind::Acquire,
+                                real_pthread_mutex_clocklock,
+                                EventType::MutexClockLock,
+                                EventType::MutexClockLockDone,
+                                EventType::MutexLockFast,
+                                real_pthread_mutex_trylock>;
+using MutexUnlockHook = Hook<HookKind::Release, real_pthread_mutex_unlock, EventType::MutexUnlock>;
+
+using CondInitHook = Hook<HookKind::Lifecycle, real_pthread_cond_init, EventType::CondInit>;
+using CondDestroyHook = Hook<HookKind::Lifecycle, real_pthread_cond_destroy, EventType::CondDestroy>;
+using CondSignalHook = Hook<HookKind::Notify, real_pthread_cond_signal, EventType::CondSignal>;
+using CondBroadcastHook = Hook<HookKind::Notify, real_pthread_cond_broadcast, EventType::CondBroadcast>;
+using CondWaitHook =
+        Hook<HookKind::Wait, real_pthread_cond_wait, EventType::CondWait, EventType::CondWaitDone>;
+using CondTimedWaitHook = Hook<HookKind::Wait,
+                               real_pthread_cond_timedwait,
+                               EventType::CondTimedWait,
+                               EventType::CondTimedWaitDone>;
+using CondClockWaitHook = Hook<HookKind::Wait,
+                               real_pthread_cond_clockwait,
+                               EventType::CondClockWait,
+                               EventType::CondClockWaitDone>;
+
+using RWLockInitHook = Hook<HookKind::Lifecycle, real_pthread_rwlock_init, EventType::RWLockInit>;
+using RWLockDestroyHook =
+        Hook<HookKind::Lifecycle, real_pthread_rwlock_destroy, EventType::RWLockDestroy>;
+using RWLockReadHook = Hook<HookKind::Acquire,
+                            real_pthread_rwlock_rdlock,
+                            EventType::RWLockRead,
+                            EventType::RWLockReadDone,
+                            EventType::RWLockReadFast,
+                            real_pthread_rwlock_tryrdlock>;
+using RWLockTryReadHook = Hook<HookKind::TryAcquire,
+                               real_pthread_rwlock_tryrdlock,
+                               EventType::RWLockTryRead,
+                               EventType::RWLockTryReadDone>;
+using RWLockTimedReadHook = Hook<HookKind::Acquire,
+                                 real_pthread_rwlock_timedrdlock,
+                                 EventType::RWLockTimedRead,
+                                 EventType::RWLockTimedReadDone,
+                                 EventType::RWLockReadFast,
+                                 real_pthread_rwlock_tryrdlock>;
+using RWLockWriteHook = Hook<HookKind::Acquire,
+                             real_pthread_rwlock_wrlock,
+                             EventType::RWLockWrite,
+                             EventType::RWLockWriteDone,
+                             EventType::RWLockWriteFast,
+                             real_pthread_rwlock_trywrlock>;
+using RWLockTryWriteHook = Hook<HookKind::TryAcquire,
+                                real_pthread_rwlock_trywrlock,
+                                EventType::RWLockTryWrite,
+                                EventType::RWLockTryWriteDone>;
+using RWLockTimedWriteHook = Hook<HookKind::Acquire,
+                                  real_pthread_rwlock_timedwrlock,
+                                  EventType::RWLockTimedWrite,
+                                  EventType::RWLockTimedWriteDone,
+                                  EventType::RWLockWriteFast,
+                                  real_pthread_rwlock_trywrlock>;
+using RWLockUnlockHook = Hook<HookKind::Release, real_pthread_rwlock_unlock, EventType::RWLockUnlock>;
+
+using SpinInitHook = Hook<HookKind::Lifecycle, real_pthread_spin_init, EventType::SpinInit>;
+using SpinDestroyHook = Hook<HookKind::Lifecycle, real_pthread_spin_destroy, EventType::SpinDestroy>;
+using SpinLockHook = Hook<HookKind::Acquire,
+                          real_pthread_spin_lock,
+                          EventType::SpinLock,
+                          EventType::SpinLockDone,
+                          EventType::SpinLockFast,
+                          real_pthread_spin_trylock>;
+using SpinTryLockHook = Hook<HookKind::TryAcquire,
+                             real_pthread_spin_trylock,
+                             EventType::SpinTryLock,
+                             EventType::SpinTryLockDone>;
+using SpinUnlockHook = Hook<HookKind::Release, real_pthread_spin_unlock, EventType::SpinUnlock>;
+
+using SemInitHook = Hook<HookKind::Lifecycle, real_sem_init, EventType::SemInit>;
+using SemDestroyHook = Hook<HookKind::Lifecycle, real_sem_destroy, EventType::SemDestroy>;
+using SemWaitHook = Hook<HookKind::Acquire,
+                         real_sem_wait,
+                         EventType::SemWait,
+                         EventType::SemWaitDone,
+                         EventType::SemWaitFast,
+                         real_sem_trywait>;
+using SemTryWaitHook =
+        Hook<HookKind::TryAcquire, real_sem_trywait, EventType::SemTryWait, EventType::SemTryWaitDone>;
+using SemTimedWaitHook = Hook<HookKind::Acquire,
+                              real_sem_timedwait,
+                              EventType::SemTimedWait,
+                              EventType::SemTimedWaitDone,
+                              EventType::SemWaitFast,
+                              real_sem_trywait>;
+using SemClockWaitHook = Hook<HookKind::Acquire,
+                              real_sem_clockwait,
+                              EventType::SemTimedWait,
+                              EventType::SemTimedWaitDone,
+                              EventType::SemWaitFast,
+                              real_sem_trywait>;
+using SemPostHook = Hook<HookKind::Notify, real_sem_post, EventType::SemPost>;
+
+using BarrierInitHook = Hook<HookKind::Lifecycle, real_pthread_barrier_init, EventType::BarrierInit>;
+using BarrierDestroyHook =
+        Hook<HookKind::Lifecycle, real_pthread_barrier_destroy, EventType::BarrierDestroy>;
+using BarrierWaitHook = Hook<HookKind::Wait,
+                             real_pthread_barrier_wait,
+                             EventType::BarrierWait,
+                             EventType::BarrierWaitDone>;
 
-// Library constructor
+using ThreadCreateHook = Hook<HookKind::Lifecycle, real_pthread_create, EventType::ThreadCreate>;
+
+}  // namespace skeleton_key
+
+// Library constructor. The hooks start the tracer themselves if one runs
+// first.
 __attribute__((constructor)) static void
 init_skeleton_key()
 {
     printf("Initializing!\n");
-    // Load versioned symbols for condition variables
-    real_pthread_cond_init = reinterpret_cast<decltype(real_pthread_cond_init)>(
-            dlvsym(RTLD_NEXT, "pthread_cond_init", "GLIBC_2.3.2"));
-    real_pthread_cond_destroy = reinterpret_cast<decltype(real_pthread_cond_destroy)>(
-            dlvsym(RTLD_NEXT, "pthread_cond_destroy", "GLIBC_2.3.2"));
-    real_pthread_cond_signal = reinterpret_cast<decltype(real_pthread_cond_signal)>(
-            dlvsym(RTLD_NEXT, "pthread_cond_signal", "GLIBC_2.3.2"));
-    real_pthread_cond_broadcast = reinterpret_cast<decltype(real_pthread_cond_broadcast)>(
-            dlvsym(RTLD_NEXT, "pthread_cond_broadcast", "GLIBC_2.3.2"));
-    real_pthread_cond_wait = reinterpret_cast<decltype(real_pthread_cond_wait)>(
-            dlvsym(RTLD_NEXT, "pthread_cond_wait", "GLIBC_2.3.2"));
-    real_pthread_cond_timedwait = reinterpret_cast<decltype(real_pthread_cond_timedwait)>(
-            dlvsym(RTLD_NEXT, "pthread_cond_timedwait", "GLIBC_2.3.2"));
-
-    // Load standard symbols
-    real_pthread_mutex_init =
-            reinterpret_cast<decltype(real_pthread_mutex_init)>(dlsym(RTLD_NEXT, "pthread_mutex_init"));
-    real_pthread_mutex_destroy = reinterpret_cast<decltype(real_pthread_mutex_destroy)>(
-            dlsym(RTLD_NEXT, "pthread_mutex_destroy"));
-    real_pthread_mutex_lock =
-            reinterpret_cast<decltype(real_pthread_mutex_lock)>(dlsym(RTLD_NEXT, "pthread_mutex_lock"));
-    real_pthread_mutex_trylock = reinterpret_cast<decltype(real_pthread_mutex_trylock)>(
-            dlsym(RTLD_NEXT, "pthread_mutex_trylock"));
-    real_pthread_mutex_timedlock = reinterpret_cast<decltype(real_pthread_mutex_timedlock)>(
-            dlsym(RTLD_NEXT, "pthread_mutex_timedlock"));
-    real_pthread_mutex_unlock = reinterpret_cast<decltype(real_pthread_mutex_unlock)>(
-            dlsym(RTLD_NEXT, "pthread_mutex_unlock"));
-    real_pthread_create =
-            reinterpret_cast<decltype(real_pthread_create)>(dlsym(RTLD_NEXT, "pthread_create"));
-    real_pthread_rwlock_init = reinterpret_cast<decltype(real_pthread_rwlock_init)>(
-            dlsym(RTLD_NEXT, "pthread_rwlock_init"));
-    real_pthread_rwlock_destroy = reinterpret_cast<decltype(real_pthread_rwlock_destroy)>(
-            dlsym(RTLD_NEXT, "pthread_rwlock_destroy"));
-    real_pthread_rwlock_rdlock = reinterpret_cast<decltype(real_pthread_rwlock_rdlock)>(
-            dlsym(RTLD_NEXT, "pthread_rwlock_rdlock"));
-    real_pthread_rwlock_tryrdlock = reinterpret_cast<decltype(real_pthread_rwlock_tryrdlock)>(
-            dlsym(RTLD_NEXT, "pthread_rwlock_tryrdlock"));
-    real_pthread_rwlock_timedrdlock = reinterpret_cast<decltype(real_pthread_rwlock_timedrdlock)>(
-            dlsym(RTLD_NEXT, "pthread_rwlock_timedrdlock"));
-    real_pthread_rwlock_wrlock = reinterpret_cast<decltype(real_pthread_rwlock_wrlock)>(
-            dlsym(RTLD_NEXT, "pthread_rwlock_wrlock"));
-    real_pthread_rwlock_trywrlock = reinterpret_cast<decltype(real_pthread_rwlock_trywrlock)>(
-            dlsym(RTLD_NEXT, "pthread_rwlock_trywrlock"));
-    real_pthread_rwlock_timedwrlock = reinterpret_cast<decltype(real_pthread_rwlock_timedwrlock)>(
-            dlsym(RTLD_NEXT, "pthread_rwlock_timedwrlock"));
-    real_pthread_rwlock_unlock = reinterpret_cast<decltype(real_pthread_rwlock_unlock)>(
-            dlsym(RTLD_NEXT, "pthread_rwlock_unlock"));
-
-    const char* filename = getenv("SKELETON_KEYOUTPUT");
-    if (filename) {
-        skeleton_key::EventLogger::instance().init(filename);
-    } else {
-        skeleton_key::EventLogger::instance().init();
-    }
+    skeleton_key::startTracer();
 }
 
 // Interposed pthread functions
@@ -290,389 +4415,245 @@ extern "C" {
 int
 pthread_mutex_init(pthread_mutex_t* mutex, const pthread_mutexattr_t* attr)
 {
-    if (in_hook) return real_pthread_mutex_init(mutex, attr);
-    in_hook = true;
-    int result = real_pthread_mutex_init(mutex, attr);
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::MutexInit, mutex, nullptr, result);
-    in_hook = false;
-    return result;
+    return skeleton_key::MutexInitHook::call(mutex, attr);
 }
 
 int
 pthread_mutex_destroy(pthread_mutex_t* mutex)
 {
-    if (in_hook) return real_pthread_mutex_destroy(mutex);
-    in_hook = true;
-    int result = real_pthread_mutex_destroy(mutex);
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::MutexDestroy, mutex, nullptr, result);
-    in_hook = false;
-    return result;
+    return skeleton_key::MutexDestroyHook::call(mutex);
 }
 
 int
 pthread_mutex_lock(pthread_mutex_t* mutex)
 {
-    if (in_hook) return real_pthread_mutex_lock(mutex);
-    in_hook = true;
-
-    auto start = std::chrono::steady_clock::now();
-    skeleton_key::EventLogger::instance().log(skeleton_key::EventType::MutexLock, mutex, nullptr, 0);
-
-    int result = real_pthread_mutex_lock(mutex);
-
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(
-                            std::chrono::steady_clock::now() - start)
-                            .count();
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::MutexLockDone, mutex, nullptr, result, duration);
-
-    in_hook = false;
-    return result;
+    return skeleton_key::MutexLockHook::call(mutex);
 }
 
 int
 pthread_mutex_trylock(pthread_mutex_t* mutex)
 {
-    if (in_hook) return real_pthread_mutex_trylock(mutex);
-    in_hook = true;
-
-    auto start = std::chrono::steady_clock::now();
-    skeleton_key::EventLogger::instance().log(skeleton_key::EventType::MutexTryLock, mutex, nullptr, 0);
-
-    int result = real_pthread_mutex_trylock(mutex);
-
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(
-                            std::chrono::steady_clock::now() - start)
-                            .count();
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::MutexTryLockDone, mutex, nullptr, result, duration);
-
-    in_hook = false;
-    return result;
+    return skeleton_key::MutexTryLockHook::call(mutex);
 }
 
 int
 pthread_mutex_timedlock(pthread_mutex_t* mutex, const struct timespec* abstime)
 {
-    if (in_hook) return real_pthread_mutex_timedlock(mutex, abstime);
-    in_hook = true;
-
-    auto start = std::chrono::steady_clock::now();
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::MutexTimedLock, mutex, nullptr, 0);
-
-    int result = real_pthread_mutex_timedlock(mutex, abstime);
-
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(
-                            std::chrono::steady_clock::now() - start)
-                            .count();
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::MutexTimedLockDone, mutex, nullptr, result, duration);
+    return skeleton_key::MutexTimedLockHook::call(mutex, abstime);
+}
 
-    in_hook = false;
-    return result;
+int
+pthread_mutex_clocklock(pthread_mutex_t* mutex, clockid_t clock, const struct timespec* abstime)
+{
+    return skeleton_key::MutexClockLockHook::call(mutex, clock, abstime);
 }
 
 int
 pthread_mutex_unlock(pthread_mutex_t* mutex)
 {
-    if (in_hook) return real_pthread_mutex_unlock(mutex);
-    in_hook = true;
-
-    int result = real_pthread_mutex_unlock(mutex);
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::MutexUnlock, mutex, nullptr, result);
-
-    in_hook = false;
-    return result;
+    return skeleton_key::MutexUnlockHook::call(mutex);
 }
 
 // Condition variable functions
 int
 pthread_cond_init(pthread_cond_t* cond, const pthread_condattr_t* attr)
 {
-    if (in_hook) return real_pthread_cond_init(cond, attr);
-    in_hook = true;
-
-    int result = real_pthread_cond_init(cond, attr);
-    skeleton_key::EventLogger::instance().log(skeleton_key::EventType::CondInit, cond, nullptr, result);
-
-    in_hook = false;
-    return result;
+    return skeleton_key::CondInitHook::call(cond, attr);
 }
 
 int
 pthread_cond_destroy(pthread_cond_t* cond)
 {
-    if (in_hook) return real_pthread_cond_destroy(cond);
-    in_hook = true;
-
-    int result = real_pthread_cond_destroy(cond);
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::CondDestroy, cond, nullptr, result);
-
-    in_hook = false;
-    return result;
+    return skeleton_key::CondDestroyHook::call(cond);
 }
 
 int
 pthread_cond_signal(pthread_cond_t* cond)
 {
-    if (in_hook) return real_pthread_cond_signal(cond);
-    in_hook = true;
-
-    int result = real_pthread_cond_signal(cond);
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::CondSignal, cond, nullptr, result);
-
-    in_hook = false;
-    return result;
+    return skeleton_key::CondSignalHook::call(cond);
 }
 
 int
 pthread_cond_broadcast(pthread_cond_t* cond)
 {
-    if (in_hook) return real_pthread_cond_broadcast(cond);
-    in_hook = true;
-
-    int result = real_pthread_cond_broadcast(cond);
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::CondBroadcast, cond, nullptr, result);
-
-    in_hook = false;
-    return result;
+    return skeleton_key::CondBroadcastHook::call(cond);
 }
 
 int
 pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex)
 {
-    if (in_hook) return real_pthread_cond_wait(cond, mutex);
-    in_hook = true;
-
-    auto start = std::chrono::steady_clock::now();
-    skeleton_key::EventLogger::instance().log(skeleton_key::EventType::CondWait, cond, mutex, 0);
-
-    int result = real_pthread_cond_wait(cond, mutex);
-
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(
-                            std::chrono::steady_clock::now() - start)
-                            .count();
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::CondWaitDone, cond, mutex, result, duration);
-
-    in_hook = false;
-    return result;
+    return skeleton_key::CondWaitHook::call(cond, mutex);
 }
 
 int
 pthread_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* abstime)
 {
-    if (in_hook) return real_pthread_cond_timedwait(cond, mutex, abstime);
-    in_hook = true;
-
-    auto start = std::chrono::steady_clock::now();
-    skeleton_key::EventLogger::instance().log(skeleton_key::EventType::CondTimedWait, cond, mutex, 0);
-
-    int result = real_pthread_cond_timedwait(cond, mutex, abstime);
-
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(
-                            std::chrono::steady_clock::now() - start)
-                            .count();
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::CondTimedWaitDone, cond, mutex, result, duration);
+    return skeleton_key::CondTimedWaitHook::call(cond, mutex, abstime);
+}
 
-    in_hook = false;
-    return result;
+int
+pthread_cond_clockwait(pthread_cond_t* cond,
+                       pthread_mutex_t* mutex,
+                       clockid_t clock,
+                       const struct timespec* abstime)
+{
+    return skeleton_key::CondClockWaitHook::call(cond, mutex, clock, abstime);
 }
 
 // RWLock functions
 int
 pthread_rwlock_init(pthread_rwlock_t* rwlock, const pthread_rwlockattr_t* attr)
 {
-    if (in_hook) return real_pthread_rwlock_init(rwlock, attr);
-    in_hook = true;
-
-    int result = real_pthread_rwlock_init(rwlock, attr);
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::RWLockInit, rwlock, nullptr, result);
-
-    in_hook = false;
-    return result;
+    return skeleton_key::RWLockInitHook::call(rwlock, attr);
 }
 
 int
 pthread_rwlock_destroy(pthread_rwlock_t* rwlock)
 {
-    if (in_hook) return real_pthread_rwlock_destroy(rwlock);
-    in_hook = true;
-
-    int result = real_pthread_rwlock_destroy(rwlock);
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::RWLockDestroy, rwlock, nullptr, result);
-
-    in_hook = false;
-    return result;
+    return skeleton_key::RWLockDestroyHook::call(rwlock);
 }
 
 int
 pthread_rwlock_rdlock(pthread_rwlock_t* rwlock)
 {
-    if (in_hook) return real_pthread_rwlock_rdlock(rwlock);
-    in_hook = true;
-
-    auto start = std::chrono::steady_clock::now();
-    skeleton_key::EventLogger::instance().log(skeleton_key::EventType::RWLockRead, rwlock, nullptr, 0);
-
-    int result = real_pthread_rwlock_rdlock(rwlock);
-
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(
-                            std::chrono::steady_clock::now() - start)
-                            .count();
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::RWLockReadDone, rwlock, nullptr, result, duration);
-
-    in_hook = false;
-    return result;
+    return skeleton_key::RWLockReadHook::call(rwlock);
 }
 
 int
 pthread_rwlock_tryrdlock(pthread_rwlock_t* rwlock)
 {
-    if (in_hook) return real_pthread_rwlock_tryrdlock(rwlock);
-    in_hook = true;
-
-    auto start = std::chrono::steady_clock::now();
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::RWLockTryRead, rwlock, nullptr, 0);
-
-    int result = real_pthread_rwlock_tryrdlock(rwlock);
-
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(
-                            std::chrono::steady_clock::now() - start)
-                            .count();
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::RWLockTryReadDone, rwlock, nullptr, result, duration);
-
-    in_hook = false;
-    return result;
+    return skeleton_key::RWLockTryReadHook::call(rwlock);
 }
 
 int
 pthread_rwlock_timedrdlock(pthread_rwlock_t* rwlock, const struct timespec* abstime)
 {
-    if (in_hook) return real_pthread_rwlock_timedrdlock(rwlock, abstime);
-    in_hook = true;
-
-    auto start = std::chrono::steady_clock::now();
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::RWLockTimedRead, rwlock, nullptr, 0);
-
-    int result = real_pthread_rwlock_timedrdlock(rwlock, abstime);
-
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(
-                            std::chrono::steady_clock::now() - start)
-                            .count();
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::RWLockTimedReadDone, rwlock, nullptr, result, duration);
-
-    in_hook = false;
-    return result;
+    return skeleton_key::RWLockTimedReadHook::call(rwlock, abstime);
 }
 
 int
 pthread_rwlock_wrlock(pthread_rwlock_t* rwlock)
 {
-    if (in_hook) return real_pthread_rwlock_wrlock(rwlock);
-    in_hook = true;
+    return skeleton_key::RWLockWriteHook::call(rwlock);
+}
 
-    auto start = std::chrono::steady_clock::now();
-    skeleton_key::EventLogger::instance().log(skeleton_key::EventType::RWLockWrite, rwlock, nullptr, 0);
+int
+pthread_rwlock_trywrlock(pthread_rwlock_t* rwlock)
+{
+    return skeleton_key::RWLockTryWriteHook::call(rwlock);
+}
 
-    int result = real_pthread_rwlock_wrlock(rwlock);
+int
+pthread_rwlock_timedwrlock(pthread_rwlock_t* rwlock, const struct timespec* abstime)
+{
+    return skeleton_key::RWLockTimedWriteHook::call(rwlock, abstime);
+}
 
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(
-                            std::chrono::steady_clock::now() - start)
-                            .count();
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::RWLockWriteDone, rwlock, nullptr, result, duration);
+int
+pthread_rwlock_unlock(pthread_rwlock_t* rwlock)
+{
+    return skeleton_key::RWLockUnlockHook::call(rwlock);
+}
 
-    in_hook = false;
-    return result;
+// Spinlock functions. pthread_spinlock_t is a volatile int; the hooks take
+// the lock as a plain pointer.
+int
+pthread_spin_init(pthread_spinlock_t* lock, int pshared)
+{
+    return skeleton_key::SpinInitHook::call(const_cast<int*>(lock), pshared);
 }
 
 int
-pthread_rwlock_trywrlock(pthread_rwlock_t* rwlock)
+pthread_spin_destroy(pthread_spinlock_t* lock)
 {
-    if (in_hook) return real_pthread_rwlock_trywrlock(rwlock);
-    in_hook = true;
+    return skeleton_key::SpinDestroyHook::call(const_cast<int*>(lock));
+}
 
-    auto start = std::chrono::steady_clock::now();
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::RWLockTryWrite, rwlock, nullptr, 0);
+int
+pthread_spin_lock(pthread_spinlock_t* lock)
+{
+    return skeleton_key::SpinLockHook::call(const_cast<int*>(lock));
+}
 
-    int result = real_pthread_rwlock_trywrlock(rwlock);
+int
+pthread_spin_trylock(pthread_spinlock_t* lock)
+{
+    return skeleton_key::SpinTryLockHook::call(const_cast<int*>(lock));
+}
 
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(
-                            std::chrono::steady_clock::now() - start)
-                            .count();
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::RWLockTryWriteDone, rwlock, nullptr, result, duration);
+int
+pthread_spin_unlock(pthread_spinlock_t* lock)
+{
+    return skeleton_key::SpinUnlockHook::call(const_cast<int*>(lock));
+}
 
-    in_hook = false;
-    return result;
+// Semaphore functions
+int
+sem_init(sem_t* sem, int pshared, unsigned value)
+{
+    return skeleton_key::SemInitHook::call(sem, pshared, value);
 }
 
 int
-pthread_rwlock_timedwrlock(pthread_rwlock_t* rwlock, const struct timespec* abstime)
+sem_destroy(sem_t* sem)
 {
-    if (in_hook) return real_pthread_rwlock_timedwrlock(rwlock, abstime);
-    in_hook = true;
+    return skeleton_key::SemDestroyHook::call(sem);
+}
 
-    auto start = std::chrono::steady_clock::now();
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::RWLockTimedWrite, rwlock, nullptr, 0);
+int
+sem_wait(sem_t* sem)
+{
+    return skeleton_key::SemWaitHook::call(sem);
+}
 
-    int result = real_pthread_rwlock_timedwrlock(rwlock, abstime);
+int
+sem_trywait(sem_t* sem)
+{
+    return skeleton_key::SemTryWaitHook::call(sem);
+}
 
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(
-                            std::chrono::steady_clock::now() - start)
-                            .count();
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::RWLockTimedWriteDone, rwlock, nullptr, result, duration);
+int
+sem_timedwait(sem_t* sem, const struct timespec* abstime)
+{
+    return skeleton_key::SemTimedWaitHook::call(sem, abstime);
+}
 
-    in_hook = false;
-    return result;
+int
+sem_clockwait(sem_t* sem, clockid_t clock, const struct timespec* abstime)
+{
+    return skeleton_key::SemClockWaitHook::call(sem, clock, abstime);
 }
 
 int
-pthread_rwlock_unlock(pthread_rwlock_t* rwlock)
+sem_post(sem_t* sem)
 {
-    if (in_hook) return real_pthread_rwlock_unlock(rwlock);
-    in_hook = true;
+    return skeleton_key::SemPostHook::call(sem);
+}
 
-    int result = real_pthread_rwlock_unlock(rwlock);
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::RWLockUnlock, rwlock, nullptr, result);
+// Barrier functions
+int
+pthread_barrier_init(pthread_barrier_t* barrier, const pthread_barrierattr_t* attr, unsigned count)
+{
+    return skeleton_key::BarrierInitHook::call(barrier, attr, count);
+}
 
-    in_hook = false;
-    return result;
+int
+pthread_barrier_destroy(pthread_barrier_t* barrier)
+{
+    return skeleton_key::BarrierDestroyHook::call(barrier);
+}
+
+int
+pthread_barrier_wait(pthread_barrier_t* barrier)
+{
+    return skeleton_key::BarrierWaitHook::call(barrier);
 }
 
 // Thread creation
 int
 pthread_create(pthread_t* thread, const pthread_attr_t* attr, void* (*start_routine)(void*), void* arg)
 {
-    if (in_hook) return real_pthread_create(thread, attr, start_routine, arg);
-    in_hook = true;
-
-    int result = real_pthread_create(thread, attr, start_routine, arg);
-    skeleton_key::EventLogger::instance()
-            .log(skeleton_key::EventType::ThreadCreate, thread, nullptr, result);
-
-    in_hook = false;
-    return result;
+    return skeleton_key::ThreadCreateHook::call(thread, attr, start_routine, arg);
 }
 
 }  // extern "C"
@@ -0,0 +1,265 @@
+// Offline symbolization of the raw return addresses in a trace.
+//
+// The tracer lists the modules loaded into the traced process in a Modules
+// chunk (see trace_format.h). An address is mapped to its module and its
+// offset there, which is the same in every run of that build, and the
+// offset to a function name from the module's ELF symbol table. A module
+// file is only opened the first time one of its offsets is needed, and
+// every name looked up is remembered per build-id in a cache directory, so
+// analyzing traces of the same binaries again does not open their files at
+// all. Modules without a build-id, or whose file no longer has the recorded
+// one, are symbolized without the cache, or not at all.
+#pragma once
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "elf_symbols.h"
+#include "trace_decoder.h"
+#include "trace_format.h"
+
+namespace skeleton_key {
+
+struct Module
+{
+    // Subtracted from an address to get the ELF virtual address.
+    uint64_t load_bias;
+    uint64_t start;
+    uint64_t end;
+    // Lower-case hex; empty when the module has none.
+    std::string build_id;
+    std::string path;
+};
+
+// The modules of the traces' Modules chunks, ordered by start address, with
+// the addresses of each trace tagged as traceTag() describes.
+inline std::vector<Module>
+readModules(const std::vector<const TraceFile*>& traces)
+{
+    std::vector<Module> modules;
+    for (size_t t = 0; t < traces.size(); t++) {
+        const TraceFile& trace = *traces[t];
+        uint64_t tag = traceTag(t);
+        for (const ChunkRef& chunk : findChunks(trace, ChunkKind::Modules)) {
+            const uint8_t* payload = trace.data() + chunk.offset;
+            VarIntReader reader(payload, chunk.size);
+            auto readBytes = [&]() {
+                size_t size = std::min<size_t>(reader.readVarInt(), chunk.size - reader.position());
+                const char* bytes = reinterpret_cast<const char*>(payload + reader.position());
+                reader.seek(reader.position() + size);
+                return std::string(bytes, size);
+            };
+            uint64_t count = reader.readVarInt();
+            for (uint64_t i = 0; i < count && !reader.eof(); i++) {
+                Module module;
+                module.load_bias = reader.readVarInt() + tag;
+                module.start = reader.readVarInt() | tag;
+                module.end = reader.readVarInt() | tag;
+                static constexpr char HEX[] = "0123456789abcdef";
+                for (unsigned char byte : readBytes()) {
+                    module.build_id += HEX[byte >> 4];
+                    module.build_id += HEX[byte & 15];
+                }
+                module.path = readBytes();
+                modules.push_back(std::move(module));
+            }
+        }
+    }
+    // A later chunk describes the same module again; keep its last entry.
+    std::stable_sort(modules.begin(), modules.end(), [](const Module& a, const Module& b) {
+        return a.start < b.start;
+    });
+    std::vector<Module> unique;
+    for (Module& module : modules) {
+        if (!unique.empty() && unique.back().start == module.start) {
+            unique.back() = std::move(module);
+        } else {
+            unique.push_back(std::move(module));
+        }
+    }
+    return unique;
+}
+
+inline std::vector<Module>
+readModules(const TraceFile& trace)
+{
+    return readModules(std::vector<const TraceFile*>{&trace});
+}
+
+class Symbolizer
+{
+    struct ModuleState
+    {
+        bool cache_read = false;
+        bool elf_read = false;
+        bool elf_usable = false;
+        ElfSymbols elf;
+        // Names by offset, as cached and as looked up since.
+        std::unordered_map<uint64_t, std::string> names;
+        std::vector<uint64_t> added;
+    };
+
+    std::vector<Module> modules_;
+    std::vector<ModuleState> states_;
+    std::string cache_dir_;
+    std::unordered_map<uint64_t, std::string> by_address_;
+
+    std::string cachePath(const Module& module) const
+    {
+        return cache_dir_ + "/" + module.build_id + ".syms";
+    }
+
+    // Lines of "<hex offset> <name>"; an empty name means none was found.
+    void readCache(const Module& module, ModuleState& state)
+    {
+        state.cache_read = true;
+        if (cache_dir_.empty() || module.build_id.empty()) return;
+        FILE* file = fopen(cachePath(module).c_str(), "re");
+        if (file == nullptr) return;
+        char line[4096];
+        while (fgets(line, sizeof(line), file)) {
+            char* end = nullptr;
+            uint64_t offset = strtoull(line, &end, 16);
+            if (end == line || *end != ' ') continue;
+            std::string name(end + 1);
+            if (!name.empty() && name.back() == '\n') name.pop_back();
+            state.names.emplace(offset, std::move(name));
+        }
+        fclose(file);
+    }
+
+    static std::string baseName(const std::string& path)
+    {
+        size_t slash = path.rfind('/');
+        return slash == std::string::npos ? path : path.substr(slash + 1);
+    }
+
+    std::string resolve(uint64_t address)
+    {
+        auto it = std::upper_bound(
+                modules_.begin(), modules_.end(), address, [](uint64_t value, const Module& module) {
+                    return value < module.start;
+                });
+        if (it == modules_.begin() || address >= (it - 1)->end) return {};
+        const Module& module = *--it;
+        ModuleState& state = states_[it - modules_.begin()];
+        if (!state.cache_read) readCache(module, state);
+
+        uint64_t offset = address - module.load_bias;
+        auto cached = state.names.find(offset);
+        std::string name;
+        if (cached != state.names.end()) {
+            name = cached->second;
+        } else {
+            if (!state.elf_read) {
+                state.elf_read = true;
+                state.elf_usable = state.elf.load(module.path, module.build_id);
+            }
+            // Without the file there is nothing worth caching.
+            if (state.elf_usable) {
+                name = state.elf.lookup(offset);
+                state.names.emplace(offset, name);
+                state.added.push_back(offset);
+            }
+        }
+
+        char text[64];
+        if (name.empty()) {
+            snprintf(text, sizeof(text), "+0x%" PRIx64, offset);
+            return baseName(module.path) + text;
+        }
+        return name + " (" + baseName(module.path) + ")";
+    }
+
+  public:
+    // $SKELETON_KEY_SYMBOL_CACHE, else skeletonkey/ under $XDG_CACHE_HOME or
+    // ~/.cache. An empty variable turns the cache off.
+    static std::string defaultCacheDir()
+    {
+        if (const char* dir = getenv("SKELETON_KEY_SYMBOL_CACHE")) return dir;
+        const char* dir = getenv("XDG_CACHE_HOME");
+        if (dir && *dir) return std::string(dir) + "/skeletonkey";
+        const char* home = getenv("HOME");
+        if (home && *home) return std::string(home) + "/.cache/skeletonkey";
+        return {};
+    }
+
+    explicit Symbolizer(std::vector<Module> modules, std::string cache_dir = defaultCacheDir())
+    : modules_(std::move(modules))
+    , states_(modules_.size())
+    , cache_dir_(std::move(cache_dir))
+    {
+    }
+
+    Symbolizer(const Symbolizer&) = delete;
+    Symbolizer& operator=(const Symbolizer&) = delete;
+
+    ~Symbolizer()
+    {
+        save();
+    }
+
+    bool empty() const
+    {
+        return modules_.empty();
+    }
+
+    // "function+0xoffset (module)", "module+0xoffset" when the module has no
+    // symbol there, or empty when no module contains the address.
+    const std::string& symbolize(const void* address)
+    {
+        uint64_t value = reinterpret_cast<uintptr_t>(address);
+        auto it = by_address_.find(value);
+        if (it == by_address_.end()) it = by_address_.emplace(value, resolve(value)).first;
+        return it->second;
+    }
+
+    // Append the names looked up since the last save to the cache.
+    void save()
+    {
+        if (cache_dir_.empty()) return;
+        bool made_dir = false;
+        for (size_t i = 0; i < modules_.size(); i++) {
+            ModuleState& state = states_[i];
+            if (state.added.empty() || modules_[i].build_id.empty()) continue;
+            if (!made_dir) {
+                // Create the directory and, for the default, its parent.
+                size_t slash = cache_dir_.rfind('/');
+                if (slash != std::string::npos && slash > 0) {
+                    mkdir(cache_dir_.substr(0, slash).c_str(), 0755);
+                }
+                mkdir(cache_dir_.c_str(), 0755);
+                made_dir = true;
+            }
+            std::string lines;
+            for (uint64_t offset : state.added) {
+                char prefix[32];
+                snprintf(prefix, sizeof(prefix), "%" PRIx64 " ", offset);
+                lines += prefix + state.names[offset] + "\n";
+            }
+            // One append per module keeps concurrent analyses from
+            // interleaving within a line.
+            std::string path = cachePath(modules_[i]);
+            int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (fd >= 0) {
+                ssize_t written = ::write(fd, lines.data(), lines.size());
+                (void)written;
+                ::close(fd);
+            }
+            state.added.clear();
+        }
+    }
+};
+
+}  // namespace skeleton_key
@@ -0,0 +1,1046 @@
+// Decoding side of the trace format (see trace_format.h), used by the
+// analyzer. A TraceFile maps the trace; events come out of it either one
+// chunk at a time (ChunkDecoder), merged across threads into timestamp
+// order (forEachEvent), or decoded on several cores and split into
+// independently ordered shards (forEachEventSharded), for one trace or
+// for the traces of several processes together. Live traces are parsed
+// incrementally by TraceStream and put back in order by ReorderBuffer.
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <optional>
+#include <queue>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "compression.h"
+#include "trace_format.h"
+#include "varint_decode.h"
+
+namespace skeleton_key {
+
+// Reads varints and fixed-size values out of a byte range it does not own.
+class VarIntReader
+{
+    const uint8_t* data_;
+    size_t size_;
+    size_t pos_ = 0;
+    DecodeVarIntsFn decode_ = varIntKernel();
+
+    uint64_t readVarIntSlow()
+    {
+        uint64_t result = 0;
+        int shift = 0;
+
+        while (pos_ < size_) {
+            uint8_t byte = data_[pos_++];
+            result |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) break;
+            shift += 7;
+        }
+
+        return result;
+    }
+
+  public:
+    VarIntReader(const uint8_t* data, size_t size)
+    : data_(data)
+    , size_(size)
+    {
+    }
+
+    uint64_t readVarInt()
+    {
+        // Most fields of an event fit in a single byte.
+        if (pos_ < size_ && data_[pos_] < 0x80) return data_[pos_++];
+        return readVarIntSlow();
+    }
+
+    // Read `count` consecutive varints. Runs of multi-byte values such as
+    // stack frames go through the bulk kernel; single fields decode faster
+    // through readVarInt()'s one-byte fast path.
+    void readVarInts(uint64_t* out, size_t count)
+    {
+        pos_ = decode_(data_ + pos_, data_ + size_, out, count) - data_;
+    }
+
+    uint8_t readByte()
+    {
+        return pos_ < size_ ? data_[pos_++] : 0;
+    }
+
+    // Copy a fixed-size structure out of the buffer; false if truncated.
+    template<typename T>
+    bool readStruct(T* out)
+    {
+        if (size_ - pos_ < sizeof(T)) return false;
+        memcpy(out, data_ + pos_, sizeof(T));
+        pos_ += sizeof(T);
+        return true;
+    }
+
+    void* readPtr()
+    {
+        return reinterpret_cast<void*>(readVarInt());
+    }
+
+    std::vector<void*> readStack()
+    {
+        // Every frame takes at least a byte.
+        size_t depth = std::min<size_t>(readVarInt(), size_ - pos_);
+        std::vector<void*> stack(depth);
+
+        uint64_t frames[64];
+        for (size_t done = 0; done < depth;) {
+            size_t count = std::min<size_t>(depth - done, 64);
+            readVarInts(frames, count);
+            for (size_t i = 0; i < count; i++) {
+                stack[done + i] = reinterpret_cast<void*>(frames[i]);
+            }
+            done += count;
+        }
+
+        return stack;
+    }
+
+    bool eof() const
+    {
+        return pos_ >= size_;
+    }
+
+    size_t position() const
+    {
+        return pos_;
+    }
+
+    void seek(size_t pos)
+    {
+        pos_ = std::min(pos, size_);
+    }
+};
+
+// Converts recorded clock values to nanoseconds. Traces without a header
+// (and traces taken with the steady clock) are already in nanoseconds.
+class TraceClock
+{
+    uint64_t ticks_per_second_ = 1000000000;
+    uint64_t base_ticks_ = 0;
+    uint64_t base_ns_ = 0;
+
+  public:
+    void init(const TraceHeader& header)
+    {
+        if (header.clock != 0 && header.ticks_per_second != 0) {
+            ticks_per_second_ = header.ticks_per_second;
+            base_ticks_ = header.base_ticks;
+            base_ns_ = header.base_ns;
+        }
+    }
+
+    uint64_t toNanos(uint64_t ticks) const
+    {
+        __int128 delta = static_cast<__int128>(ticks) - base_ticks_;
+        return base_ns_ + static_cast<int64_t>(delta * 1000000000 / ticks_per_second_);
+    }
+
+    uint64_t durationToNanos(uint64_t ticks) const
+    {
+        return static_cast<uint64_t>(
+                static_cast<unsigned __int128>(ticks) * 1000000000 / ticks_per_second_);
+    }
+};
+
+static constexpr uint32_t NO_STACK = UINT32_MAX;
+
+// Times are in nanoseconds; `stack` indexes the StackStore the event was
+// decoded with.
+struct DecodedEvent
+{
+    uint64_t timestamp;
+    uint64_t duration;
+    void* ptr1;
+    void* ptr2;
+    uint32_t tid;
+    int32_t result;
+    uint32_t stack;
+    EventType type;
+};
+
+// Every distinct stack of a trace, stored once.
+class StackStore
+{
+    std::vector<std::vector<void*>> stacks_;
+    // Trace stack id -> index into stacks_.
+    std::unordered_map<uint64_t, uint32_t> ids_;
+
+  public:
+    // Stack ids are process wide, so a chunk redefining one restates the
+    // same frames.
+    void define(uint64_t id, std::vector<void*>&& frames)
+    {
+        auto [it, inserted] = ids_.emplace(id, static_cast<uint32_t>(stacks_.size()));
+        if (inserted) stacks_.push_back(std::move(frames));
+    }
+
+    uint32_t lookup(uint64_t id) const
+    {
+        auto it = ids_.find(id);
+        return it == ids_.end() ? NO_STACK : it->second;
+    }
+
+    uint32_t add(std::vector<void*>&& frames)
+    {
+        if (frames.empty()) return NO_STACK;
+        stacks_.push_back(std::move(frames));
+        return static_cast<uint32_t>(stacks_.size() - 1);
+    }
+
+    void clear()
+    {
+        stacks_.clear();
+        ids_.clear();
+    }
+
+    const std::vector<void*>& frames(uint32_t stack) const
+    {
+        static const std::vector<void*> none;
+        return stack == NO_STACK ? none : stacks_[stack];
+    }
+};
+
+// Files written by the mmap/ring backends are a header page followed by
+// fixed-size slots, each holding one chunk. Reassemble them into the same
+// stream the file backend writes, ordered by slot sequence.
+static constexpr char MAPPED_MAGIC[8] = {'S', 'K', 'M', 'M', 'A', 'P', '1', '\0'};
+static constexpr size_t MAPPED_HEADER_SIZE = 4096;
+static constexpr size_t MAPPED_SLOT_HEADER_SIZE = 16;
+static constexpr size_t MAPPED_TRACE_HEADER_OFFSET = 32;
+
+inline bool
+isMappedTrace(const uint8_t* data, size_t size)
+{
+    return size >= MAPPED_HEADER_SIZE && memcmp(data, MAPPED_MAGIC, sizeof(MAPPED_MAGIC)) == 0;
+}
+
+inline std::vector<uint8_t>
+flattenMappedTrace(const uint8_t* data, size_t size)
+{
+    uint32_t slot_size;
+    uint64_t slot_count;
+    memcpy(&slot_size, data + 8, sizeof(slot_size));
+    memcpy(&slot_count, data + 16, sizeof(slot_count));
+    if (slot_size <= MAPPED_SLOT_HEADER_SIZE) return {};
+    slot_count = std::min<uint64_t>(slot_count, (size - MAPPED_HEADER_SIZE) / slot_size);
+
+    std::vector<std::pair<uint64_t, const uint8_t*>> slots;
+    for (uint64_t i = 0; i < slot_count; i++) {
+        const uint8_t* slot = data + MAPPED_HEADER_SIZE + i * slot_size;
+        uint64_t sequence;
+        memcpy(&sequence, slot, sizeof(sequence));
+        if (sequence != 0) slots.emplace_back(sequence, slot);
+    }
+    std::sort(slots.begin(), slots.end());
+
+    // The trace header lives inside the mapped header page.
+    std::vector<uint8_t> records;
+    const uint8_t* trace_header = data + MAPPED_TRACE_HEADER_OFFSET;
+    if (memcmp(trace_header, TraceHeader::MAGIC, sizeof(TraceHeader::MAGIC)) == 0) {
+        TraceHeader header;
+        memcpy(&header, trace_header, offsetof(TraceHeader, sample_period));
+        size_t header_size =
+                std::min<size_t>(header.header_size, MAPPED_HEADER_SIZE - MAPPED_TRACE_HEADER_OFFSET);
+        records.insert(records.end(), trace_header, trace_header + header_size);
+    }
+    for (const auto& [sequence, slot] : slots) {
+        uint32_t used;
+        memcpy(&used, slot + 8, sizeof(used));
+        used = std::min<uint32_t>(used, slot_size - MAPPED_SLOT_HEADER_SIZE);
+        const uint8_t* slot_data = slot + MAPPED_SLOT_HEADER_SIZE;
+
+        // A slot's chunk header is never finished by the writer; its size is
+        // whatever the slot says was used.
+        ChunkHeader chunk;
+        memcpy(&chunk, slot_data, sizeof(chunk));
+        if (used >= sizeof(chunk) && chunk.magic == ChunkHeader::MAGIC) {
+            chunk.size = used - sizeof(chunk);
+            const auto* patched = reinterpret_cast<const uint8_t*>(&chunk);
+            records.insert(records.end(), patched, patched + sizeof(chunk));
+            records.insert(records.end(), slot_data + sizeof(chunk), slot_data + used);
+        } else {
+            records.insert(records.end(), slot_data, slot_data + used);
+        }
+    }
+    return records;
+}
+
+// A trace opened for reading. Files from the file backend are decoded
+// straight out of a read-only mapping; mapped-backend files are flattened
+// into memory first.
+class TraceFile
+{
+    void* mapping_ = MAP_FAILED;
+    size_t mapping_size_ = 0;
+    std::vector<uint8_t> flattened_;
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+    TraceHeader header_ = {};
+    bool has_header_ = false;
+    TraceClock clock_;
+
+  public:
+    TraceFile() = default;
+    TraceFile(const TraceFile&) = delete;
+    TraceFile& operator=(const TraceFile&) = delete;
+
+    ~TraceFile()
+    {
+        if (mapping_ != MAP_FAILED) munmap(mapping_, mapping_size_);
+    }
+
+    bool open(const char* filename)
+    {
+        int fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+        mapping_size_ = st.st_size;
+        if (mapping_size_ > 0) {
+            mapping_ = mmap(nullptr, mapping_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        ::close(fd);
+        if (mapping_size_ > 0 && mapping_ == MAP_FAILED) return false;
+        if (mapping_ != MAP_FAILED) madvise(mapping_, mapping_size_, MADV_SEQUENTIAL);
+
+        data_ = static_cast<const uint8_t*>(mapping_ == MAP_FAILED ? nullptr : mapping_);
+        size_ = mapping_size_;
+        if (isMappedTrace(data_, size_)) {
+            flattened_ = flattenMappedTrace(data_, size_);
+            data_ = flattened_.data();
+            size_ = flattened_.size();
+        }
+
+        has_header_ = TraceHeader::read(data_, size_, &header_);
+        if (has_header_) clock_.init(header_);
+        return true;
+    }
+
+    const uint8_t* data() const
+    {
+        return data_;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    bool hasHeader() const
+    {
+        return has_header_;
+    }
+
+    const TraceHeader& header() const
+    {
+        return header_;
+    }
+
+    const TraceClock& clock() const
+    {
+        return clock_;
+    }
+
+    unsigned version() const
+    {
+        return has_header_ ? header_.version : 1;
+    }
+
+    // Where the records or chunks start.
+    size_t bodyOffset() const
+    {
+        return has_header_ ? std::min<size_t>(header_.header_size, size_) : 0;
+    }
+};
+
+// Where one Events chunk's payload sits in the trace.
+struct ChunkRef
+{
+    size_t offset;
+    // Bytes stored in the trace, compressed or not.
+    uint32_t size;
+    uint32_t tid;
+    uint32_t event_count;
+    uint64_t base_timestamp;
+    Codec codec = Codec::None;
+    uint32_t raw_size = 0;
+};
+
+// The payload of the chunk `header` starts, at `offset`, with `size` bytes
+// of it present.
+inline ChunkRef
+chunkRef(const ChunkHeader& header, size_t offset, uint32_t size)
+{
+    ChunkRef chunk = {offset, size, header.tid, header.event_count, header.base_timestamp};
+    chunk.codec = header.codec;
+    chunk.raw_size = header.raw_size;
+    return chunk;
+}
+
+// Read the index the file backend leaves at the end of the trace. False if
+// there is none or it does not fit the file, e.g. after a crash.
+inline bool
+readChunkIndex(const TraceFile& trace, std::vector<ChunkRef>& chunks)
+{
+    ChunkIndexTrailer trailer;
+    if (trace.size() < trace.bodyOffset() + sizeof(ChunkHeader) + sizeof(trailer)) return false;
+    memcpy(&trailer, trace.data() + trace.size() - sizeof(trailer), sizeof(trailer));
+    if (trailer.magic != ChunkIndexTrailer::MAGIC) return false;
+
+    size_t entries_size = static_cast<size_t>(trailer.entry_count) * sizeof(ChunkIndexEntry);
+    if (trailer.index_offset + sizeof(ChunkHeader) + entries_size + sizeof(trailer) != trace.size()) {
+        return false;
+    }
+    ChunkHeader header;
+    memcpy(&header, trace.data() + trailer.index_offset, sizeof(header));
+    if (header.magic != ChunkHeader::MAGIC || header.kind != ChunkKind::Index) return false;
+
+    const uint8_t* entries = trace.data() + trailer.index_offset + sizeof(ChunkHeader);
+    chunks.reserve(trailer.entry_count);
+    for (uint32_t i = 0; i < trailer.entry_count; i++) {
+        ChunkIndexEntry entry;
+        memcpy(&entry, entries + i * sizeof(entry), sizeof(entry));
+        if (entry.offset + sizeof(ChunkHeader) + entry.size > trailer.index_offset) {
+            chunks.clear();
+            return false;
+        }
+        size_t payload = entry.offset + sizeof(ChunkHeader);
+        ChunkRef chunk = {payload, entry.size, entry.tid, entry.event_count, entry.base_timestamp};
+        // Only the chunk header says how the payload is stored.
+        memcpy(&header, trace.data() + entry.offset, sizeof(header));
+        if (header.magic == ChunkHeader::MAGIC) {
+            chunk.codec = header.codec;
+            chunk.raw_size = header.raw_size;
+        }
+        chunks.push_back(chunk);
+    }
+    return true;
+}
+
+// Walk the chunk headers from file offset `start` up to the Index chunk or
+// the end of the trace, calling visit(header, reference) for each chunk.
+template<typename Visitor>
+void
+walkChunks(const TraceFile& trace, size_t start, Visitor&& visit)
+{
+    VarIntReader reader(trace.data(), trace.size());
+    reader.seek(start);
+    ChunkHeader chunk;
+    while (reader.readStruct(&chunk)) {
+        if (chunk.magic != ChunkHeader::MAGIC) {
+            std::cerr << "Corrupt chunk at offset " << reader.position() - sizeof(chunk) << "\n";
+            break;
+        }
+        if (chunk.kind == ChunkKind::Index) break;
+        size_t offset = reader.position();
+        uint32_t size = static_cast<uint32_t>(std::min<size_t>(chunk.size, trace.size() - offset));
+        visit(chunk, chunkRef(chunk, offset, size));
+        reader.seek(offset + size);
+    }
+}
+
+// Find the Events chunks of a version 2 trace without decoding any events:
+// from the index if the trace has one, otherwise by walking the chunk headers.
+inline std::vector<ChunkRef>
+indexChunks(const TraceFile& trace)
+{
+    std::vector<ChunkRef> chunks;
+    if (readChunkIndex(trace, chunks)) return chunks;
+    walkChunks(trace, trace.bodyOffset(), [&](const ChunkHeader& header, const ChunkRef& chunk) {
+        if (header.kind == ChunkKind::Events) chunks.push_back(chunk);
+    });
+    return chunks;
+}
+
+// Find the chunks of another kind, e.g. Modules. With an index only the
+// chunks after the last indexed one need to be looked at.
+inline std::vector<ChunkRef>
+findChunks(const TraceFile& trace, ChunkKind kind)
+{
+    std::vector<ChunkRef> chunks;
+    if (trace.version() < 2) return chunks;
+    size_t start = trace.bodyOffset();
+    std::vector<ChunkRef> indexed;
+    if (readChunkIndex(trace, indexed) && !indexed.empty()) {
+        start = indexed.back().offset + indexed.back().size;
+    }
+    walkChunks(trace, start, [&](const ChunkHeader& header, const ChunkRef& chunk) {
+        if (header.kind == kind) chunks.push_back(chunk);
+    });
+    return chunks;
+}
+
+// Group chunks by thread: one list of chunk indices per thread, each in file
+// order, with threads in order of their first chunk.
+inline std::vector<std::vector<size_t>>
+chunksByThread(const std::vector<ChunkRef>& chunks)
+{
+    std::vector<std::vector<size_t>> threads;
+    std::unordered_map<uint32_t, size_t> thread_of_tid;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        auto [it, inserted] = thread_of_tid.emplace(chunks[i].tid, threads.size());
+        if (inserted) threads.emplace_back();
+        threads[it->second].push_back(i);
+    }
+    return threads;
+}
+
+// When the traces of several processes are analyzed together, the lock and
+// code addresses and stack ids of the i-th are tagged with traceTag(i) in
+// their top 16 bits, above any user-space address, so that one process's
+// never collide with another's; a forked child has the same addresses as
+// its parent for different locks. The first trace's are unchanged.
+inline uint64_t
+traceTag(size_t index)
+{
+    return static_cast<uint64_t>(index) << 48;
+}
+
+// The position of the trace a tagged address came from.
+inline size_t
+traceIndex(const void* address)
+{
+    return reinterpret_cast<uintptr_t>(address) >> 48;
+}
+
+// A tagged address as its own process had it.
+inline void*
+untagged(const void* address)
+{
+    return reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(address) & (traceTag(1) - 1));
+}
+
+class ChunkDecoder
+{
+    // The decompressed payload, for a compressed chunk.
+    std::vector<uint8_t> raw_;
+    VarIntReader reader_;
+    const TraceClock* clock_;
+    StackStore* stacks_;
+    uint32_t tid_;
+    uint64_t timestamp_;
+    uint64_t tag_;
+    LockDictionary locks_;
+
+    void* address(uint64_t value) const
+    {
+        return reinterpret_cast<void*>(value != 0 ? value | tag_ : 0);
+    }
+
+    std::vector<void*> readStack()
+    {
+        std::vector<void*> frames = reader_.readStack();
+        if (tag_ != 0) {
+            for (void*& frame : frames) frame = address(reinterpret_cast<uintptr_t>(frame));
+        }
+        return frames;
+    }
+
+  public:
+    ChunkDecoder(const TraceFile& trace, const ChunkRef& chunk, StackStore& stacks, uint64_t tag = 0)
+    : ChunkDecoder(trace.data() + chunk.offset, chunk, trace.clock(), stacks, tag)
+    {
+    }
+
+    // Decode a payload that is not part of a TraceFile; chunk.offset is unused.
+    ChunkDecoder(
+            const uint8_t* payload,
+            const ChunkRef& chunk,
+            const TraceClock& clock,
+            StackStore& stacks,
+            uint64_t tag = 0)
+    : reader_(payload, chunk.codec == Codec::None ? chunk.size : 0)
+    , clock_(&clock)
+    , stacks_(&stacks)
+    , tid_(chunk.tid)
+    , timestamp_(chunk.base_timestamp)
+    , tag_(tag)
+    {
+        if (chunk.codec == Codec::None) return;
+        raw_.resize(chunk.raw_size);
+        if (decompress(chunk.codec, payload, chunk.size, raw_.data(), raw_.size())) {
+            reader_ = VarIntReader(raw_.data(), raw_.size());
+            return;
+        }
+        // The chunk decodes as empty; say so once.
+        static std::atomic<bool> warned{false};
+        if (!warned.exchange(true)) {
+            std::cerr << "Cannot decompress " << codecName(chunk.codec) << " chunks"
+                      << (codecAvailable(chunk.codec) ? ", the trace is corrupt" : " in this build")
+                      << "\n";
+        }
+    }
+
+    // The reader may point into raw_, whose buffer moves along.
+    ChunkDecoder(ChunkDecoder&&) = default;
+    ChunkDecoder(const ChunkDecoder&) = delete;
+    ChunkDecoder& operator=(const ChunkDecoder&) = delete;
+
+    bool next(DecodedEvent& event)
+    {
+        while (!reader_.eof()) {
+            uint8_t type_byte = reader_.readByte();
+            if (type_byte == RECORD_STACK_DEFINITION) {
+                uint64_t id = reader_.readVarInt() | tag_;
+                stacks_->define(id, readStack());
+                continue;
+            }
+            event.type = static_cast<EventType>(type_byte & EVENT_TYPE_MASK);
+            event.tid = tid_;
+            timestamp_ += zigzagDecode(reader_.readVarInt());
+            event.timestamp = clock_->toNanos(timestamp_);
+            event.ptr1 = address(locks_.decode(reader_.readVarInt()));
+            event.ptr2 = nullptr;
+            if (type_byte & EVENT_HAS_PTR2) event.ptr2 = address(locks_.decode(reader_.readVarInt()));
+            event.result = 0;
+            if (type_byte & EVENT_HAS_RESULT) {
+                event.result = static_cast<int32_t>(zigzagDecode(reader_.readVarInt()));
+            }
+            event.duration = 0;
+            if (eventHasDuration(event.type)) {
+                event.duration = clock_->durationToNanos(reader_.readVarInt());
+            }
+            uint64_t stack_ref = reader_.readVarInt();
+            event.stack = NO_STACK;
+            if (stack_ref == STACK_INLINE) {
+                event.stack = stacks_->add(readStack());
+            } else if (stack_ref >= STACK_ID_BASE) {
+                event.stack = stacks_->lookup((stack_ref - STACK_ID_BASE) | tag_);
+            }
+            return true;
+        }
+        return false;
+    }
+};
+
+// Version 1: a flat sequence of self-contained records.
+inline void
+decodeRecords(const TraceFile& trace, StackStore& stacks, std::vector<DecodedEvent>& events)
+{
+    VarIntReader reader(trace.data(), trace.size());
+    reader.seek(trace.bodyOffset());
+    const TraceClock& clock = trace.clock();
+    while (!reader.eof()) {
+        // Every field is a varint (types all fit in a single byte).
+        uint64_t fields[7];
+        reader.readVarInts(fields, 7);
+        DecodedEvent event;
+        event.timestamp = clock.toNanos(fields[0]);
+        event.tid = fields[1];
+        event.type = static_cast<EventType>(fields[2]);
+        event.ptr1 = reinterpret_cast<void*>(fields[3]);
+        event.ptr2 = reinterpret_cast<void*>(fields[4]);
+        event.result = fields[5];
+        event.duration = clock.durationToNanos(fields[6]);
+        event.stack = stacks.add(reader.readStack());
+        events.push_back(event);
+    }
+}
+
+// The events of one thread, decoding its chunks as they are reached.
+class ThreadChunkStream
+{
+    const TraceFile* trace_;
+    StackStore* stacks_;
+    uint64_t tag_;
+    std::vector<const ChunkRef*> chunks_;
+    size_t next_chunk_ = 0;
+    std::optional<ChunkDecoder> decoder_;
+
+  public:
+    ThreadChunkStream(const TraceFile& trace, StackStore& stacks, uint64_t tag = 0)
+    : trace_(&trace)
+    , stacks_(&stacks)
+    , tag_(tag)
+    {
+    }
+
+    void addChunk(const ChunkRef& chunk)
+    {
+        chunks_.push_back(&chunk);
+    }
+
+    bool next(DecodedEvent& event)
+    {
+        while (true) {
+            if (decoder_ && decoder_->next(event)) return true;
+            if (next_chunk_ == chunks_.size()) return false;
+            decoder_.emplace(*trace_, *chunks_[next_chunk_++], *stacks_, tag_);
+        }
+    }
+};
+
+// The events of one thread already decoded into a series of vectors.
+class DecodedStream
+{
+    std::vector<const std::vector<DecodedEvent>*> parts_;
+    size_t part_ = 0;
+    size_t position_ = 0;
+
+  public:
+    void addPart(const std::vector<DecodedEvent>& part)
+    {
+        if (!part.empty()) parts_.push_back(&part);
+    }
+
+    bool next(DecodedEvent& event)
+    {
+        if (part_ == parts_.size()) return false;
+        event = (*parts_[part_])[position_++];
+        if (position_ == parts_[part_]->size()) {
+            part_++;
+            position_ = 0;
+        }
+        return true;
+    }
+};
+
+// Merges per-thread event streams into timestamp order. A thread's chunks
+// appear in the file in the order it filled them, so each thread is one
+// sorted stream and a k-way merge restores the global order without holding
+// all events in memory. Ties go to the stream listed first, which for
+// streams in chunksByThread() order is what a stable sort would do.
+template<typename Stream>
+class EventMerger
+{
+    std::vector<Stream> streams_;
+    std::vector<DecodedEvent> heads_;
+    // (timestamp of the stream's head event, stream index), smallest first.
+    std::priority_queue<
+            std::pair<uint64_t, size_t>,
+            std::vector<std::pair<uint64_t, size_t>>,
+            std::greater<std::pair<uint64_t, size_t>>>
+            queue_;
+
+  public:
+    explicit EventMerger(std::vector<Stream>&& streams)
+    : streams_(std::move(streams))
+    , heads_(streams_.size())
+    {
+        for (size_t i = 0; i < streams_.size(); i++) {
+            if (streams_[i].next(heads_[i])) queue_.emplace(heads_[i].timestamp, i);
+        }
+    }
+
+    bool next(DecodedEvent& event)
+    {
+        if (queue_.empty()) return false;
+        size_t index = queue_.top().second;
+        queue_.pop();
+        event = heads_[index];
+        if (streams_[index].next(heads_[index])) queue_.emplace(heads_[index].timestamp, index);
+        return true;
+    }
+};
+
+// Version 1 traces carry no per-thread structure; decode and sort them
+// whole. The sort is stable so events of one thread keep their order.
+inline std::vector<DecodedEvent>
+sortedRecords(const TraceFile& trace, StackStore& stacks)
+{
+    std::vector<DecodedEvent> events;
+    decodeRecords(trace, stacks, events);
+    std::stable_sort(events.begin(), events.end(), [](const auto& a, const auto& b) {
+        return a.timestamp < b.timestamp;
+    });
+    return events;
+}
+
+// Call `visit` with every event of the traces in timestamp order, the
+// threads of all of them merged together; their addresses are tagged as
+// traceTag() describes. Timestamps are comparable across the traces of one
+// machine, which all count CLOCK_MONOTONIC. A version 1 trace can only be
+// read alone.
+template<typename Visitor>
+void
+forEachEvent(const std::vector<const TraceFile*>& traces, StackStore& stacks, Visitor&& visit)
+{
+    if (traces.size() == 1 && traces[0]->version() < 2) {
+        for (const DecodedEvent& event : sortedRecords(*traces[0], stacks)) visit(event);
+        return;
+    }
+
+    std::vector<std::vector<ChunkRef>> chunks(traces.size());
+    std::vector<ThreadChunkStream> streams;
+    for (size_t t = 0; t < traces.size(); t++) {
+        if (traces[t]->version() < 2) continue;
+        chunks[t] = indexChunks(*traces[t]);
+        for (const auto& thread : chunksByThread(chunks[t])) {
+            streams.emplace_back(*traces[t], stacks, traceTag(t));
+            for (size_t chunk : thread) streams.back().addChunk(chunks[t][chunk]);
+        }
+    }
+    EventMerger<ThreadChunkStream> merger(std::move(streams));
+    DecodedEvent event;
+    while (merger.next(event)) visit(event);
+}
+
+template<typename Visitor>
+void
+forEachEvent(const TraceFile& trace, StackStore& stacks, Visitor&& visit)
+{
+    forEachEvent(std::vector<const TraceFile*>{&trace}, stacks, std::forward<Visitor>(visit));
+}
+
+// Incremental parser for a version 2 trace that arrives in pieces, from the
+// socket backend or a file that is still being written. It holds on to at
+// most the one chunk that is not complete yet.
+class TraceStream
+{
+    std::vector<uint8_t> pending_;
+    bool has_header_ = false;
+    TraceHeader header_ = {};
+    TraceClock clock_;
+
+  public:
+    // Append `size` bytes and call visit(chunk, payload) for every Events
+    // chunk they complete. False if the data is not a version 2 trace.
+    template<typename ChunkVisitor>
+    bool feed(const uint8_t* data, size_t size, ChunkVisitor&& visit)
+    {
+        pending_.insert(pending_.end(), data, data + size);
+        size_t pos = 0;
+        if (!has_header_) {
+            if (pending_.size() < offsetof(TraceHeader, sample_period)) return true;
+            if (!TraceHeader::read(pending_.data(), pending_.size(), &header_)) return false;
+            if (header_.version < 2) return false;
+            if (pending_.size() < header_.header_size) return true;
+            TraceHeader::read(pending_.data(), pending_.size(), &header_);
+            clock_.init(header_);
+            has_header_ = true;
+            pos = header_.header_size;
+        }
+
+        ChunkHeader chunk;
+        while (pending_.size() - pos >= sizeof(chunk)) {
+            memcpy(&chunk, pending_.data() + pos, sizeof(chunk));
+            if (chunk.magic != ChunkHeader::MAGIC) return false;
+            if (pending_.size() - pos - sizeof(chunk) < chunk.size) break;
+            if (chunk.kind == ChunkKind::Events) {
+                visit(chunkRef(chunk, 0, chunk.size), pending_.data() + pos + sizeof(chunk));
+            }
+            pos += sizeof(chunk) + chunk.size;
+        }
+        pending_.erase(pending_.begin(), pending_.begin() + pos);
+        return true;
+    }
+
+    bool hasHeader() const
+    {
+        return has_header_;
+    }
+
+    const TraceHeader& header() const
+    {
+        return header_;
+    }
+
+    const TraceClock& clock() const
+    {
+        return clock_;
+    }
+};
+
+// Restores timestamp order to events that arrive roughly in order. Each
+// thread's events come in order, but threads hand over their chunks at
+// different times. An event is released once an event `window` nanoseconds
+// newer has been seen; one that arrives after events newer than it were
+// already released is passed on at once, out of order, and counted as late.
+// Memory is bounded by the events of one window.
+class ReorderBuffer
+{
+    struct Entry
+    {
+        DecodedEvent event;
+        uint64_t sequence;
+
+        bool operator>(const Entry& other) const
+        {
+            if (event.timestamp != other.event.timestamp) return event.timestamp > other.event.timestamp;
+            return sequence > other.sequence;
+        }
+    };
+
+    uint64_t window_;
+    uint64_t newest_ = 0;
+    uint64_t released_ = 0;
+    uint64_t sequence_ = 0;
+    uint64_t late_ = 0;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue_;
+
+  public:
+    explicit ReorderBuffer(uint64_t window)
+    : window_(window)
+    {
+    }
+
+    template<typename Visitor>
+    void push(const DecodedEvent& event, Visitor&& visit)
+    {
+        if (event.timestamp < released_) {
+            late_++;
+            visit(event);
+            return;
+        }
+        queue_.push({event, sequence_++});
+        newest_ = std::max(newest_, event.timestamp);
+        while (!queue_.empty() && queue_.top().event.timestamp + window_ <= newest_) {
+            released_ = queue_.top().event.timestamp;
+            visit(queue_.top().event);
+            queue_.pop();
+        }
+    }
+
+    // Release everything still held, e.g. once the stream has ended.
+    template<typename Visitor>
+    void flush(Visitor&& visit)
+    {
+        while (!queue_.empty()) {
+            released_ = queue_.top().event.timestamp;
+            visit(queue_.top().event);
+            queue_.pop();
+        }
+    }
+
+    uint64_t late() const
+    {
+        return late_;
+    }
+};
+
+// Run fn(0) .. fn(count - 1), each on its own thread.
+template<typename Function>
+void
+runOnThreads(unsigned count, Function&& fn)
+{
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < count; i++) threads.emplace_back(fn, i);
+    fn(0u);
+    for (auto& thread : threads) thread.join();
+}
+
+// Hands `event` to push(shard) for the shard shard_of names, or for both
+// when it names a pair.
+template<typename ShardOf, typename Push>
+void
+routeEvent(ShardOf& shard_of, const DecodedEvent& event, Push&& push)
+{
+    if constexpr (std::is_integral_v<decltype(shard_of(event))>) {
+        push(shard_of(event));
+    } else {
+        auto [first, second] = shard_of(event);
+        push(first);
+        if (second != first) push(second);
+    }
+}
+
+// Parallel variant of forEachEvent for visitors whose state can be split
+// into `shards` independent parts, e.g. by lock. shard_of(event) names the
+// part an event belongs to, or a std::pair of two parts for an event that
+// touches both (a condition wait changes its cond and its mutex); visit(shard,
+// event) then gets every event of that shard in timestamp order, called from
+// one thread per shard.
+//
+// The chunks are first decoded on all threads into per-shard buckets, then
+// each shard merges its own buckets. Events come without stacks: chunks are
+// decoded by scratch StackStores that are thrown away.
+//
+// Several traces are merged as forEachEvent() merges them.
+template<typename ShardOf, typename Visitor>
+void
+forEachEventSharded(
+        const std::vector<const TraceFile*>& traces,
+        unsigned shards,
+        ShardOf&& shard_of,
+        Visitor&& visit)
+{
+    shards = std::max(shards, 1u);
+    if (traces.size() == 1 && traces[0]->version() < 2) {
+        StackStore stacks;
+        for (DecodedEvent event : sortedRecords(*traces[0], stacks)) {
+            event.stack = NO_STACK;
+            routeEvent(shard_of, event, [&](unsigned shard) { visit(shard, event); });
+        }
+        return;
+    }
+
+    // The chunks of all traces, each thread's still in a row.
+    std::vector<ChunkRef> chunks;
+    std::vector<size_t> trace_of;
+    std::vector<std::vector<size_t>> threads;
+    for (size_t t = 0; t < traces.size(); t++) {
+        if (traces[t]->version() < 2) continue;
+        std::vector<ChunkRef> own = indexChunks(*traces[t]);
+        for (std::vector<size_t>& thread : chunksByThread(own)) {
+            for (size_t& chunk : thread) {
+                chunks.push_back(own[chunk]);
+                trace_of.push_back(t);
+                chunk = chunks.size() - 1;
+            }
+            threads.push_back(std::move(thread));
+        }
+    }
+    // buckets[chunk][shard]
+    std::vector<std::vector<std::vector<DecodedEvent>>> buckets(chunks.size());
+    std::atomic<size_t> next_chunk{0};
+    runOnThreads(shards, [&](unsigned) {
+        StackStore scratch;
+        for (size_t i = next_chunk++; i < chunks.size(); i = next_chunk++) {
+            auto& bucket = buckets[i];
+            bucket.resize(shards);
+            for (auto& events : bucket) events.reserve(chunks[i].event_count / shards + 1);
+            ChunkDecoder decoder(*traces[trace_of[i]], chunks[i], scratch, traceTag(trace_of[i]));
+            DecodedEvent event;
+            while (decoder.next(event)) {
+                event.stack = NO_STACK;
+                routeEvent(shard_of, event, [&](unsigned shard) { bucket[shard].push_back(event); });
+            }
+            scratch.clear();
+        }
+    });
+
+    runOnThreads(shards, [&](unsigned shard) {
+        std::vector<DecodedStream> streams(threads.size());
+        for (size_t t = 0; t < threads.size(); t++) {
+            for (size_t chunk : threads[t]) streams[t].addPart(buckets[chunk][shard]);
+        }
+        EventMerger<DecodedStream> merger(std::move(streams));
+        DecodedEvent event;
+        while (merger.next(event)) visit(shard, event);
+    });
+}
+
+template<typename ShardOf, typename Visitor>
+void
+forEachEventSharded(const TraceFile& trace, unsigned shards, ShardOf&& shard_of, Visitor&& visit)
+{
+    forEachEventSharded(std::vector<const TraceFile*>{&trace},
+                        shards,
+                        std::forward<ShardOf>(shard_of),
+                        std::forward<Visitor>(visit));
+}
+
+}  // namespace skeleton_key
@@ -0,0 +1,436 @@
+// On-disk trace format, shared by the tracer and the readers.
+//
+// A trace starts with a TraceHeader. In version 2 the rest of the file is a
+// sequence of chunks, each a ChunkHeader followed by `size` payload bytes.
+// An Events chunk holds the events of one thread; every chunk can be decoded
+// on its own because all delta state starts over at its beginning.
+//
+// Each event in an Events chunk is encoded as:
+//
+//   u8      type, or'ed with EVENT_HAS_PTR2 / EVENT_HAS_RESULT
+//   varint  zigzag(timestamp - previous timestamp in the chunk)
+//   varint  LockDictionary code for ptr1
+//   varint  LockDictionary code for ptr2     (if EVENT_HAS_PTR2)
+//   varint  zigzag(result)                    (if EVENT_HAS_RESULT)
+//   varint  duration                          (if eventHasDuration(type))
+//   varint  stack reference: STACK_NONE, STACK_INLINE followed by the depth
+//           and one varint per frame, or STACK_ID_BASE + stack id
+//
+// An Events chunk whose header names a codec holds that codec's compressed
+// form of the payload above, raw_size bytes once decompressed. Each chunk is
+// compressed on its own, so it still decodes without any other.
+//
+// Stack ids are process wide. The first event in a chunk that refers to an id
+// is preceded by a definition record:
+//
+//   u8      RECORD_STACK_DEFINITION
+//   varint  stack id
+//   varint  depth, then one varint per frame
+//
+// Stack frames are raw return addresses. So that they can be symbolized
+// later, and told apart across runs despite ASLR, every backend but the
+// aggregate one writes a Modules chunk when the trace closes, listing the
+// objects loaded into the process at that point (or at the last check, on
+// a fatal signal):
+//
+//   varint  module count, then for each module:
+//   varint  load bias: what to subtract from an address to get the ELF
+//           virtual address within the module
+//   varint  start and end of the module's loaded segments
+//   varint  build-id size, then the build-id bytes
+//   varint  path size, then the path bytes
+//
+// The file backend ends the trace with an Index chunk: one ChunkIndexEntry
+// per Events chunk in file order, then a ChunkIndexTrailer. The trailer is
+// the last thing in the file, so a reader can find every chunk, and split
+// the work of decoding them, without walking the chunk headers first. Other
+// chunks, like the Modules chunk, sit between the last indexed chunk and the
+// Index chunk.
+//
+// Version 1 traces (and traces with no header at all) are a flat sequence of
+// records: timestamp, tid, type byte, ptr1, ptr2, result, duration and the
+// stack, every field a plain varint.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace skeleton_key {
+
+enum class EventType : uint8_t {
+    // Thread events
+    ThreadCreate,
+
+    // Mutex events
+    MutexInit,
+    MutexDestroy,
+    MutexLock,
+    MutexLockDone,
+    MutexTryLock,
+    MutexTryLockDone,
+    MutexTimedLock,
+    MutexTimedLockDone,
+    MutexUnlock,
+
+    // RWLock events
+    RWLockInit,
+    RWLockDestroy,
+    RWLockRead,
+    RWLockReadDone,
+    RWLockTryRead,
+    RWLockTryReadDone,
+    RWLockTimedRead,
+    RWLockTimedReadDone,
+    RWLockWrite,
+    RWLockWriteDone,
+    RWLockTryWrite,
+    RWLockTryWriteDone,
+    RWLockTimedWrite,
+    RWLockTimedWriteDone,
+    RWLockUnlock,
+
+    // Condition variable events
+    CondInit,
+    CondDestroy,
+    CondSignal,
+    CondBroadcast,
+    CondWait,
+    CondWaitDone,
+    CondTimedWait,
+    CondTimedWaitDone,
+
+    // Acquisitions that did not have to wait, logged in place of the
+    // Lock/LockDone pair when only contended acquisitions are traced.
+    MutexLockFast,
+    RWLockReadFast,
+    RWLockWriteFast,
+
+    // Spinlock events. The duration of a SpinLockDone is time the thread
+    // spent spinning on the CPU rather than blocked.
+    SpinInit,
+    SpinDestroy,
+    SpinLock,
+    SpinLockDone,
+    SpinTryLock,
+    SpinTryLockDone,
+    SpinUnlock,
+    SpinLockFast,
+
+    // Semaphore events. A semaphore has no owner: a wait takes one unit,
+    // which any thread may give back with a post. sem_clockwait() is logged
+    // as SemTimedWait.
+    SemInit,
+    SemDestroy,
+    SemWait,
+    SemWaitDone,
+    SemTryWait,
+    SemTryWaitDone,
+    SemTimedWait,
+    SemTimedWaitDone,
+    SemPost,
+    SemWaitFast,
+
+    // Barrier events. The wait of the thread that completes a round returns
+    // PTHREAD_BARRIER_SERIAL_THREAD as its result.
+    BarrierInit,
+    BarrierDestroy,
+    BarrierWait,
+    BarrierWaitDone,
+
+    // Waits against a chosen clock, which newer libstdc++ uses for the
+    // timed waits of std::timed_mutex and std::condition_variable.
+    MutexClockLock,
+    MutexClockLockDone,
+    CondClockWait,
+    CondClockWaitDone,
+};
+
+// The *Done events carry how long the call took.
+inline bool
+eventHasDuration(EventType type)
+{
+    switch (type) {
+        case EventType::MutexLockDone:
+        case EventType::MutexTryLockDone:
+        case EventType::MutexTimedLockDone:
+        case EventType::RWLockReadDone:
+        case EventType::RWLockTryReadDone:
+        case EventType::RWLockTimedReadDone:
+        case EventType::RWLockWriteDone:
+        case EventType::RWLockTryWriteDone:
+        case EventType::RWLockTimedWriteDone:
+        case EventType::CondWaitDone:
+        case EventType::CondTimedWaitDone:
+        case EventType::SpinLockDone:
+        case EventType::SpinTryLockDone:
+        case EventType::SemWaitDone:
+        case EventType::SemTryWaitDone:
+        case EventType::SemTimedWaitDone:
+        case EventType::BarrierWaitDone:
+        case EventType::MutexClockLockDone:
+        case EventType::CondClockWaitDone:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Flag bits or'ed into the type byte of a version 2 event.
+static constexpr uint8_t EVENT_HAS_PTR2 = 0x80;
+static constexpr uint8_t EVENT_HAS_RESULT = 0x40;
+static constexpr uint8_t EVENT_TYPE_MASK = 0x3F;
+
+// Type byte of a stack definition record inside an Events chunk.
+static constexpr uint8_t RECORD_STACK_DEFINITION = 0x3F;
+static_assert(static_cast<uint8_t>(EventType::CondClockWaitDone) < RECORD_STACK_DEFINITION,
+              "event types must fit below the stack definition record");
+
+// Stack references in a version 2 event.
+static constexpr uint64_t STACK_NONE = 0;
+static constexpr uint64_t STACK_INLINE = 1;
+static constexpr uint64_t STACK_ID_BASE = 2;
+
+enum class ClockSource : uint32_t {
+    // clock_gettime(CLOCK_MONOTONIC) through std::chrono, in nanoseconds.
+    Steady = 0,
+    // Raw cycle counter (rdtscp on x86, CNTVCT_EL0 on arm64). Converted to
+    // nanoseconds by the reader using the calibration in the trace header.
+    Tsc = 1,
+};
+
+#pragma pack(push, 1)
+// Written at the very start of the trace (or inside the header page of a
+// mapped trace). All fields are little-endian and fixed width so the writer
+// can patch the calibration in place when it closes the file; readers skip
+// whatever lies beyond header_size.
+struct TraceHeader
+{
+    static constexpr char MAGIC[8] = {'S', 'K', 'E', 'Y', 'T', 'R', 'C', '\0'};
+    static constexpr uint32_t VERSION = 2;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t clock;
+    uint32_t pid;
+    // Timestamps convert as base_ns + (ticks - base_ticks) * 1e9 / ticks_per_second.
+    uint64_t ticks_per_second;
+    uint64_t base_ticks;
+    uint64_t base_ns;
+    // Sampling: on average one in sample_period operations is traced, and
+    // with a window only during the first sample_on_ms of every
+    // sample_on_ms + sample_off_ms. Zero periods mean everything was traced.
+    // Older writers end the header before these fields.
+    uint32_t sample_period;
+    uint32_t sample_flags;
+    uint32_t sample_on_ms;
+    uint32_t sample_off_ms;
+
+    bool valid() const
+    {
+        return memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+    }
+
+    // Factor that turns sampled counts and totals into estimates for the
+    // whole run.
+    double sampleScale() const
+    {
+        double scale = sample_period > 1 ? sample_period : 1;
+        if (sample_on_ms > 0 && sample_off_ms > 0) {
+            scale *= static_cast<double>(sample_on_ms + sample_off_ms) / sample_on_ms;
+        }
+        return scale;
+    }
+
+    // Read a header of any size from `data`, zeroing fields the writer did
+    // not have. Returns false when there is no header.
+    static bool read(const uint8_t* data, size_t size, TraceHeader* header)
+    {
+        *header = {};
+        if (size < offsetof(TraceHeader, sample_period)) return false;
+        memcpy(header, data, offsetof(TraceHeader, sample_period));
+        if (!header->valid()) return false;
+        size_t available = header->header_size < size ? header->header_size : size;
+        memcpy(header, data, available < sizeof(TraceHeader) ? available : sizeof(TraceHeader));
+        return true;
+    }
+};
+
+// TraceHeader::sample_flags
+static constexpr uint32_t SAMPLE_RANDOM = 1;
+
+// In a sampled trace the owner a thread waited behind was itself most
+// likely not sampled, so readers also count an acquisition as contended
+// when the duration of its *Done event, which times the lock call alone,
+// is this long: far more than an uncontended call, far less than going to
+// sleep on the futex and being woken.
+static constexpr uint64_t SAMPLED_CONTENTION_NS = 1000;
+
+enum class ChunkKind : uint8_t {
+    Events = 1,
+    Index = 2,
+    Modules = 3,
+};
+
+// How an Events chunk's payload is stored; see compression.h.
+enum class Codec : uint8_t {
+    None = 0,
+    Zstd = 1,
+    Lz4 = 2,
+};
+
+struct ChunkHeader
+{
+    static constexpr uint32_t MAGIC = 0x4b43'4b53;  // "SKCK"
+
+    uint32_t magic;
+    ChunkKind kind;
+    Codec codec;
+    uint8_t reserved[2];
+    // Payload bytes following this header.
+    uint32_t size;
+    uint32_t tid;
+    uint32_t event_count;
+    // Payload bytes after decompression; unused without a codec.
+    uint32_t raw_size;
+    // Timestamp the first event's delta is taken against.
+    uint64_t base_timestamp;
+};
+
+struct ChunkIndexEntry
+{
+    // File offset of the chunk header.
+    uint64_t offset;
+    // Copied from the chunk header.
+    uint64_t base_timestamp;
+    uint32_t size;
+    uint32_t tid;
+    uint32_t event_count;
+    uint32_t reserved;
+};
+
+struct ChunkIndexTrailer
+{
+    static constexpr uint32_t MAGIC = 0x5849'4b53;  // "SKIX"
+
+    // File offset of the Index chunk's header.
+    uint64_t index_offset;
+    uint32_t entry_count;
+    uint32_t magic;
+};
+#pragma pack(pop)
+static_assert(sizeof(ChunkHeader) == 32, "readers rely on a 32 byte chunk header");
+static_assert(sizeof(ChunkIndexEntry) == 32 && sizeof(ChunkIndexTrailer) == 16, "fixed index layout");
+
+inline uint64_t
+zigzagEncode(int64_t value)
+{
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t
+zigzagDecode(uint64_t value)
+{
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+// Appends varints to a buffer the caller has made big enough. The tracer's
+// chunks and the benchmarks' synthetic traces are both encoded with it.
+class VarIntWriter
+{
+  private:
+    uint8_t* pos_;
+
+    void encodeVarInt(uint64_t value)
+    {
+        do {
+            uint8_t byte = value & 0x7F;
+            value >>= 7;
+            if (value) byte |= 0x80;
+            *pos_++ = byte;
+        } while (value);
+    }
+
+  public:
+    explicit VarIntWriter(uint8_t* out)
+    : pos_(out)
+    {
+    }
+
+    void write(uint64_t value)
+    {
+        encodeVarInt(value);
+    }
+
+    void writeByte(uint8_t byte)
+    {
+        *pos_++ = byte;
+    }
+
+    void writePtr(const void* ptr)
+    {
+        encodeVarInt(reinterpret_cast<uint64_t>(ptr));
+    }
+
+    void writeStack(void* const* stack, uint32_t depth)
+    {
+        encodeVarInt(depth);
+        for (uint32_t i = 0; i < depth; i++) {
+            encodeVarInt(reinterpret_cast<uint64_t>(stack[i]));
+        }
+    }
+
+    uint8_t* position() const
+    {
+        return pos_;
+    }
+};
+
+// Tiny dictionary of lock addresses, reset at the start of every chunk. A
+// hit is encoded as its slot number; a miss as SIZE plus the zigzag delta
+// from the previous miss, after which the address replaces the oldest entry.
+// The encoder and decoder make the same updates, so they stay in step.
+class LockDictionary
+{
+  public:
+    static constexpr uint64_t SIZE = 8;
+
+  private:
+    uint64_t entries_[SIZE] = {};
+    uint64_t last_ = 0;
+    unsigned next_ = 0;
+
+    void insert(uint64_t address)
+    {
+        entries_[next_] = address;
+        next_ = (next_ + 1) % SIZE;
+        last_ = address;
+    }
+
+  public:
+    void reset()
+    {
+        *this = LockDictionary();
+    }
+
+    uint64_t encode(uint64_t address)
+    {
+        for (uint64_t i = 0; i < SIZE; i++) {
+            if (entries_[i] == address) return i;
+        }
+        uint64_t code = SIZE + zigzagEncode(static_cast<int64_t>(address - last_));
+        insert(address);
+        return code;
+    }
+
+    uint64_t decode(uint64_t code)
+    {
+        if (code < SIZE) return entries_[code];
+        uint64_t address = last_ + static_cast<uint64_t>(zigzagDecode(code - SIZE));
+        insert(address);
+        return address;
+    }
+};
+
+}  // namespace skeleton_key
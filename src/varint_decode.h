@@ -0,0 +1,213 @@
+// Bulk LEB128 varint decoding for the trace readers.
+//
+// Every field of an event after its type byte is a varint, and so is every
+// frame of a stack, so the decoder mostly reads runs of consecutive varints
+// whose count it knows up front. The kernels here decode such a run. Instead
+// of testing every byte they find all terminating bytes (those without the
+// continuation bit) in a block with one SIMD compare and move mask, then
+// extract each value with a fixed, branch-free sequence of masks and shifts.
+// Values longer than 8 bytes and the last few bytes of the input go through
+// the plain byte-at-a-time loop.
+//
+// The kernel is picked once at run time from the CPU's features:
+// AVX2 > SSE2 on x86-64, NEON on arm64, a 64-bit SWAR kernel elsewhere.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#    include <immintrin.h>
+#elif defined(__aarch64__)
+#    include <arm_neon.h>
+#endif
+
+namespace skeleton_key {
+
+// Decode `count` varints from [in, end) into `out` and return the position
+// after the last one. Stops early at `end`; the missing values are zero.
+using DecodeVarIntsFn =
+        const uint8_t* (*)(const uint8_t* in, const uint8_t* end, uint64_t* out, size_t count);
+
+inline const uint8_t*
+decodeVarIntsScalar(const uint8_t* in, const uint8_t* end, uint64_t* out, size_t count)
+{
+    for (; count > 0; count--) {
+        uint64_t result = 0;
+        int shift = 0;
+        while (in < end) {
+            uint8_t byte = *in++;
+            result |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) break;
+            shift += 7;
+        }
+        *out++ = result;
+    }
+    return in;
+}
+
+namespace varint_detail {
+
+// Gather the 7-bit groups of a varint of `length` (1..8) bytes starting at
+// `in` into its value, by halving the number of groups three times.
+inline uint64_t
+extract(const uint8_t* in, unsigned length)
+{
+    uint64_t x;
+    memcpy(&x, in, sizeof(x));
+    x &= ~uint64_t(0) >> (64 - 8 * length);
+    x = (x & 0x007F'007F'007F'007Full) | ((x & 0x7F00'7F00'7F00'7F00ull) >> 1);
+    x = (x & 0x0000'3FFF'0000'3FFFull) | ((x & 0x3FFF'0000'3FFF'0000ull) >> 2);
+    x = (x & 0x0000'0000'0FFF'FFFFull) | ((x & 0x0FFF'FFFF'0000'0000ull) >> 4);
+    return x;
+}
+
+// The kernels differ only in how they find terminating bytes. A Block
+// classifies SIZE bytes at a time into a mask holding one set bit per
+// terminating byte, STRIDE bits per byte.
+template<typename Block>
+inline const uint8_t*
+decodeBlocks(const uint8_t* in, const uint8_t* end, uint64_t* out, size_t count)
+{
+    // extract() may read 8 bytes from any byte of the block.
+    while (count > 0 && end - in >= static_cast<ptrdiff_t>(Block::SIZE + 8)) {
+        uint64_t terminators = Block::terminators(in);
+        unsigned consumed = 0;
+        while (count > 0 && terminators != 0) {
+            unsigned last = __builtin_ctzll(terminators) / Block::STRIDE;
+            unsigned length = last + 1 - consumed;
+            if (length > 8) break;
+            *out++ = extract(in + consumed, length);
+            count--;
+            consumed = last + 1;
+            terminators &= terminators - 1;
+        }
+        in += consumed;
+        if (count > 0 && (terminators != 0 || consumed == 0)) {
+            // A value too long for extract(), or spanning the whole block.
+            in = decodeVarIntsScalar(in, end, out++, 1);
+            count--;
+        }
+    }
+    return decodeVarIntsScalar(in, end, out, count);
+}
+
+// Portable: eight bytes in a 64-bit word, terminators are clear top bits.
+struct SwarBlock
+{
+    static constexpr unsigned SIZE = 8;
+    static constexpr unsigned STRIDE = 8;
+
+    static uint64_t terminators(const uint8_t* in)
+    {
+        uint64_t x;
+        memcpy(&x, in, sizeof(x));
+        return ~x & 0x8080'8080'8080'8080ull;
+    }
+};
+
+#if defined(__x86_64__)
+struct Sse2Block
+{
+    static constexpr unsigned SIZE = 16;
+    static constexpr unsigned STRIDE = 1;
+
+    static uint64_t terminators(const uint8_t* in)
+    {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+        return static_cast<uint16_t>(~_mm_movemask_epi8(bytes));
+    }
+};
+
+struct Avx2Block
+{
+    static constexpr unsigned SIZE = 32;
+    static constexpr unsigned STRIDE = 1;
+
+    __attribute__((target("avx2"))) static uint64_t terminators(const uint8_t* in)
+    {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+        return static_cast<uint32_t>(~_mm256_movemask_epi8(bytes));
+    }
+};
+#elif defined(__aarch64__)
+struct NeonBlock
+{
+    static constexpr unsigned SIZE = 16;
+    static constexpr unsigned STRIDE = 4;
+
+    static uint64_t terminators(const uint8_t* in)
+    {
+        // Narrowing shift turns the per-byte compare into 4 bits per byte.
+        uint8x16_t clear = vcltq_u8(vld1q_u8(in), vdupq_n_u8(0x80));
+        uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(clear), 4);
+        return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0) & 0x1111'1111'1111'1111ull;
+    }
+};
+#endif
+
+}  // namespace varint_detail
+
+inline const uint8_t*
+decodeVarIntsSwar(const uint8_t* in, const uint8_t* end, uint64_t* out, size_t count)
+{
+    return varint_detail::decodeBlocks<varint_detail::SwarBlock>(in, end, out, count);
+}
+
+#if defined(__x86_64__)
+inline const uint8_t*
+decodeVarIntsSse2(const uint8_t* in, const uint8_t* end, uint64_t* out, size_t count)
+{
+    return varint_detail::decodeBlocks<varint_detail::Sse2Block>(in, end, out, count);
+}
+
+__attribute__((target("avx2"), flatten)) inline const uint8_t*
+decodeVarIntsAvx2(const uint8_t* in, const uint8_t* end, uint64_t* out, size_t count)
+{
+    return varint_detail::decodeBlocks<varint_detail::Avx2Block>(in, end, out, count);
+}
+#elif defined(__aarch64__)
+inline const uint8_t*
+decodeVarIntsNeon(const uint8_t* in, const uint8_t* end, uint64_t* out, size_t count)
+{
+    return varint_detail::decodeBlocks<varint_detail::NeonBlock>(in, end, out, count);
+}
+#endif
+
+struct VarIntKernel
+{
+    const char* name;
+    DecodeVarIntsFn decode;
+};
+
+// Every kernel this CPU can run, expected slowest first.
+inline size_t
+availableVarIntKernels(VarIntKernel* kernels)
+{
+    size_t count = 0;
+    kernels[count++] = {"scalar", decodeVarIntsScalar};
+    kernels[count++] = {"swar", decodeVarIntsSwar};
+#if defined(__x86_64__)
+    kernels[count++] = {"sse2", decodeVarIntsSse2};
+    if (__builtin_cpu_supports("avx2")) kernels[count++] = {"avx2", decodeVarIntsAvx2};
+#elif defined(__aarch64__)
+    kernels[count++] = {"neon", decodeVarIntsNeon};
+#endif
+    return count;
+}
+
+static constexpr size_t MAX_VARINT_KERNELS = 4;
+
+// The fastest kernel for this CPU.
+inline DecodeVarIntsFn
+varIntKernel()
+{
+    static const DecodeVarIntsFn kernel = [] {
+        VarIntKernel kernels[MAX_VARINT_KERNELS];
+        return kernels[availableVarIntKernels(kernels) - 1].decode;
+    }();
+    return kernel;
+}
+
+}  // namespace skeleton_key
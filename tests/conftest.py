@@ -0,0 +1,225 @@
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import shutil
+from pathlib import Path
+
+import pytest
+
+REPO = Path(__file__).parent.parent
+
+FIGHT_C = r"""
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NUM_THREADS 5
+#define NUM_ITERATIONS 3
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Structure to hold thread-specific data
+typedef struct
+{
+    int thread_id;
+} thread_data_t;
+
+void*
+worker(void* arg)
+{
+    thread_data_t* data = (thread_data_t*)arg;
+
+    for (int i = 0; i < NUM_ITERATIONS; i++) {
+        // Try to get the lock
+        printf("Thread %d trying to acquire lock...\n", data->thread_id);
+        pthread_mutex_lock(&lock);
+
+        // Critical section
+        printf("Thread %d got the lock!\n", data->thread_id);
+
+        // Simulate some work
+        usleep(1); 
+
+        // Release the lock
+        printf("Thread %d releasing lock\n", data->thread_id);
+        pthread_mutex_unlock(&lock);
+    }
+
+    return NULL;
+}
+
+int
+main()
+{
+    pthread_t threads[NUM_THREADS];
+    thread_data_t thread_data[NUM_THREADS];
+
+    // Initialize random seed
+    srand(time(NULL));
+
+    // Create threads
+    for (int i = 0; i < NUM_THREADS; i++) {
+        thread_data[i].thread_id = i + 1;
+
+        if (pthread_create(&threads[i], NULL, worker, &thread_data[i]) != 0) {
+            perror("Failed to create thread");
+            return 1;
+        }
+    }
+
+    // Wait for all threads to complete
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Cleanup
+    pthread_mutex_destroy(&lock);
+
+    return 0;
+}
+"""
+
+@pytest.fixture(scope="session")
+def build_dir():
+    """Create and return a temporary build directory."""
+    temp_dir = tempfile.mkdtemp()
+    yield temp_dir
+    shutil.rmtree(temp_dir)
+
+@pytest.fixture(scope="session")
+def skeletonkey_lib(build_dir):
+    """Build skeletonkey and return path to the library."""
+    # Build skeletonkey
+    subprocess.run(["cmake", "-B", build_dir, "-S", str(REPO)], check=True)
+    subprocess.run(["make", "-C", build_dir], check=True)
+
+    lib_path = Path(build_dir) / "libskeleton_key.so"
+    assert lib_path.exists(), "Library was not built successfully"
+    return lib_path
+
+@pytest.fixture(scope="session")
+def fight_binary(build_dir):
+    """Compile the fight.c example and return its path."""
+    # Write the test program
+    src_path = Path(build_dir) / "fight.c"
+    src_path.write_text(FIGHT_C)
+    
+    # Compile it
+    bin_path = Path(build_dir) / "fight"
+    subprocess.run([
+        "gcc", "-o", str(bin_path), str(src_path), 
+        "-pthread", "-g", "-O0"
+    ], check=True)
+    
+    assert bin_path.exists(), "Test binary was not built successfully"
+    return bin_path
+
+@pytest.fixture(scope="session")
+def analyzer_binary(skeletonkey_lib):
+    """Return the path to skeletonkey-analyze, built along with the library."""
+    bin_path = skeletonkey_lib.parent / "skeletonkey-analyze"
+    assert bin_path.exists(), "Analyzer was not built successfully"
+    return bin_path
+
+@pytest.fixture(scope="session")
+def compile_c(build_dir):
+    """Return a function compiling C source text or an example file into build_dir."""
+    def compile_c(name, source=None, flags=()):
+        if source is None:
+            src_path = REPO / "examples" / f"{name}.c"
+        else:
+            src_path = Path(build_dir) / f"{name}.c"
+            src_path.write_text(source)
+        bin_path = Path(build_dir) / name
+        subprocess.run([
+            "gcc", "-o", str(bin_path), str(src_path),
+            "-pthread", "-g", "-O0", *flags
+        ], check=True)
+        assert bin_path.exists(), f"{name} was not built successfully"
+        return bin_path
+    return compile_c
+
+def run_traced(lib, binary, trace_file, **env_vars):
+    """Run binary with the tracer preloaded, writing trace_file, and return its result."""
+    env = os.environ.copy()
+    env["LD_PRELOAD"] = str(lib)
+    env["SKELETON_KEYOUTPUT"] = str(trace_file)
+    env.update({key: str(value) for key, value in env_vars.items()})
+    result = subprocess.run([str(binary)], env=env, capture_output=True, text=True, timeout=60)
+    assert result.returncode == 0, f"{binary} failed: {result.stderr}"
+    return result
+
+def symbol_offsets(binary, *names):
+    """Return the offsets of the named data symbols in binary."""
+    result = subprocess.run(["nm", str(binary)], capture_output=True, text=True, check=True)
+    offsets = {}
+    for line in result.stdout.splitlines():
+        fields = line.split()
+        if len(fields) == 3 and fields[2] in names:
+            offsets[fields[2]] = int(fields[0], 16)
+    return offsets
+
+def run_analyzer(analyzer, *args):
+    """Run skeletonkey-analyze and return its standard output."""
+    result = subprocess.run([str(analyzer), *map(str, args)], capture_output=True, text=True,
+                            timeout=60)
+    assert result.returncode == 0, f"skeletonkey-analyze failed: {result.stderr}"
+    return result.stdout
+
+def run_parse(*args):
+    """Run parse.py and return its standard output."""
+    env = os.environ.copy()
+    env["COLUMNS"] = "200"
+    result = subprocess.run([sys.executable, str(REPO / "parse.py"), *map(str, args)],
+                            capture_output=True, text=True, env=env, timeout=60)
+    assert result.returncode == 0, f"parse.py failed: {result.stderr}"
+    return result.stdout
+
+def parse_summary(text):
+    """Parse the aggregate backend's text summary.
+
+    Returns the locks, each a dict of its counters with its `sites` and
+    histograms, the `thread` lines, and the `# total` counters.
+    """
+    locks, threads, total = [], [], {}
+    current = None
+    for line in text.splitlines():
+        fields = line.split()
+        counters = {key: int(value) for key, value in
+                    (field.split("=") for field in fields if "=" in field)}
+        if line.startswith("lock "):
+            current = dict(counters, address=fields[1], kind=fields[2], sites=[])
+            locks.append(current)
+        elif line.startswith("  site "):
+            current["sites"].append(dict(counters, histograms={}))
+        elif line.lstrip().startswith(("wait_histogram", "hold_histogram")):
+            buckets = {int(lower): int(count) for lower, count in
+                       (bucket.split(":") for bucket in fields[1:])}
+            owner = current["sites"][-1]["histograms"] if line.startswith("    ") else current
+            owner[fields[0]] = buckets
+        elif line.startswith("thread "):
+            threads.append(dict(counters, tid=int(fields[1])))
+        elif line.startswith("# total"):
+            total = counters
+    return locks, threads, total
+
+def table_rows(output, title):
+    """Return the cells of each row of the table titled `title`.
+
+    Both analyzers' tables start their rows with the lock number; rich's
+    column separators and those of plain output are dropped.
+    """
+    lines = output.splitlines()
+    start = next(i for i, line in enumerate(lines) if line.strip() == title)
+    rows = []
+    for line in lines[start + 2:]:
+        cells = re.sub(r"[│┃|]", " ", line).split()
+        if cells and cells[0].isdigit():
+            rows.append(cells)
+        elif rows:
+            break
+    return rows
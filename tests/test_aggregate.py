@@ -0,0 +1,168 @@
+import os
+import re
+import socket
+import subprocess
+import urllib.error
+import urllib.request
+
+from conftest import run_traced, run_analyzer, parse_summary
+
+# Two threads take one mutex 20 times each, sleeping while they hold it, then
+# the program stays up to be scraped.
+SERVE_C = r"""
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+pthread_mutex_t busy = PTHREAD_MUTEX_INITIALIZER;
+
+void*
+worker(void* arg)
+{
+    for (int i = 0; i < 20; i++) {
+        pthread_mutex_lock(&busy);
+        usleep(200);
+        pthread_mutex_unlock(&busy);
+    }
+    return NULL;
+}
+
+int
+main()
+{
+    pthread_t threads[2];
+    for (int i = 0; i < 2; i++) pthread_create(&threads[i], NULL, worker, NULL);
+    for (int i = 0; i < 2; i++) pthread_join(threads[i], NULL);
+
+    // Stay up to be scraped until standard input closes.
+    printf("ready\n");
+    fflush(stdout);
+    char buffer[64];
+    while (read(0, buffer, sizeof(buffer)) > 0) {
+    }
+    return 0;
+}
+"""
+
+def test_aggregate_summary(skeletonkey_lib, analyzer_binary, fight_binary, tmp_path):
+    """The aggregate backend counts the same acquisitions as a full trace, consistently."""
+    summary_file = tmp_path / "summary.txt"
+    run_traced(skeletonkey_lib, fight_binary, summary_file, SKELETON_KEY_BACKEND="aggregate")
+    locks, threads, total = parse_summary(summary_file.read_text())
+
+    # fight.c's five threads each take its one mutex three times.
+    assert len(locks) == 1
+    lock = locks[0]
+    assert lock["kind"] == "mutex"
+    assert lock["acquisitions"] == 15
+    assert lock["contentions"] <= lock["acquisitions"]
+    assert lock["owner_changes"] < lock["acquisitions"]
+    assert lock["max_wait_ns"] <= lock["wait_ns"]
+    assert lock["max_hold_ns"] <= lock["hold_ns"]
+    assert sum(lock["hold_histogram"].values()) == lock["acquisitions"]
+    assert sum(lock.get("wait_histogram", {}).values()) == lock["contentions"]
+
+    # Call sites and threads split the lock's counts between them.
+    assert sum(site["acquisitions"] for site in lock["sites"]) == lock["acquisitions"]
+    assert sum(site["contentions"] for site in lock["sites"]) == lock["contentions"]
+    assert sum(site["wait_ns"] for site in lock["sites"]) == lock["wait_ns"]
+    assert sum(thread["contentions"] for thread in threads) == lock["contentions"]
+    assert sum(thread["blocked_ns"] for thread in threads) == total["blocked_ns"]
+    assert total["blocked_ns"] + total["spin_ns"] == lock["wait_ns"]
+
+    # A full trace of the same program sees as many acquisitions.
+    trace_file = tmp_path / "fight.bin"
+    run_traced(skeletonkey_lib, fight_binary, trace_file)
+    output = run_analyzer(analyzer_binary, trace_file)
+    row = re.search(r"^\s*0\s+(\d+)\s", output, re.MULTILINE)
+    assert row and int(row.group(1)) == lock["acquisitions"]
+
+def test_aggregate_disabled(skeletonkey_lib, fight_binary, tmp_path):
+    """Starting disabled, the aggregate backend counts nothing."""
+    summary_file = tmp_path / "summary.txt"
+    run_traced(skeletonkey_lib, fight_binary, summary_file, SKELETON_KEY_BACKEND="aggregate",
+               SKELETON_KEY_ENABLED=0)
+    locks, threads, _total = parse_summary(summary_file.read_text())
+    assert sum(lock["acquisitions"] for lock in locks) == 0
+    assert threads == []
+
+def free_port():
+    with socket.socket() as probe:
+        probe.bind(("127.0.0.1", 0))
+        return probe.getsockname()[1]
+
+def parse_metrics(text):
+    """Map each sample of a Prometheus text exposition to its value, by name and labels."""
+    samples = {}
+    for line in text.splitlines():
+        if line and not line.startswith("#"):
+            sample, value = line.rsplit(" ", 1)
+            samples[sample] = float(value)
+    return samples
+
+def test_metrics_scrape(skeletonkey_lib, compile_c, tmp_path):
+    """GET /metrics serves the aggregate counters of the running process."""
+    # The executable's dynamic symbols name its locks in the labels.
+    binary = compile_c("serve", SERVE_C, flags=["-rdynamic"])
+    port = free_port()
+    env = os.environ.copy()
+    env["LD_PRELOAD"] = str(skeletonkey_lib)
+    env["SKELETON_KEYOUTPUT"] = str(tmp_path / "summary.txt")
+    env["SKELETON_KEY_BACKEND"] = "aggregate"
+    env["SKELETON_KEY_METRICS"] = f"127.0.0.1:{port}"
+    process = subprocess.Popen([str(binary)], env=env, stdin=subprocess.PIPE,
+                               stdout=subprocess.PIPE, text=True)
+    try:
+        while process.stdout.readline().strip() != "ready":
+            assert process.poll() is None, "Program exited before it could be scraped"
+        url = f"http://127.0.0.1:{port}"
+        with urllib.request.urlopen(f"{url}/metrics", timeout=10) as response:
+            assert response.status == 200
+            text = response.read().decode()
+        try:
+            urllib.request.urlopen(f"{url}/other", timeout=10)
+            assert False, "Only /metrics is served"
+        except urllib.error.HTTPError as error:
+            assert error.code == 404
+    finally:
+        process.stdin.close()
+        assert process.wait(timeout=30) == 0
+
+    samples = parse_metrics(text)
+    labels = re.search(r'skeleton_key_lock_acquisitions_total\{(lock="0x[0-9a-f]+",kind="mutex",'
+                       r'symbol="busy")\}', text)
+    assert labels, text
+    labels = labels.group(1)
+    def lock_sample(name, extra=""):
+        return samples[f"{name}{{{labels}{extra}}}"]
+
+    acquisitions = lock_sample("skeleton_key_lock_acquisitions_total")
+    contentions = lock_sample("skeleton_key_lock_contentions_total")
+    assert acquisitions == 40
+    assert contentions <= acquisitions
+    assert lock_sample("skeleton_key_lock_owner_changes_total") <= acquisitions
+
+    # Histogram buckets are cumulative and end in the sample count.
+    for name, count in (("skeleton_key_lock_wait_seconds", contentions),
+                        ("skeleton_key_lock_hold_seconds", acquisitions)):
+        buckets = [value for sample, value in samples.items()
+                   if sample.startswith(f"{name}_bucket{{{labels},")]
+        assert buckets == sorted(buckets)
+        assert buckets[-1] == lock_sample(f"{name}_bucket", ',le="+Inf"') == count
+        assert lock_sample(f"{name}_count") == count
+    # Every hold slept for 200us.
+    assert lock_sample("skeleton_key_lock_hold_seconds_sum") >= 40 * 200e-6
+
+    threads = [value for sample, value in samples.items()
+               if sample.startswith("skeleton_key_thread_contentions_total{")]
+    assert len(threads) == 2
+    assert sum(threads) == contentions
+    assert samples["skeleton_key_locks"] == 1
+    assert samples["skeleton_key_sample_scale"] == 1
+    assert samples["skeleton_key_blocked_seconds_total"] == \
+        lock_sample("skeleton_key_lock_wait_seconds_sum")
+
+    # The summary written at exit has the same counts.
+    locks, _threads, _total = parse_summary((tmp_path / "summary.txt").read_text())
+    assert locks[0]["acquisitions"] == acquisitions
+    assert locks[0]["contentions"] == contentions
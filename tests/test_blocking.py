@@ -0,0 +1,45 @@
+import re
+
+from conftest import run_traced, run_analyzer, symbol_offsets
+
+SECTION = re.compile(r"#(\d+) lock (0x[0-9a-f]+): blocked others ([0-9.]+) ms at the root of their "
+                     r"chain, ([0-9.]+) ms directly, (\d+) waits over (\d+) holds")
+
+def test_blocking_chain(skeletonkey_lib, analyzer_binary, compile_c, tmp_path):
+    """Waits in examples/blocking_chain.c are charged to the root and the direct blocker."""
+    binary = compile_c("blocking_chain")
+    trace_file = tmp_path / "chain.bin"
+    run_traced(skeletonkey_lib, binary, trace_file)
+
+    output = run_analyzer(analyzer_binary, "--blocking", trace_file)
+    assert output.startswith("Blocking: 2 contended waits"), output
+
+    sections = SECTION.findall(output)
+    assert len(sections) == 2, output
+    offsets = symbol_offsets(binary, "lock_1", "lock_2")
+    ranked = {}
+    for rank, address, root, direct, waits, holds in sections:
+        name = "lock_1" if int(address, 16) & 0xfff == offsets["lock_1"] & 0xfff else "lock_2"
+        ranked[name] = (int(rank), float(root), float(direct), int(waits), int(holds))
+
+    # The holder's section of lock_2 is the root of both waits: the middle
+    # thread's 80 ms directly, and the last thread's 60 ms behind lock_1,
+    # whose owner was itself waiting for lock_2.
+    rank, root, direct, waits, holds = ranked["lock_2"]
+    assert rank == 1
+    assert (waits, holds) == (1, 1)
+    assert 60 <= direct < root
+    assert root >= direct + 40
+
+    # The middle thread's section of lock_1 blocked the last thread directly,
+    # but was almost never at the root of its chain.
+    rank, root, direct, waits, holds = ranked["lock_1"]
+    assert rank == 2
+    assert (waits, holds) == (1, 1)
+    assert direct >= 40
+    assert root < 10
+
+    # Each section is reported with the stack that acquired it.
+    first, second = output.split("\n#2 ")
+    assert "holder" in first
+    assert "middle" in second
@@ -0,0 +1,159 @@
+import os
+import subprocess
+
+import pytest
+
+from conftest import run_analyzer, parse_summary, table_rows
+
+# Takes one mutex as many times as each line of standard input says,
+# answering "done" after each line, until standard input closes.
+PACED_C = r"""
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+pthread_mutex_t paced = PTHREAD_MUTEX_INITIALIZER;
+
+int
+main()
+{
+    printf("ready\n");
+    fflush(stdout);
+    char line[64];
+    while (fgets(line, sizeof(line), stdin)) {
+        for (int i = atoi(line); i > 0; i--) {
+            pthread_mutex_lock(&paced);
+            pthread_mutex_unlock(&paced);
+        }
+        printf("done\n");
+        fflush(stdout);
+    }
+    return 0;
+}
+"""
+
+class Paced:
+    """The paced program, traced with a control socket."""
+
+    def __init__(self, lib, analyzer, binary, output, control, **env_vars):
+        self.analyzer = analyzer
+        self.control_path = control
+        env = os.environ.copy()
+        env["LD_PRELOAD"] = str(lib)
+        env["SKELETON_KEYOUTPUT"] = str(output)
+        env["SKELETON_KEY_CONTROL"] = str(control)
+        env.update({key: str(value) for key, value in env_vars.items()})
+        self.process = subprocess.Popen([str(binary)], env=env, stdin=subprocess.PIPE,
+                                        stdout=subprocess.PIPE, text=True)
+        self.wait_for("ready")
+
+    def wait_for(self, word):
+        while True:
+            line = self.process.stdout.readline()
+            assert line, "Program exited early"
+            if line.strip() == word:
+                return
+
+    def lock(self, times):
+        self.process.stdin.write(f"{times}\n")
+        self.process.stdin.flush()
+        self.wait_for("done")
+
+    def control(self, *command):
+        result = subprocess.run([str(self.analyzer), "--control", str(self.control_path),
+                                 *command], capture_output=True, text=True, timeout=30)
+        return result.stdout.strip()
+
+    def finish(self):
+        self.process.stdin.close()
+        assert self.process.wait(timeout=30) == 0
+
+@pytest.fixture
+def paced(skeletonkey_lib, analyzer_binary, compile_c, tmp_path):
+    binary = compile_c("paced", PACED_C)
+    started = []
+    def start(output, **env_vars):
+        program = Paced(skeletonkey_lib, analyzer_binary, binary, output, tmp_path / "control",
+                        **env_vars)
+        started.append(program)
+        return program
+    yield start
+    for program in started:
+        if program.process.poll() is None:
+            program.process.kill()
+            program.process.wait()
+
+def test_invalid_sampling(paced, tmp_path):
+    """Malformed sampling commands are refused and leave the sampling alone."""
+    program = paced(tmp_path / "trace.bin", SKELETON_KEY_SAMPLE=4)
+    for command in (["sample", "-1"], ["sample", "abc"], ["sample", "0"], ["sample", "4x"],
+                    ["sample", "99999999999"]):
+        assert program.control(*command) == "error: sample is a period of 1 or more", command
+    for window in ("-5:x", "5", "5:", "5:-1", ":5"):
+        assert program.control("sample-window", window) == \
+            "error: sample-window is ON_MS:OFF_MS or 0", window
+    status = program.control("status")
+    assert " sample=4 " in status and " window=0:0 " in status, status
+    program.finish()
+
+def locked(analyzer, trace_file):
+    """How many times the paced program's mutex was locked, by the trace."""
+    rows = table_rows(run_analyzer(analyzer, trace_file), "Lock Analysis Summary")
+    assert len(rows) == 1
+    return int(rows[0][1])
+
+def test_rotate_seals_chunks(paced, analyzer_binary, tmp_path):
+    """A rotation cuts at the command: the finished file has every event logged before it."""
+    trace_file = tmp_path / "trace.bin"
+    program = paced(trace_file)
+    # The thread stays idle across the rotation with its chunk not handed in.
+    program.lock(100)
+    assert program.control("rotate") == f"ok {trace_file}.1"
+    program.lock(50)
+    program.finish()
+    assert locked(analyzer_binary, f"{trace_file}.1") == 100
+    assert locked(analyzer_binary, trace_file) == 50
+
+def test_rate_change_rotates(paced, analyzer_binary, tmp_path):
+    """Changing the rate finishes the file, so each file is scaled by the rate it was sampled at."""
+    trace_file = tmp_path / "trace.bin"
+    program = paced(trace_file)
+    program.lock(100)
+    assert program.control("sample", "4") == f"ok {trace_file}.1"
+    program.lock(100)
+    # Only the mode changes, which scales nothing: no new file.
+    assert program.control("sample-mode", "every") == "ok"
+    program.finish()
+    assert locked(analyzer_binary, f"{trace_file}.1") == 100
+    assert locked(analyzer_binary, trace_file) == 100
+    assert run_analyzer(analyzer_binary, trace_file).startswith(
+        "Sampled trace: counts and totals are scaled by 4\n")
+    assert "Sampled" not in run_analyzer(analyzer_binary, f"{trace_file}.1")
+
+def test_rate_change_aggregate(paced, tmp_path):
+    """The aggregate backend writes out its counts so far and starts over at a change of rate."""
+    summary_file = tmp_path / "summary.txt"
+    program = paced(summary_file, SKELETON_KEY_BACKEND="aggregate")
+    program.lock(100)
+    assert program.control("sample", "4") == f"ok {summary_file}.1"
+    program.lock(100)
+    program.finish()
+
+    first = (tmp_path / "summary.txt.1").read_text()
+    assert "# sampled" not in first
+    locks, _threads, _total = parse_summary(first)
+    assert [lock["acquisitions"] for lock in locks] == [100]
+    second = summary_file.read_text()
+    assert "# sampled: multiply counts and totals by 4.000 for estimates" in second
+    locks, _threads, _total = parse_summary(second)
+    assert [lock["acquisitions"] for lock in locks] == [25]
+    assert sum(locks[0]["hold_histogram"].values()) == 25
+
+def test_rate_change_refused(paced, tmp_path):
+    """Backends that write one header for the whole run keep their rate."""
+    program = paced(tmp_path / "trace.bin", SKELETON_KEY_BACKEND="mmap")
+    assert program.control("sample", "4") == \
+        "error: only the file and aggregate backends can change the rate"
+    assert program.control("sample", "1") == "ok"
+    assert program.control("sample-mode", "random") == "ok"
+    program.finish()
@@ -0,0 +1,53 @@
+import os
+import re
+import subprocess
+
+from conftest import run_analyzer, symbol_offsets
+
+def test_deadlock_example(skeletonkey_lib, analyzer_binary, compile_c, tmp_path):
+    """The A -> B / B -> A threads of examples/deadlock.c show up as a lock order cycle."""
+    binary = compile_c("deadlock")
+    trace_file = tmp_path / "deadlock.bin"
+
+    env = os.environ.copy()
+    env["LD_PRELOAD"] = str(skeletonkey_lib)
+    env["SKELETON_KEYOUTPUT"] = str(trace_file)
+    process = subprocess.Popen([str(binary)], env=env, stdout=subprocess.DEVNULL)
+    try:
+        process.wait(timeout=5)
+        hung = False
+    except subprocess.TimeoutExpired:
+        # The threads usually do deadlock; SIGTERM still writes the trace out.
+        process.terminate()
+        process.wait(timeout=10)
+        hung = True
+
+    output = run_analyzer(analyzer_binary, "--deadlocks", trace_file)
+    assert "Lock order: 2 locks, 2 orderings, 1 potential deadlocks" in output
+
+    cycle = re.search(r"Potential deadlock #1: (0x[0-9a-f]+) -> (0x[0-9a-f]+) -> (0x[0-9a-f]+)",
+                      output)
+    assert cycle, output
+    first, second, last = (int(address, 16) for address in cycle.groups())
+    assert first == last and first != second
+
+    # The two locks are the example's mutexes: the position-independent
+    # executable moves them by whole pages, so their distance and page
+    # offsets match the symbol table's.
+    offsets = symbol_offsets(binary, "mutex_a", "mutex_b")
+    mutex_a, mutex_b = offsets["mutex_a"], offsets["mutex_b"]
+    assert abs(first - second) == abs(mutex_a - mutex_b)
+    assert {first & 0xfff, second & 0xfff} == {mutex_a & 0xfff, mutex_b & 0xfff}
+
+    # Each of the two threads takes one lock while holding the other.
+    takes = re.findall(r"tid=(\d+) took (0x[0-9a-f]+) holding (0x[0-9a-f]+)", output)
+    assert len(takes) == 2
+    assert len({tid for tid, _, _ in takes}) == 2
+    assert {(int(took, 16), int(held, 16)) for _, took, held in takes} == \
+        {(second, first), (first, second)}
+
+    if hung:
+        assert "1 deadlocks" in output
+        waits = re.findall(r"tid=(\d+) waits for (0x[0-9a-f]+) held by tid=(\d+)", output)
+        assert len(waits) == 2
+        assert {int(lock, 16) for _, lock, _ in waits} == {first, second}
@@ -0,0 +1,86 @@
+import re
+from collections import Counter
+
+from conftest import run_traced, run_analyzer, symbol_offsets
+
+# A quiet mutex and rwlock the main thread takes 100 times each without ever
+# waiting, and a busy mutex two threads take 20 times each, sleeping while
+# they hold it.
+FILTER_C = r"""
+#include <pthread.h>
+#include <unistd.h>
+
+pthread_mutex_t quiet = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t busy = PTHREAD_MUTEX_INITIALIZER;
+pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+
+void*
+worker(void* arg)
+{
+    for (int i = 0; i < 20; i++) {
+        pthread_mutex_lock(&busy);
+        usleep(200);
+        pthread_mutex_unlock(&busy);
+    }
+    return NULL;
+}
+
+int
+main()
+{
+    pthread_t threads[2];
+    for (int i = 0; i < 2; i++) pthread_create(&threads[i], NULL, worker, NULL);
+    for (int i = 0; i < 100; i++) {
+        pthread_mutex_lock(&quiet);
+        pthread_mutex_unlock(&quiet);
+        pthread_rwlock_rdlock(&rwlock);
+        pthread_rwlock_unlock(&rwlock);
+    }
+    for (int i = 0; i < 2; i++) pthread_join(threads[i], NULL);
+    return 0;
+}
+"""
+
+LOCKS = ("quiet", "busy", "rwlock")
+
+def acquisitions(analyzer, trace_file, binary, events="MutexLockDone|RWLockReadDone"):
+    """Count the traced `events`, acquisitions by default, of each lock of binary by name."""
+    output = run_analyzer(analyzer, "--events", trace_file)
+    pages = {offset & 0xfff: name for name, offset in symbol_offsets(binary, *LOCKS).items()}
+    counts = Counter()
+    for address in re.findall(rf" (?:{events})\s+ptr=(0x[0-9a-f]+)", output):
+        counts[pages[int(address, 16) & 0xfff]] += 1
+    return counts
+
+def test_lock_type_filter(skeletonkey_lib, analyzer_binary, compile_c, tmp_path):
+    """SKELETON_KEY_LOCK_TYPES traces only the listed kinds of lock."""
+    binary = compile_c("filter", FILTER_C)
+    trace_file = tmp_path / "filter.bin"
+
+    run_traced(skeletonkey_lib, binary, trace_file)
+    assert acquisitions(analyzer_binary, trace_file, binary) == \
+        {"quiet": 100, "busy": 40, "rwlock": 100}
+
+    run_traced(skeletonkey_lib, binary, trace_file, SKELETON_KEY_LOCK_TYPES="rwlock")
+    assert acquisitions(analyzer_binary, trace_file, binary) == {"rwlock": 100}
+    output = run_analyzer(analyzer_binary, "--events", trace_file)
+    assert "Mutex" not in output
+
+    run_traced(skeletonkey_lib, binary, trace_file, SKELETON_KEY_LOCK_TYPES="mutex,cond")
+    assert acquisitions(analyzer_binary, trace_file, binary) == {"quiet": 100, "busy": 40}
+
+def test_mute_after(skeletonkey_lib, analyzer_binary, compile_c, tmp_path):
+    """SKELETON_KEY_MUTE_AFTER stops tracing locks that are never waited for."""
+    binary = compile_c("filter", FILTER_C)
+    trace_file = tmp_path / "filter.bin"
+
+    run_traced(skeletonkey_lib, binary, trace_file, SKELETON_KEY_MUTE_AFTER=10)
+    counts = acquisitions(analyzer_binary, trace_file, binary)
+    assert counts["quiet"] == 10
+    assert counts["rwlock"] == 10
+    # The busy mutex is waited for too often to go ten takes without.
+    assert counts["busy"] > 10
+
+    # Every traced acquisition still has its unlock.
+    unlocks = acquisitions(analyzer_binary, trace_file, binary, "MutexUnlock|RWLockUnlock")
+    assert unlocks == counts
@@ -0,0 +1,102 @@
+from conftest import run_traced, run_analyzer, run_parse, table_rows
+
+# Spinlocks, semaphores and barriers: three threads pass a barrier four
+# times and take a spinlock 50 times each, a consumer waits for 30 posts,
+# and the main thread fails two try-waits and a timed wait.
+PRIMITIVES_C = r"""
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NUM_THREADS 3
+#define NUM_ROUNDS 4
+#define NUM_SPINS 50
+#define NUM_ITEMS 30
+
+pthread_spinlock_t spin;
+pthread_barrier_t barrier;
+sem_t items;
+sem_t empty;
+
+void*
+worker(void* arg)
+{
+    for (int round = 0; round < NUM_ROUNDS; round++) {
+        pthread_barrier_wait(&barrier);
+    }
+    for (int i = 0; i < NUM_SPINS; i++) {
+        pthread_spin_lock(&spin);
+        pthread_spin_unlock(&spin);
+    }
+    return NULL;
+}
+
+void*
+consumer(void* arg)
+{
+    for (int i = 0; i < NUM_ITEMS; i++) sem_wait(&items);
+    return NULL;
+}
+
+int
+main()
+{
+    pthread_t threads[NUM_THREADS];
+    pthread_t consumer_thread;
+
+    pthread_spin_init(&spin, PTHREAD_PROCESS_PRIVATE);
+    pthread_barrier_init(&barrier, NULL, NUM_THREADS);
+    sem_init(&items, 0, 0);
+    sem_init(&empty, 0, 0);
+
+    for (int i = 0; i < NUM_THREADS; i++) pthread_create(&threads[i], NULL, worker, NULL);
+    pthread_create(&consumer_thread, NULL, consumer, NULL);
+    for (int i = 0; i < NUM_ITEMS; i++) {
+        usleep(100);
+        sem_post(&items);
+    }
+
+    // Waits on a semaphore nobody posts: two try-waits and a timed wait fail.
+    sem_trywait(&empty);
+    sem_trywait(&empty);
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 1000 * 1000;
+    if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000 * 1000 * 1000;
+    }
+    sem_timedwait(&empty, &deadline);
+
+    for (int i = 0; i < NUM_THREADS; i++) pthread_join(threads[i], NULL);
+    pthread_join(consumer_thread, NULL);
+    return 0;
+}
+"""
+
+def test_primitive_tables(skeletonkey_lib, analyzer_binary, compile_c, tmp_path):
+    """Spinlock, semaphore and barrier counts show up in their tables."""
+    binary = compile_c("primitives", PRIMITIVES_C)
+    trace_file = tmp_path / "primitives.bin"
+    run_traced(skeletonkey_lib, binary, trace_file)
+
+    output = run_analyzer(analyzer_binary, trace_file)
+    summary = table_rows(output, "Lock Analysis Summary")
+    assert len(summary) == 1
+    _lock, locked, *_times, flags = summary[0]
+    assert locked == "150"
+    assert flags.startswith("S")
+
+    # Columns: lock, waits, failed, posts, then times.
+    semaphores = sorted(row[1:4] for row in table_rows(output, "Semaphores"))
+    assert semaphores == [["0", "3", "0"], ["30", "0", "30"]]
+
+    # Columns: lock, waits, rounds, then times.
+    barriers = [row[1:3] for row in table_rows(output, "Barriers")]
+    assert barriers == [["12", "4"]]
+
+    # parse.py counts them the same way.
+    python = run_parse(trace_file)
+    for title in ("Lock Analysis Summary", "Semaphores", "Barriers"):
+        assert table_rows(python, title) == table_rows(output, title)
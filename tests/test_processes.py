@@ -0,0 +1,130 @@
+import re
+import subprocess
+from pathlib import Path
+
+from conftest import run_traced, run_analyzer
+
+# Parent and forked child take the same two mutexes in opposite orders from
+# two threads run one after the other, so each has a lock order cycle at the
+# same addresses without ever deadlocking.
+FORK_C = r"""
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+pthread_mutex_t mutex_a = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mutex_b = PTHREAD_MUTEX_INITIALIZER;
+
+void*
+forward(void* arg)
+{
+    pthread_mutex_lock(&mutex_a);
+    pthread_mutex_lock(&mutex_b);
+    pthread_mutex_unlock(&mutex_b);
+    pthread_mutex_unlock(&mutex_a);
+    return NULL;
+}
+
+void*
+backward(void* arg)
+{
+    pthread_mutex_lock(&mutex_b);
+    pthread_mutex_lock(&mutex_a);
+    pthread_mutex_unlock(&mutex_a);
+    pthread_mutex_unlock(&mutex_b);
+    return NULL;
+}
+
+static void
+run(void* (*fn)(void*))
+{
+    pthread_t thread;
+    pthread_create(&thread, NULL, fn, NULL);
+    pthread_join(thread, NULL);
+}
+
+int
+main()
+{
+    pid_t child = fork();
+    run(forward);
+    run(backward);
+    if (child == 0) return 0;
+    printf("%d %d\n", getpid(), child);
+    int status;
+    waitpid(child, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : 1;
+}
+"""
+
+# The child takes a lock and leaves through _exit(), with no atexit() handler
+# to write out its trace, while the parent runs both threads of FORK_C.
+FORK_EXIT_C = FORK_C.replace("    if (child == 0) return 0;\n", "").replace(
+    "    run(forward);\n", "    run(forward);\n    if (child == 0) _exit(0);\n")
+
+def test_forked_child_trace(skeletonkey_lib, analyzer_binary, compile_c, tmp_path):
+    """A forked child writes OUTPUT.PID, and the merged analysis tells the processes apart."""
+    binary = compile_c("fork", FORK_C)
+    trace_file = tmp_path / "trace.bin"
+    result = run_traced(skeletonkey_lib, binary, trace_file)
+    parent, child = result.stdout.splitlines()[-1].split()
+
+    child_file = Path(f"{trace_file}.{child}")
+    assert trace_file.exists(), "No parent trace was generated"
+    assert child_file.exists(), "No child trace was generated"
+
+    # Each process alone has its own cycle over two locks.
+    for path in (trace_file, child_file):
+        output = run_analyzer(analyzer_binary, "--deadlocks", path)
+        assert "Lock order: 2 locks" in output
+        assert "1 potential deadlocks" in output
+        assert "(pid " not in output
+
+    output = run_analyzer(analyzer_binary, "--deadlocks", trace_file, child_file)
+    assert "Lock order: 4 locks" in output
+    assert "2 potential deadlocks" in output
+    cycles = [line for line in output.splitlines() if line.startswith("Potential deadlock #")]
+    assert len(cycles) == 2
+    pids = set()
+    for cycle in cycles:
+        # Both locks of a cycle belong to one process, named after the address.
+        pairs = re.findall(r"(0x[0-9a-f]+) \(pid (\d+)\)", cycle)
+        assert len(pairs) == 3
+        assert len({pid for _, pid in pairs}) == 1
+        pids.add(pairs[0][1])
+    assert pids == {parent, child}
+    # The child shares the parent's addresses, and neither carries the tag
+    # that keeps them apart.
+    addresses = [set(re.findall(r"0x[0-9a-f]+", cycle)) for cycle in cycles]
+    assert addresses[0] == addresses[1]
+    assert all(int(address, 16) < 1 << 48 for address in addresses[0])
+
+    output = run_analyzer(analyzer_binary, "--events", trace_file, child_file)
+    shown = re.findall(r"ptr=(0x[0-9a-f]+) \(pid (\d+)\)", output)
+    assert {pid for _, pid in shown} == {parent, child}
+    frames = re.findall(r"^\s+(0x[0-9a-f]+)", output, re.MULTILINE)
+    assert frames and all(int(frame, 16) < 1 << 48 for frame in frames)
+
+def test_forked_child_exit(skeletonkey_lib, analyzer_binary, compile_c, tmp_path):
+    """A child that leaves through _exit() still leaves a trace with a header to merge."""
+    binary = compile_c("fork_exit", FORK_EXIT_C)
+    trace_file = tmp_path / "trace.bin"
+    result = run_traced(skeletonkey_lib, binary, trace_file)
+    parent, child = result.stdout.splitlines()[-1].split()
+
+    child_file = Path(f"{trace_file}.{child}")
+    assert child_file.stat().st_size > 0, "The child's trace has no header"
+    output = run_analyzer(analyzer_binary, "--deadlocks", trace_file, child_file)
+    assert "1 potential deadlocks" in output or "2 potential deadlocks" in output, output
+
+    # An empty file, as older tracers left behind, is skipped rather than
+    # failing the whole analysis.
+    empty_file = tmp_path / "trace.bin.1"
+    empty_file.write_bytes(b"")
+    result = subprocess.run([str(analyzer_binary), "--deadlocks", str(trace_file), str(empty_file)],
+                            capture_output=True, text=True, timeout=60)
+    assert result.returncode == 0, result.stderr
+    assert f"{empty_file}: empty trace, skipped" in result.stderr
+    assert "Lock order: 2 locks" in result.stdout
+    assert "1 potential deadlocks" in result.stdout